@@ -8,6 +8,13 @@
 
 #include "PCH_NSKeyedArchiver_Analyzer.hpp"
 
+#include <thread>
+#include <map>
+#include <algorithm>
+
+// While a thread is taking part in a parallel expansion, the nodes it creates go into its own list (merged into allNodes when the threads are joined) so that no locking is needed
+static thread_local vector<PCH_UnarchivedBase *> *workerNodeList = nullptr;
+
 string PCH_UnarchivedBase::TypeName()
 {
     switch (this->type) {
@@ -90,10 +97,26 @@ string PCH_UnarchivedBase::TypeName()
     }
 }
 
-PCH_UnarchivedModel::PCH_UnarchivedModel(PCH_PList_Value *root)
+PCH_UnarchivedModel::PCH_UnarchivedModel(PCH_PList_Value *root, unsigned int numThreads, PCH_PList_MemoryResource *memoryResource)
 {
+    PCH_PList_MemoryScope memoryScope(memoryResource);
+    
     // assume that this is not a valid list
     this->isValid = false;
+    this->rootItem = nullptr;
+    this->pchPlistRoot = nullptr;
+    this->expandedObjects = nullptr;
+    this->topIndex = -1;
+    
+    // no objects until the $objects array has been found (a dict has no elements)
+    this->objects = &root->Elements();
+    
+    this->numThreads = (numThreads == 0 ? thread::hardware_concurrency() : numThreads);
+    
+    if (this->numThreads == 0)
+    {
+        this->numThreads = 1;
+    }
     
     // if the root is not a dictionary, this can't be an archive, so just return
     if (root->valueType != PCH_PList_Value::Dict)
@@ -109,10 +132,8 @@ PCH_UnarchivedModel::PCH_UnarchivedModel(PCH_PList_Value *root)
     // vector<PCH_PList_Value *> objects;
     PCH_PList_Value::dictStruct topDict;
     bool topIsValid = false;
-    for (int i=0; i<root->value.dictValue->size(); i++)
+    for (const PCH_PList_Value::dictStruct &nextEntry : root->Entries())
     {
-        PCH_PList_Value::dictStruct nextEntry = root->value.dictValue->at(i);
-        
         if (nextEntry.key->valueType == PCH_PList_Value::AsciiString)
         {
             if (nextEntry.key->value.asciiStringValue->compare("$archiver") == 0)
@@ -129,7 +150,7 @@ PCH_UnarchivedModel::PCH_UnarchivedModel(PCH_PList_Value *root)
             {
                 if (nextEntry.val->valueType == PCH_PList_Value::Array)
                 {
-                    this->objects = *nextEntry.val->value.arrayValue;
+                    this->objects = &nextEntry.val->Elements();
                 }
             }
             else if (nextEntry.key->value.asciiStringValue->compare("$version") == 0)
@@ -157,86 +178,1063 @@ PCH_UnarchivedModel::PCH_UnarchivedModel(PCH_PList_Value *root)
         }
     }
     
-    if ((!foundArchiver) || (this->objects.size() == 0) || (archiverVersion != PCH_NSKEYEDARCHIVER_VERSION) || (!topIsValid))
+    if ((!foundArchiver) || (this->objects->size() == 0) || (archiverVersion != PCH_NSKEYEDARCHIVER_VERSION) || (!topIsValid))
     {
         cerr << "This is not an archive!" << endl;
         return;
     }
     
-    int topIndex = (int)topDict.val->value.uidValue;
+    int64_t topIndex = topDict.val->value.uidValue;
+    this->topIndex = topIndex;
+    
+    this->expandedObjects = new atomic<PCH_UnarchivedBase *>[this->objects->size()];
     
-    this->rootItem = this->ExpandObjectAtIndex(topIndex);
+    for (int i=0; i<this->objects->size(); i++)
+    {
+        this->expandedObjects[i].store(nullptr, memory_order_relaxed);
+    }
+    
+    vector<PendingExpansion> expansionStack;
+    
+    this->rootItem = this->ExpandObjectAtIndex(topIndex, expansionStack);
+    this->FinishExpansions(expansionStack, 0);
     
     // save the original plist pointer so we can re-access it if needed
     this->pchPlistRoot = root;
+    
+    this->isValid = true;
 }
 
+PCH_UnarchivedModel::~PCH_UnarchivedModel()
+{
+    for (int i=0; i<this->allNodes.size(); i++)
+    {
+        delete this->allNodes[i];
+    }
+    
+    delete[] this->expandedObjects;
+}
 
-PCH_UnarchivedBase *PCH_UnarchivedModel::ExpandObjectAtIndex(const int index)
+PCH_UnarchivedMember::~PCH_UnarchivedMember()
 {
-    PCH_PList_Value *item = this->objects.at(index);
+    if (this->type == Data)
+    {
+        delete this->value.dataVal;
+    }
+    else if (this->type == String)
+    {
+        delete this->value.stringVal;
+    }
+}
+
+PCH_UnarchivedBase *PCH_UnarchivedModel::AddNode(PCH_UnarchivedBase *node)
+{
+    if (workerNodeList != nullptr)
+    {
+        workerNodeList->push_back(node);
+    }
+    else
+    {
+        this->allNodes.push_back(node);
+    }
     
-    return this->ExpandValue(item);
+    return node;
 }
 
+PCH_UnarchivedBase *PCH_UnarchivedModel::ClaimObjectAtIndex(const int64_t index, PCH_UnarchivedBase *node)
+{
+    PCH_UnarchivedBase *expected = nullptr;
+    
+    if (this->expandedObjects[index].compare_exchange_strong(expected, node, memory_order_acq_rel))
+    {
+        return this->AddNode(node);
+    }
+    
+    // some other thread claimed the object while we were creating our node. Its node may still be being filled in, but it will be complete by the time the parallel expansion is joined.
+    delete node;
+    
+    return expected;
+}
 
-PCH_UnarchivedBase *PCH_UnarchivedModel::ExpandValue(PCH_PList_Value *plistValue)
+void PCH_UnarchivedModel::RunParallel(size_t count, const function<void(size_t, size_t)> &expandRange)
 {
-    PCH_PList_Value::pch_value_type vType = plistValue->valueType;
+    // Threads grab chunks from a shared counter, so a thread that draws a few large subtrees doesn't hold up the others. Using several chunks per thread keeps the load balanced.
+    size_t chunkSize = count / (this->numThreads * 8);
     
-    if (vType == PCH_PList_Value::Dict)
+    if (chunkSize < 16)
     {
-        vector<PCH_PList_Value::dictStruct> theDict = *plistValue->value.dictValue;
+        chunkSize = 16;
+    }
+    
+    atomic<size_t> nextChunk(0);
+    
+    vector<vector<PCH_UnarchivedBase *>> nodeLists(this->numThreads);
+    
+    // the nodes created by the other threads come from the same resource as the ones created by this one
+    PCH_PList_MemoryResource *memoryResource = PCH_PList_MemoryResource::Current();
+    
+    auto worker = [&](unsigned int workerIndex)
+    {
+        PCH_PList_MemoryScope memoryScope(memoryResource);
+        workerNodeList = &nodeLists[workerIndex];
+        
+        size_t start;
         
-        PCH_PList_Value *classPtr = PCH_PList_Value::ValueForStringKey(theDict, "$class");
-        if (classPtr != nullptr)
+        while ((start = nextChunk.fetch_add(chunkSize, memory_order_relaxed)) < count)
         {
-            // this is a class definition, so hand off
-            return this->ExpandClassDefinitionWith(theDict);
+            expandRange(start, min(start + chunkSize, count));
         }
+        
+        workerNodeList = nullptr;
+    };
+    
+    vector<thread> threads;
+    threads.reserve(this->numThreads - 1);
+    
+    for (unsigned int i=1; i<this->numThreads; i++)
+    {
+        threads.push_back(thread(worker, i));
     }
-    else if (vType == PCH_PList_Value::Int)
+    
+    // the calling thread does its share too
+    worker(0);
+    
+    for (int i=0; i<threads.size(); i++)
     {
-        PCH_UnarchivedMember newMember;
+        threads[i].join();
+    }
+    
+    for (int i=0; i<nodeLists.size(); i++)
+    {
+        this->allNodes.insert(this->allNodes.end(), nodeLists[i].begin(), nodeLists[i].end());
+    }
+}
+
+PCH_UnarchivedModel::FoundationKind PCH_UnarchivedModel::FoundationKindForClassName(const string &className)
+{
+    // The list of classes is short enough that a linear search is faster than setting up a map
+    static const struct
+    {
+        const char *name;
+        FoundationKind kind;
+        
+    } foundationClasses[] = {
+        
+        {"NSArray", nsArray},
+        {"NSMutableArray", nsArray},
+        {"NSOrderedSet", nsArray},
+        {"NSMutableOrderedSet", nsArray},
+        {"NSSet", nsSet},
+        {"NSMutableSet", nsSet},
+        {"NSDictionary", nsDictionary},
+        {"NSMutableDictionary", nsDictionary},
+        {"NSString", nsString},
+        {"NSMutableString", nsString},
+        {"NSData", nsData},
+        {"NSMutableData", nsData},
+        {"NSDate", nsDate},
+        {"NSNumber", nsNumber}
+    };
+    
+    for (int i=0; i<sizeof(foundationClasses) / sizeof(foundationClasses[0]); i++)
+    {
+        if (className.compare(foundationClasses[i].name) == 0)
+        {
+            return foundationClasses[i].kind;
+        }
+    }
+    
+    return notFoundation;
+}
+
+PCH_UnarchivedBase *PCH_UnarchivedModel::ExpandObjectAtIndex(int64_t index, vector<PendingExpansion> &stack)
+{
+    // Some objects only pass on the value of another object: a bare UID, or a Foundation scalar that holds its value as a UID. These are followed in a loop (chains of them could be long, or even circular), and each one is given its value once the end of the chain has been expanded.
+    struct Referral
+    {
+        int64_t index;
+        FoundationKind kind;
+    };
+    
+    vector<Referral> referrals;
+    
+    PCH_UnarchivedBase *result = nullptr;
+    
+    while (true)
+    {
+        // UID 0 is always the '$null' string. A chain that is longer than the number of objects must be circular.
+        if (index <= 0 || index >= this->objects->size() || referrals.size() >= this->objects->size())
+        {
+            result = nullptr;
+            break;
+        }
+        
+        // if we've (or another thread has) already expanded this object, we're done
+        PCH_UnarchivedBase *existing = this->expandedObjects[index].load(memory_order_acquire);
+        
+        if (existing != nullptr)
+        {
+            result = existing;
+            break;
+        }
+        
+        PCH_PList_Value *item = (*this->objects)[index];
+        
+        PCH_PList_Value *referral = nullptr;
+        FoundationKind kind = notFoundation;
+        
+        if (item->valueType == PCH_PList_Value::Dict && this->IsClassInstance(item))
+        {
+            const vector<PCH_PList_Value::dictStruct> &theDict = *item->value.dictValue;
+            
+            const string *className = nullptr;
+            kind = this->FoundationKindForInstance(theDict, className);
+            
+            if (kind == nsArray || kind == nsSet || kind == nsDictionary)
+            {
+                result = this->ExpandFoundationCollection(index, kind, *className, theDict, stack);
+                break;
+            }
+            else if (kind != notFoundation)
+            {
+                PCH_PList_Value *scalar = FoundationScalarValue(kind, theDict);
+                
+                if (scalar == nullptr || scalar->valueType != PCH_PList_Value::Uid)
+                {
+                    result = this->PublishScalarObject(index, kind, (scalar != nullptr ? this->StartValue(scalar, stack) : nullptr));
+                    break;
+                }
+                
+                referral = scalar;
+            }
+            else
+            {
+                // this is a class definition, so hand off
+                result = this->ExpandClassDefinitionWith(index, theDict, stack);
+                break;
+            }
+        }
+        else if (item->valueType == PCH_PList_Value::Uid)
+        {
+            referral = item;
+        }
+        else if (item->valueType == PCH_PList_Value::Array || item->valueType == PCH_PList_Value::Set)
+        {
+            // plain (un-keyed) plist arrays don't normally show up in archives, but handle them anyway. Like the Foundation collections, they're registered before their elements are expanded.
+            PCH_UnarchivedArray *newArray = new PCH_UnarchivedArray(item->valueType == PCH_PList_Value::Set ? Set : Array);
+            
+            result = this->ClaimObjectAtIndex(index, newArray);
+            
+            if (result == newArray)
+            {
+                this->ResolveUIDArray(item, newArray->elements, stack);
+            }
+            
+            break;
+        }
+        else
+        {
+            result = this->PublishScalarObject(index, notFoundation, this->StartValue(item, stack));
+            break;
+        }
+        
+        Referral nextReferral = {index, kind};
+        referrals.push_back(nextReferral);
+        
+        index = referral->value.uidValue;
+    }
+    
+    for (auto nextReferral = referrals.rbegin(); nextReferral != referrals.rend(); nextReferral++)
+    {
+        result = this->PublishScalarObject(nextReferral->index, nextReferral->kind, result);
+    }
+    
+    return result;
+}
+
+bool PCH_UnarchivedModel::IsClassInstance(PCH_PList_Value *item)
+{
+    PCH_PList_Value *classPtr = PCH_PList_Value::ValueForStringKey(*item->value.dictValue, "$class");
+    
+    return (classPtr != nullptr && classPtr->valueType == PCH_PList_Value::Uid && classPtr->value.uidValue < this->objects->size());
+}
+
+PCH_UnarchivedModel::FoundationKind PCH_UnarchivedModel::FoundationKindForInstance(const vector<PCH_PList_Value::dictStruct> &dict, const string *&className)
+{
+    PCH_PList_Value *classDef = (*this->objects)[PCH_PList_Value::ValueForStringKey(dict, "$class")->value.uidValue];
+    PCH_PList_Value *classNamePtr = (classDef->valueType == PCH_PList_Value::Dict ? PCH_PList_Value::ValueForStringKey(*classDef->value.dictValue, "$classname") : nullptr);
+    
+    if (classNamePtr == nullptr || classNamePtr->valueType != PCH_PList_Value::AsciiString)
+    {
+        return notFoundation;
+    }
+    
+    className = classNamePtr->value.asciiStringValue;
+    
+    return FoundationKindForClassName(*className);
+}
+
+void PCH_UnarchivedModel::ResolveUIDArray(PCH_PList_Value *uidArray, vector<PCH_UnarchivedBase *> &resolved, vector<PendingExpansion> &stack)
+{
+    if (uidArray == nullptr || (uidArray->valueType != PCH_PList_Value::Array && uidArray->valueType != PCH_PList_Value::Set))
+    {
+        return;
+    }
+    
+    const vector<PCH_PList_Value *> &uids = uidArray->Elements();
+    
+    size_t base = resolved.size();
+    resolved.resize(base + uids.size());
+    
+    // The elements of a wide collection are independent subtrees, so they are farmed out to several threads (each with its own stack). Nested collections inside a parallel expansion are expanded on the thread that found them.
+    if (uids.size() >= PCH_UNARCHIVER_PARALLEL_THRESHOLD && this->numThreads > 1 && workerNodeList == nullptr)
+    {
+        this->RunParallel(uids.size(), [&](size_t start, size_t end)
+        {
+            vector<PendingExpansion> workerStack;
+            
+            for (size_t i=start; i<end; i++)
+            {
+                resolved[base + i] = this->ExpandValue(uids[i], workerStack);
+            }
+        });
+        
+        return;
+    }
+    
+    // the elements are pushed in reverse so that they come off the stack in order
+    for (size_t i=uids.size(); i>0; i--)
+    {
+        PendingExpansion nextExpansion = {uids[i - 1], &resolved[base + i - 1]};
+        stack.push_back(nextExpansion);
+    }
+}
+
+PCH_UnarchivedBase *PCH_UnarchivedModel::ExpandFoundationCollection(const int64_t index, FoundationKind kind, const string &className, const vector<PCH_PList_Value::dictStruct> &dict, vector<PendingExpansion> &stack)
+{
+    if (kind == nsDictionary)
+    {
+        PCH_UnarchivedDict *result = new PCH_UnarchivedDict();
+        result->className = className;
+        
+        PCH_UnarchivedBase *winner = this->ClaimObjectAtIndex(index, result);
+        
+        if (winner != result)
+        {
+            return winner;
+        }
+        
+        // the values go on the stack first, so that the keys are expanded first
+        this->ResolveUIDArray(PCH_PList_Value::ValueForStringKey(dict, "NS.objects"), result->values, stack);
+        this->ResolveUIDArray(PCH_PList_Value::ValueForStringKey(dict, "NS.keys"), result->keys, stack);
+        
+        return result;
+    }
+    
+    PCH_UnarchivedArray *result = new PCH_UnarchivedArray(kind == nsSet ? Set : Array);
+    result->className = className;
+    
+    // register the (still empty) collection before resolving the elements so that any reference back to this object finds it
+    PCH_UnarchivedBase *winner = this->ClaimObjectAtIndex(index, result);
+    
+    if (winner != result)
+    {
+        return winner;
+    }
+    
+    this->ResolveUIDArray(PCH_PList_Value::ValueForStringKey(dict, "NS.objects"), result->elements, stack);
+    
+    return result;
+}
+
+PCH_PList_Value *PCH_UnarchivedModel::FoundationScalarValue(FoundationKind kind, const vector<PCH_PList_Value::dictStruct> &dict)
+{
+    // these all hold a single scalar, under a key that depends on the class
+    PCH_PList_Value *scalar = nullptr;
+    
+    if (kind == nsString)
+    {
+        scalar = PCH_PList_Value::ValueForStringKey(dict, "NS.string");
+        
+        if (scalar == nullptr)
+        {
+            scalar = PCH_PList_Value::ValueForStringKey(dict, "NS.bytes");
+        }
+    }
+    else if (kind == nsData)
+    {
+        scalar = PCH_PList_Value::ValueForStringKey(dict, "NS.data");
+    }
+    else if (kind == nsDate)
+    {
+        scalar = PCH_PList_Value::ValueForStringKey(dict, "NS.time");
+    }
+    else
+    {
+        // NSNumbers are normally archived as plain plist numbers, but if we get one as a class, just take the first member that isn't the class
+        for (const PCH_PList_Value::dictStruct &entry : dict)
+        {
+            if (entry.key->valueType == PCH_PList_Value::AsciiString && entry.key->value.asciiStringValue->compare("$class") != 0)
+            {
+                scalar = entry.val;
+                break;
+            }
+        }
+    }
+    
+    return scalar;
+}
+
+PCH_UnarchivedBase *PCH_UnarchivedModel::PublishScalarObject(const int64_t index, FoundationKind kind, PCH_UnarchivedBase *result)
+{
+    // NS.bytes (used by some NSString archives) is data, but it is really the UTF-8 string
+    if (kind == nsString && result != nullptr && result->type == Data)
+    {
+        PCH_UnarchivedMember *strMember = (PCH_UnarchivedMember *)this->AddNode(new PCH_UnarchivedMember(String));
+        vector<char> *bytes = ((PCH_UnarchivedMember *)result)->value.dataVal;
+        strMember->value.stringVal = new string(bytes->begin(), bytes->end());
+        result = strMember;
+    }
+    else if (kind == nsDate && result != nullptr && result->type == Double)
+    {
+        PCH_UnarchivedMember *dateMember = (PCH_UnarchivedMember *)this->AddNode(new PCH_UnarchivedMember(Date));
+        dateMember->value.dateVal = ((PCH_UnarchivedMember *)result)->value.doubleVal;
+        result = dateMember;
+    }
+    
+    if (result == nullptr)
+    {
+        return nullptr;
+    }
+    
+    // scalars can't refer back to their own object, so they're published after they've been created. If we lose the race, our node is simply left for the destructor.
+    PCH_UnarchivedBase *expected = nullptr;
+    
+    if (!this->expandedObjects[index].compare_exchange_strong(expected, result, memory_order_acq_rel))
+    {
+        return expected;
+    }
+    
+    return result;
+}
+
+PCH_UnarchivedBase *PCH_UnarchivedModel::ExpandValue(PCH_PList_Value *plistValue, vector<PendingExpansion> &stack)
+{
+    size_t baseDepth = stack.size();
+    
+    PCH_UnarchivedBase *result = this->StartValue(plistValue, stack);
+    
+    this->FinishExpansions(stack, baseDepth);
+    
+    return result;
+}
+
+void PCH_UnarchivedModel::FinishExpansions(vector<PendingExpansion> &stack, size_t baseDepth)
+{
+    while (stack.size() > baseDepth)
+    {
+        PendingExpansion nextExpansion = stack.back();
+        stack.pop_back();
+        
+        *nextExpansion.destination = this->StartValue(nextExpansion.value, stack);
+    }
+}
+
+PCH_UnarchivedBase *PCH_UnarchivedModel::StartValue(PCH_PList_Value *plistValue, vector<PendingExpansion> &stack)
+{
+    if (plistValue == nullptr)
+    {
+        return nullptr;
+    }
+    
+    switch (plistValue->valueType)
+    {
+        case PCH_PList_Value::Uid:
+        {
+            return this->ExpandObjectAtIndex(plistValue->value.uidValue, stack);
+        }
+            
+        case PCH_PList_Value::Bool:
+        {
+            PCH_UnarchivedMember *newMember = new PCH_UnarchivedMember(Bool);
+            newMember->value.boolVal = plistValue->value.boolValue;
+            return this->AddNode(newMember);
+        }
+            
+        case PCH_PList_Value::Int:
+        {
+            PCH_UnarchivedMember *newMember = new PCH_UnarchivedMember(Int);
+            newMember->value.intVal = plistValue->value.intValue;
+            return this->AddNode(newMember);
+        }
+            
+        case PCH_PList_Value::Double:
+        {
+            PCH_UnarchivedMember *newMember = new PCH_UnarchivedMember(Double);
+            newMember->value.doubleVal = plistValue->value.doubleValue;
+            return this->AddNode(newMember);
+        }
+            
+        case PCH_PList_Value::Date:
+        {
+            PCH_UnarchivedMember *newMember = new PCH_UnarchivedMember(Date);
+            newMember->value.dateVal = plistValue->value.dateValue;
+            return this->AddNode(newMember);
+        }
+            
+        case PCH_PList_Value::Data:
+        {
+            PCH_UnarchivedMember *newMember = new PCH_UnarchivedMember(Data);
+            newMember->value.dataVal = new vector<char>(*plistValue->value.dataValue);
+            return this->AddNode(newMember);
+        }
+            
+        case PCH_PList_Value::AsciiString:
+        {
+            PCH_UnarchivedMember *newMember = new PCH_UnarchivedMember(String);
+            newMember->value.stringVal = new string(*plistValue->value.asciiStringValue);
+            return this->AddNode(newMember);
+        }
+            
+        case PCH_PList_Value::UnicodeString:
+        {
+            PCH_UnarchivedMember *newMember = new PCH_UnarchivedMember(String);
+            newMember->value.stringVal = new string(PCH_PList::UTF8FromUTF16(*plistValue->value.uniStringValue));
+            return this->AddNode(newMember);
+        }
+            
+        case PCH_PList_Value::Array:
+        case PCH_PList_Value::Set:
+        {
+            // an inline array (not an object of its own)
+            PCH_UnarchivedArray *result = new PCH_UnarchivedArray(plistValue->valueType == PCH_PList_Value::Set ? Set : Array);
+            this->AddNode(result);
+            
+            this->ResolveUIDArray(plistValue, result->elements, stack);
+            
+            return result;
+        }
+            
+        default:
+            break;
     }
     
     return nullptr;
 }
 
 
-PCH_UnarchivedClass *PCH_UnarchivedModel::ExpandClassDefinitionWith(const vector<PCH_PList_Value::dictStruct> dict)
+PCH_UnarchivedClass *PCH_UnarchivedModel::ExpandClassDefinitionWith(const int64_t index, const vector<PCH_PList_Value::dictStruct> &dict, vector<PendingExpansion> &stack)
 {
     PCH_UnarchivedClass *result = new PCH_UnarchivedClass();
     
-    // start out by creating the basic definition of the class
-    int classUID = (int)PCH_PList_Value::ValueForStringKey(dict, "$class")->value.uidValue;
-    
-    vector<PCH_PList_Value::dictStruct> defDict = *this->objects.at(classUID)->value.dictValue;
+    // register the instance before expanding the members so that cyclic references resolve to it
+    PCH_UnarchivedBase *winner = this->ClaimObjectAtIndex(index, result);
     
-    result->name = *PCH_PList_Value::ValueForStringKey(defDict, "classname")->value.asciiStringValue;
+    if (winner != result)
+    {
+        return (PCH_UnarchivedClass *)winner;
+    }
     
-    vector<PCH_PList_Value *> superArray = *PCH_PList_Value::ValueForStringKey(defDict, "classname")->value.arrayValue;
+    // Start out by creating the basic definition of the class. If '$class' doesn't refer to a class definition (a dict), the class is left without a name or supers.
+    PCH_PList_Value *classPtr = PCH_PList_Value::ValueForStringKey(dict, "$class");
+    PCH_PList_Value *classDef = (classPtr != nullptr && classPtr->valueType == PCH_PList_Value::Uid && classPtr->value.uidValue < this->objects->size() ? (*this->objects)[classPtr->value.uidValue] : nullptr);
     
-    for (int i=0; i<superArray.size(); i++)
+    if (classDef != nullptr && classDef->valueType == PCH_PList_Value::Dict)
     {
-        result->supers.push_back(*superArray.at(i)->value.asciiStringValue);
+        const vector<PCH_PList_Value::dictStruct> &defDict = *classDef->value.dictValue;
+        
+        PCH_PList_Value *namePtr = PCH_PList_Value::ValueForStringKey(defDict, "$classname");
+        
+        if (namePtr != nullptr && namePtr->valueType == PCH_PList_Value::AsciiString)
+        {
+            result->name = *namePtr->value.asciiStringValue;
+        }
+        
+        PCH_PList_Value *supersPtr = PCH_PList_Value::ValueForStringKey(defDict, "$classes");
+        
+        if (supersPtr != nullptr && supersPtr->valueType == PCH_PList_Value::Array)
+        {
+            const vector<PCH_PList_Value *> &superArray = *supersPtr->value.arrayValue;
+            
+            for (int i=0; i<superArray.size(); i++)
+            {
+                if (superArray[i]->valueType == PCH_PList_Value::AsciiString)
+                {
+                    result->supers.push_back(*superArray[i]->value.asciiStringValue);
+                }
+            }
+        }
     }
     
     // Now go through the members (if any). Essentially, any entry that doesn't have the key '$class' is a member of the class
-    for (int i=0; i<dict.size(); i++)
+    result->members.reserve(dict.size());
+    
+    for (const PCH_PList_Value::dictStruct &entry : dict)
     {
-        string nextKey = *dict.at(i).key->value.asciiStringValue;
-        
-        if (nextKey.compare("$class") != 0)
+        if (entry.key->valueType == PCH_PList_Value::AsciiString && entry.key->value.asciiStringValue->compare("$class") != 0)
         {
             PCH_UnarchivedClass::memberDef nextMember;
-            nextMember.name = nextKey;
-            
-            nextMember.baseType = *this->ExpandValue(PCH_PList_Value::ValueForStringKey(dict, nextKey));
+            nextMember.name = *entry.key->value.asciiStringValue;
+            nextMember.value = nullptr;
             
             result->members.push_back(nextMember);
         }
     }
     
+    // The member values are filled in from the stack (now that the members vector won't move any more). They're pushed in reverse so that they come off the stack in order.
+    size_t memberNum = result->members.size();
+    
+    for (auto entry = dict.rbegin(); entry != dict.rend(); entry++)
+    {
+        if (entry->key->valueType == PCH_PList_Value::AsciiString && entry->key->value.asciiStringValue->compare("$class") != 0)
+        {
+            memberNum--;
+            
+            PendingExpansion nextExpansion = {entry->val, &result->members[memberNum].value};
+            stack.push_back(nextExpansion);
+        }
+    }
+    
+    return result;
+}
+
+// Escape a string so that it can be written as a JSON string literal
+static string JSONEscaped(const string &str)
+{
+    string result;
+    result.reserve(str.size() + 2);
+    
+    for (size_t i=0; i<str.size(); i++)
+    {
+        char nextChar = str[i];
+        
+        if (nextChar == '"' || nextChar == '\\')
+        {
+            result += '\\';
+            result += nextChar;
+        }
+        else if ((unsigned char)nextChar < 0x20)
+        {
+            char escBuff[8];
+            snprintf(escBuff, sizeof(escBuff), "\\u%04x", (unsigned int)nextChar);
+            result += escBuff;
+        }
+        else
+        {
+            result += nextChar;
+        }
+    }
+    
     return result;
 }
+
+string PCH_UnarchivedModel::ClassNameForObject(PCH_PList_Value *object)
+{
+    switch (object->valueType)
+    {
+        case PCH_PList_Value::Null:
+            return string("(null)");
+        case PCH_PList_Value::Bool:
+            return string("(bool)");
+        case PCH_PList_Value::Int:
+            return string("(int)");
+        case PCH_PList_Value::Double:
+            return string("(real)");
+        case PCH_PList_Value::Date:
+            return string("(date)");
+        case PCH_PList_Value::Data:
+            return string("(data)");
+        case PCH_PList_Value::AsciiString:
+        case PCH_PList_Value::UnicodeString:
+            return string("(string)");
+        case PCH_PList_Value::Uid:
+            return string("(uid)");
+        case PCH_PList_Value::Array:
+        case PCH_PList_Value::IntArray:
+        case PCH_PList_Value::DoubleArray:
+            return string("(array)");
+        case PCH_PList_Value::Set:
+            return string("(set)");
+        default:
+            break;
+    }
+    
+    const vector<PCH_PList_Value::dictStruct> &dict = *object->value.dictValue;
+    
+    // class definitions are the dictionaries that hold $classname (instances point at them through $class)
+    if (PCH_PList_Value::ValueForStringKey(dict, "$classname") != nullptr)
+    {
+        return string("(class definition)");
+    }
+    
+    PCH_PList_Value *classPtr = PCH_PList_Value::ValueForStringKey(dict, "$class");
+    
+    if (classPtr != nullptr && classPtr->valueType == PCH_PList_Value::Uid && classPtr->value.uidValue < this->objects->size())
+    {
+        PCH_PList_Value *classDef = (*this->objects)[classPtr->value.uidValue];
+        
+        if (classDef->valueType == PCH_PList_Value::Dict)
+        {
+            PCH_PList_Value *namePtr = PCH_PList_Value::ValueForStringKey(*classDef->value.dictValue, "$classname");
+            
+            if (namePtr != nullptr && namePtr->valueType == PCH_PList_Value::AsciiString)
+            {
+                return *namePtr->value.asciiStringValue;
+            }
+        }
+    }
+    
+    return string("(dict)");
+}
+
+// The number of bytes the binary plist encoding uses for a count (the low nibble holds counts up to 14, after which an int object follows)
+static size_t EncodedCountSize(size_t count)
+{
+    if (count < 15)
+    {
+        return 0;
+    }
+    
+    return (count < 0x100 ? 2 : (count < 0x10000 ? 3 : (count < 0x100000000ULL ? 5 : 9)));
+}
+
+// This is an estimate of the number of bytes that a single value occupies in the binary plist, not counting any children. Object references are counted as 2 bytes each, which is what most archives use.
+static size_t EncodedNodeSize(const PCH_PList_Value *value)
+{
+    const size_t refSize = 2;
+    
+    switch (value->valueType)
+    {
+        case PCH_PList_Value::Int:
+        {
+            uint64_t absVal = (uint64_t)value->value.intValue;
+            return 1 + (absVal < 0x100 ? 1 : (absVal < 0x10000 ? 2 : (absVal < 0x100000000ULL ? 4 : 8)));
+        }
+            
+        case PCH_PList_Value::Double:
+        case PCH_PList_Value::Date:
+            return 9;
+            
+        case PCH_PList_Value::Data:
+            return 1 + EncodedCountSize(value->value.dataValue->size()) + value->value.dataValue->size();
+            
+        case PCH_PList_Value::AsciiString:
+            return 1 + EncodedCountSize(value->value.asciiStringValue->size()) + value->value.asciiStringValue->size();
+            
+        case PCH_PList_Value::UnicodeString:
+            return 1 + EncodedCountSize(value->value.uniStringValue->size()) + 2 * value->value.uniStringValue->size();
+            
+        case PCH_PList_Value::Uid:
+        {
+            uint64_t uid = (uint64_t)value->value.uidValue;
+            return 1 + (uid < 0x100 ? 1 : (uid < 0x10000 ? 2 : (uid < 0x100000000ULL ? 4 : 8)));
+        }
+            
+        case PCH_PList_Value::Array:
+        case PCH_PList_Value::Set:
+        {
+            const vector<PCH_PList_Value *> &elements = value->Elements();
+            return 1 + EncodedCountSize(elements.size()) + refSize * elements.size();
+        }
+            
+        case PCH_PList_Value::Dict:
+        {
+            const vector<PCH_PList_Value::dictStruct> &dict = value->Entries();
+            return 1 + EncodedCountSize(dict.size()) + 2 * refSize * dict.size();
+        }
+            
+        default:
+            break;
+    }
+    
+    return 1;
+}
+
+// Adds up the encoded sizes of a value and all of the values held "inline" in it (ie: not referenced through a UID)
+class PCH_EncodedSizeCounter : public PCH_PListValueVisitor
+{
+public:
+    
+    size_t totalSize;
+    
+    PCH_EncodedSizeCounter() {this->totalSize = 0;}
+    
+    virtual bool BeginValue(const PCH_PList_Value *value, Role role, size_t depth)
+    {
+        this->totalSize += EncodedNodeSize(value);
+        return true;
+    }
+};
+
+size_t PCH_UnarchivedModel::EncodedSize(PCH_PList_Value *value)
+{
+    PCH_EncodedSizeCounter counter;
+    this->treeWalker.Walk(value, counter);
+    
+    return counter.totalSize;
+}
+
+// Collects the UIDs referenced by a value, directly or inside inline collections. Dict keys are never references, so they're skipped (along with the value for the top-level "$class" key, if skipClass is set).
+class PCH_UIDCollector : public PCH_PListValueVisitor
+{
+public:
+    
+    PCH_UIDCollector(vector<int64_t> &uids, bool skipClass) : uids(uids), skipClass(skipClass), skipNextValue(false) {}
+    
+    virtual bool BeginValue(const PCH_PList_Value *value, Role role, size_t depth)
+    {
+        if (role == dictKey)
+        {
+            this->skipNextValue = (this->skipClass && depth == 1 && value->valueType == PCH_PList_Value::AsciiString && value->value.asciiStringValue->compare("$class") == 0);
+            return false;
+        }
+        
+        if (role == dictValue && this->skipNextValue)
+        {
+            this->skipNextValue = false;
+            return false;
+        }
+        
+        if (value->valueType == PCH_PList_Value::Uid)
+        {
+            this->uids.push_back(value->value.uidValue);
+        }
+        
+        return true;
+    }
+    
+private:
+    
+    vector<int64_t> &uids;
+    bool skipClass;
+    bool skipNextValue;
+};
+
+// Append the UIDs referenced by 'value' (directly or inside inline collections) to 'uids'. The reference to the class definition is skipped if 'skipClass' is true.
+void PCH_UnarchivedModel::CollectUIDs(PCH_PList_Value *value, vector<int64_t> &uids, bool skipClass)
+{
+    PCH_UIDCollector collector(uids, skipClass);
+    this->treeWalker.Walk(value, collector);
+}
+
+void PCH_UnarchivedModel::WriteStatistics(ostream &outStream, int numHotspots)
+{
+    size_t numObjects = this->objects->size();
+    
+    // per-object data
+    vector<string> classNames(numObjects);
+    vector<size_t> bytes(numObjects);
+    vector<size_t> memberCounts(numObjects, 0);
+    vector<vector<int64_t>> references(numObjects);
+    vector<size_t> fanIn(numObjects, 0);
+    
+    for (size_t i=0; i<numObjects; i++)
+    {
+        PCH_PList_Value *object = (*this->objects)[i];
+        
+        classNames[i] = this->ClassNameForObject(object);
+        bytes[i] = EncodedSize(object);
+        
+        CollectUIDs(object, references[i], true);
+        
+        if (object->valueType == PCH_PList_Value::Dict)
+        {
+            const vector<PCH_PList_Value::dictStruct> &dict = *object->value.dictValue;
+            PCH_PList_Value *nsObjects = PCH_PList_Value::ValueForStringKey(dict, "NS.objects");
+            
+            // for Foundation collections the interesting "member count" is the number of elements
+            if (nsObjects != nullptr && nsObjects->valueType == PCH_PList_Value::Array)
+            {
+                memberCounts[i] = nsObjects->value.arrayValue->size();
+            }
+            else
+            {
+                memberCounts[i] = (PCH_PList_Value::ValueForStringKey(dict, "$class") != nullptr ? dict.size() - 1 : dict.size());
+            }
+        }
+        
+        for (int j=0; j<references[i].size(); j++)
+        {
+            int64_t ref = references[i][j];
+            
+            if (ref >= 0 && ref < numObjects)
+            {
+                fanIn[ref]++;
+            }
+        }
+    }
+    
+    // Walk the reference graph depth-first from the root (with an explicit stack so that deep archives can't overflow the call stack). Each object is visited once; its depth and parent are those of the first path that reached it, and its "subtree" is everything first reached through it.
+    vector<int64_t> depth(numObjects, -1);
+    vector<int64_t> parent(numObjects, -1);
+    vector<int64_t> visitOrder;
+    visitOrder.reserve(numObjects);
+    
+    if (this->topIndex >= 0 && this->topIndex < numObjects)
+    {
+        vector<int64_t> stack;
+        stack.push_back(this->topIndex);
+        depth[this->topIndex] = 0;
+        
+        while (!stack.empty())
+        {
+            int64_t next = stack.back();
+            stack.pop_back();
+            
+            visitOrder.push_back(next);
+            
+            for (int j=0; j<references[next].size(); j++)
+            {
+                int64_t ref = references[next][j];
+                
+                // UID 0 is $null, which isn't interesting
+                if (ref > 0 && ref < numObjects && depth[ref] < 0)
+                {
+                    depth[ref] = depth[next] + 1;
+                    parent[ref] = next;
+                    stack.push_back(ref);
+                }
+            }
+        }
+    }
+    
+    vector<size_t> subtreeBytes(bytes);
+    
+    for (size_t i=visitOrder.size(); i>0; i--)
+    {
+        int64_t next = visitOrder[i-1];
+        
+        if (parent[next] >= 0)
+        {
+            subtreeBytes[parent[next]] += subtreeBytes[next];
+        }
+    }
+    
+    // now gather everything per class
+    struct ClassStats
+    {
+        size_t instances = 0;
+        size_t totalBytes = 0;
+        size_t totalMembers = 0;
+        size_t totalFanIn = 0;
+        size_t totalFanOut = 0;
+        size_t maxFanIn = 0;
+        size_t maxFanOut = 0;
+        int64_t maxDepth = -1;
+    };
+    
+    map<string, ClassStats> classStats;
+    
+    int64_t deepestObject = -1;
+    
+    for (size_t i=0; i<numObjects; i++)
+    {
+        ClassStats &stats = classStats[classNames[i]];
+        
+        stats.instances++;
+        stats.totalBytes += bytes[i];
+        stats.totalMembers += memberCounts[i];
+        stats.totalFanIn += fanIn[i];
+        stats.totalFanOut += references[i].size();
+        stats.maxFanIn = max(stats.maxFanIn, fanIn[i]);
+        stats.maxFanOut = max(stats.maxFanOut, references[i].size());
+        stats.maxDepth = max(stats.maxDepth, depth[i]);
+        
+        if (depth[i] >= 0 && (deepestObject < 0 || depth[i] > depth[deepestObject]))
+        {
+            deepestObject = i;
+        }
+    }
+    
+    // the classes are listed in order of decreasing total bytes
+    vector<pair<string, ClassStats>> sortedClasses(classStats.begin(), classStats.end());
+    
+    sort(sortedClasses.begin(), sortedClasses.end(), [](const pair<string, ClassStats> &a, const pair<string, ClassStats> &b) {return a.second.totalBytes > b.second.totalBytes;});
+    
+    size_t totalBytes = 0;
+    
+    for (size_t i=0; i<numObjects; i++)
+    {
+        totalBytes += bytes[i];
+    }
+    
+    outStream << "{" << endl;
+    outStream << "  \"objects\": " << numObjects << "," << endl;
+    outStream << "  \"root\": " << this->topIndex << "," << endl;
+    outStream << "  \"reachable\": " << visitOrder.size() << "," << endl;
+    outStream << "  \"totalBytes\": " << totalBytes << "," << endl;
+    
+    outStream << "  \"classes\": [" << endl;
+    
+    for (int i=0; i<sortedClasses.size(); i++)
+    {
+        const ClassStats &stats = sortedClasses[i].second;
+        double count = (double)stats.instances;
+        
+        outStream << "    {\"class\": \"" << JSONEscaped(sortedClasses[i].first) << "\"";
+        outStream << ", \"instances\": " << stats.instances;
+        outStream << ", \"totalBytes\": " << stats.totalBytes;
+        outStream << ", \"averageMembers\": " << stats.totalMembers / count;
+        outStream << ", \"averageFanIn\": " << stats.totalFanIn / count;
+        outStream << ", \"maxFanIn\": " << stats.maxFanIn;
+        outStream << ", \"averageFanOut\": " << stats.totalFanOut / count;
+        outStream << ", \"maxFanOut\": " << stats.maxFanOut;
+        outStream << ", \"maxDepth\": " << stats.maxDepth << "}";
+        outStream << (i + 1 < sortedClasses.size() ? "," : "") << endl;
+    }
+    
+    outStream << "  ]," << endl;
+    
+    // the deepest chain, listed from the root down
+    vector<int64_t> chain;
+    
+    for (int64_t next = deepestObject; next >= 0; next = parent[next])
+    {
+        chain.push_back(next);
+    }
+    
+    reverse(chain.begin(), chain.end());
+    
+    outStream << "  \"deepestChain\": [";
+    
+    for (int i=0; i<chain.size(); i++)
+    {
+        outStream << (i > 0 ? ", " : "") << "{\"index\": " << chain[i] << ", \"class\": \"" << JSONEscaped(classNames[chain[i]]) << "\"}";
+    }
+    
+    outStream << "]," << endl;
+    
+    // the hotspots are the objects with the biggest subtrees (the root is left out, since it always "owns" everything)
+    vector<int64_t> hotspots;
+    
+    for (size_t i=0; i<visitOrder.size(); i++)
+    {
+        if (visitOrder[i] != this->topIndex)
+        {
+            hotspots.push_back(visitOrder[i]);
+        }
+    }
+    
+    size_t numToReport = min(hotspots.size(), (size_t)max(numHotspots, 0));
+    
+    partial_sort(hotspots.begin(), hotspots.begin() + numToReport, hotspots.end(), [&subtreeBytes](int64_t a, int64_t b) {return subtreeBytes[a] > subtreeBytes[b];});
+    
+    outStream << "  \"hotspots\": [" << endl;
+    
+    for (size_t i=0; i<numToReport; i++)
+    {
+        int64_t index = hotspots[i];
+        
+        outStream << "    {\"index\": " << index;
+        outStream << ", \"class\": \"" << JSONEscaped(classNames[index]) << "\"";
+        outStream << ", \"bytes\": " << bytes[index];
+        outStream << ", \"subtreeBytes\": " << subtreeBytes[index];
+        outStream << ", \"depth\": " << depth[index];
+        outStream << ", \"fanIn\": " << fanIn[index];
+        outStream << ", \"fanOut\": " << references[index].size() << "}";
+        outStream << (i + 1 < numToReport ? "," : "") << endl;
+    }
+    
+    outStream << "  ]" << endl;
+    outStream << "}" << endl;
+}
@@ -16,12 +16,17 @@
 
 #include <string>
 #include <vector>
+#include <atomic>
+#include <functional>
 
 using namespace std;
 
 // This appears to be the only value allowed by Apple
 #define PCH_NSKEYEDARCHIVER_VERSION  100000
 
+// Collections with at least this many elements have their elements expanded in parallel (smaller ones aren't worth the cost of starting threads)
+#define PCH_UNARCHIVER_PARALLEL_THRESHOLD   256
+
 enum PCH_UnarchivedType
 {
     Undefined,
@@ -45,8 +50,13 @@ struct PCH_UnarchivedBase
     
     PCH_UnarchivedBase() {this->type = Undefined;}
     PCH_UnarchivedBase(PCH_UnarchivedType wType) {this->type = wType;}
+    virtual ~PCH_UnarchivedBase() {};
     
     string TypeName();
+    
+    // nodes come from the current PCH_PList_MemoryResource
+    static void *operator new(size_t numBytes) {return PCH_PList_MemoryResource::AllocateNode(numBytes);}
+    static void operator delete(void *node, size_t numBytes) {PCH_PList_MemoryResource::FreeNode(node, numBytes);}
 };
 
 // I believe that all objects that can be serialized by NSKeyedArchive have to be _classes_, but I'm not 100% sure, so I'll allow the possibility for future expansion by allowing the definition of structs too.
@@ -58,10 +68,10 @@ struct PCH_UnarchivedStruct : PCH_UnarchivedBase
     // a vector of the structs from which this struct is derived
     vector<string> supers;
     
-    // a struct to define each member
+    // a struct to define each member. The value is owned by the PCH_UnarchivedModel that created it (members may point at objects that are shared with other instances)
     struct memberDef
     {
-        PCH_UnarchivedBase baseType;
+        PCH_UnarchivedBase *value;
         string name;
     };
     
@@ -78,10 +88,9 @@ struct PCH_UnarchivedClass : PCH_UnarchivedStruct
     virtual ~PCH_UnarchivedClass() {};
 };
 
+// Scalar values (including NSString, NSData, NSDate and NSNumber instances, which are collapsed into their native values). The 'type' ivar (from PCH_UnarchivedBase) says which field of the union is valid.
 struct PCH_UnarchivedMember:PCH_UnarchivedBase
 {
-    PCH_UnarchivedType type;
-    
     union pch_memberValue
     {
         bool boolVal;
@@ -93,6 +102,32 @@ struct PCH_UnarchivedMember:PCH_UnarchivedBase
         
     } value;
     
+    PCH_UnarchivedMember(PCH_UnarchivedType wType) : PCH_UnarchivedBase(wType) {this->value.intVal = 0;}
+    virtual ~PCH_UnarchivedMember();
+};
+
+// NSArray, NSMutableArray, NSSet, NSMutableSet (and their ordered-set cousins) are collapsed into a single contiguous vector of elements. The 'type' is either Array or Set.
+struct PCH_UnarchivedArray:PCH_UnarchivedBase
+{
+    // the name of the class that was actually archived (eg: "NSMutableArray")
+    string className;
+    
+    vector<PCH_UnarchivedBase *> elements;
+    
+    PCH_UnarchivedArray(PCH_UnarchivedType wType) : PCH_UnarchivedBase(wType) {}
+    virtual ~PCH_UnarchivedArray() {};
+};
+
+// NSDictionary and NSMutableDictionary are collapsed into two parallel contiguous vectors (keys[i] goes with values[i])
+struct PCH_UnarchivedDict:PCH_UnarchivedBase
+{
+    string className;
+    
+    vector<PCH_UnarchivedBase *> keys;
+    vector<PCH_UnarchivedBase *> values;
+    
+    PCH_UnarchivedDict() : PCH_UnarchivedBase(Dict) {}
+    virtual ~PCH_UnarchivedDict() {};
 };
 
 class PCH_UnarchivedModel
@@ -105,22 +140,101 @@ public:
     
     PCH_UnarchivedBase *rootItem;
     
-    PCH_UnarchivedModel(PCH_PList_Value *root);
+    // The number of threads used to expand wide collections. If numThreads is 0, the number of hardware threads is used. Pass 1 to expand everything on the calling thread. If memoryResource isn't NULL, the nodes of the model come from it (on all of the threads) instead of from the current resource; it must outlive the model.
+    PCH_UnarchivedModel(PCH_PList_Value *root, unsigned int numThreads = 0, PCH_PList_MemoryResource *memoryResource = NULL);
+    virtual ~PCH_UnarchivedModel();
+    
+    // Analysis mode: write a JSON report of the archive to outStream. The report gives, per class name, the instance count, the (approximate) encoded bytes, the average member count, the UID fan-in and fan-out and the deepest reference depth. It also lists the deepest reference chain from the root and the 'numHotspots' objects whose subtrees account for the most bytes. This only looks at the raw $objects array, so it works whether or not the model could be expanded.
+    void WriteStatistics(ostream &outStream, int numHotspots = 20);
     
 private:
     
+    // The Foundation classes that are recognized and collapsed into native containers/values instead of going through the generic class expansion
+    enum FoundationKind
+    {
+        notFoundation,
+        nsArray,
+        nsSet,
+        nsDictionary,
+        nsString,
+        nsData,
+        nsDate,
+        nsNumber
+    };
+    
     int version; // always 100000
     
-    vector<PCH_PList_Value *> objects;
+    // the $objects array of the archive (borrowed from the plist tree, which must outlive the model)
+    const vector<PCH_PList_Value *> *objects;
+    
+    unsigned int numThreads;
+    
+    // The expanded version of each entry in 'objects' (nullptr until it has been expanded). Every object in the archive is expanded at most once, no matter how many times its UID is referenced (this also takes care of cyclic references). The entries are atomic so that threads expanding sibling subtrees can claim an object with a single compare-and-swap.
+    atomic<PCH_UnarchivedBase *> *expandedObjects;
+    
+    // Every node created by the model, so that the destructor can free them (nodes may be shared, so they do not own their children)
+    vector<PCH_UnarchivedBase *> allNodes;
+    
+    // Publish 'node' as the expansion of the object at 'index'. If another thread got there first, 'node' is deleted and the other thread's node is returned instead.
+    PCH_UnarchivedBase *ClaimObjectAtIndex(const int64_t index, PCH_UnarchivedBase *node);
+    
+    // Call expandRange() over [0, count) split into chunks, using up to numThreads threads (including the calling one)
+    void RunParallel(size_t count, const function<void(size_t, size_t)> &expandRange);
+    
+    static FoundationKind FoundationKindForClassName(const string &className);
+    
+    // The expansion doesn't use recursion, so the depth of an archive is only limited by the memory available. Expanding a value creates its node right away; containers are created empty (and published, if they are objects of their own, so that references back to them find them), and an entry for each of their children is pushed on a stack. The entries are popped (pushing the entries for their own children) until the stack is back to where it started. Each thread has its own stack.
+    struct PendingExpansion
+    {
+        PCH_PList_Value *value;
+        
+        // where the node for 'value' goes (an element, key, value or member of a node that has already been created)
+        PCH_UnarchivedBase **destination;
+    };
+    
+    // Expand 'plistValue' and everything below it
+    PCH_UnarchivedBase *ExpandValue(PCH_PList_Value *plistValue, vector<PendingExpansion> &stack);
+    
+    void FinishExpansions(vector<PendingExpansion> &stack, size_t baseDepth);
+    
+    // These return the node for a value or object, leaving any children that still have to be expanded on 'stack'
+    PCH_UnarchivedBase *StartValue(PCH_PList_Value *plistValue, vector<PendingExpansion> &stack);
+    
+    PCH_UnarchivedBase *ExpandObjectAtIndex(int64_t index, vector<PendingExpansion> &stack);
+    
+    PCH_UnarchivedBase *ExpandFoundationCollection(const int64_t index, FoundationKind kind, const string &className, const vector<PCH_PList_Value::dictStruct> &dict, vector<PendingExpansion> &stack);
+    
+    // Resolve an entire NS.objects/NS.keys array of UIDs in one go, appending the results to 'resolved' (this is the only place where 'resolved' grows, so the stack can point into it)
+    void ResolveUIDArray(PCH_PList_Value *uidArray, vector<PCH_UnarchivedBase *> &resolved, vector<PendingExpansion> &stack);
+    
+    PCH_UnarchivedClass *ExpandClassDefinitionWith(const int64_t index, const vector<PCH_PList_Value::dictStruct> &dict, vector<PendingExpansion> &stack);
+    
+    // true if 'item' (a dict) has a $class entry that refers to a valid object
+    bool IsClassInstance(PCH_PList_Value *item);
+    
+    // The kind of the class instance 'dict'. 'className' is set if the class has a name.
+    FoundationKind FoundationKindForInstance(const vector<PCH_PList_Value::dictStruct> &dict, const string *&className);
+    
+    // the value held by an NSString, NSData, NSDate or NSNumber instance
+    static PCH_PList_Value *FoundationScalarValue(FoundationKind kind, const vector<PCH_PList_Value::dictStruct> &dict);
+    
+    // Publish 'result' (converted to the right type for 'kind') as the expansion of the object at 'index', returning whichever node was published
+    PCH_UnarchivedBase *PublishScalarObject(const int64_t index, FoundationKind kind, PCH_UnarchivedBase *result);
+    
+    PCH_UnarchivedBase *AddNode(PCH_UnarchivedBase *node);
+    
+    // the index of the root object (from the $top dictionary), or -1 if there isn't one
+    int64_t topIndex;
     
-    // members
-    vector<PCH_UnarchivedMember> members;
+    // Statistics helpers
+    string ClassNameForObject(PCH_PList_Value *object);
     
-    PCH_UnarchivedBase *ExpandValue(PCH_PList_Value *plistValue);
+    size_t EncodedSize(PCH_PList_Value *value);
     
-    PCH_UnarchivedBase *ExpandObjectAtIndex(const int index);
+    void CollectUIDs(PCH_PList_Value *value, vector<int64_t> &uids, bool skipClass);
     
-    PCH_UnarchivedClass *ExpandClassDefinitionWith(const vector<PCH_PList_Value::dictStruct> dict);
+    // used by EncodedSize() and CollectUIDs()
+    PCH_PListTreeWalker treeWalker;
 };
 
 #endif /* PCH_NSKeyedArchiver_Analyzer_hpp */
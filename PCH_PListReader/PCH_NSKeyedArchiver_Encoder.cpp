@@ -0,0 +1,448 @@
+//
+//  PCH_NSKeyedArchiver_Encoder.cpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-19.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+#include "PCH_NSKeyedArchiver_Encoder.hpp"
+#include "PCH_PListWriter.hpp"
+
+#include <fstream>
+
+// the number of plist objects in the parts of the archive outside of $objects (the root dict, its four keys and their values, and the "root" entry of $top)
+#define PCH_ARCHIVE_FRAME_OBJECTS       11
+
+PCH_NSKeyedArchiver_Encoder::PCH_NSKeyedArchiver_Encoder(const PCH_UnarchivedBase *rootObject)
+{
+    this->numPlistObjects = PCH_ARCHIVE_FRAME_OBJECTS;
+    
+    // UID 0 is always the '$null' string
+    ArchivedObject nullObject = {nullptr, 0, 0, 0};
+    this->archivedObjects.push_back(nullObject);
+    this->numPlistObjects++;
+    
+    this->rootUID = this->UIDForObject(rootObject);
+    
+    // The objects are numbered in the order they are reached, which is the order they are written in. New objects are added to the end of archivedObjects as they are found, so this loop ends once everything reachable from the root has a UID.
+    for (size_t uid=1; uid<this->archivedObjects.size(); uid++)
+    {
+        this->NumberReferences(uid);
+    }
+}
+
+bool PCH_NSKeyedArchiver_Encoder::IsStoredInInstance(const PCH_UnarchivedBase *member)
+{
+    return (member != nullptr && (member->type == Bool || member->type == Int || member->type == Double));
+}
+
+int64_t PCH_NSKeyedArchiver_Encoder::UIDForObject(const PCH_UnarchivedBase *object)
+{
+    if (object == nullptr || object->type == Undefined || object->type == Enum)
+    {
+        return 0;
+    }
+    
+    auto inserted = this->uidForObject.insert(make_pair(object, (int64_t)this->archivedObjects.size()));
+    
+    if (inserted.second)
+    {
+        ArchivedObject newObject = {object, 0, 0, 0};
+        this->archivedObjects.push_back(newObject);
+    }
+    
+    return inserted.first->second;
+}
+
+int64_t PCH_NSKeyedArchiver_Encoder::UIDForClass(const string &name, const vector<string> &classes)
+{
+    this->classKey = name;
+    
+    for (const string &nextClass : classes)
+    {
+        this->classKey += '\0';
+        this->classKey += nextClass;
+    }
+    
+    auto inserted = this->uidForClass.insert(make_pair(this->classKey, (int64_t)this->archivedObjects.size()));
+    
+    if (inserted.second)
+    {
+        ClassDescription newClass = {name, classes};
+        
+        if (newClass.classes.empty())
+        {
+            newClass.classes.push_back(name);
+        }
+        
+        ArchivedObject newObject = {nullptr, this->classDescriptions.size(), 0, 0};
+        this->archivedObjects.push_back(newObject);
+        this->classDescriptions.push_back(newClass);
+        
+        // the dict, its two keys, the class name, the $classes array and its strings
+        this->numPlistObjects += 5 + newClass.classes.size();
+    }
+    
+    return inserted.first->second;
+}
+
+int64_t PCH_NSKeyedArchiver_Encoder::UIDForFoundationClass(const string &className, const char *defaultName)
+{
+    string name(className.empty() ? defaultName : className);
+    
+    vector<string> classes;
+    classes.push_back(name);
+    
+    // NSMutableArray -> NSArray, and so on
+    if (name.compare(0, 9, "NSMutable") == 0)
+    {
+        classes.push_back("NS" + name.substr(9));
+    }
+    
+    classes.push_back("NSObject");
+    
+    return this->UIDForClass(name, classes);
+}
+
+void PCH_NSKeyedArchiver_Encoder::NumberReferences(int64_t uid)
+{
+    // the entry is copied, since numbering the references may add to archivedObjects
+    ArchivedObject archivedObject = this->archivedObjects[uid];
+    const PCH_UnarchivedBase *object = archivedObject.object;
+    
+    if (object == nullptr)
+    {
+        // class descriptions were counted when they were added
+        return;
+    }
+    
+    archivedObject.firstRef = this->refs.size();
+    
+    switch (object->type)
+    {
+        case Class:
+        case Struct:
+        {
+            const PCH_UnarchivedStruct *instance = (const PCH_UnarchivedStruct *)object;
+            
+            archivedObject.classUID = this->UIDForClass(instance->name, instance->supers);
+            
+            for (const PCH_UnarchivedStruct::memberDef &member : instance->members)
+            {
+                this->refs.push_back(IsStoredInInstance(member.value) ? 0 : this->UIDForObject(member.value));
+            }
+            
+            // the dict, "$class" and its UID, and a key and a value for each member
+            this->numPlistObjects += 3 + 2 * instance->members.size();
+            break;
+        }
+        
+        case Array:
+        case Set:
+        {
+            const PCH_UnarchivedArray *array = (const PCH_UnarchivedArray *)object;
+            
+            archivedObject.classUID = this->UIDForFoundationClass(array->className, (object->type == Set ? "NSSet" : "NSArray"));
+            
+            for (const PCH_UnarchivedBase *element : array->elements)
+            {
+                this->refs.push_back(this->UIDForObject(element));
+            }
+            
+            // the dict, "NS.objects" and its array, "$class" and its UID, and the UIDs of the elements
+            this->numPlistObjects += 5 + array->elements.size();
+            break;
+        }
+        
+        case Dict:
+        {
+            const PCH_UnarchivedDict *dict = (const PCH_UnarchivedDict *)object;
+            
+            archivedObject.classUID = this->UIDForFoundationClass(dict->className, "NSDictionary");
+            
+            for (const PCH_UnarchivedBase *key : dict->keys)
+            {
+                this->refs.push_back(this->UIDForObject(key));
+            }
+            
+            // a dict with fewer values than keys gets '$null' for the rest
+            for (size_t i=0; i<dict->keys.size(); i++)
+            {
+                this->refs.push_back(i < dict->values.size() ? this->UIDForObject(dict->values[i]) : 0);
+            }
+            
+            // the dict, "NS.keys", "NS.objects" and their arrays, "$class" and its UID, and the UIDs of the keys and values
+            this->numPlistObjects += 7 + 2 * dict->keys.size();
+            break;
+        }
+        
+        case Date:
+        {
+            archivedObject.classUID = this->UIDForFoundationClass("NSDate", "NSDate");
+            
+            // the dict, "NS.time" and its value, "$class" and its UID
+            this->numPlistObjects += 5;
+            break;
+        }
+        
+        default:
+        {
+            this->numPlistObjects++;
+            break;
+        }
+    }
+    
+    this->archivedObjects[uid] = archivedObject;
+}
+
+void PCH_NSKeyedArchiver_Encoder::SendKey(PCH_PListEventHandler &handler, const string &key)
+{
+    handler.Key(key.data(), key.size());
+}
+
+void PCH_NSKeyedArchiver_Encoder::SendString(PCH_PListEventHandler &handler, const string &str)
+{
+    handler.StringValue(str.data(), str.size());
+}
+
+void PCH_NSKeyedArchiver_Encoder::SendEvents(PCH_PListEventHandler &handler) const
+{
+    handler.BeginDict();
+    
+    SendKey(handler, "$archiver");
+    SendString(handler, "NSKeyedArchiver");
+    
+    SendKey(handler, "$version");
+    handler.IntValue(PCH_NSKEYEDARCHIVER_VERSION);
+    
+    SendKey(handler, "$top");
+    handler.BeginDict();
+    SendKey(handler, "root");
+    handler.UidValue(this->rootUID);
+    handler.EndDict();
+    
+    SendKey(handler, "$objects");
+    handler.BeginArray();
+    
+    SendString(handler, "$null");
+    
+    for (size_t uid=1; uid<this->archivedObjects.size(); uid++)
+    {
+        const ArchivedObject &archivedObject = this->archivedObjects[uid];
+        
+        if (archivedObject.object == nullptr)
+        {
+            this->SendClassEvents(handler, this->classDescriptions[archivedObject.classIndex]);
+        }
+        else
+        {
+            this->SendObjectEvents(handler, archivedObject);
+        }
+    }
+    
+    handler.EndArray();
+    
+    handler.EndDict();
+}
+
+void PCH_NSKeyedArchiver_Encoder::SendClassEvents(PCH_PListEventHandler &handler, const ClassDescription &classDescription) const
+{
+    handler.BeginDict();
+    
+    SendKey(handler, "$classname");
+    SendString(handler, classDescription.name);
+    
+    SendKey(handler, "$classes");
+    handler.BeginArray();
+    
+    for (const string &nextClass : classDescription.classes)
+    {
+        SendString(handler, nextClass);
+    }
+    
+    handler.EndArray();
+    
+    handler.EndDict();
+}
+
+void PCH_NSKeyedArchiver_Encoder::SendObjectEvents(PCH_PListEventHandler &handler, const ArchivedObject &archivedObject) const
+{
+    const PCH_UnarchivedBase *object = archivedObject.object;
+    const int64_t *objectRefs = this->refs.data() + archivedObject.firstRef;
+    
+    switch (object->type)
+    {
+        case Class:
+        case Struct:
+        {
+            const PCH_UnarchivedStruct *instance = (const PCH_UnarchivedStruct *)object;
+            
+            handler.BeginDict();
+            
+            for (size_t i=0; i<instance->members.size(); i++)
+            {
+                const PCH_UnarchivedBase *value = instance->members[i].value;
+                
+                SendKey(handler, instance->members[i].name);
+                
+                if (!IsStoredInInstance(value))
+                {
+                    handler.UidValue(objectRefs[i]);
+                }
+                else if (value->type == Bool)
+                {
+                    handler.BoolValue(((const PCH_UnarchivedMember *)value)->value.boolVal);
+                }
+                else if (value->type == Int)
+                {
+                    handler.IntValue(((const PCH_UnarchivedMember *)value)->value.intVal);
+                }
+                else
+                {
+                    handler.RealValue(((const PCH_UnarchivedMember *)value)->value.doubleVal);
+                }
+            }
+            
+            SendKey(handler, "$class");
+            handler.UidValue(archivedObject.classUID);
+            
+            handler.EndDict();
+            break;
+        }
+        
+        case Array:
+        case Set:
+        {
+            size_t numElements = ((const PCH_UnarchivedArray *)object)->elements.size();
+            
+            handler.BeginDict();
+            
+            SendKey(handler, "NS.objects");
+            handler.BeginArray();
+            
+            for (size_t i=0; i<numElements; i++)
+            {
+                handler.UidValue(objectRefs[i]);
+            }
+            
+            handler.EndArray();
+            
+            SendKey(handler, "$class");
+            handler.UidValue(archivedObject.classUID);
+            
+            handler.EndDict();
+            break;
+        }
+        
+        case Dict:
+        {
+            size_t numKeys = ((const PCH_UnarchivedDict *)object)->keys.size();
+            
+            handler.BeginDict();
+            
+            SendKey(handler, "NS.keys");
+            handler.BeginArray();
+            
+            for (size_t i=0; i<numKeys; i++)
+            {
+                handler.UidValue(objectRefs[i]);
+            }
+            
+            handler.EndArray();
+            
+            SendKey(handler, "NS.objects");
+            handler.BeginArray();
+            
+            for (size_t i=0; i<numKeys; i++)
+            {
+                handler.UidValue(objectRefs[numKeys + i]);
+            }
+            
+            handler.EndArray();
+            
+            SendKey(handler, "$class");
+            handler.UidValue(archivedObject.classUID);
+            
+            handler.EndDict();
+            break;
+        }
+        
+        case Date:
+        {
+            handler.BeginDict();
+            
+            SendKey(handler, "NS.time");
+            handler.RealValue(((const PCH_UnarchivedMember *)object)->value.dateVal);
+            
+            SendKey(handler, "$class");
+            handler.UidValue(archivedObject.classUID);
+            
+            handler.EndDict();
+            break;
+        }
+        
+        case String:
+        {
+            const string *str = ((const PCH_UnarchivedMember *)object)->value.stringVal;
+            handler.StringValue(str->data(), str->size());
+            break;
+        }
+        
+        case Data:
+        {
+            const vector<char> *bytes = ((const PCH_UnarchivedMember *)object)->value.dataVal;
+            handler.DataValue(bytes->data(), bytes->size());
+            break;
+        }
+        
+        case Bool:
+        {
+            handler.BoolValue(((const PCH_UnarchivedMember *)object)->value.boolVal);
+            break;
+        }
+        
+        case Int:
+        {
+            handler.IntValue(((const PCH_UnarchivedMember *)object)->value.intVal);
+            break;
+        }
+        
+        default:
+        {
+            handler.RealValue(((const PCH_UnarchivedMember *)object)->value.doubleVal);
+            break;
+        }
+    }
+}
+
+PCH_PList::ErrorType PCH_NSKeyedArchiver_Encoder::Encode(ostream &outStream) const
+{
+    PCH_BinaryPListWriter writer(outStream, this->numPlistObjects);
+    
+    this->SendEvents(writer);
+    
+    return writer.Finish();
+}
+
+PCH_PList::ErrorType PCH_NSKeyedArchiver_Encoder::EncodeFile(const PCH_UnarchivedBase *rootObject, string outputPath)
+{
+    vector<char> outBuffer(1024 * 1024);
+    ofstream outFile;
+    bool useStdout = (outputPath.compare("-") == 0);
+    
+    if (!useStdout)
+    {
+        outFile.rdbuf()->pubsetbuf(outBuffer.data(), outBuffer.size());
+        outFile.open(outputPath.c_str(), ios::out | ios::binary | ios::trunc);
+        
+        if (!outFile.is_open())
+        {
+            return PCH_PList::errorCouldNotWriteFile;
+        }
+    }
+    
+    PCH_NSKeyedArchiver_Encoder encoder(rootObject);
+    
+    return encoder.Encode(useStdout ? cout : outFile);
+}
@@ -0,0 +1,118 @@
+//
+//  PCH_NSKeyedArchiver_Encoder.hpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-19.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+// The other direction from PCH_UnarchivedModel: this class takes an object model made of PCH_UnarchivedBase nodes (built by hand, or by PCH_UnarchivedModel) and writes it as an NSKeyedArchiver archive, that is a plist with the keys "$archiver", "$version", "$top" and "$objects".
+// Every object gets one entry in $objects, no matter how many times it is referenced: objects are told apart by their address, so shared objects (and cycles) are archived once. Instances of the same class share a single class description ($classname and $classes).
+// The objects are numbered first, in the order in which they are reached from the root (without recursion, so the depth of the model doesn't matter). Numbering also records the UIDs that each object refers to and counts the plist objects, so the archive itself is then written in a single pass through the writer, in $objects order, without any further lookups.
+
+#ifndef PCH_NSKeyedArchiver_Encoder_hpp
+#define PCH_NSKeyedArchiver_Encoder_hpp
+
+#include <stdio.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "PCH_PList.hpp"
+#include "PCH_NSKeyedArchiver_Analyzer.hpp"
+
+using namespace std;
+
+/*
+ HOW THE MODEL IS ARCHIVED
+    
+    Class, Struct       a dict with "$class" (the UID of the class description) and one entry per member. Bool, Int and Double members are stored in the dict itself, other members are UIDs (a member with no value is UID 0, the '$null' object).
+    Array, Set          a dict with "NS.objects" (an array of UIDs) and "$class". If className is empty, NSArray or NSSet is used.
+    Dict                a dict with "NS.keys" and "NS.objects" (arrays of UIDs) and "$class". If className is empty, NSDictionary is used.
+    String, Data        a plain string or data object
+    Bool, Int, Double   a plain boolean or number object (when the value is an object of its own, eg: an element of an array)
+    Date                an NSDate instance, with the time in "NS.time"
+    Undefined, Enum     UID 0
+ 
+ The $classes of a class description are the 'supers' of the model (which, like in an archive, start with the class name itself), or just the class name if there are no supers. Foundation collections get their class, the immutable class for NSMutable... classes, and NSObject.
+ */
+
+class PCH_NSKeyedArchiver_Encoder
+{
+public:
+    
+    // The model is numbered right away. The model must not change (or be deleted) while the encoder is in use.
+    explicit PCH_NSKeyedArchiver_Encoder(const PCH_UnarchivedBase *rootObject);
+    
+    // the number of entries in $objects (including '$null') and the number of class descriptions among them
+    size_t NumArchivedObjects() const {return this->archivedObjects.size();}
+    size_t NumClasses() const {return this->classDescriptions.size();}
+    
+    // Send the archive to 'handler' as events (so it can go to any of the writers)
+    void SendEvents(PCH_PListEventHandler &handler) const;
+    
+    // Write the archive to 'outStream' as a binary plist
+    PCH_PList::ErrorType Encode(ostream &outStream) const;
+    
+    // Write the archive of the model at 'rootObject' to the file at 'outputPath' ("-" writes to stdout) as a binary plist
+    static PCH_PList::ErrorType EncodeFile(const PCH_UnarchivedBase *rootObject, string outputPath);
+    
+private:
+    
+    // An entry in $objects: either an object of the model or a class description (in which case 'object' is NULL and 'classIndex' says which one). For objects, 'firstRef' is where the UIDs that the object refers to start in 'refs', and 'classUID' is the UID of its class description (if it has one).
+    struct ArchivedObject
+    {
+        const PCH_UnarchivedBase *object;
+        size_t classIndex;
+        size_t firstRef;
+        int64_t classUID;
+    };
+    
+    struct ClassDescription
+    {
+        string name;
+        vector<string> classes;
+    };
+    
+    vector<ArchivedObject> archivedObjects;
+    
+    // The UIDs referred to by the objects, one for each member, element, key and value (in that order), so the objects can be written without looking them up again. Members that are stored in their instance have a slot too (holding 0), to keep the slots in step with the members.
+    vector<int64_t> refs;
+    
+    unordered_map<const PCH_UnarchivedBase *, int64_t> uidForObject;
+    
+    vector<ClassDescription> classDescriptions;
+    
+    // the UIDs of the class descriptions, by name and $classes (separated by NUL characters)
+    unordered_map<string, int64_t> uidForClass;
+    
+    // scratch space for the key of uidForClass
+    string classKey;
+    
+    // the number of objects a PCH_BinaryPListWriter will write for the archive (before duplicates are removed)
+    uint64_t numPlistObjects;
+    
+    int64_t rootUID;
+    
+    // Returns the UID of 'object', giving it the next one (and adding it to the end of archivedObjects) if it doesn't have one yet
+    int64_t UIDForObject(const PCH_UnarchivedBase *object);
+    
+    int64_t UIDForClass(const string &name, const vector<string> &classes);
+    int64_t UIDForFoundationClass(const string &className, const char *defaultName);
+    
+    // Record the UIDs that the object at 'uid' refers to (numbering the ones that are new) and count its plist objects
+    void NumberReferences(int64_t uid);
+    
+    void SendObjectEvents(PCH_PListEventHandler &handler, const ArchivedObject &archivedObject) const;
+    void SendClassEvents(PCH_PListEventHandler &handler, const ClassDescription &classDescription) const;
+    
+    // Bool, Int and Double members are written straight into their instance instead of as objects of their own
+    static bool IsStoredInInstance(const PCH_UnarchivedBase *member);
+    
+    static void SendKey(PCH_PListEventHandler &handler, const string &key);
+    static void SendString(PCH_PListEventHandler &handler, const string &str);
+};
+
+#endif /* PCH_NSKeyedArchiver_Encoder_hpp */
@@ -50,19 +50,55 @@
 */
 
 #include "PCH_PList.hpp"
+#include "PCH_XMLPListParser.hpp"
+#include "PCH_PListWriter.hpp"
 
 #include <fstream>
+#include <sstream>
 #include <cassert>
+#include <algorithm>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// a limit of 0 means that there is no limit
+static inline bool PCH_OverLimit(uint64_t value, uint64_t limit)
+{
+    return (limit != 0 && value > limit);
+}
 
 PCH_PList::PCH_PList()
 {
     this->isValid = false;
     this->plistRoot = NULL;
+    this->indexCacheMapping = NULL;
+    this->indexCacheMappingSize = 0;
+    this->lazyStream = NULL;
+    this->numDecodedBytes = 0;
+    this->numValues = 0;
+    this->expansionLimit = 0;
+    this->limitError = noError;
 }
 
-PCH_PList::PCH_PList(string pathName)
+PCH_PList::PCH_PList(string pathName, bool useIndexCache)
 {
-    this->isValid = (this->InitializeWithFile(pathName) == noError);
+    this->plistRoot = NULL;
+    this->indexCacheMapping = NULL;
+    this->indexCacheMappingSize = 0;
+    this->lazyStream = NULL;
+    this->numDecodedBytes = 0;
+    this->numValues = 0;
+    this->expansionLimit = 0;
+    this->limitError = noError;
+    this->isValid = (this->InitializeWithFile(pathName, useIndexCache) == noError);
 }
 
 PCH_PList::~PCH_PList()
@@ -71,868 +107,5043 @@ PCH_PList::~PCH_PList()
     {
         delete this->objectArray[i];
     }
+    
+    delete this->plistRoot;
+    
+    if (this->indexCacheMapping != NULL)
+    {
+        munmap(this->indexCacheMapping, this->indexCacheMappingSize);
+    }
 }
 
-PCH_PList::ErrorType PCH_PList::InitializeWithFile(string filePath)
+PCH_PList_Value *PCH_PList::ReleaseRoot()
 {
-    ifstream pFile;
+    PCH_PList_Value *result = this->plistRoot;
+    this->plistRoot = NULL;
     
-    pFile.open(filePath.c_str());
+    return result;
+}
+
+// A stream buffer that keeps the whole stream in one block of memory, so that the decoder can work on the bytes where they are instead of reading them through the stream. The bytes may not all be there yet (see PCH_PrefetchStreamBuf), which is why they're asked for with BytesFor().
+class PCH_ContiguousStreamBuf : public streambuf
+{
+public:
     
-    if (!pFile.is_open())
+    PCH_ContiguousStreamBuf()
     {
-        return errorCouldNotOpenFile;
+        this->block = NULL;
+        this->readableStart = 0;
+        this->readableEnd = 0;
     }
     
-    // This "safe" calculation of filelength comes from https://stackoverflow.com/questions/22984956/tellg-function-give-wrong-size-of-file/22986486#22986486
-    pFile.ignore(std::numeric_limits<std::streamsize>::max());
-    std::streamsize fileLength = pFile.gcount();
-    pFile.clear(); //  Since ignore will have set eof, we clear it
-    
-    // We start out by reading the data in the file's trailer
-    streampos trailerStart = fileLength - PCH_PLIST_TRAILER_LENGTH;
-    // The first 6 bytes of the trailer are unused by our class, so we skip past them
-    pFile.seekg(trailerStart + (streampos)6);
-    
-    char tByteBuff;
-    
-    // get the offset_table_offset_size
-    pFile.read(&tByteBuff, 1);
-    int offset_table_offset_size = (int)tByteBuff;
+    // Returns the start of the block once the 'length' bytes at 'position' can be read from it, or NULL if they never will be (because they are past the end of the stream, or couldn't be read)
+    const char *BytesFor(uint64_t position, uint64_t length)
+    {
+        // almost every request is for bytes in the range that is already known to be readable
+        if (position >= this->readableStart && position <= this->readableEnd && length <= this->readableEnd - position)
+        {
+            return this->block;
+        }
+        
+        return this->WaitForBytes(position, length);
+    }
     
-    // get the object_ref_size
-    pFile.read(&tByteBuff, 1);
-    int object_ref_size = (int)tByteBuff;
+protected:
     
-    // get the number of objects in the file (note that as a number, this value is in Big-endian format, so we need to convert it to the host computer's method of numerical representation
-    char eBuff[8];
-    pFile.read(eBuff, 8);
-    uint64_t numObjects;
-    memcpy(&numObjects, eBuff, 8);
-    numObjects = PCH_SwapInt64BigToHost(numObjects);
+    const char *block;
+    uint64_t readableStart;
+    uint64_t readableEnd;
     
-    // get the offset to the "top" object in the list of objects
-    pFile.read(eBuff, 8);
-    uint64_t top_object_offset;
-    memcpy(&top_object_offset, eBuff, 8);
-    top_object_offset = PCH_SwapInt64BigToHost(top_object_offset);
+    // Called by BytesFor() for bytes outside of the readable range. Subclasses whose bytes arrive over time wait for them here, and update the range.
+    virtual const char *WaitForBytes(uint64_t position, uint64_t length)
+    {
+        return NULL;
+    }
+};
+
+// A stream buffer that reads a whole file into memory on a background thread while the parser is reading from it, so that reading the file and decoding its objects overlap instead of taking turns. The end of the file (the trailer and the offset table, which the parser needs first) is read before anything else; after that the file is read from the start in chunks of PCH_PLIST_PREFETCH_CHUNK_SIZE bytes. When the parser gets ahead of the reader, it waits for the chunk it needs.
+class PCH_PrefetchStreamBuf : public PCH_ContiguousStreamBuf
+{
+public:
     
-    // Get the location (in bytes from the beginning of the file) of the offset table
-    pFile.read(eBuff, 8);
-    int64_t offset_table_start;
-    memcpy(&offset_table_start, eBuff, 8);
-    offset_table_start = PCH_SwapInt64BigToHost(offset_table_start);
+    PCH_PrefetchStreamBuf(int fileDescriptor, uint64_t fileLength) : buffer((size_t)fileLength)
+    {
+        this->fileDescriptor = fileDescriptor;
+        this->streamLength = fileLength;
+        this->fileLength = fileLength;
+        this->frontAvailable = 0;
+        this->tailStart = fileLength;
+        this->tailAvailable = false;
+        this->stopReading = false;
+        
+        this->block = this->buffer.data();
+        this->setg(this->buffer.data(), this->buffer.data(), this->buffer.data());
+        
+        // it isn't worth starting a thread for a small file
+        if (fileLength <= PCH_PLIST_PREFETCH_CHUNK_SIZE)
+        {
+            this->ReadFile();
+        }
+        else
+        {
+            this->readerThread = thread(&PCH_PrefetchStreamBuf::ReadFile, this);
+        }
+    }
     
-    pFile.clear(); // The last read will have set eof, we clear it and go back to the beginning of the file
-    pFile.seekg(0, std::ios_base::beg);
+    ~PCH_PrefetchStreamBuf()
+    {
+        if (this->readerThread.joinable())
+        {
+            {
+                lock_guard<mutex> lock(this->availableMutex);
+                this->stopReading = true;
+            }
+            
+            this->readerThread.join();
+        }
+    }
     
-    // read the header and store it
-    pFile.read(this->headerBuffer, PCH_PLIST_HEADER_LENGTH);
+protected:
     
-    // Test the first 6 bytes of the header and make sure they are equal to the string "bplist", otherwise return false
-    if (strncmp(this->headerBuffer, "bplist", 6) != 0)
+    int_type underflow()
     {
-        cerr << "This is not a valid plist file";
-        return errorNotValidPlistFile;
+        size_t position = this->gptr() - this->eback();
+        
+        if (!this->MakeAvailable(position))
+        {
+            return traits_type::eof();
+        }
+        
+        return traits_type::to_int_type(*this->gptr());
     }
     
-    // Iterate through all the objects in the file. Basically, we read "objects" until we reach the beginning of the offset table (whose position we have already extracted from the file in the section above).
-    while (pFile.tellg() < offset_table_start)
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which = ios_base::in)
     {
-        // cout << "Filepos: " << pFile.tellg() << endl;
-        // read the next marker byte
-        char mBuff;
-        pFile.read(&mBuff, 1);
-        uint8_t markerByte = mBuff;
+        off_type newPos = off;
+        
+        if (dir == ios_base::cur)
+        {
+            newPos += this->gptr() - this->eback();
+        }
+        else if (dir == ios_base::end)
+        {
+            newPos += this->streamLength;
+        }
+        
+        if (newPos < 0 || (uint64_t)newPos > this->streamLength)
+        {
+            return pos_type(off_type(-1));
+        }
         
-        // each marker byte encodes two pieces of 4-bit information (we'll call them "highNibble" and "lowNibble").
-        uint8_t highNibble = markerByte & 0xF0;
-        // we want to shift the value of the high nibble down to its lower 4 bits, so we shift it to the right
-        highNibble >>= 4;
+        // the bytes at the new position are waited for when they're read
+        this->setg(this->eback(), this->eback() + newPos, this->eback() + newPos);
         
-        uint8_t lowNibble = markerByte & 0x0F;
+        return pos_type(newPos);
+    }
+    
+    pos_type seekpos(pos_type pos, ios_base::openmode which = ios_base::in)
+    {
+        return this->seekoff(off_type(pos), ios_base::beg, which);
+    }
+    
+    // The readable range is the front of the file, the tail, or (once the front has reached the tail) the whole file
+    const char *WaitForBytes(uint64_t position, uint64_t length)
+    {
+        unique_lock<mutex> lock(this->availableMutex);
         
-        switch (highNibble) {
+        while (true)
+        {
+            if (position > this->fileLength || length > this->fileLength - position)
+            {
+                return NULL;
+            }
             
-            // null, bool, and fill types
-            case 0x0:
+            if (this->tailAvailable && this->frontAvailable >= this->tailStart)
             {
-                if (lowNibble == 0x0)
-                {
-                    this->objectArray.push_back(new PCH_PList_Entry(nullType, 0, NULL));
-                }
-                else if (lowNibble == 0x08)
-                {
-                    this->objectArray.push_back(new PCH_PList_Entry(boolFalseType, 0, NULL));
-                }
-                else if (lowNibble == 0x09)
-                {
-                    this->objectArray.push_back(new PCH_PList_Entry(boolTrueType, 0, NULL));
-                }
-                else if (lowNibble == 0x0F)
-                {
-                    this->objectArray.push_back(new PCH_PList_Entry(fillType, 0, NULL));
-                }
-                else
-                {
-                    cerr << "An unknown object type was encountered";
-                    return errorUnknownObjectType;
-                }
-                break;
+                this->readableStart = 0;
+                this->readableEnd = this->fileLength;
             }
-                
-            // integer types
-            case 0x01:
+            else if (position + length <= this->frontAvailable)
             {
-                // The number of bytes in the integer are encoded in the lowNibble, as 2^lowNibble.
-                // We use bitwise shifting of the number 1 to calculate the power of 2
-                int numberOfBytesToRead = 1 << (int)lowNibble;
-                
-                if (numberOfBytesToRead > 8)
-                {
-                    // 128-bit integers are a bit of a mess. I'll develop this if and only if really I need it.
-                    cerr << "128-bit integers have not been implemented yet.";
-                    return errorUnknownObjectType;
-                    
-                    break;
-                }
-                else
-                {
-                    // initialize an 8-byte buffer to all zeros
-                    char buffer[8] = {0};
-                    // get a pointer to the start of the buffer
-                    char *buffPtr = buffer;
-                    // we only want to copy as many bytes as specified by the lowNibble, so we advance the pointer to "pad" the number with zeroes
-                    buffPtr += (8 - numberOfBytesToRead);
-                    pFile.read(buffPtr, numberOfBytesToRead);
-                    // copy the bytes we just read into an int64_t type
-                    int64_t data;
-                    memcpy(&data, buffer, 8);
-                    // data is in Big-endian, so convert it as necessary
-                    data = PCH_SwapInt64BigToHost(data);
-                    // creata a new pointer with the converted data and add it to our object array
-                    int64_t *dataPtr = new int64_t(data);
-                    this->objectArray.push_back(new PCH_PList_Entry(int64Type, sizeof(int64_t), dataPtr));
-                }
-                
-                break;
+                this->readableStart = 0;
+                this->readableEnd = this->frontAvailable;
+            }
+            else if (this->tailAvailable && position >= this->tailStart)
+            {
+                this->readableStart = this->tailStart;
+                this->readableEnd = this->fileLength;
             }
             
-            // real (float and double) types
-            case 0x02:
+            if (position >= this->readableStart && position + length <= this->readableEnd)
             {
-                // The number of bytes in the number are encoded in the lowNibble, as 2^lowNibble. This value should be either 4 (float) or 8 (double)
-                // We use bitwise shifting of the number 1 to calculate the power of 2
-                int numberOfBytesToRead = 1 << (int)lowNibble;
-                
-                // make sure there are at least 4 bytes to read
-                if (numberOfBytesToRead < sizeof(float))
-                {
-                    cerr << "Illegal number of bytes for real type";
-                    return errorIllegalRealLength;
-                }
-                
-                if (numberOfBytesToRead == sizeof(float))
-                {
-                    // initialize the buffer and read the data into it
-                    char buffer[numberOfBytesToRead];
-                    pFile.read(buffer, numberOfBytesToRead);
-                    float data;
-                    PCH_FloatBigEndian bigData;
-                    // copy the data from the file into bigData and convert it from Big-endian
-                    memcpy(&bigData, buffer, numberOfBytesToRead);
-                    data = PCH_SwapFloatBigToHost(bigData);
-                    // creata a new pointer with the converted data and add it to our object array
-                    double *dataPtr = new double(data);
-                    this->objectArray.push_back(new PCH_PList_Entry(doubleType, sizeof(double), dataPtr));
-                }
-                else // must be double
-                {
-                    // see the comments above for reading a float
-                    char buffer[numberOfBytesToRead];
-                    pFile.read(buffer, numberOfBytesToRead);
-                    double data;
-                    PCH_DoubleBigEndian bigData;
-                    memcpy(&bigData, buffer, numberOfBytesToRead);
-                    data = PCH_SwapDoubleBigToHost(bigData);
-                    double *dataPtr = new double(data);
-                    this->objectArray.push_back(new PCH_PList_Entry(doubleType, sizeof(double), dataPtr));
-                }
-                
-                break;
+                return this->block;
             }
-                
-            // date
-            case 0x03:
+            
+            this->availableCondition.wait(lock);
+        }
+    }
+    
+private:
+    
+    int fileDescriptor;
+    uint64_t streamLength;
+    vector<char> buffer;
+    
+    // The bytes before frontAvailable have been read, and so have the bytes from tailStart to the end of the file once tailAvailable is set. If a read fails, fileLength is cut back to what was read.
+    mutex availableMutex;
+    condition_variable availableCondition;
+    uint64_t fileLength;
+    uint64_t frontAvailable;
+    uint64_t tailStart;
+    bool tailAvailable;
+    bool stopReading;
+    
+    thread readerThread;
+    
+    // Wait until the byte at 'position' has been read, then let the stream read up to the end of the data that's available there. Returns false at the end of the file.
+    bool MakeAvailable(size_t position)
+    {
+        unique_lock<mutex> lock(this->availableMutex);
+        
+        while (true)
+        {
+            if (position >= this->fileLength)
             {
-                // dates are 64-bit (8-byte) real numbers, ie: doubles (see the comments for reading floats above for the procedure the code follows)
-                int numberOfBytesToRead = 8;
-                char buffer[numberOfBytesToRead];
-                pFile.read(buffer, numberOfBytesToRead);
-                double data;
-                PCH_DoubleBigEndian bigData;
-                memcpy(&bigData, buffer, numberOfBytesToRead);
-                data = PCH_SwapDoubleBigToHost(bigData);
-                double *dataPtr = new double(data);
-                this->objectArray.push_back(new PCH_PList_Entry(dateType, sizeof(double), dataPtr));
-                
-                break;
+                return false;
             }
-                
-            // data
-            case 0x04:
+            
+            if (this->tailAvailable && position >= this->tailStart)
             {
-                // data is represented as a contiguous string of bytes
-                
-                // get the lowNibble value into a local variable. If this value is less than 0xF (decimal 15), it is the actual number of bytes of data that follow.
-                int64_t count = (int64_t)lowNibble;
-                
-                // according to the format specification, for data objects, if the lowerNibble is equal to 1111 (hexadecinal 0xF), then the actual byte count is encoded differently
-                if (count == 0xF)
-                {
-                    // The low nibble of the NEXT byte is used to calculate the number of bytes of data that are available for reading
-                    char countLenBuff;
-                    pFile.read(&countLenBuff, 1);
-                    int64_t countLen = (int64_t)countLenBuff & 0x0F;
-                    // The number of bytes that hold the  is actually 2^countLen
-                    countLen = 1 << countLen;
-                    
-                    // Initialize an 8-byte buffer to all zeroes
-                    char countBuff[8] = {0};
-                    // set a pointer to the beginning of the buffer
-                    char *countBuffPtr = countBuff;
-                    // we advance the pointer so we only read as many bytes as needed
-                    countBuffPtr += (8 - countLen);
-                    pFile.read(countBuffPtr, countLen);
-                    // copy the result into count, but then we need to convert from Big-endian
-                    memcpy(&count, countBuff, 8);
-                    count = PCH_SwapInt64BigToHost(count);
-                }
-                
-                // read and save the next count bytes
-                char *cResult = new char[count];
-                pFile.read(cResult, count);
-                
-                this->objectArray.push_back(new PCH_PList_Entry(dataType, count, cResult));
-                
-                break;
+                this->setg(this->eback(), this->eback() + position, this->eback() + this->fileLength);
+                return true;
             }
-                
-            // ASCII string
-            case 0x05:
+            
+            if (position < this->frontAvailable)
             {
-                // the procedure to figure out how many bytes to read in is the same as for data objects, above
-                int64_t charCount = (int64_t)lowNibble;
-                
-                if (charCount == 0xF)
-                {
-                    char countLenBuff;
-                    pFile.read(&countLenBuff, 1);
-                    int64_t countLen = (int64_t)countLenBuff & 0x0F;
-                    countLen = 1 << countLen;
-                    
-                    char countBuff[8] = {0};
-                    char *countBuffPtr = countBuff;
-                    countBuffPtr += (8 - countLen);
-                    pFile.read(countBuffPtr, countLen);
-                    memcpy(&charCount, countBuff, 8);
-                    charCount = PCH_SwapInt64BigToHost(charCount);
-                }
-                
-                char cResult[charCount+1];
-                cResult[charCount] = 0;
-                pFile.read(cResult, (int)charCount);
-                // cout << "Filepos: " << pFile.tellg() << endl;
-
-                string *result = new string(cResult);
-                
-                // cout << "The char array is " << cResult << endl << "The string is: " << *result << endl;
-                
-                this->objectArray.push_back(new PCH_PList_Entry(asciiStringType, charCount, result));
-                
-                break;
+                this->setg(this->eback(), this->eback() + position, this->eback() + this->frontAvailable);
+                return true;
             }
-                
-            // Unicode string
-            case 0x06:
+            
+            this->availableCondition.wait(lock);
+        }
+    }
+    
+    // read 'length' bytes at 'offset' into the buffer, returning false if the whole range couldn't be read
+    bool ReadRange(uint64_t offset, uint64_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t numRead = pread(this->fileDescriptor, this->buffer.data() + offset, (size_t)length, (off_t)offset);
+            
+            if (numRead <= 0)
             {
-                // Unicode strings are a pain because each character (wchar_t) is 16-bits (2-bytes) long. And those bytes are Big-endian. Sigh.
-                // To start, we calculate start using the same method as for data objects, above.
-                int64_t charCount = (int64_t)lowNibble;
-                
-                if (charCount == 0xF)
-                {
-                    char countLenBuff;
-                    pFile.read(&countLenBuff, 1);
-                    int64_t countLen = (int64_t)countLenBuff & 0x0F;
-                    countLen = 1 << countLen;
-                    
-                    char countBuff[8] = {0};
-                    char *countBuffPtr = countBuff;
-                    countBuffPtr += (8 - countLen);
-                    pFile.read(countBuffPtr, countLen);
-                    memcpy(&charCount, countBuff, 8);
-                    charCount = PCH_SwapInt64BigToHost(charCount);
-                }
-                
-                // read in 2 bytes at a time, converting from Big-endian each time, and appeding the result to the resultString
-                uint16_t wcharBuff;
-                wstring resultString(L"");
-                for (int i=0; i<charCount; i++)
-                {
-                    pFile.read((char *)&wcharBuff, 2);
-                    
-                    wcharBuff = PCH_SwapInt16BigToHost(wcharBuff);
-                    
-                    wchar_t nextChar = wcharBuff;
-                    
-                    resultString += nextChar;
-                }
-                
-                auto result = new wstring(resultString, charCount);
-                
-                this->objectArray.push_back(new PCH_PList_Entry(unicodeStringType, charCount, result));
-                
-                break;
+                return false;
             }
-                
-            // UID
-            // The UID is the "User ID" on Mac OSX systems, but I don't understand why this would ever be useful information to save to a file. In any case, we take care of it.
-            // UPDATE: After analyzing the Apple-produced code in https://opensource.apple.com/source/CF/CF-550/CFBinaryPList.c, particularly the function _appendUID, it appears that the UID is an integer (max size of 64 bits) and that the number as represented in the plist file is indeed in Big-endian format, like other numbers.
-            case 0x08:
+            
+            offset += numRead;
+            length -= numRead;
+        }
+        
+        return true;
+    }
+    
+    void ReadFile()
+    {
+        // The end of the file first. If the trailer says that the offset table starts before the end chunk, the rest of the offset table is read too.
+        uint64_t newTailStart = this->streamLength - min(this->streamLength, (uint64_t)PCH_PLIST_PREFETCH_CHUNK_SIZE);
+        bool readOK = this->ReadRange(newTailStart, this->streamLength - newTailStart);
+        
+        if (readOK && this->streamLength >= PCH_PLIST_HEADER_LENGTH + PCH_PLIST_TRAILER_LENGTH)
+        {
+            uint64_t offsetTableStart;
+            memcpy(&offsetTableStart, this->buffer.data() + this->streamLength - 8, 8);
+            offsetTableStart = PCH_SwapInt64BigToHost(offsetTableStart);
+            
+            if (offsetTableStart >= PCH_PLIST_HEADER_LENGTH && offsetTableStart < newTailStart)
             {
-                // unlike just about every other type of object, the number of bytes to read the UID is (lowNibble + 1)
-                int64_t numberOfBytesToRead = (int64_t)lowNibble + 1;
-                
-                // initialize an 8-byte buffer to all zeros
-                char buffer[8] = {0};
-                // get a pointer to the start of the buffer
-                char *buffPtr = buffer;
-                // we only want to copy as many bytes as specified by the lowNibble, so we advance the pointer to "pad" the number with zeroes
-                buffPtr += (8 - numberOfBytesToRead);
-                pFile.read(buffPtr, numberOfBytesToRead);
-                // copy the bytes we just read into an int64_t type
-                int64_t data;
-                memcpy(&data, buffer, 8);
-                // data is in Big-endian, so convert it as necessary
-                data = PCH_SwapInt64BigToHost(data);
-                // creata a new pointer with the converted data and add it to our object array
-                int64_t *dataPtr = new int64_t(data);
-                this->objectArray.push_back(new PCH_PList_Entry(uidType, sizeof(int64_t), dataPtr));
-                                
-                break;
+                readOK = this->ReadRange(offsetTableStart, newTailStart - offsetTableStart);
+                newTailStart = offsetTableStart;
             }
-                
-            // array or set
-            case 0x0A:
-            case 0x0C:
+        }
+        
+        {
+            lock_guard<mutex> lock(this->availableMutex);
+            
+            if (readOK)
             {
-                // The code for extracting an array or a set is identical - the only time that the difference interests us is when we create the PCH_PList_Entry for the object
-                ObjectType obType = (highNibble == 0x0A ? arrayType : setType);
-                
-                // extract the byte count using the same method as for data objects, above
-                int64_t count = (int64_t)lowNibble;
-                
-                if (count == 0xF)
-                {
-                    char countLenBuff;
-                    pFile.read(&countLenBuff, 1);
-                    int64_t countLen = (int64_t)countLenBuff & 0x0F;
-                    countLen = 1 << countLen;
-                    
-                    char countBuff[8] = {0};
-                    char *countBuffPtr = countBuff;
-                    countBuffPtr += (8 - countLen);
-                    pFile.read(countBuffPtr, countLen);
-                    memcpy(&count, countBuff, 8);
-                    count = PCH_SwapInt64BigToHost(count);
-                }
-                
-                // The members of the array/set are actually indices into the object array itself. Naturally, the indices are in Big-endian format, which needs to be dealt with
-                vector<int64_t> values;
-                for (int64_t i=0; i<count; i++)
-                {
-                    char valBuff[sizeof(int64_t)] = {0};
-                    char *valBuffPtr = valBuff + (sizeof(int64_t) - object_ref_size);
-                    pFile.read(valBuffPtr, object_ref_size);
-                    int64_t value;
-                    memcpy(&value, valBuff, sizeof(int64_t));
-                    value = PCH_SwapInt64BigToHost(value);
-                    values.push_back(value);
-                }
-                
-                auto result = new vector<int64_t>(values);
-                
-                this->objectArray.push_back(new PCH_PList_Entry(obType, count, result));
-                
-                break;
+                this->tailStart = newTailStart;
+                this->tailAvailable = true;
+            }
+            else
+            {
+                this->fileLength = 0;
             }
+        }
+        
+        this->availableCondition.notify_all();
+        
+        // then the rest of the file, from the start
+        uint64_t position = 0;
+        
+        while (readOK && position < newTailStart)
+        {
+            uint64_t chunkLength = min(newTailStart - position, (uint64_t)PCH_PLIST_PREFETCH_CHUNK_SIZE);
+            readOK = this->ReadRange(position, chunkLength);
             
-            // dictionary
-            case 0x0D:
             {
-                // dictionairies are similar to arrays/sets, except that instead of a single index into the object array, there are two: one for the key and the other for the value. The methods used to extract these indices is the same as for arrays/sets.
-                int64_t count = (int64_t)lowNibble;
-                
-                if (count == 0xF)
-                {
-                    char countLenBuff;
-                    pFile.read(&countLenBuff, 1);
-                    int64_t countLen = (int64_t)countLenBuff & 0x0F;
-                    countLen = 1 << countLen;
-                    
-                    char countBuff[8] = {0};
-                    char *countBuffPtr = countBuff;
-                    countBuffPtr += (8 - countLen);
-                    pFile.read(countBuffPtr, countLen);
-                    memcpy(&count, countBuff, 8);
-                    count = PCH_SwapInt64BigToHost(count);
-                }
-                
-                vector<int64_t> keys;
-                vector<int64_t> values;
+                lock_guard<mutex> lock(this->availableMutex);
                 
-                for (int64_t i=0; i<count; i++)
+                if (readOK)
                 {
-                    char keyBuff[sizeof(int64_t)] = {0};
-                    char *keyBuffPtr = keyBuff + (sizeof(int64_t) - object_ref_size);
-                    pFile.read(keyBuffPtr, object_ref_size);
-                    int64_t key;
-                    memcpy(&key, keyBuff, sizeof(int64_t));
-                    key = PCH_SwapInt64BigToHost(key);
-                    keys.push_back(key);
+                    position += chunkLength;
+                    this->frontAvailable = position;
                 }
-                
-                for (int64_t i=0; i<count; i++)
+                else
                 {
-                    char valBuff[sizeof(int64_t)] = {0};
-                    char *valBuffPtr = valBuff + (sizeof(int64_t) - object_ref_size);
-                    pFile.read(valBuffPtr, object_ref_size);
-                    int64_t value;
-                    memcpy(&value, valBuff, sizeof(int64_t));
-                    value = PCH_SwapInt64BigToHost(value);
-                    values.push_back(value);
+                    this->fileLength = position;
                 }
                 
-                auto result = new vector<PCH_PList_Dict>();
-                
-                for (int64_t i=0; i<count; i++)
+                if (this->stopReading)
                 {
-                    PCH_PList_Dict nextEntry(keys[i], values[i]);
-                    result->push_back(nextEntry);
+                    readOK = false;
                 }
-                
-                this->objectArray.push_back(new PCH_PList_Entry(dictType, count, result));
-                
-                break;
             }
-                
-            default:
-            {
-                cerr << "An unknown object type was encountered";
-                return errorUnknownObjectType;
-                
-                break;
+            
+            this->availableCondition.notify_all();
+        }
+    }
+};
+
+PCH_PList::ErrorType PCH_PList::InitializeWithFile(string filePath, bool useIndexCache)
+{
+    // With the sidecar index, the file usually isn't read at all (it's memory-mapped instead), so prefetching it would only get in the way
+    if (useIndexCache)
+    {
+        ifstream pFile;
+        
+        pFile.open(filePath.c_str(), ios::in | ios::binary);
+        
+        if (!pFile.is_open())
+        {
+            return errorCouldNotOpenFile;
+        }
+        
+        return this->InitializeWithSeekableStream(pFile, filePath);
+    }
+    
+    int fileDescriptor = open(filePath.c_str(), O_RDONLY);
+    
+    if (fileDescriptor < 0)
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    struct stat fileStat;
+    
+    if (fstat(fileDescriptor, &fileStat) != 0 || !S_ISREG(fileStat.st_mode))
+    {
+        close(fileDescriptor);
+        return errorCouldNotOpenFile;
+    }
+    
+    ErrorType err;
+    
+    {
+        PCH_PrefetchStreamBuf prefetchBuf(fileDescriptor, (uint64_t)fileStat.st_size);
+        istream prefetchStream(&prefetchBuf);
+        
+        err = this->InitializeWithSeekableStream(prefetchStream, string(""));
+    }
+    
+    close(fileDescriptor);
+    
+    return err;
+}
+
+// This is the in-memory equivalent of std::istringstream, except that it reads directly from the caller's buffer instead of copying it. Seeking is supported so that the buffer can be handed to the same parser as a file.
+class PCH_MemoryStreamBuf : public PCH_ContiguousStreamBuf
+{
+public:
+    
+    PCH_MemoryStreamBuf(const char *buffer, size_t length)
+    {
+        char *bufferStart = const_cast<char *>(buffer);
+        this->setg(bufferStart, bufferStart, bufferStart + length);
+        
+        // all of it can be read right away
+        this->block = buffer;
+        this->readableEnd = length;
+    }
+    
+protected:
+    
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which = ios_base::in)
+    {
+        off_type newPos = off;
+        
+        if (dir == ios_base::cur)
+        {
+            newPos += this->gptr() - this->eback();
+        }
+        else if (dir == ios_base::end)
+        {
+            newPos += this->egptr() - this->eback();
+        }
+        
+        if (newPos < 0 || newPos > this->egptr() - this->eback())
+        {
+            return pos_type(off_type(-1));
+        }
+        
+        this->setg(this->eback(), this->eback() + newPos, this->egptr());
+        
+        return pos_type(newPos);
+    }
+    
+    pos_type seekpos(pos_type pos, ios_base::openmode which = ios_base::in)
+    {
+        return this->seekoff(off_type(pos), ios_base::beg, which);
+    }
+};
+
+PCH_PList::ErrorType PCH_PList::InitializeWithBuffer(const void *buffer, size_t length, bool copyBuffer)
+{
+    if (copyBuffer)
+    {
+        const char *bytePtr = (const char *)buffer;
+        return this->InitializeWithBuffer(vector<char>(bytePtr, bytePtr + length));
+    }
+    
+    PCH_MemoryStreamBuf memBuf((const char *)buffer, length);
+    istream memStream(&memBuf);
+    
+    return this->InitializeWithSeekableStream(memStream, string(""));
+}
+
+PCH_PList::ErrorType PCH_PList::InitializeWithBuffer(vector<char> &&buffer)
+{
+    this->ownedBuffer = move(buffer);
+    
+    // XML plists are parsed in place, which we can do because we own the buffer
+    if (PCH_XMLPListParser::IsXMLPList(this->ownedBuffer.data(), this->ownedBuffer.size()))
+    {
+        return this->InitializeWithXMLBuffer(this->ownedBuffer.data(), this->ownedBuffer.size());
+    }
+    
+    PCH_MemoryStreamBuf memBuf(this->ownedBuffer.data(), this->ownedBuffer.size());
+    istream memStream(&memBuf);
+    
+    return this->InitializeWithSeekableStream(memStream, string(""));
+}
+
+PCH_PList::ErrorType PCH_PList::InitializeWithStream(istream &inStream)
+{
+    // The stream can't seek (and we don't know how long it is), so just read it into a buffer that grows as needed. Doubling the chunk size keeps the number of reallocations logarithmic.
+    vector<char> buffer;
+    size_t chunkSize = 64 * 1024;
+    
+    while (inStream.good())
+    {
+        size_t oldSize = buffer.size();
+        buffer.resize(oldSize + chunkSize);
+        
+        inStream.read(buffer.data() + oldSize, chunkSize);
+        buffer.resize(oldSize + (size_t)inStream.gcount());
+        
+        if (chunkSize < 16 * 1024 * 1024)
+        {
+            chunkSize *= 2;
+        }
+    }
+    
+    if (inStream.bad())
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    return this->InitializeWithBuffer(move(buffer));
+}
+
+// An event handler that checks the contents of an XML plist against a PCH_PList_Limits on their way to another handler. XML has no references, so every value and key is an object (and a value in the tree). Once a limit has been exceeded, no more events are passed on, so the target stops growing right away (the parser still goes through the rest of the text, but doesn't allocate anything for it).
+class PCH_PListLimitFilter : public PCH_PListEventHandler
+{
+public:
+    
+    // the first limit that was exceeded (or noError)
+    PCH_PList::ErrorType error;
+    
+    PCH_PListLimitFilter(const PCH_PList_Limits &limits, PCH_PListEventHandler &target) : limits(limits), target(target)
+    {
+        this->error = PCH_PList::noError;
+        this->numObjects = 0;
+        this->numBytes = 0;
+    }
+    
+    virtual void BeginDict()
+    {
+        if (this->BeginContainer())
+        {
+            this->target.BeginDict();
+        }
+    }
+    
+    virtual void EndDict()
+    {
+        if (this->EndContainer())
+        {
+            this->target.EndDict();
+        }
+    }
+    
+    virtual void BeginArray()
+    {
+        if (this->BeginContainer())
+        {
+            this->target.BeginArray();
+        }
+    }
+    
+    virtual void EndArray()
+    {
+        if (this->EndContainer())
+        {
+            this->target.EndArray();
+        }
+    }
+    
+    virtual void BeginSet()
+    {
+        if (this->BeginContainer())
+        {
+            this->target.BeginSet();
+        }
+    }
+    
+    virtual void EndSet()
+    {
+        if (this->EndContainer())
+        {
+            this->target.EndSet();
+        }
+    }
+    
+    virtual void Key(const char *str, size_t length)
+    {
+        // keys are counted as objects, but the entry is counted when its value arrives
+        if (this->CountObject() && this->CountBytes(length))
+        {
+            this->target.Key(str, length);
+        }
+    }
+    
+    virtual void StringValue(const char *str, size_t length)
+    {
+        if (this->CountValue() && this->CountBytes(length))
+        {
+            this->target.StringValue(str, length);
+        }
+    }
+    
+    virtual void DataValue(const char *bytes, size_t length)
+    {
+        if (this->CountValue() && this->CountBytes(length))
+        {
+            this->target.DataValue(bytes, length);
+        }
+    }
+    
+    virtual void IntValue(int64_t value)
+    {
+        if (this->CountValue())
+        {
+            this->target.IntValue(value);
+        }
+    }
+    
+    virtual void RealValue(double value)
+    {
+        if (this->CountValue())
+        {
+            this->target.RealValue(value);
+        }
+    }
+    
+    virtual void BoolValue(bool value)
+    {
+        if (this->CountValue())
+        {
+            this->target.BoolValue(value);
+        }
+    }
+    
+    virtual void DateValue(double value)
+    {
+        if (this->CountValue())
+        {
+            this->target.DateValue(value);
+        }
+    }
+    
+    virtual void UidValue(int64_t value)
+    {
+        if (this->CountValue())
+        {
+            this->target.UidValue(value);
+        }
+    }
+    
+private:
+    
+    const PCH_PList_Limits &limits;
+    PCH_PListEventHandler &target;
+    
+    uint64_t numObjects;
+    uint64_t numBytes;
+    
+    // the number of children of each open container
+    vector<uint64_t> childCounts;
+    
+    bool Fail(PCH_PList::ErrorType limitError)
+    {
+        this->error = limitError;
+        return false;
+    }
+    
+    bool CountObject()
+    {
+        if (this->error != PCH_PList::noError)
+        {
+            return false;
+        }
+        
+        this->numObjects++;
+        
+        if (PCH_OverLimit(this->numObjects, this->limits.maxObjects))
+        {
+            return this->Fail(PCH_PList::errorTooManyObjects);
+        }
+        
+        if (PCH_OverLimit(this->numObjects, this->limits.maxValues))
+        {
+            return this->Fail(PCH_PList::errorTooManyValues);
+        }
+        
+        return true;
+    }
+    
+    bool CountValue()
+    {
+        if (!this->CountObject())
+        {
+            return false;
+        }
+        
+        if (!this->childCounts.empty() && PCH_OverLimit(++this->childCounts.back(), this->limits.maxCollectionSize))
+        {
+            return this->Fail(PCH_PList::errorCollectionTooLarge);
+        }
+        
+        return true;
+    }
+    
+    bool CountBytes(size_t length)
+    {
+        this->numBytes += length;
+        
+        if (PCH_OverLimit(this->numBytes, this->limits.maxDecodedBytes))
+        {
+            return this->Fail(PCH_PList::errorTooManyBytes);
+        }
+        
+        return true;
+    }
+    
+    bool BeginContainer()
+    {
+        if (!this->CountValue())
+        {
+            return false;
+        }
+        
+        if (PCH_OverLimit(this->childCounts.size() + 1, this->limits.maxDepth))
+        {
+            return this->Fail(PCH_PList::errorTooDeep);
+        }
+        
+        this->childCounts.push_back(0);
+        
+        return true;
+    }
+    
+    bool EndContainer()
+    {
+        if (this->error != PCH_PList::noError)
+        {
+            return false;
+        }
+        
+        if (!this->childCounts.empty())
+        {
+            this->childCounts.pop_back();
+        }
+        
+        return true;
+    }
+};
+
+PCH_PList::ErrorType PCH_PList::InitializeWithXMLBuffer(char *buffer, size_t length)
+{
+    PCH_PList_MemoryScope memoryScope(this->memoryResource);
+    
+    memset(this->headerBuffer, 0, PCH_PLIST_HEADER_LENGTH);
+    memcpy(this->headerBuffer, buffer, min(length, (size_t)PCH_PLIST_HEADER_LENGTH));
+    
+    PCH_PListTreeBuilder treeBuilder;
+    PCH_PListLimitFilter limitFilter(this->limits, treeBuilder);
+    
+    ErrorType err = PCH_XMLPListParser::Parse(buffer, length, limitFilter);
+    
+    if (err != noError)
+    {
+        delete treeBuilder.root;
+        
+        cerr << "This is not a valid XML plist file";
+        return err;
+    }
+    
+    if (limitFilter.error != noError)
+    {
+        delete treeBuilder.root;
+        
+        return limitFilter.error;
+    }
+    
+    // everything has been copied into the tree, so the buffer isn't needed any more
+    vector<char>().swap(this->ownedBuffer);
+    
+    delete this->plistRoot;
+    this->plistRoot = treeBuilder.root;
+    
+    return noError;
+}
+
+PCH_PList::ErrorType PCH_PList::InitializeWithSeekableStream(istream &pFile, const string &indexCachePath)
+{
+    PCH_PList_MemoryScope memoryScope(this->memoryResource);
+    
+    bool useIndexCache = !indexCachePath.empty();
+    string filePath = indexCachePath;
+    
+    // check whether this is actually an XML plist. If it is, the whole thing is read into a buffer (the XML parser needs a writable buffer anyway).
+    char firstBytes[64];
+    pFile.read(firstBytes, sizeof(firstBytes));
+    
+    if (PCH_XMLPListParser::IsXMLPList(firstBytes, (size_t)pFile.gcount()))
+    {
+        pFile.clear();
+        pFile.seekg(0, ios_base::end);
+        streamoff streamLength = pFile.tellg();
+        pFile.seekg(0, ios_base::beg);
+        
+        vector<char> xmlBuffer((size_t)streamLength);
+        pFile.read(xmlBuffer.data(), streamLength);
+        xmlBuffer.resize((size_t)pFile.gcount());
+        
+        this->ownedBuffer = move(xmlBuffer);
+        
+        return this->InitializeWithXMLBuffer(this->ownedBuffer.data(), this->ownedBuffer.size());
+    }
+    
+    pFile.clear();
+    pFile.seekg(0, ios_base::beg);
+    
+    this->numDecodedBytes = 0;
+    this->numValues = 0;
+    this->limitError = noError;
+    
+    uint64_t fileLength;
+    vector<char> offsetTableBytes;
+    
+    ErrorType err = this->ReadFileStructure(pFile, fileLength, offsetTableBytes);
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    // If the caller asked for it, try to get everything from the sidecar index instead of parsing the file
+    uint64_t sourceHash = 0;
+    
+    if (useIndexCache)
+    {
+        sourceHash = PCH_PList::IndexCacheHash(this->headerBuffer, offsetTableBytes.data(), offsetTableBytes.size(), fileLength);
+        
+        if (this->LoadIndexCache(filePath, fileLength, sourceHash))
+        {
+            return this->BuildTree();
+        }
+    }
+    
+    // Iterate through all the objects in the file, in the order given by the offset table. If the whole stream is in memory (which it is, unless the sidecar index is being used), the objects are decoded where they are, without going through the stream.
+    uint64_t numObjects = this->offsetTable.size();
+    this->objectArray.reserve(numObjects);
+    
+    PCH_ContiguousStreamBuf *contiguousBuf = dynamic_cast<PCH_ContiguousStreamBuf *>(pFile.rdbuf());
+    streampos filePos = pFile.tellg();
+    
+    for (uint64_t i=0; i<numObjects; i++)
+    {
+        this->currentPayloadOffset = 0;
+        
+        PCH_PList_Entry *entry = NULL;
+        
+        if (contiguousBuf != NULL)
+        {
+            uint64_t objectLength;
+            err = this->DecodeObject(*contiguousBuf, this->offsetTable[i], &entry, objectLength);
+        }
+        else
+        {
+            // objects are usually stored one after the other, so avoid the seek if we're already there
+            if (filePos != (streampos)this->offsetTable[i])
+            {
+                pFile.clear();
+                pFile.seekg(this->offsetTable[i]);
+            }
+            
+            err = this->ReadObject(pFile, &entry);
+            filePos = pFile.tellg();
+        }
+        
+        if (err != noError)
+        {
+            return err;
+        }
+        
+        this->objectArray.push_back(entry);
+        
+        if (useIndexCache)
+        {
+            this->payloadOffsets.push_back(this->currentPayloadOffset);
+        }
+    }
+    
+    if (useIndexCache)
+    {
+        this->SaveIndexCache(filePath, fileLength, sourceHash);
+        
+        // the payload offsets are only needed to build the index
+        vector<uint64_t>().swap(this->payloadOffsets);
+    }
+    
+    cerr << "Done reading objects" << endl << endl;
+    
+    err = this->BuildTree();
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    cerr << "Done creating plist tree" << endl;
+    
+    return noError;
+}
+
+PCH_PList::ErrorType PCH_PList::InitializeWithFile(string filePath, const vector<string> &keyPaths)
+{
+    PCH_PList_MemoryScope memoryScope(this->memoryResource);
+    
+    ifstream pFile;
+    
+    pFile.open(filePath.c_str(), ios::in | ios::binary);
+    
+    if (!pFile.is_open())
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    this->numDecodedBytes = 0;
+    this->numValues = 0;
+    this->limitError = noError;
+    
+    uint64_t fileLength;
+    vector<char> offsetTableBytes;
+    
+    ErrorType err = this->ReadFileStructure(pFile, fileLength, offsetTableBytes);
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    // build the tree of key paths
+    KeyPathNode keyPathRoot;
+    
+    for (int i=0; i<keyPaths.size(); i++)
+    {
+        KeyPathNode *node = &keyPathRoot;
+        size_t componentStart = 0;
+        
+        while (componentStart <= keyPaths[i].size())
+        {
+            size_t componentEnd = keyPaths[i].find('.', componentStart);
+            
+            if (componentEnd == string::npos)
+            {
+                componentEnd = keyPaths[i].size();
+            }
+            
+            node = &node->children[keyPaths[i].substr(componentStart, componentEnd - componentStart)];
+            componentStart = componentEnd + 1;
+        }
+        
+        // a shorter path that was already asked for takes precedence over a longer one (and vice-versa)
+        node->children.clear();
+    }
+    
+    // none of the objects are decoded until they are needed
+    this->objectArray.assign(this->offsetTable.size(), NULL);
+    
+    this->lazyStream = &pFile;
+    
+    PCH_PList_Entry *rootEntry = this->EntryAtIndex(this->topObject);
+    
+    if (rootEntry == NULL)
+    {
+        this->lazyStream = NULL;
+        return errorUnknownObjectType;
+    }
+    
+    delete this->plistRoot;
+    this->plistRoot = (keyPathRoot.children.empty() ? GetValue(this->topObject) : GetProjectedValue(this->topObject, keyPathRoot));
+    
+    this->lazyStream = NULL;
+    
+    if (this->limitError != noError)
+    {
+        delete this->plistRoot;
+        this->plistRoot = NULL;
+        
+        return this->limitError;
+    }
+    
+    return noError;
+}
+
+PCH_PList_Entry *PCH_PList::EntryAtIndex(uint64_t index)
+{
+    if (index >= this->objectArray.size())
+    {
+        return NULL;
+    }
+    
+    if (this->objectArray[index] == NULL && this->lazyStream != NULL)
+    {
+        this->lazyStream->clear();
+        this->lazyStream->seekg(this->offsetTable[index]);
+        
+        PCH_PList_Entry *entry = NULL;
+        ErrorType err = this->ReadObject(*this->lazyStream, &entry);
+        
+        if (err == noError)
+        {
+            this->objectArray[index] = entry;
+        }
+        else if ((err == errorCollectionTooLarge || err == errorTooManyBytes) && this->limitError == noError)
+        {
+            // objects that can't be decoded are treated as null, but a limit stops the whole load
+            this->limitError = err;
+        }
+    }
+    
+    return this->objectArray[index];
+}
+
+PCH_PList_Value *PCH_PList::GetProjectedValue(uint64_t index, const KeyPathNode &keyPaths)
+{
+    // the partial tree is thrown away when a limit is exceeded, so there's no point in going on
+    if (this->limitError != noError)
+    {
+        return NULL;
+    }
+    
+    PCH_PList_Entry *entry = this->EntryAtIndex(index);
+    
+    // the end of a key path (or a scalar) keeps everything
+    if (keyPaths.children.empty() || (entry->entryType != dictType && entry->entryType != arrayType && entry->entryType != setType))
+    {
+        return GetValue(index);
+    }
+    
+    auto result = new PCH_PList_Value;
+    
+    if (entry->entryType == dictType)
+    {
+        result->valueType = PCH_PList_Value::pch_value_type::Dict;
+        result->value.dictValue = new vector<PCH_PList_Value::dictStruct>();
+        
+        const vector<PCH_PList_Dict> &dict = *(vector<PCH_PList_Dict> *)entry->data;
+        
+        // only the keys are decoded for entries that we don't want
+        for (int i=0; i<dict.size(); i++)
+        {
+            PCH_PList_Entry *keyEntry = this->EntryAtIndex(dict[i].keyOffset);
+            
+            if (keyEntry == NULL || keyEntry->entryType != asciiStringType)
+            {
+                continue;
+            }
+            
+            auto child = keyPaths.children.find(*(string *)keyEntry->data);
+            
+            if (child == keyPaths.children.end())
+            {
+                continue;
+            }
+            
+            PCH_PList_Entry *valEntry = this->EntryAtIndex(dict[i].valueOffset);
+            
+            if (valEntry == NULL)
+            {
+                continue;
+            }
+            
+            PCH_PList_Value::dictStruct tDict;
+            tDict.key = GetValue(dict[i].keyOffset);
+            tDict.val = GetProjectedValue(dict[i].valueOffset, child->second);
+            
+            result->value.dictValue->push_back(tDict);
+        }
+    }
+    else
+    {
+        // for arrays and sets, the key path components are element indices
+        result->valueType = (entry->entryType == arrayType ? PCH_PList_Value::pch_value_type::Array : PCH_PList_Value::pch_value_type::Set);
+        result->value.arrayValue = new vector<PCH_PList_Value *>();
+        
+        const vector<int64_t> &indices = *(vector<int64_t> *)entry->data;
+        
+        // the children are sorted as strings, so put them back into numerical order to keep the elements in their original order
+        vector<pair<uint64_t, const KeyPathNode *>> elements;
+        
+        for (auto child = keyPaths.children.begin(); child != keyPaths.children.end(); child++)
+        {
+            char *endPtr = NULL;
+            unsigned long long elementIndex = strtoull(child->first.c_str(), &endPtr, 10);
+            
+            if (!child->first.empty() && *endPtr == 0 && elementIndex < indices.size())
+            {
+                elements.push_back(make_pair((uint64_t)elementIndex, &child->second));
+            }
+        }
+        
+        sort(elements.begin(), elements.end());
+        
+        for (int i=0; i<elements.size(); i++)
+        {
+            PCH_PList_Entry *elementEntry = this->EntryAtIndex(indices[elements[i].first]);
+            
+            if (elementEntry != NULL)
+            {
+                result->value.arrayValue->push_back(GetProjectedValue(indices[elements[i].first], *elements[i].second));
+            }
+        }
+    }
+    
+    return result;
+}
+
+// Read the trailer, the header and the offset table (the offsetTable ivar is set, and the raw bytes of the table are returned in offsetTableBytes)
+PCH_PList::ErrorType PCH_PList::ReadFileStructure(istream &pFile, uint64_t &fileLength, vector<char> &offsetTableBytes)
+{
+    // The stream is seekable, so the length can be found by seeking to the end (instead of reading the whole file to get there)
+    pFile.clear();
+    pFile.seekg(0, ios_base::end);
+    streamoff endPos = pFile.tellg();
+    
+    if (endPos >= 0)
+    {
+        fileLength = (uint64_t)endPos;
+    }
+    else
+    {
+        // This "safe" calculation of filelength comes from https://stackoverflow.com/questions/22984956/tellg-function-give-wrong-size-of-file/22986486#22986486
+        pFile.clear();
+        pFile.seekg(0, ios_base::beg);
+        pFile.ignore(std::numeric_limits<std::streamsize>::max());
+        fileLength = (uint64_t)pFile.gcount();
+    }
+    
+    pFile.clear(); //  Since ignore will have set eof, we clear it
+    
+    // the number of values that limits.maxExpansion allows for a file of this size (if that doesn't fit in 64 bits, there's no limit)
+    uint64_t maxExpansion = this->limits.maxExpansion;
+    this->expansionLimit = (maxExpansion != 0 && fileLength > UINT64_MAX / maxExpansion ? 0 : maxExpansion * fileLength);
+    
+    if (fileLength < PCH_PLIST_HEADER_LENGTH + PCH_PLIST_TRAILER_LENGTH)
+    {
+        cerr << "This is not a valid plist file";
+        return errorNotValidPlistFile;
+    }
+    
+    // We start out by reading the data in the file's trailer
+    streampos trailerStart = fileLength - PCH_PLIST_TRAILER_LENGTH;
+    // The first 6 bytes of the trailer are unused by our class, so we skip past them
+    pFile.seekg(trailerStart + (streampos)6);
+    
+    char tByteBuff;
+    
+    // get the offset_table_offset_size
+    pFile.read(&tByteBuff, 1);
+    int offset_table_offset_size = (int)tByteBuff;
+    
+    // get the object_ref_size
+    pFile.read(&tByteBuff, 1);
+    int object_ref_size = (int)tByteBuff;
+    
+    if (offset_table_offset_size < 1 || offset_table_offset_size > 8 || object_ref_size < 1 || object_ref_size > 8)
+    {
+        cerr << "This is not a valid plist file";
+        return errorNotValidPlistFile;
+    }
+    
+    // get the number of objects in the file (note that as a number, this value is in Big-endian format, so we need to convert it to the host computer's method of numerical representation
+    char eBuff[8];
+    pFile.read(eBuff, 8);
+    uint64_t numObjects;
+    memcpy(&numObjects, eBuff, 8);
+    numObjects = PCH_SwapInt64BigToHost(numObjects);
+    
+    // get the offset to the "top" object in the list of objects
+    pFile.read(eBuff, 8);
+    uint64_t top_object_offset;
+    memcpy(&top_object_offset, eBuff, 8);
+    top_object_offset = PCH_SwapInt64BigToHost(top_object_offset);
+    
+    // Get the location (in bytes from the beginning of the file) of the offset table
+    pFile.read(eBuff, 8);
+    int64_t offset_table_start;
+    memcpy(&offset_table_start, eBuff, 8);
+    offset_table_start = PCH_SwapInt64BigToHost(offset_table_start);
+    
+    pFile.clear(); // The last read will have set eof, we clear it and go back to the beginning of the file
+    pFile.seekg(0, std::ios_base::beg);
+    
+    // read the header and store it
+    pFile.read(this->headerBuffer, PCH_PLIST_HEADER_LENGTH);
+    
+    // Test the first 6 bytes of the header and make sure they are equal to the string "bplist", otherwise return false
+    if (strncmp(this->headerBuffer, "bplist", 6) != 0)
+    {
+        cerr << "This is not a valid plist file";
+        return errorNotValidPlistFile;
+    }
+    
+    // Read the offset table. Each entry is the position in the file of the object with that index.
+    this->objectRefSize = object_ref_size;
+    this->topObject = top_object_offset;
+    this->offsetTableStart = offset_table_start;
+    
+    // make sure that the offset table is actually inside the file before allocating anything for it
+    if (offset_table_start < PCH_PLIST_HEADER_LENGTH || (uint64_t)offset_table_start > fileLength || numObjects > (fileLength - offset_table_start) / offset_table_offset_size)
+    {
+        cerr << "This is not a valid plist file";
+        return errorNotValidPlistFile;
+    }
+    
+    if (PCH_OverLimit(numObjects, this->limits.maxObjects))
+    {
+        cerr << "The plist has too many objects";
+        return errorTooManyObjects;
+    }
+    
+    offsetTableBytes.resize(numObjects * offset_table_offset_size);
+    pFile.seekg(offset_table_start);
+    pFile.read(offsetTableBytes.data(), offsetTableBytes.size());
+    
+    if (pFile.gcount() != offsetTableBytes.size() || top_object_offset >= numObjects)
+    {
+        cerr << "This is not a valid plist file";
+        return errorNotValidPlistFile;
+    }
+    
+    this->offsetTable.resize(numObjects);
+    
+    for (uint64_t i=0; i<numObjects; i++)
+    {
+        char offBuff[8] = {0};
+        memcpy(offBuff + (8 - offset_table_offset_size), &offsetTableBytes[i * offset_table_offset_size], offset_table_offset_size);
+        uint64_t offset;
+        memcpy(&offset, offBuff, 8);
+        this->offsetTable[i] = PCH_SwapInt64BigToHost(offset);
+    }
+    
+    return noError;
+}
+
+// What the decoder needs to know about an object from its marker byte. There is one of these for each of the 256 markers, so that every object is dispatched with a single lookup.
+struct PCH_PList_MarkerInfo
+{
+    // noError, or the error for objects with this marker (and the message to print for it, if there is one)
+    PCH_PList::ErrorType error;
+    const char *message;
+    
+    PCH_PList::ObjectType type;
+    
+    // Null, bool, fill, int, real, date and UID objects have a fixed number of bytes after the marker. Data, strings and collections have a count instead (in the low nibble, or in an int that follows the marker), and 'unitLength' bytes (or object references, for collections) for each unit of the count.
+    uint8_t fixedLength;
+    bool hasCount;
+    bool isCollection;
+    uint8_t unitLength;
+};
+
+static array<PCH_PList_MarkerInfo, 256> PCH_BuildMarkerTable()
+{
+    array<PCH_PList_MarkerInfo, 256> table;
+    
+    for (int marker=0; marker<256; marker++)
+    {
+        // each marker byte encodes two pieces of 4-bit information (we'll call them "highNibble" and "lowNibble")
+        int highNibble = marker >> 4;
+        int lowNibble = marker & 0x0F;
+        
+        PCH_PList_MarkerInfo &info = table[marker];
+        info.error = PCH_PList::noError;
+        info.message = NULL;
+        info.type = PCH_PList::nullType;
+        info.fixedLength = 0;
+        info.hasCount = false;
+        info.isCollection = false;
+        info.unitLength = 0;
+        
+        switch (highNibble)
+        {
+            // null, bool, and fill types
+            case 0x0:
+            {
+                if (lowNibble == 0x0)
+                {
+                    info.type = PCH_PList::nullType;
+                }
+                else if (lowNibble == 0x08)
+                {
+                    info.type = PCH_PList::boolFalseType;
+                }
+                else if (lowNibble == 0x09)
+                {
+                    info.type = PCH_PList::boolTrueType;
+                }
+                else if (lowNibble == 0x0F)
+                {
+                    info.type = PCH_PList::fillType;
+                }
+                else
+                {
+                    info.error = PCH_PList::errorUnknownObjectType;
+                    info.message = "An unknown object type was encountered";
+                }
+                break;
+            }
+            
+            // The number of bytes in an integer is 2^lowNibble. 128-bit integers are a bit of a mess, so they're not supported.
+            case 0x1:
+            {
+                if (lowNibble <= 3)
+                {
+                    info.type = PCH_PList::int64Type;
+                    info.fixedLength = 1 << lowNibble;
+                }
+                else
+                {
+                    info.error = PCH_PList::errorUnknownObjectType;
+                    info.message = "128-bit integers have not been implemented yet.";
+                }
+                break;
+            }
+            
+            // reals are also 2^lowNibble bytes, which has to be 4 (float) or 8 (double)
+            case 0x2:
+            {
+                if (lowNibble == 2 || lowNibble == 3)
+                {
+                    info.type = PCH_PList::doubleType;
+                    info.fixedLength = 1 << lowNibble;
+                }
+                else
+                {
+                    info.error = PCH_PList::errorIllegalRealLength;
+                    info.message = "Illegal number of bytes for real type";
+                }
+                break;
+            }
+            
+            // dates are always doubles
+            case 0x3:
+            {
+                info.type = PCH_PList::dateType;
+                info.fixedLength = 8;
+                break;
+            }
+            
+            // data, ASCII strings and Unicode strings (whose characters are 2 bytes long)
+            case 0x4:
+            case 0x5:
+            case 0x6:
+            {
+                info.type = (highNibble == 0x4 ? PCH_PList::dataType : (highNibble == 0x5 ? PCH_PList::asciiStringType : PCH_PList::unicodeStringType));
+                info.hasCount = true;
+                info.unitLength = (highNibble == 0x6 ? 2 : 1);
+                break;
+            }
+            
+            // unlike just about every other type of object, the number of bytes in a UID is (lowNibble + 1)
+            case 0x8:
+            {
+                if (lowNibble < 8)
+                {
+                    info.type = PCH_PList::uidType;
+                    info.fixedLength = lowNibble + 1;
+                }
+                else
+                {
+                    info.error = PCH_PList::errorNotValidPlistFile;
+                }
+                break;
+            }
+                
+            // arrays and sets have a reference for each element, dicts have two for each entry (a key and a value)
+            case 0xA:
+            case 0xC:
+            case 0xD:
+            {
+                info.type = (highNibble == 0xA ? PCH_PList::arrayType : (highNibble == 0xC ? PCH_PList::setType : PCH_PList::dictType));
+                info.hasCount = true;
+                info.isCollection = true;
+                info.unitLength = (highNibble == 0xD ? 2 : 1);
+                break;
+            }
+            
+            default:
+            {
+                info.error = PCH_PList::errorUnknownObjectType;
+                info.message = "An unknown object type was encountered";
+                break;
+            }
+        }
+    }
+    
+    return table;
+}
+
+static const array<PCH_PList_MarkerInfo, 256> PCH_markerTable = PCH_BuildMarkerTable();
+
+// Returns the unsigned big-endian number in the 'numBytes' (1 to 8) bytes at 'bytes'
+static inline uint64_t PCH_ReadBigEndian(const char *bytes, uint64_t numBytes)
+{
+    const uint8_t *bytePtr = (const uint8_t *)bytes;
+    
+    switch (numBytes)
+    {
+        case 1:
+            return bytePtr[0];
+            
+        case 2:
+            return ((uint64_t)bytePtr[0] << 8) | bytePtr[1];
+            
+        case 4:
+            return ((uint64_t)bytePtr[0] << 24) | ((uint64_t)bytePtr[1] << 16) | ((uint64_t)bytePtr[2] << 8) | bytePtr[3];
+        
+        case 8:
+            return ((uint64_t)bytePtr[0] << 56) | ((uint64_t)bytePtr[1] << 48) | ((uint64_t)bytePtr[2] << 40) | ((uint64_t)bytePtr[3] << 32) | ((uint64_t)bytePtr[4] << 24) | ((uint64_t)bytePtr[5] << 16) | ((uint64_t)bytePtr[6] << 8) | bytePtr[7];
+        
+        default:
+        {
+            uint64_t result = 0;
+            
+            for (int i=0; i<numBytes; i++)
+            {
+                result = (result << 8) | bytePtr[i];
+            }
+            
+            return result;
+        }
+    }
+}
+
+// Longer data, strings and collections have their count in an int object right after the marker. 'bytes' points at the int and 'available' is the number of bytes that can be read there. Returns false if there isn't a valid count.
+static inline bool PCH_ReadExtendedCount(const char *bytes, uint64_t available, uint64_t &count, uint64_t &countLength)
+{
+    if (available < 1 || ((uint8_t)bytes[0] >> 4) != 0x01)
+    {
+        return false;
+    }
+    
+    // counts are at most 8 bytes long
+    uint64_t numBytes = (uint64_t)1 << (bytes[0] & 0x0F);
+    
+    if (numBytes > 8 || numBytes >= available)
+    {
+        return false;
+    }
+    
+    count = PCH_ReadBigEndian(bytes + 1, numBytes);
+    countLength = 1 + numBytes;
+    
+    return true;
+}
+
+// Read the object that starts at the current position of pFile, leaving the stream just after it. The new entry is returned in *entry.
+PCH_PList::ErrorType PCH_PList::ReadObject(istream &pFile, PCH_PList_Entry **entry)
+{
+    streamoff streamPosition = pFile.tellg();
+    
+    if (streamPosition < 0)
+    {
+        return errorNotValidPlistFile;
+    }
+    
+    uint64_t position = (uint64_t)streamPosition;
+    ErrorType err;
+    
+    // streams that are in memory are decoded in place
+    PCH_ContiguousStreamBuf *contiguousBuf = dynamic_cast<PCH_ContiguousStreamBuf *>(pFile.rdbuf());
+    
+    if (contiguousBuf != NULL)
+    {
+        uint64_t objectLength;
+        err = this->DecodeObject(*contiguousBuf, position, entry, objectLength);
+        
+        if (err == noError)
+        {
+            pFile.seekg((streamoff)(position + objectLength));
+        }
+        
+        return err;
+    }
+    
+    // Anything else is read into objectBuffer: the header first, then the rest of the object once its length is known
+    if (position >= this->offsetTableStart)
+    {
+        return errorNotValidPlistFile;
+    }
+    
+    uint64_t available = this->offsetTableStart - position;
+    uint64_t numRead = min(available, (uint64_t)PCH_PLIST_MAX_OBJECT_HEADER_LENGTH);
+    
+    this->objectBuffer.resize((size_t)numRead);
+    pFile.read(this->objectBuffer.data(), (streamsize)numRead);
+    
+    if ((uint64_t)pFile.gcount() != numRead)
+    {
+        return errorNotValidPlistFile;
+    }
+    
+    ObjectHeader header;
+    err = this->ParseObjectHeader(this->objectBuffer.data(), available, header);
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    if (header.length > numRead)
+    {
+        this->objectBuffer.resize((size_t)header.length);
+        pFile.read(this->objectBuffer.data() + numRead, (streamsize)(header.length - numRead));
+        
+        if ((uint64_t)pFile.gcount() != header.length - numRead)
+        {
+            return errorNotValidPlistFile;
+        }
+    }
+    else if (header.length < numRead)
+    {
+        pFile.seekg((streamoff)(position + header.length));
+    }
+    
+    this->MakeEntry(this->objectBuffer.data(), position, header, entry);
+    
+    // the buffer doesn't hang on to the memory of a big object
+    if (this->objectBuffer.capacity() > PCH_PLIST_PAYLOAD_CHUNK_SIZE)
+    {
+        vector<char>().swap(this->objectBuffer);
+    }
+    
+    return noError;
+}
+
+PCH_PList::ErrorType PCH_PList::DecodeObject(PCH_ContiguousStreamBuf &streamBuf, uint64_t position, PCH_PList_Entry **entry, uint64_t &objectLength)
+{
+    // objects have to be before the offset table
+    if (position >= this->offsetTableStart)
+    {
+        return errorNotValidPlistFile;
+    }
+    
+    uint64_t available = this->offsetTableStart - position;
+    const char *streamBytes = streamBuf.BytesFor(position, min(available, (uint64_t)PCH_PLIST_MAX_OBJECT_HEADER_LENGTH));
+    
+    if (streamBytes == NULL)
+    {
+        return errorNotValidPlistFile;
+    }
+    
+    ObjectHeader header;
+    ErrorType err = this->ParseObjectHeader(streamBytes + position, available, header);
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    // the rest of the object (which is nearly always there already)
+    if (streamBuf.BytesFor(position, header.length) == NULL)
+    {
+        return errorNotValidPlistFile;
+    }
+    
+    this->MakeEntry(streamBytes + position, position, header, entry);
+    objectLength = header.length;
+    
+    return noError;
+}
+
+PCH_PList::ErrorType PCH_PList::ParseObjectHeader(const char *objectBytes, uint64_t available, ObjectHeader &header)
+{
+    const PCH_PList_MarkerInfo &marker = PCH_markerTable[(uint8_t)objectBytes[0]];
+    
+    if (marker.error != noError)
+    {
+        if (marker.message != NULL)
+        {
+            cerr << marker.message;
+        }
+        
+        return marker.error;
+    }
+    
+    header.type = marker.type;
+    header.headerLength = 1;
+    
+    if (!marker.hasCount)
+    {
+        header.count = marker.fixedLength;
+        header.length = 1 + marker.fixedLength;
+        
+        return (header.length <= available ? noError : errorNotValidPlistFile);
+    }
+    
+    // the count is in the low nibble, unless the low nibble is 0xF
+    header.count = (uint8_t)objectBytes[0] & 0x0F;
+    
+    if (header.count == 0x0F)
+    {
+        uint64_t countLength;
+        
+        if (!PCH_ReadExtendedCount(objectBytes + 1, available - 1, header.count, countLength))
+        {
+            return errorNotValidPlistFile;
+        }
+        
+        header.headerLength += countLength;
+    }
+    
+    // This is the one bounds check for the object: its payload or references have to end before the offset table. The count comes from the file, so this also bounds what is allocated for the object.
+    uint64_t unitLength = (marker.isCollection ? marker.unitLength * (uint64_t)this->objectRefSize : marker.unitLength);
+    
+    if (header.count > (available - header.headerLength) / unitLength)
+    {
+        return errorNotValidPlistFile;
+    }
+    
+    header.length = header.headerLength + header.count * unitLength;
+    
+    if (marker.isCollection)
+    {
+        if (PCH_OverLimit(header.count, this->limits.maxCollectionSize))
+        {
+            cerr << (header.type == dictType ? "A collection in the plist has too many entries" : "A collection in the plist has too many elements");
+            return errorCollectionTooLarge;
+        }
+    }
+    else if (!this->ChargeDecodedBytes(header.count * unitLength))
+    {
+        return errorTooManyBytes;
+    }
+    
+    return noError;
+}
+
+void PCH_PList::MakeEntry(const char *objectBytes, uint64_t position, const ObjectHeader &header, PCH_PList_Entry **entry)
+{
+    const char *body = objectBytes + header.headerLength;
+    uint64_t refSize = (uint64_t)this->objectRefSize;
+    
+    switch (header.type)
+    {
+        case nullType:
+        case boolFalseType:
+        case boolTrueType:
+        case fillType:
+        {
+            *entry = new PCH_PList_Entry(header.type, 0, NULL);
+            break;
+        }
+            
+        // Ints are big-endian (and the shorter ones are unsigned). After analyzing the Apple-produced code in https://opensource.apple.com/source/CF/CF-550/CFBinaryPList.c, particularly the function _appendUID, it appears that UIDs are stored the same way.
+        case int64Type:
+        case uidType:
+        {
+            int64_t *dataPtr = new int64_t((int64_t)PCH_ReadBigEndian(body, header.count));
+            *entry = new PCH_PList_Entry(header.type, sizeof(int64_t), dataPtr);
+            break;
+        }
+            
+        // reals (floats or doubles) and dates (doubles) are all kept as doubles
+        case doubleType:
+        case dateType:
+        {
+            double data;
+            
+            if (header.count == sizeof(float))
+            {
+                uint32_t bits = (uint32_t)PCH_ReadBigEndian(body, sizeof(float));
+                float floatData;
+                memcpy(&floatData, &bits, sizeof(float));
+                data = floatData;
+            }
+            else
+            {
+                uint64_t bits = PCH_ReadBigEndian(body, sizeof(double));
+                memcpy(&data, &bits, sizeof(double));
+            }
+            
+            double *dataPtr = new double(data);
+            *entry = new PCH_PList_Entry(header.type, sizeof(double), dataPtr);
+            break;
+        }
+            
+        // the payloads of data and strings are copied straight into the vector or string that holds them
+        case dataType:
+        {
+            this->currentPayloadOffset = position + header.headerLength;
+            
+            vector<char> *result = new vector<char>(body, body + header.count);
+            *entry = new PCH_PList_Entry(dataType, (size_t)header.count, result);
+            break;
+        }
+            
+        case asciiStringType:
+        {
+            this->currentPayloadOffset = position + header.headerLength;
+            
+            string *result = new string(body, (size_t)header.count);
+            *entry = new PCH_PList_Entry(asciiStringType, (size_t)header.count, result);
+            break;
+        }
+            
+        // each character of a Unicode string is a big-endian uint16_t
+        case unicodeStringType:
+        {
+            this->currentPayloadOffset = position + header.headerLength;
+            
+            const uint8_t *charBytes = (const uint8_t *)body;
+            wstring *result = new wstring((size_t)header.count, L' ');
+            
+            for (uint64_t i=0; i<header.count; i++)
+            {
+                (*result)[i] = (wchar_t)(((uint16_t)charBytes[2 * i] << 8) | charBytes[2 * i + 1]);
+            }
+            
+            *entry = new PCH_PList_Entry(unicodeStringType, (size_t)header.count, result);
+            break;
+        }
+            
+        // The members of arrays and sets are indices into the object array itself (big-endian, of course)
+        case arrayType:
+        case setType:
+        {
+            vector<int64_t> *result = new vector<int64_t>((size_t)header.count);
+            
+            for (uint64_t i=0; i<header.count; i++)
+            {
+                (*result)[i] = (int64_t)PCH_ReadBigEndian(body + i * refSize, refSize);
+            }
+            
+            *entry = new PCH_PList_Entry(header.type, (size_t)header.count, result);
+            break;
+        }
+            
+        // dictionaries have all of their key references, followed by all of their value references
+        case dictType:
+        {
+            const char *valueRefs = body + header.count * refSize;
+            
+            vector<PCH_PList_Dict> *result = new vector<PCH_PList_Dict>();
+            result->reserve((size_t)header.count);
+            
+            for (uint64_t i=0; i<header.count; i++)
+            {
+                result->push_back(PCH_PList_Dict(PCH_ReadBigEndian(body + i * refSize, refSize), PCH_ReadBigEndian(valueRefs + i * refSize, refSize)));
+            }
+            
+            *entry = new PCH_PList_Entry(dictType, (size_t)header.count, result);
+            break;
+        }
+    }
+}
+
+void PCH_PListTreeWalker::Walk(const PCH_PList_Value *root, PCH_PListValueVisitor &visitor)
+{
+    this->openContainers.clear();
+    
+    this->Visit(root, PCH_PListValueVisitor::rootValue, visitor);
+    
+    while (!this->openContainers.empty())
+    {
+        OpenContainer &top = this->openContainers.back();
+        
+        const PCH_PList_Value *child;
+        PCH_PListValueVisitor::Role role;
+        
+        if (top.container->valueType == PCH_PList_Value::Dict)
+        {
+            const vector<PCH_PList_Value::dictStruct> &entries = top.container->Entries();
+            
+            if (top.nextChild < 2 * entries.size())
+            {
+                const PCH_PList_Value::dictStruct &entry = entries[top.nextChild / 2];
+                
+                child = (top.nextChild % 2 == 0 ? entry.key : entry.val);
+                role = (top.nextChild % 2 == 0 ? PCH_PListValueVisitor::dictKey : PCH_PListValueVisitor::dictValue);
+                top.nextChild++;
+                
+                this->Visit(child, role, visitor);
+                
+                continue;
+            }
+        }
+        else
+        {
+            const vector<PCH_PList_Value *> &elements = top.container->Elements();
+            
+            if (top.nextChild < elements.size())
+            {
+                child = elements[top.nextChild];
+                top.nextChild++;
+                
+                this->Visit(child, PCH_PListValueVisitor::element, visitor);
+                
+                continue;
+            }
+        }
+        
+        // the container has no children left
+        OpenContainer finished = top;
+        this->openContainers.pop_back();
+        
+        visitor.EndValue(finished.container, finished.role, this->openContainers.size());
+    }
+}
+
+void PCH_PListTreeWalker::Visit(const PCH_PList_Value *value, PCH_PListValueVisitor::Role role, PCH_PListValueVisitor &visitor)
+{
+    if (value == NULL)
+    {
+        return;
+    }
+    
+    size_t depth = this->openContainers.size();
+    
+    if (!visitor.BeginValue(value, role, depth))
+    {
+        return;
+    }
+    
+    if (value->valueType == PCH_PList_Value::Array || value->valueType == PCH_PList_Value::Set || value->valueType == PCH_PList_Value::Dict)
+    {
+        OpenContainer newContainer;
+        newContainer.container = value;
+        newContainer.role = role;
+        newContainer.nextChild = 0;
+        
+        this->openContainers.push_back(newContainer);
+    }
+    else
+    {
+        visitor.EndValue(value, role, depth);
+    }
+}
+
+// The visitor used by TraversePlist(). Each value is written as an element with its contents one tab further in. Dict keys and values are wrapped in <key> and <value> elements, one tab in from the dict, so the keys and values themselves are two tabs in.
+class PCH_PListPrinter : public PCH_PListValueVisitor
+{
+public:
+    
+    PCH_PListPrinter(ostream &outStream, int numSpacesPerTab) : outStream(outStream), numSpacesPerTab(numSpacesPerTab), numTabs(1) {}
+    
+    virtual bool BeginValue(const PCH_PList_Value *value, Role role, size_t depth);
+    virtual void EndValue(const PCH_PList_Value *value, Role role, size_t depth);
+    
+private:
+    
+    ostream &outStream;
+    int numSpacesPerTab;
+    
+    // the indentation of the value being written
+    int numTabs;
+    
+    // enough spaces for the deepest indentation so far, so that writing the indentation doesn't allocate anything
+    string spaces;
+    
+    void Indent(int tabs);
+    
+    // write a line with 'text' at the indentation 'tabs'
+    void Line(int tabs, const char *text);
+    
+    // write a number with its tags (the elements of packed arrays are written the same way as separate Int and Double values)
+    void IntElement(int tabs, int64_t number);
+    void DoubleElement(int tabs, double number);
+};
+
+void PCH_PListPrinter::Indent(int tabs)
+{
+    size_t numSpaces = tabs * this->numSpacesPerTab;
+    
+    if (this->spaces.size() < numSpaces)
+    {
+        this->spaces.resize(numSpaces, ' ');
+    }
+    
+    this->outStream.write(this->spaces.data(), numSpaces);
+}
+
+void PCH_PListPrinter::Line(int tabs, const char *text)
+{
+    this->Indent(tabs);
+    this->outStream << text << '\n';
+}
+
+void PCH_PListPrinter::IntElement(int tabs, int64_t number)
+{
+    this->Line(tabs, "<int>");
+    
+    this->Indent(tabs + 1);
+    this->outStream << number << '\n';
+    
+    this->Line(tabs, "</int>");
+}
+
+void PCH_PListPrinter::DoubleElement(int tabs, double number)
+{
+    this->Line(tabs, "<double>");
+    
+    this->Indent(tabs + 1);
+    this->outStream << number << '\n';
+    
+    this->Line(tabs, "</double>");
+}
+
+bool PCH_PListPrinter::BeginValue(const PCH_PList_Value *value, Role role, size_t depth)
+{
+    if (role == dictKey)
+    {
+        // used for analyzing NSKeyedArchive plists
+        if (value->valueType != PCH_PList_Value::AsciiString)
+        {
+            cerr << "Got a non-string dictionary key" << endl;
+        }
+        
+        this->Line(this->numTabs - 1, "<key>");
+    }
+    else if (role == dictValue)
+    {
+        this->Line(this->numTabs - 1, "<value>");
+    }
+    
+    switch (value->valueType)
+    {
+        case PCH_PList_Value::Bool:
+        {
+            this->Line(this->numTabs, "<bool>");
+            this->Line(this->numTabs + 1, (value->value.boolValue ? "TRUE" : "FALSE"));
+            this->Line(this->numTabs, "</bool>");
+            
+            break;
+        }
+        
+        case PCH_PList_Value::Int:
+        {
+            this->IntElement(this->numTabs, value->value.intValue);
+            
+            break;
+        }
+            
+        case PCH_PList_Value::Double:
+        {
+            this->DoubleElement(this->numTabs, value->value.doubleValue);
+            
+            break;
+        }
+            
+        case PCH_PList_Value::Date:
+        {
+            this->Line(this->numTabs, "<date>");
+            
+            this->Indent(this->numTabs + 1);
+            this->outStream << value->value.dateValue << '\n';
+            
+            this->Line(this->numTabs, "</date>");
+            
+            break;
+        }
+            
+        case PCH_PList_Value::AsciiString:
+        {
+            this->Line(this->numTabs, "<ascii-string>");
+            this->Line(this->numTabs + 1, value->value.asciiStringValue->c_str());
+            this->Line(this->numTabs, "</ascii-string>");
+            
+            break;
+        }
+        
+        case PCH_PList_Value::UnicodeString:
+        {
+            this->Line(this->numTabs, "<unicode-string>");
+            
+            this->Indent(this->numTabs + 1);
+            this->outStream << value->value.uniStringValue->c_str() << '\n';
+            
+            this->Line(this->numTabs, "</unicode-string>");
+            
+            break;
+        }
+            
+        case PCH_PList_Value::Data:
+        {
+            this->Line(this->numTabs, "<data>");
+            
+            this->Indent(this->numTabs + 1);
+            
+            for (int i=0; i<value->value.dataValue->size(); i++)
+            {
+                this->outStream << hex << setfill('0') << setw(2) << value->value.dataValue->at(i);
+            }
+            
+            this->outStream << '\n';
+            
+            this->Line(this->numTabs, "</data>");
+            
+            break;
+        }
+            
+        case PCH_PList_Value::Uid:
+        {
+            this->Line(this->numTabs, "<UID>");
+            
+            this->Indent(this->numTabs + 1);
+            this->outStream << value->value.uidValue << '\n';
+            
+            this->Line(this->numTabs, "</UID>");
+            
+            break;
+        }
+            
+        case PCH_PList_Value::Array:
+        {
+            this->Line(this->numTabs, "<array>");
+            this->numTabs += 1;
+            
+            break;
+        }
+            
+        case PCH_PList_Value::Set:
+        {
+            this->Line(this->numTabs, "<set>");
+            this->numTabs += 1;
+            
+            break;
+        }
+            
+        case PCH_PList_Value::IntArray:
+        {
+            this->Line(this->numTabs, "<array>");
+            
+            for (int64_t number : value->Ints())
+            {
+                this->IntElement(this->numTabs + 1, number);
+            }
+            
+            this->Line(this->numTabs, "</array>");
+            
+            break;
+        }
+        
+        case PCH_PList_Value::DoubleArray:
+        {
+            this->Line(this->numTabs, "<array>");
+            
+            for (double number : value->Doubles())
+            {
+                this->DoubleElement(this->numTabs + 1, number);
+            }
+            
+            this->Line(this->numTabs, "</array>");
+            
+            break;
+        }
+        
+        case PCH_PList_Value::Dict:
+        {
+            this->Line(this->numTabs, "<dict>");
+            this->numTabs += 2;
+            
+            break;
+        }
+            
+        default:
+        {
+            break;
+        }
+    }
+    
+    return true;
+}
+
+void PCH_PListPrinter::EndValue(const PCH_PList_Value *value, Role role, size_t depth)
+{
+    if (value->valueType == PCH_PList_Value::Array)
+    {
+        this->numTabs -= 1;
+        this->Line(this->numTabs, "</array>");
+    }
+    else if (value->valueType == PCH_PList_Value::Set)
+    {
+        this->numTabs -= 1;
+        this->Line(this->numTabs, "</set>");
+    }
+    else if (value->valueType == PCH_PList_Value::Dict)
+    {
+        this->numTabs -= 2;
+        this->Line(this->numTabs, "</dict>");
+    }
+    
+    if (role == dictKey)
+    {
+        this->Line(this->numTabs - 1, "</key>");
+    }
+    else if (role == dictValue)
+    {
+        this->Line(this->numTabs - 1, "</value>");
+    }
+}
+
+void PCH_PList::TraversePlist(ostream& outStream)
+{
+    outStream << "<plist>" << endl;
+    
+    PCH_PListPrinter printer(outStream, this->numSpacesPerTab);
+    this->treeWalker.Walk(this->plistRoot, printer);
+    
+    outStream << "</plist>" << endl;
+}
+
+// Make the value for 'entry'. Containers are made empty (with room for their children); everything else is complete.
+static PCH_PList_Value *PCH_NewValueForEntry(const PCH_PList_Entry *entry)
+{
+    auto result = new PCH_PList_Value;
+    
+    // a reference to an object that couldn't be decoded is treated as null
+    if (entry == NULL)
+    {
+        return result;
+    }
+    
+    auto entryType = entry->entryType;
+    
+    switch (entryType) {
+            
+        case PCH_PList::boolTrueType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::Bool;
+            result->value.boolValue = true;
+
+            break;
+        }
+           
+        case PCH_PList::boolFalseType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::Bool;
+            result->value.boolValue = false;
+            
+            break;
+        }
+            
+        case PCH_PList::int64Type:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::Int;
+            result->value.intValue = *(int64_t*)(entry->data);
+            
+            break;
+        }
+            
+        case PCH_PList::dateType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::Date;
+            result->value.dateValue = *(double*)(entry->data);
+            
+            break;
+        }
+            
+        case PCH_PList::doubleType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::Double;
+            result->value.doubleValue = *(double*)(entry->data);
+            
+            break;
+        }
+            
+        case PCH_PList::dataType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::Data;
+            result->value.dataValue = new vector<char>(*(vector<char> *)entry->data);
+            
+            break;
+        }
+            
+        case PCH_PList::asciiStringType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::AsciiString;
+            result->value.asciiStringValue = new string(*(string *)entry->data);
+            
+            break;
+        }
+        
+        case PCH_PList::unicodeStringType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::UnicodeString;
+            result->value.uniStringValue = new wstring(*(wstring *)entry->data);
+            
+            break;
+        }
+            
+        case PCH_PList::uidType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::Uid;
+            result->value.uidValue = *(int64_t*)(entry->data);
+            
+            break;
+        }
+            
+        case PCH_PList::arrayType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::Array;
+            
+            result->value.arrayValue = new vector<PCH_PList_Value *>();
+            result->value.arrayValue->reserve(entry->dataSize);
+            
+            break;
+        }
+            
+        case PCH_PList::setType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::Set;
+            
+            result->value.setValue = new vector<PCH_PList_Value *>();
+            result->value.setValue->reserve(entry->dataSize);
+            
+            break;
+        }
+            
+        case PCH_PList::dictType:
+        {
+            result->valueType = PCH_PList_Value::pch_value_type::Dict;
+            
+            result->value.dictValue = new vector<PCH_PList_Value::dictStruct>();
+            result->value.dictValue->reserve(entry->dataSize);
+            
+            break;
+        }
+            
+        case PCH_PList::nullType:
+        case PCH_PList::fillType:
+        {
+            // fill bytes only pad a binary plist, so a reference to one is a null too
+            break;
+        }
+            
+        default:
+        {
+            cerr << "Unimplemented marker!" << endl;
+            
+            break;
+        }
+    }
+    
+    return result;
+}
+
+PCH_PList_Value *PCH_PList::GetValue(uint64_t index)
+{
+    PCH_PList_Entry *entry = this->EntryAtIndex(index);
+    
+    if (this->limitError != noError || !this->ChargeValue(entry, true))
+    {
+        return NULL;
+    }
+    
+    PCH_PList_Value *result = this->PackedArrayValue(entry);
+    
+    if (result != NULL)
+    {
+        return result;
+    }
+    
+    result = PCH_NewValueForEntry(entry);
+    
+    if (entry == NULL || (entry->entryType != arrayType && entry->entryType != setType && entry->entryType != dictType))
+    {
+        return result;
+    }
+    
+    // Each frame is a container whose children are being added. The stack is kept between calls, so it only grows when a deeper plist comes along.
+    size_t baseDepth = this->valueStack.size();
+    
+    if (this->openObjects.size() != this->objectArray.size())
+    {
+        this->openObjects.assign(this->objectArray.size(), false);
+    }
+    
+    ValueFrame rootFrame = {index, entry, result, 0};
+    this->valueStack.push_back(rootFrame);
+    this->openObjects[index] = true;
+    
+    while (this->valueStack.size() > baseDepth)
+    {
+        ValueFrame &frame = this->valueStack.back();
+        
+        bool isDict = (frame.entry->entryType == dictType);
+        
+        // dicts have a key and a value for each entry
+        if (frame.nextChild == (isDict ? 2 * frame.entry->dataSize : frame.entry->dataSize))
+        {
+            this->openObjects[frame.index] = false;
+            this->valueStack.pop_back();
+            continue;
+        }
+        
+        size_t childNum = frame.nextChild++;
+        
+        // unlike the other collection types, the data field of a dict does not hold indices into the objectArray, but the key/value pairs (as PCH_PList_Dict's) - those pairs ARE indices into the object array
+        uint64_t childIndex;
+        
+        if (isDict)
+        {
+            const PCH_PList_Dict &pair = (*(vector<PCH_PList_Dict> *)frame.entry->data)[childNum / 2];
+            childIndex = (childNum % 2 == 0 ? pair.keyOffset : pair.valueOffset);
+        }
+        else
+        {
+            childIndex = (*(vector<int64_t> *)frame.entry->data)[childNum];
+        }
+        
+        PCH_PList_Entry *childEntry = this->EntryAtIndex(childIndex);
+        
+        // A reference to a container that is still being filled in (the container itself, or one of the containers above it) would expand forever, so the file has a cycle
+        if (childEntry != NULL && this->openObjects[childIndex])
+        {
+            this->limitError = errorCyclicReference;
+            break;
+        }
+        
+        // the first reference to a data object takes its payload instead of copying it
+        bool takesPayload = (childEntry != NULL && childEntry->entryType == dataType && childIndex < this->payloadOwners.size() && this->payloadOwners[childIndex] == NULL);
+        
+        if (!this->ChargeValue(childEntry, !takesPayload))
+        {
+            break;
+        }
+        
+        PCH_PList_Value *child;
+        
+        if (childEntry != NULL && childEntry->entryType == dataType && childIndex < this->payloadOwners.size())
+        {
+            child = this->TakeDataValue(childEntry, childIndex);
+        }
+        else if ((child = this->PackedArrayValue(childEntry)) == NULL)
+        {
+            child = PCH_NewValueForEntry(childEntry);
+        }
+        
+        if (isDict)
+        {
+            if (childNum % 2 == 0)
+            {
+                PCH_PList_Value::dictStruct tDict;
+                tDict.key = child;
+                tDict.val = NULL;
+                
+                frame.value->value.dictValue->push_back(tDict);
+            }
+            else
+            {
+                frame.value->value.dictValue->back().val = child;
+            }
+        }
+        else if (frame.entry->entryType == setType)
+        {
+            frame.value->value.setValue->push_back(child);
+        }
+        else
+        {
+            frame.value->value.arrayValue->push_back(child);
+        }
+        
+        // (this invalidates 'frame'). Packed arrays are complete already.
+        if (child->valueType == PCH_PList_Value::Array || child->valueType == PCH_PList_Value::Set || child->valueType == PCH_PList_Value::Dict)
+        {
+            if (PCH_OverLimit(this->valueStack.size() - baseDepth + 1, this->limits.maxDepth))
+            {
+                this->limitError = errorTooDeep;
+                break;
+            }
+            
+            ValueFrame childFrame = {childIndex, childEntry, child, 0};
+            this->valueStack.push_back(childFrame);
+            this->openObjects[childIndex] = true;
+        }
+    }
+    
+    // if a limit was exceeded (or a cycle was found), the partial tree is thrown away (the child that went past it has already been added to its container, or was never made)
+    if (this->limitError != noError)
+    {
+        for (size_t i=baseDepth; i<this->valueStack.size(); i++)
+        {
+            this->openObjects[this->valueStack[i].index] = false;
+        }
+        
+        this->valueStack.erase(this->valueStack.begin() + baseDepth, this->valueStack.end());
+        
+        delete result;
+        return NULL;
+    }
+    
+    return result;
+}
+
+PCH_PList_Value *PCH_PList::PackedArrayValue(PCH_PList_Entry *entry)
+{
+    if (!this->packNumericArrays || entry == NULL || entry->entryType != arrayType || entry->dataSize < PCH_PLIST_PACKED_ARRAY_MIN_COUNT)
+    {
+        return NULL;
+    }
+    
+    // every element has to be the same type of number
+    const vector<int64_t> &elements = *(vector<int64_t> *)entry->data;
+    ObjectType elementType = nullType;
+    
+    for (size_t i=0; i<elements.size(); i++)
+    {
+        PCH_PList_Entry *element = this->EntryAtIndex((uint64_t)elements[i]);
+        
+        if (element == NULL || (element->entryType != int64Type && element->entryType != doubleType) || (i > 0 && element->entryType != elementType))
+        {
+            return NULL;
+        }
+        
+        elementType = element->entryType;
+    }
+    
+    // Each element is a separate object in the file (with its own marker and size), so there's no block of big-endian numbers to convert in one go. The numbers were converted when their objects were read, and are gathered here.
+    auto result = new PCH_PList_Value;
+    
+    if (elementType == int64Type)
+    {
+        result->valueType = PCH_PList_Value::pch_value_type::IntArray;
+        result->value.intArrayValue = new vector<int64_t>(elements.size());
+        
+        int64_t *numbers = result->value.intArrayValue->data();
+        
+        for (size_t i=0; i<elements.size(); i++)
+        {
+            numbers[i] = *(int64_t *)this->objectArray[elements[i]]->data;
+        }
+    }
+    else
+    {
+        result->valueType = PCH_PList_Value::pch_value_type::DoubleArray;
+        result->value.doubleArrayValue = new vector<double>(elements.size());
+        
+        double *numbers = result->value.doubleArrayValue->data();
+        
+        for (size_t i=0; i<elements.size(); i++)
+        {
+            numbers[i] = *(double *)this->objectArray[elements[i]]->data;
+        }
+    }
+    
+    return result;
+}
+
+PCH_PList::ErrorType PCH_PList::BuildTree()
+{
+    this->payloadOwners.assign(this->objectArray.size(), NULL);
+    
+    delete this->plistRoot;
+    this->plistRoot = GetValue(this->topObject);
+    
+    vector<PCH_PList_Value *>().swap(this->payloadOwners);
+    
+    return this->limitError;
+}
+
+PCH_PList_Value *PCH_PList::TakeDataValue(PCH_PList_Entry *entry, uint64_t index)
+{
+    // a data object that is referenced more than once is copied from the value that took its payload
+    const PCH_PList_Value *owner = this->payloadOwners[index];
+    
+    if (owner != NULL)
+    {
+        return owner->Clone();
+    }
+    
+    auto result = new PCH_PList_Value;
+    result->valueType = PCH_PList_Value::pch_value_type::Data;
+    result->value.dataValue = (vector<char> *)entry->data;
+    
+    // the entry is left with an empty payload
+    entry->data = new vector<char>;
+    entry->dataSize = 0;
+    
+    this->payloadOwners[index] = result;
+    
+    return result;
+}
+
+bool PCH_PList::ChargeDecodedBytes(uint64_t numBytes)
+{
+    this->numDecodedBytes += numBytes;
+    
+    return !PCH_OverLimit(this->numDecodedBytes, this->limits.maxDecodedBytes);
+}
+
+bool PCH_PList::ChargeValue(const PCH_PList_Entry *entry, bool copiesPayload)
+{
+    this->numValues++;
+    
+    if (PCH_OverLimit(this->numValues, this->limits.maxValues) || PCH_OverLimit(this->numValues, this->expansionLimit))
+    {
+        this->limitError = errorTooManyValues;
+        return false;
+    }
+    
+    if (copiesPayload && entry != NULL && (entry->entryType == dataType || entry->entryType == asciiStringType || entry->entryType == unicodeStringType))
+    {
+        if (!this->ChargeDecodedBytes(entry->entryType == unicodeStringType ? 2 * (uint64_t)entry->dataSize : (uint64_t)entry->dataSize))
+        {
+            this->limitError = errorTooManyBytes;
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// FNV-1a, which is plenty good enough to detect a changed file (it is combined with the file's size and modification time)
+static uint64_t PCH_FNV1aHash(const void *bytes, size_t length, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    const unsigned char *bytePtr = (const unsigned char *)bytes;
+    
+    for (size_t i=0; i<length; i++)
+    {
+        hash ^= bytePtr[i];
+        hash *= 0x100000001b3ULL;
+    }
+    
+    return hash;
+}
+
+uint64_t PCH_PList::IndexCacheHash(const char *header, const char *offsetTable, size_t offsetTableLength, uint64_t fileLength)
+{
+    // Hashing the whole file would cost as much as parsing it, so we hash the header and the offset table (which changes whenever any object moves or changes size), along with the file length
+    uint64_t hash = PCH_FNV1aHash(header, PCH_PLIST_HEADER_LENGTH);
+    hash = PCH_FNV1aHash(offsetTable, offsetTableLength, hash);
+    hash = PCH_FNV1aHash(&fileLength, sizeof(fileLength), hash);
+    
+    return hash;
+}
+
+bool PCH_PList::LoadIndexCache(const string &filePath, uint64_t fileLength, uint64_t sourceHash)
+{
+    struct stat sourceStat;
+    
+    if (stat(filePath.c_str(), &sourceStat) != 0)
+    {
+        return false;
+    }
+    
+    string indexPath = filePath + PCH_PLIST_INDEX_CACHE_EXTENSION;
+    
+    int indexFD = open(indexPath.c_str(), O_RDONLY);
+    
+    if (indexFD < 0)
+    {
+        return false;
+    }
+    
+    struct stat indexStat;
+    
+    if (fstat(indexFD, &indexStat) != 0 || indexStat.st_size < sizeof(PCH_PList_IndexHeader))
+    {
+        close(indexFD);
+        return false;
+    }
+    
+    size_t indexSize = (size_t)indexStat.st_size;
+    void *indexMapping = mmap(NULL, indexSize, PROT_READ, MAP_PRIVATE, indexFD, 0);
+    close(indexFD);
+    
+    if (indexMapping == MAP_FAILED)
+    {
+        return false;
+    }
+    
+    const char *indexBytes = (const char *)indexMapping;
+    const PCH_PList_IndexHeader *header = (const PCH_PList_IndexHeader *)indexBytes;
+    uint64_t numObjects = this->offsetTable.size();
+    
+    // make sure that the index belongs to this exact file, and that all of its sections are actually in the index file
+    bool indexIsValid = (memcmp(header->magic, PCH_PLIST_INDEX_CACHE_MAGIC, sizeof(header->magic)) == 0);
+    indexIsValid = indexIsValid && header->version == PCH_PLIST_INDEX_CACHE_VERSION && header->byteOrderMark == PCH_PLIST_INDEX_CACHE_BOM;
+    indexIsValid = indexIsValid && header->sourceSize == fileLength && header->sourceMTime == (int64_t)sourceStat.st_mtime && header->sourceHash == sourceHash;
+    indexIsValid = indexIsValid && header->numObjects == numObjects && header->topObject == this->topObject && header->objectRefSize == this->objectRefSize;
+    indexIsValid = indexIsValid && header->entriesOffset + numObjects * sizeof(PCH_PList_IndexEntry) <= indexSize;
+    indexIsValid = indexIsValid && header->refsOffset + header->numRefs * sizeof(uint64_t) <= indexSize;
+    indexIsValid = indexIsValid && header->keyHashOffset + header->numKeyHashSlots * sizeof(PCH_PList_KeyHashSlot) <= indexSize;
+    
+    if (!indexIsValid)
+    {
+        munmap(indexMapping, indexSize);
+        return false;
+    }
+    
+    // strings and data are copied straight out of the original file, which we also map
+    int sourceFD = open(filePath.c_str(), O_RDONLY);
+    void *sourceMapping = (sourceFD >= 0 && fileLength > 0 ? mmap(NULL, fileLength, PROT_READ, MAP_PRIVATE, sourceFD, 0) : MAP_FAILED);
+    
+    if (sourceFD >= 0)
+    {
+        close(sourceFD);
+    }
+    
+    if (sourceMapping == MAP_FAILED)
+    {
+        munmap(indexMapping, indexSize);
+        return false;
+    }
+    
+    const char *sourceBytes = (const char *)sourceMapping;
+    const PCH_PList_IndexEntry *entries = (const PCH_PList_IndexEntry *)(indexBytes + header->entriesOffset);
+    const uint64_t *refs = (const uint64_t *)(indexBytes + header->refsOffset);
+    
+    this->objectArray.reserve(numObjects);
+    
+    for (uint64_t i=0; i<numObjects && indexIsValid; i++)
+    {
+        const PCH_PList_IndexEntry &entry = entries[i];
+        ObjectType entryType = (ObjectType)entry.type;
+        
+        switch (entryType)
+        {
+            case nullType:
+            case boolFalseType:
+            case boolTrueType:
+            case fillType:
+            {
+                this->objectArray.push_back(new PCH_PList_Entry(entryType, 0, NULL));
+                break;
+            }
+                
+            case int64Type:
+            case uidType:
+            {
+                this->objectArray.push_back(new PCH_PList_Entry(entryType, sizeof(int64_t), new int64_t((int64_t)entry.value)));
+                break;
+            }
+                
+            case doubleType:
+            case dateType:
+            {
+                double data;
+                memcpy(&data, &entry.value, sizeof(double));
+                this->objectArray.push_back(new PCH_PList_Entry(entryType, sizeof(double), new double(data)));
+                break;
+            }
+                
+            case dataType:
+            case asciiStringType:
+            case unicodeStringType:
+            {
+                uint64_t payloadSize = (entryType == unicodeStringType ? 2 * entry.dataSize : entry.dataSize);
+                
+                if (entry.value + payloadSize > fileLength)
+                {
+                    indexIsValid = false;
+                    break;
+                }
+                
+                const char *payload = sourceBytes + entry.value;
+                
+                if (entryType == dataType)
+                {
+                    this->objectArray.push_back(new PCH_PList_Entry(dataType, entry.dataSize, new vector<char>(payload, payload + entry.dataSize)));
+                }
+                else if (entryType == asciiStringType)
+                {
+                    this->objectArray.push_back(new PCH_PList_Entry(asciiStringType, entry.dataSize, new string(payload, entry.dataSize)));
+                }
+                else
+                {
+                    wstring *result = new wstring(entry.dataSize, L' ');
+                    
+                    for (uint64_t j=0; j<entry.dataSize; j++)
+                    {
+                        uint16_t wcharBuff;
+                        memcpy(&wcharBuff, payload + 2 * j, 2);
+                        (*result)[j] = (wchar_t)(uint16_t)PCH_SwapInt16BigToHost(wcharBuff);
+                    }
+                    
+                    this->objectArray.push_back(new PCH_PList_Entry(unicodeStringType, entry.dataSize, result));
+                }
+                
+                break;
+            }
+                
+            case arrayType:
+            case setType:
+            {
+                if (entry.value + entry.dataSize > header->numRefs)
+                {
+                    indexIsValid = false;
+                    break;
+                }
+                
+                const uint64_t *first = refs + entry.value;
+                this->objectArray.push_back(new PCH_PList_Entry(entryType, entry.dataSize, new vector<int64_t>(first, first + entry.dataSize)));
+                break;
+            }
+                
+            case dictType:
+            {
+                // the keys come first, followed by the values
+                if (entry.value + 2 * entry.dataSize > header->numRefs)
+                {
+                    indexIsValid = false;
+                    break;
+                }
+                
+                const uint64_t *keys = refs + entry.value;
+                const uint64_t *values = keys + entry.dataSize;
+                
+                auto result = new vector<PCH_PList_Dict>();
+                result->reserve(entry.dataSize);
+                
+                for (uint64_t j=0; j<entry.dataSize; j++)
+                {
+                    result->push_back(PCH_PList_Dict(keys[j], values[j]));
+                }
+                
+                this->objectArray.push_back(new PCH_PList_Entry(dictType, entry.dataSize, result));
+                break;
+            }
+                
+            default:
+            {
+                indexIsValid = false;
+                break;
+            }
+        }
+    }
+    
+    munmap(sourceMapping, fileLength);
+    
+    if (!indexIsValid)
+    {
+        // throw away whatever we managed to build and let the caller parse the file normally
+        for (int i=0; i<this->objectArray.size(); i++)
+        {
+            delete this->objectArray[i];
+        }
+        
+        this->objectArray.clear();
+        
+        munmap(indexMapping, indexSize);
+        
+        return false;
+    }
+    
+    // the index stays mapped so that its key hash table can be used by IndexOfStringObject()
+    this->indexCacheMapping = indexMapping;
+    this->indexCacheMappingSize = indexSize;
+    
+    return true;
+}
+
+bool PCH_PList::SaveIndexCache(const string &filePath, uint64_t fileLength, uint64_t sourceHash)
+{
+    struct stat sourceStat;
+    
+    if (stat(filePath.c_str(), &sourceStat) != 0)
+    {
+        return false;
+    }
+    
+    uint64_t numObjects = this->objectArray.size();
+    
+    vector<PCH_PList_IndexEntry> entries(numObjects);
+    vector<uint64_t> refs;
+    vector<uint64_t> keyObjects;
+    
+    for (uint64_t i=0; i<numObjects; i++)
+    {
+        PCH_PList_Entry *nextEntry = this->objectArray[i];
+        PCH_PList_IndexEntry &entry = entries[i];
+        
+        memset(&entry, 0, sizeof(entry));
+        entry.type = (uint8_t)nextEntry->entryType;
+        entry.dataSize = nextEntry->dataSize;
+        
+        switch (nextEntry->entryType)
+        {
+            case int64Type:
+            case uidType:
+            {
+                entry.value = (uint64_t)*(int64_t *)nextEntry->data;
+                break;
+            }
+                
+            case doubleType:
+            case dateType:
+            {
+                memcpy(&entry.value, nextEntry->data, sizeof(double));
+                break;
+            }
+                
+            case dataType:
+            case asciiStringType:
+            case unicodeStringType:
+            {
+                entry.value = this->payloadOffsets[i];
+                break;
+            }
+                
+            case arrayType:
+            case setType:
+            {
+                const vector<int64_t> &indices = *(vector<int64_t> *)nextEntry->data;
+                entry.value = refs.size();
+                refs.insert(refs.end(), indices.begin(), indices.end());
+                break;
+            }
+                
+            case dictType:
+            {
+                const vector<PCH_PList_Dict> &dict = *(vector<PCH_PList_Dict> *)nextEntry->data;
+                entry.value = refs.size();
+                
+                for (int j=0; j<dict.size(); j++)
+                {
+                    refs.push_back(dict[j].keyOffset);
+                    keyObjects.push_back(dict[j].keyOffset);
+                }
+                
+                for (int j=0; j<dict.size(); j++)
+                {
+                    refs.push_back(dict[j].valueOffset);
+                }
+                
+                break;
+            }
+                
+            default:
+                break;
+        }
+    }
+    
+    // The key hash table is an open-addressing table (linear probing) of every ASCII string that is used as a dictionary key
+    sort(keyObjects.begin(), keyObjects.end());
+    keyObjects.erase(unique(keyObjects.begin(), keyObjects.end()), keyObjects.end());
+    
+    uint64_t numSlots = 16;
+    
+    while (numSlots < 2 * keyObjects.size())
+    {
+        numSlots <<= 1;
+    }
+    
+    vector<PCH_PList_KeyHashSlot> slots(numSlots);
+    
+    for (uint64_t i=0; i<numSlots; i++)
+    {
+        slots[i].hash = 0;
+        slots[i].objectIndex = PCH_PLIST_INDEX_CACHE_EMPTY_SLOT;
+    }
+    
+    for (int i=0; i<keyObjects.size(); i++)
+    {
+        uint64_t objectIndex = keyObjects[i];
+        
+        if (objectIndex >= numObjects || this->objectArray[objectIndex]->entryType != asciiStringType)
+        {
+            continue;
+        }
+        
+        const string &key = *(string *)this->objectArray[objectIndex]->data;
+        uint64_t hash = PCH_FNV1aHash(key.data(), key.size());
+        uint64_t slot = hash & (numSlots - 1);
+        
+        while (slots[slot].objectIndex != PCH_PLIST_INDEX_CACHE_EMPTY_SLOT)
+        {
+            slot = (slot + 1) & (numSlots - 1);
+        }
+        
+        slots[slot].hash = hash;
+        slots[slot].objectIndex = objectIndex;
+    }
+    
+    PCH_PList_IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PCH_PLIST_INDEX_CACHE_MAGIC, sizeof(header.magic));
+    header.version = PCH_PLIST_INDEX_CACHE_VERSION;
+    header.byteOrderMark = PCH_PLIST_INDEX_CACHE_BOM;
+    header.sourceSize = fileLength;
+    header.sourceMTime = (int64_t)sourceStat.st_mtime;
+    header.sourceHash = sourceHash;
+    header.numObjects = numObjects;
+    header.topObject = this->topObject;
+    header.objectRefSize = this->objectRefSize;
+    header.entriesOffset = sizeof(header);
+    header.refsOffset = header.entriesOffset + numObjects * sizeof(PCH_PList_IndexEntry);
+    header.numRefs = refs.size();
+    header.keyHashOffset = header.refsOffset + refs.size() * sizeof(uint64_t);
+    header.numKeyHashSlots = numSlots;
+    
+    // write to a temporary file and rename it so that a reader never sees a half-written index
+    string indexPath = filePath + PCH_PLIST_INDEX_CACHE_EXTENSION;
+    string tempPath = indexPath + ".tmp";
+    
+    ofstream indexFile(tempPath.c_str(), ios::out | ios::binary | ios::trunc);
+    
+    if (!indexFile.is_open())
+    {
+        return false;
+    }
+    
+    indexFile.write((const char *)&header, sizeof(header));
+    indexFile.write((const char *)entries.data(), entries.size() * sizeof(PCH_PList_IndexEntry));
+    indexFile.write((const char *)refs.data(), refs.size() * sizeof(uint64_t));
+    indexFile.write((const char *)slots.data(), slots.size() * sizeof(PCH_PList_KeyHashSlot));
+    indexFile.close();
+    
+    if (indexFile.fail() || rename(tempPath.c_str(), indexPath.c_str()) != 0)
+    {
+        unlink(tempPath.c_str());
+        return false;
+    }
+    
+    return true;
+}
+
+int64_t PCH_PList::IndexOfStringObject(const string &str)
+{
+    uint64_t hash = PCH_FNV1aHash(str.data(), str.size());
+    
+    // use the key hash table from the sidecar index if we have one
+    if (this->indexCacheMapping != NULL)
+    {
+        const char *indexBytes = (const char *)this->indexCacheMapping;
+        const PCH_PList_IndexHeader *header = (const PCH_PList_IndexHeader *)indexBytes;
+        const PCH_PList_KeyHashSlot *slots = (const PCH_PList_KeyHashSlot *)(indexBytes + header->keyHashOffset);
+        uint64_t numSlots = header->numKeyHashSlots;
+        
+        for (uint64_t slot = hash & (numSlots - 1), probes = 0; probes < numSlots; slot = (slot + 1) & (numSlots - 1), probes++)
+        {
+            if (slots[slot].objectIndex == PCH_PLIST_INDEX_CACHE_EMPTY_SLOT)
+            {
+                break;
+            }
+            
+            uint64_t objectIndex = slots[slot].objectIndex;
+            
+            if (slots[slot].hash == hash && objectIndex < this->objectArray.size() && this->objectArray[objectIndex] != NULL && this->objectArray[objectIndex]->entryType == asciiStringType && ((string *)this->objectArray[objectIndex]->data)->compare(str) == 0)
+            {
+                return (int64_t)objectIndex;
+            }
+        }
+    }
+    
+    // otherwise (or if the string isn't a dictionary key), do it the hard way
+    for (int64_t i=0; i<this->objectArray.size(); i++)
+    {
+        if (this->objectArray[i] != NULL && this->objectArray[i]->entryType == asciiStringType && ((string *)this->objectArray[i]->data)->compare(str) == 0)
+        {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+string PCH_PList::UTF8FromUTF16(const wstring &uniString)
+{
+    string result;
+    result.reserve(uniString.size());
+    
+    for (size_t i=0; i<uniString.size(); i++)
+    {
+        uint32_t codePoint = (uint32_t)uniString[i] & 0xFFFF;
+        
+        // combine surrogate pairs
+        if (codePoint >= 0xD800 && codePoint <= 0xDBFF && i+1 < uniString.size())
+        {
+            uint32_t lowSurrogate = (uint32_t)uniString[i+1] & 0xFFFF;
+            
+            if (lowSurrogate >= 0xDC00 && lowSurrogate <= 0xDFFF)
+            {
+                codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (lowSurrogate - 0xDC00);
+                i++;
+            }
+        }
+        
+        if (codePoint < 0x80)
+        {
+            result += (char)codePoint;
+        }
+        else if (codePoint < 0x800)
+        {
+            result += (char)(0xC0 | (codePoint >> 6));
+            result += (char)(0x80 | (codePoint & 0x3F));
+        }
+        else if (codePoint < 0x10000)
+        {
+            result += (char)(0xE0 | (codePoint >> 12));
+            result += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+            result += (char)(0x80 | (codePoint & 0x3F));
+        }
+        else
+        {
+            result += (char)(0xF0 | (codePoint >> 18));
+            result += (char)(0x80 | ((codePoint >> 12) & 0x3F));
+            result += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+            result += (char)(0x80 | (codePoint & 0x3F));
+        }
+    }
+    
+    return result;
+}
+
+wstring PCH_PList::UTF16FromUTF8(const char *str, size_t length)
+{
+    wstring uniString;
+    uniString.reserve(length);
+    
+    const unsigned char *bytes = (const unsigned char *)str;
+    size_t i = 0;
+    
+    while (i < length)
+    {
+        uint32_t codePoint = bytes[i];
+        size_t numExtraBytes = 0;
+        
+        if (codePoint >= 0xF0)
+        {
+            codePoint &= 0x07;
+            numExtraBytes = 3;
+        }
+        else if (codePoint >= 0xE0)
+        {
+            codePoint &= 0x0F;
+            numExtraBytes = 2;
+        }
+        else if (codePoint >= 0xC0)
+        {
+            codePoint &= 0x1F;
+            numExtraBytes = 1;
+        }
+        
+        i++;
+        
+        for (size_t j=0; j<numExtraBytes && i<length; j++, i++)
+        {
+            codePoint = (codePoint << 6) | (bytes[i] & 0x3F);
+        }
+        
+        if (codePoint >= 0x10000)
+        {
+            codePoint -= 0x10000;
+            uniString += (wchar_t)(0xD800 + (codePoint >> 10));
+            uniString += (wchar_t)(0xDC00 + (codePoint & 0x3FF));
+        }
+        else
+        {
+            uniString += (wchar_t)codePoint;
+        }
+    }
+    
+    return uniString;
+}
+
+PCH_PList::ErrorType PCH_PList::SendFileEvents(string filePath, PCH_PListEventHandler &handler)
+{
+    int fd = open(filePath.c_str(), O_RDONLY);
+    
+    if (fd < 0)
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    struct stat fileStat;
+    
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+    {
+        close(fd);
+        return errorNotValidPlistFile;
+    }
+    
+    size_t fileLength = (size_t)fileStat.st_size;
+    
+    // The mapping is private and writable because the XML parser decodes in place. Only the pages that it actually changes are copied; the rest are shared with the file system cache.
+    char *fileBytes = (char *)mmap(NULL, fileLength, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    
+    if (fileBytes == MAP_FAILED)
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    ErrorType err;
+    
+    if (PCH_XMLPListParser::IsXMLPList(fileBytes, fileLength))
+    {
+        // the XML parser reads the file from start to end, so let the kernel read ahead
+        madvise(fileBytes, fileLength, MADV_SEQUENTIAL);
+        
+        err = PCH_XMLPListParser::Parse(fileBytes, fileLength, handler);
+    }
+    else
+    {
+        PCH_MemoryStreamBuf memBuf(fileBytes, fileLength);
+        istream memStream(&memBuf);
+        
+        PCH_PList reader;
+        uint64_t streamLength;
+        vector<char> offsetTableBytes;
+        
+        err = reader.ReadFileStructure(memStream, streamLength, offsetTableBytes);
+        
+        if (err == noError)
+        {
+            err = reader.SendObjectEvents(memStream, handler);
+        }
+    }
+    
+    munmap(fileBytes, fileLength);
+    
+    return err;
+}
+
+PCH_PList::ErrorType PCH_PList::SendObjectEvents(istream &pFile, PCH_PListEventHandler &handler)
+{
+    // The containers that are currently open, and the index of the next child to send from each. Each entry only holds the list of references of its container, so memory use depends on the depth of the plist.
+    struct OpenContainer
+    {
+        uint64_t index;
+        PCH_PList_Entry *entry;
+        int64_t nextChild;
+    };
+    
+    vector<OpenContainer> openContainers;
+    
+    // the objects in openContainers (a container that is reached again while it's open contains itself)
+    vector<bool> isOpen(this->offsetTable.size(), false);
+    
+    ErrorType err = noError;
+    uint64_t nextIndex = this->topObject;
+    
+    while (true)
+    {
+        if (nextIndex >= this->offsetTable.size())
+        {
+            err = errorNotValidPlistFile;
+            break;
+        }
+        
+        pFile.clear();
+        pFile.seekg(this->offsetTable[nextIndex]);
+        
+        PCH_PList_Entry *entry = NULL;
+        err = this->ReadObject(pFile, &entry);
+        
+        if (err != noError)
+        {
+            break;
+        }
+        
+        // send the object, or open it if it's a container
+        switch (entry->entryType)
+        {
+            case boolFalseType:
+            case boolTrueType:
+                handler.BoolValue(entry->entryType == boolTrueType);
+                break;
+                
+            case int64Type:
+                handler.IntValue(*(int64_t *)entry->data);
+                break;
+                
+            case doubleType:
+                handler.RealValue(*(double *)entry->data);
+                break;
+                
+            case dateType:
+                handler.DateValue(*(double *)entry->data);
+                break;
+                
+            case dataType:
+            {
+                const vector<char> *bytes = (const vector<char> *)entry->data;
+                handler.DataValue(bytes->data(), bytes->size());
+                break;
+            }
+                
+            case asciiStringType:
+            {
+                const string *str = (const string *)entry->data;
+                handler.StringValue(str->data(), str->size());
+                break;
+            }
+                
+            case unicodeStringType:
+            {
+                string str = PCH_PList::UTF8FromUTF16(*(const wstring *)entry->data);
+                handler.StringValue(str.data(), str.size());
+                break;
+            }
+                
+            case uidType:
+                handler.UidValue(*(int64_t *)entry->data);
+                break;
+                
+            case arrayType:
+                handler.BeginArray();
+                break;
+                
+            case setType:
+                handler.BeginSet();
+                break;
+            
+            case dictType:
+                handler.BeginDict();
+                break;
+                
+            default:
+                // null and fill objects are skipped
+                break;
+        }
+        
+        if (entry->entryType == arrayType || entry->entryType == setType || entry->entryType == dictType)
+        {
+            if (isOpen[nextIndex])
+            {
+                delete entry;
+                err = errorCyclicReference;
+                break;
+            }
+            
+            OpenContainer newContainer = {nextIndex, entry, 0};
+            openContainers.push_back(newContainer);
+            isOpen[nextIndex] = true;
+        }
+        else
+        {
+            delete entry;
+        }
+        
+        // find the next object to send, closing any containers that are finished
+        bool foundNext = false;
+        
+        while (!openContainers.empty() && !foundNext)
+        {
+            OpenContainer &container = openContainers.back();
+            
+            if (container.nextChild >= (int64_t)container.entry->dataSize)
+            {
+                if (container.entry->entryType == dictType)
+                {
+                    handler.EndDict();
+                }
+                else if (container.entry->entryType == setType)
+                {
+                    handler.EndSet();
+                }
+                else
+                {
+                    handler.EndArray();
+                }
+                
+                isOpen[container.index] = false;
+                delete container.entry;
+                openContainers.pop_back();
+                
+                continue;
+            }
+            
+            if (container.entry->entryType != dictType)
+            {
+                nextIndex = (*(vector<int64_t> *)container.entry->data)[container.nextChild];
+                container.nextChild++;
+                foundNext = true;
+                
+                continue;
+            }
+            
+            const PCH_PList_Dict &dictEntry = (*(vector<PCH_PList_Dict> *)container.entry->data)[container.nextChild];
+            container.nextChild++;
+            
+            // skip entries whose values can't be represented (this means peeking at the value's marker byte)
+            if (dictEntry.valueOffset >= this->offsetTable.size() || dictEntry.keyOffset >= this->offsetTable.size())
+            {
+                err = errorNotValidPlistFile;
+                break;
+            }
+            
+            pFile.clear();
+            pFile.seekg(this->offsetTable[dictEntry.valueOffset]);
+            
+            int valueMarker = pFile.peek();
+            
+            if (valueMarker == 0x00 || valueMarker == 0x0F)
+            {
+                continue;
+            }
+            
+            pFile.seekg(this->offsetTable[dictEntry.keyOffset]);
+            
+            PCH_PList_Entry *keyEntry = NULL;
+            err = this->ReadObject(pFile, &keyEntry);
+            
+            if (err != noError)
+            {
+                break;
+            }
+            
+            if (keyEntry->entryType == asciiStringType)
+            {
+                const string *key = (const string *)keyEntry->data;
+                handler.Key(key->data(), key->size());
+            }
+            else if (keyEntry->entryType == unicodeStringType)
+            {
+                string key = PCH_PList::UTF8FromUTF16(*(const wstring *)keyEntry->data);
+                handler.Key(key.data(), key.size());
+            }
+            else
+            {
+                err = errorNotValidPlistFile;
+            }
+            
+            delete keyEntry;
+            
+            nextIndex = dictEntry.valueOffset;
+            foundNext = (err == noError);
+        }
+        
+        if (!foundNext || err != noError)
+        {
+            break;
+        }
+    }
+    
+    // only left over if there was an error
+    for (int i=0; i<openContainers.size(); i++)
+    {
+        delete openContainers[i].entry;
+    }
+    
+    return err;
+}
+
+// An event handler that applies a list of PCH_PList_Update's to a plist as its events go by, and passes the result on to another handler. This is used when UpdateFile() or CompactFile() has to write a whole new file.
+class PCH_PListUpdateFilter : public PCH_PListEventHandler
+{
+public:
+    
+    PCH_PListUpdateFilter(const vector<PCH_PList_Update> &updates, PCH_PListEventHandler &target) : target(target)
+    {
+        this->skipDepth = 0;
+        
+        for (int i=0; i<updates.size(); i++)
+        {
+            UpdateNode *node = &this->updateRoot;
+            size_t componentStart = 0;
+            
+            while (componentStart <= updates[i].keyPath.size())
+            {
+                size_t componentEnd = updates[i].keyPath.find('.', componentStart);
+                
+                if (componentEnd == string::npos)
+                {
+                    componentEnd = updates[i].keyPath.size();
+                }
+                
+                node = &node->children[updates[i].keyPath.substr(componentStart, componentEnd - componentStart)];
+                componentStart = componentEnd + 1;
+            }
+            
+            // a later update of the same key path replaces an earlier one
+            node->hasUpdate = true;
+            node->value = updates[i].value;
+        }
+    }
+    
+    // Returns true if the parent container of every update was found
+    bool AllUpdatesApplied()
+    {
+        return this->AllUpdatesApplied(this->updateRoot);
+    }
+    
+    virtual void BeginDict()
+    {
+        if (this->BeginValue(true, true))
+        {
+            this->target.BeginDict();
+        }
+    }
+    
+    virtual void EndDict()
+    {
+        if (this->EndContainer())
+        {
+            this->target.EndDict();
+        }
+    }
+    
+    virtual void BeginArray()
+    {
+        if (this->BeginValue(true, false))
+        {
+            this->target.BeginArray();
+        }
+    }
+    
+    virtual void EndArray()
+    {
+        if (this->EndContainer())
+        {
+            this->target.EndArray();
+        }
+    }
+    
+    virtual void BeginSet()
+    {
+        if (this->BeginValue(true, false))
+        {
+            this->target.BeginSet();
+        }
+    }
+    
+    virtual void EndSet()
+    {
+        if (this->EndContainer())
+        {
+            this->target.EndSet();
+        }
+    }
+    
+    virtual void Key(const char *str, size_t length)
+    {
+        // the key is held back until we know whether its value is being kept
+        if (this->skipDepth == 0)
+        {
+            this->pendingKey.assign(str, length);
+        }
+    }
+    
+    virtual void StringValue(const char *str, size_t length)
+    {
+        if (this->BeginValue(false, false))
+        {
+            this->target.StringValue(str, length);
+        }
+    }
+    
+    virtual void DataValue(const char *bytes, size_t length)
+    {
+        if (this->BeginValue(false, false))
+        {
+            this->target.DataValue(bytes, length);
+        }
+    }
+    
+    virtual void IntValue(int64_t value)
+    {
+        if (this->BeginValue(false, false))
+        {
+            this->target.IntValue(value);
+        }
+    }
+    
+    virtual void RealValue(double value)
+    {
+        if (this->BeginValue(false, false))
+        {
+            this->target.RealValue(value);
+        }
+    }
+    
+    virtual void BoolValue(bool value)
+    {
+        if (this->BeginValue(false, false))
+        {
+            this->target.BoolValue(value);
+        }
+    }
+    
+    virtual void DateValue(double value)
+    {
+        if (this->BeginValue(false, false))
+        {
+            this->target.DateValue(value);
+        }
+    }
+    
+    virtual void UidValue(int64_t value)
+    {
+        if (this->BeginValue(false, false))
+        {
+            this->target.UidValue(value);
+        }
+    }
+    
+private:
+    
+    // the updates, arranged as a tree of key path components
+    struct UpdateNode
+    {
+        map<string, UpdateNode> children;
+        
+        bool hasUpdate = false;
+        bool applied = false;
+        const PCH_PList_Value *value = NULL;
+    };
+    
+    UpdateNode updateRoot;
+    
+    PCH_PListEventHandler &target;
+    
+    // the containers that are currently open, with the updates for their children (if there are any)
+    struct OpenContainer
+    {
+        UpdateNode *updates;
+        bool isDict;
+        uint64_t nextIndex;
+    };
+    
+    vector<OpenContainer> openContainers;
+    
+    // while this is non-zero, the events belong to a value that is being replaced or removed
+    int skipDepth;
+    
+    string pendingKey;
+    
+    bool AllUpdatesApplied(const UpdateNode &node)
+    {
+        if (node.hasUpdate && !node.applied)
+        {
+            return false;
+        }
+        
+        for (auto child = node.children.begin(); child != node.children.end(); child++)
+        {
+            if (!this->AllUpdatesApplied(child->second))
+            {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    // Called for every value; returns true if the value should be passed on (after its key, which is sent here)
+    bool BeginValue(bool isContainer, bool isDict)
+    {
+        if (this->skipDepth > 0)
+        {
+            if (isContainer)
+            {
+                this->skipDepth++;
+            }
+            
+            return false;
+        }
+        
+        UpdateNode *updates = NULL;
+        
+        if (this->openContainers.empty())
+        {
+            updates = &this->updateRoot;
+        }
+        else
+        {
+            OpenContainer &container = this->openContainers.back();
+            string name = (container.isDict ? this->pendingKey : to_string(container.nextIndex));
+            container.nextIndex++;
+            
+            if (container.updates != NULL)
+            {
+                auto child = container.updates->children.find(name);
+                
+                if (child != container.updates->children.end())
+                {
+                    updates = &child->second;
+                }
+            }
+            
+            // a value that is being replaced (or removed) is skipped, and the new value is sent in its place
+            if (updates != NULL && updates->hasUpdate)
+            {
+                updates->applied = true;
+                
+                if (isContainer)
+                {
+                    this->skipDepth = 1;
+                }
+                
+                if (updates->value != NULL)
+                {
+                    if (container.isDict)
+                    {
+                        this->target.Key(name.data(), name.size());
+                    }
+                    
+                    updates->value->SendEvents(this->target);
+                }
+                
+                return false;
+            }
+            
+            if (container.isDict)
+            {
+                this->target.Key(name.data(), name.size());
+            }
+        }
+        
+        if (isContainer)
+        {
+            OpenContainer newContainer = {updates, isDict, 0};
+            this->openContainers.push_back(newContainer);
+        }
+        
+        return true;
+    }
+    
+    // Called at the end of every container; returns true if the end should be passed on (after any values that are being added)
+    bool EndContainer()
+    {
+        if (this->skipDepth > 0)
+        {
+            this->skipDepth--;
+            return false;
+        }
+        
+        if (this->openContainers.empty())
+        {
+            return false;
+        }
+        
+        OpenContainer container = this->openContainers.back();
+        this->openContainers.pop_back();
+        
+        if (container.updates == NULL)
+        {
+            return true;
+        }
+        
+        if (container.isDict)
+        {
+            // keys that weren't in the dict are added (and removing a key that isn't there is done already)
+            for (auto child = container.updates->children.begin(); child != container.updates->children.end(); child++)
+            {
+                if (child->second.hasUpdate && !child->second.applied)
+                {
+                    child->second.applied = true;
+                    
+                    if (child->second.value != NULL)
+                    {
+                        this->target.Key(child->first.data(), child->first.size());
+                        child->second.value->SendEvents(this->target);
+                    }
+                }
+            }
+        }
+        else
+        {
+            // elements just past the end of an array are appended
+            auto child = container.updates->children.find(to_string(container.nextIndex));
+            
+            while (child != container.updates->children.end() && child->second.hasUpdate && child->second.value != NULL)
+            {
+                child->second.applied = true;
+                child->second.value->SendEvents(this->target);
+                
+                container.nextIndex++;
+                child = container.updates->children.find(to_string(container.nextIndex));
+            }
+        }
+        
+        return true;
+    }
+};
+
+// Returns the first copy of 'pattern' in [start, end), or NULL if there isn't one. The scan is driven by memchr() (which libc vectorizes), looking for the pattern's byte at 'anchor'. The caller picks a byte that isn't zero for the anchor, since zero bytes are everywhere in a binary plist.
+static const char *PCH_FindPattern(const char *start, const char *end, const string &pattern, size_t anchor)
+{
+    size_t patternLength = pattern.size();
+    
+    if (end - start < (ptrdiff_t)patternLength)
+    {
+        return NULL;
+    }
+    
+    // the anchor byte of the last possible match
+    const char *lastAnchor = end - patternLength + anchor;
+    const char *anchorPtr = start + anchor;
+    
+    while (anchorPtr <= lastAnchor)
+    {
+        anchorPtr = (const char *)memchr(anchorPtr, pattern[anchor], lastAnchor - anchorPtr + 1);
+        
+        if (anchorPtr == NULL)
+        {
+            return NULL;
+        }
+        
+        const char *candidate = anchorPtr - anchor;
+        
+        if (memcmp(candidate, pattern.data(), patternLength) == 0)
+        {
+            return candidate;
+        }
+        
+        anchorPtr++;
+    }
+    
+    return NULL;
+}
+
+// If the object at 'offset' has the type 'objectType' (the high nibble of its marker: 0x04 for data, 0x05 for an ASCII string or 0x06 for a UTF-16 string), set payloadStart and payloadLength to the position and length (in bytes) of its bytes or characters and return true
+static bool PCH_PayloadAt(const char *bytes, uint64_t length, uint64_t offset, uint8_t objectType, uint64_t &payloadStart, uint64_t &payloadLength)
+{
+    if (offset >= length)
+    {
+        return false;
+    }
+    
+    uint8_t marker = (uint8_t)bytes[offset];
+    
+    if ((marker >> 4) != objectType)
+    {
+        return false;
+    }
+    
+    uint64_t count = marker & 0x0F;
+    uint64_t position = offset + 1;
+    
+    // longer strings have their length in an int object after the marker
+    if (count == 0x0F)
+    {
+        uint64_t countLength;
+        
+        if (!PCH_ReadExtendedCount(bytes + position, length - position, count, countLength))
+        {
+            return false;
+        }
+        
+        position += countLength;
+    }
+    
+    uint64_t unitLength = (objectType == 0x06 ? 2 : 1);
+    
+    if (count > (length - position) / unitLength)
+    {
+        return false;
+    }
+    
+    payloadStart = position;
+    payloadLength = count * unitLength;
+    
+    return true;
+}
+
+PCH_PList::ErrorType PCH_PList::SearchFile(string filePath, const string &searchString, vector<PCH_PList_SearchHit> &hits)
+{
+    hits.clear();
+    
+    int fd = open(filePath.c_str(), O_RDONLY);
+    
+    if (fd < 0)
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    struct stat fileStat;
+    
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+    {
+        close(fd);
+        return errorNotValidPlistFile;
+    }
+    
+    size_t fileLength = (size_t)fileStat.st_size;
+    
+    const char *fileBytes = (const char *)mmap(NULL, fileLength, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    
+    if (fileBytes == MAP_FAILED)
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    if (PCH_XMLPListParser::IsXMLPList(fileBytes, fileLength))
+    {
+        munmap((void *)fileBytes, fileLength);
+        return errorNotValidPlistFile;
+    }
+    
+    PCH_MemoryStreamBuf memBuf(fileBytes, fileLength);
+    istream memStream(&memBuf);
+    
+    PCH_PList reader;
+    uint64_t streamLength;
+    vector<char> offsetTableBytes;
+    
+    ErrorType err = reader.ReadFileStructure(memStream, streamLength, offsetTableBytes);
+    
+    if (err != noError || searchString.empty())
+    {
+        munmap((void *)fileBytes, fileLength);
+        return err;
+    }
+    
+    // The forms of the string to look for: ASCII (which only ASCII strings can be stored as) and UTF-16BE. The anchor is the first byte that isn't zero.
+    struct SearchPattern
+    {
+        string bytes;
+        bool unicode;
+        size_t anchor;
+    };
+    
+    vector<SearchPattern> patterns;
+    
+    bool isAscii = true;
+    
+    for (int i=0; i<searchString.size() && isAscii; i++)
+    {
+        isAscii = ((unsigned char)searchString[i] < 0x80);
+    }
+    
+    if (isAscii)
+    {
+        patterns.push_back({searchString, false, 0});
+    }
+    
+    wstring utf16String = PCH_PList::UTF16FromUTF8(searchString.data(), searchString.size());
+    SearchPattern utf16Pattern = {string(), true, 0};
+    
+    for (int i=0; i<utf16String.size(); i++)
+    {
+        utf16Pattern.bytes.push_back((char)((utf16String[i] >> 8) & 0xFF));
+        utf16Pattern.bytes.push_back((char)(utf16String[i] & 0xFF));
+    }
+    
+    while (utf16Pattern.anchor + 1 < utf16Pattern.bytes.size() && utf16Pattern.bytes[utf16Pattern.anchor] == 0)
+    {
+        utf16Pattern.anchor++;
+    }
+    
+    if (!utf16Pattern.bytes.empty())
+    {
+        patterns.push_back(utf16Pattern);
+    }
+    
+    madvise((void *)fileBytes, fileLength, MADV_SEQUENTIAL);
+    
+    const char *objectsStart = fileBytes + PCH_PLIST_HEADER_LENGTH;
+    const char *objectsEnd = fileBytes + reader.offsetTableStart;
+    
+    // The objects sorted by position (to find the object that a match is in) and the objects that contain the string. They are only set up once there is a match, so a file without the string costs one scan per pattern.
+    vector<pair<uint64_t, uint64_t>> sortedOffsets;
+    vector<bool> isMatch;
+    bool foundMatch = false;
+    
+    for (int p=0; p<patterns.size(); p++)
+    {
+        const SearchPattern &pattern = patterns[p];
+        const char *searchPos = objectsStart;
+        const char *match;
+        
+        while ((match = PCH_FindPattern(searchPos, objectsEnd, pattern.bytes, pattern.anchor)) != NULL)
+        {
+            searchPos = match + 1;
+            
+            if (sortedOffsets.empty())
+            {
+                sortedOffsets.reserve(reader.offsetTable.size());
+                
+                for (uint64_t i=0; i<reader.offsetTable.size(); i++)
+                {
+                    sortedOffsets.push_back(make_pair(reader.offsetTable[i], i));
+                }
+                
+                sort(sortedOffsets.begin(), sortedOffsets.end());
+                isMatch.assign(reader.offsetTable.size(), false);
+            }
+            
+            uint64_t matchOffset = (uint64_t)(match - fileBytes);
+            
+            // the match is in the object that starts closest before it
+            auto object = upper_bound(sortedOffsets.begin(), sortedOffsets.end(), make_pair(matchOffset, UINT64_MAX));
+            
+            if (object == sortedOffsets.begin())
+            {
+                continue;
+            }
+            
+            object--;
+            
+            uint64_t payloadStart, payloadLength;
+            
+            if (!PCH_PayloadAt(fileBytes, fileLength, object->first, (pattern.unicode ? 0x06 : 0x05), payloadStart, payloadLength) || matchOffset < payloadStart || matchOffset + pattern.bytes.size() > payloadStart + payloadLength || (pattern.unicode && (matchOffset - payloadStart) % 2 != 0))
+            {
+                continue;
+            }
+            
+            // more than one object index can point at the same bytes
+            for (auto sameObject = object; sameObject->first == object->first; sameObject--)
+            {
+                isMatch[sameObject->second] = true;
+                
+                if (sameObject == sortedOffsets.begin())
+                {
+                    break;
+                }
+            }
+            
+            foundMatch = true;
+            
+            // the rest of this string doesn't need to be searched
+            searchPos = fileBytes + payloadStart + payloadLength;
+        }
+    }
+    
+    if (foundMatch)
+    {
+        err = reader.CollectSearchHits(memStream, isMatch, hits);
+    }
+    
+    munmap((void *)fileBytes, fileLength);
+    
+    return err;
+}
+
+PCH_PList::ErrorType PCH_PList::CollectSearchHits(istream &pFile, const vector<bool> &isMatch, vector<PCH_PList_SearchHit> &hits)
+{
+    uint64_t numObjects = this->offsetTable.size();
+    
+    if (isMatch[this->topObject])
+    {
+        hits.push_back({this->topObject, string(""), false});
+    }
+    
+    // The containers that are being walked, like in SendObjectEvents(). keyPath holds the path of the innermost one; each container remembers the length of its own path.
+    struct OpenContainer
+    {
+        uint64_t index;
+        PCH_PList_Entry *entry;
+        int64_t nextChild;
+        size_t pathLength;
+    };
+    
+    vector<OpenContainer> openContainers;
+    vector<bool> isOpen(numObjects, false);
+    string keyPath;
+    
+    ErrorType err = noError;
+    uint64_t containerIndex = this->topObject;
+    
+    while (true)
+    {
+        pFile.clear();
+        pFile.seekg(this->offsetTable[containerIndex]);
+        
+        PCH_PList_Entry *entry = NULL;
+        err = this->ReadObject(pFile, &entry);
+        
+        if (err != noError)
+        {
+            break;
+        }
+        
+        if (entry->entryType != arrayType && entry->entryType != setType && entry->entryType != dictType)
+        {
+            delete entry;
+        }
+        else if (isOpen[containerIndex])
+        {
+            delete entry;
+            err = errorCyclicReference;
+            break;
+        }
+        else
+        {
+            OpenContainer newContainer = {containerIndex, entry, 0, keyPath.size()};
+            openContainers.push_back(newContainer);
+            isOpen[containerIndex] = true;
+        }
+        
+        // find the next child that is a container, adding the hits on the way
+        bool foundNext = false;
+        
+        while (!openContainers.empty() && !foundNext && err == noError)
+        {
+            OpenContainer &container = openContainers.back();
+            
+            if (container.nextChild >= (int64_t)container.entry->dataSize)
+            {
+                isOpen[container.index] = false;
+                delete container.entry;
+                openContainers.pop_back();
+                
+                continue;
+            }
+            
+            bool isDict = (container.entry->entryType == dictType);
+            int64_t childPosition = container.nextChild;
+            int64_t keyIndex = -1;
+            int64_t childIndex;
+            
+            if (isDict)
+            {
+                const PCH_PList_Dict &dictEntry = (*(vector<PCH_PList_Dict> *)container.entry->data)[childPosition];
+                keyIndex = dictEntry.keyOffset;
+                childIndex = dictEntry.valueOffset;
+            }
+            else
+            {
+                childIndex = (*(vector<int64_t> *)container.entry->data)[childPosition];
+            }
+            
+            container.nextChild++;
+            
+            if (childIndex < 0 || (uint64_t)childIndex >= numObjects || keyIndex >= (int64_t)numObjects)
+            {
+                err = errorNotValidPlistFile;
+                break;
+            }
+            
+            // the child's marker byte says whether it's a container
+            pFile.clear();
+            pFile.seekg(this->offsetTable[childIndex]);
+            
+            int childType = pFile.peek() >> 4;
+            bool childIsContainer = (childType == 0x0A || childType == 0x0C || childType == 0x0D);
+            bool keyIsMatch = (keyIndex >= 0 && isMatch[keyIndex]);
+            
+            // the child's path is only worked out if it's needed
+            if (!childIsContainer && !isMatch[childIndex] && !keyIsMatch)
+            {
+                continue;
+            }
+            
+            keyPath.resize(container.pathLength);
+            
+            if (!keyPath.empty())
+            {
+                keyPath += ".";
+            }
+            
+            if (isDict)
+            {
+                pFile.clear();
+                pFile.seekg(this->offsetTable[keyIndex]);
+                
+                PCH_PList_Entry *keyEntry = NULL;
+                err = this->ReadObject(pFile, &keyEntry);
+                
+                if (err != noError)
+                {
+                    break;
+                }
+                
+                if (keyEntry->entryType == asciiStringType)
+                {
+                    keyPath += *(const string *)keyEntry->data;
+                }
+                else if (keyEntry->entryType == unicodeStringType)
+                {
+                    keyPath += PCH_PList::UTF8FromUTF16(*(const wstring *)keyEntry->data);
+                }
+                else
+                {
+                    err = errorNotValidPlistFile;
+                }
+                
+                delete keyEntry;
+                
+                if (err != noError)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                keyPath += to_string(childPosition);
+            }
+            
+            if (keyIsMatch)
+            {
+                hits.push_back({(uint64_t)keyIndex, keyPath, true});
+            }
+            
+            if (isMatch[childIndex])
+            {
+                hits.push_back({(uint64_t)childIndex, keyPath, false});
+            }
+            
+            if (childIsContainer)
+            {
+                containerIndex = childIndex;
+                foundNext = true;
+            }
+        }
+        
+        if (!foundNext || err != noError)
+        {
+            break;
+        }
+    }
+    
+    // only left over if there was an error
+    for (int i=0; i<openContainers.size(); i++)
+    {
+        delete openContainers[i].entry;
+    }
+    
+    return err;
+}
+
+PCH_PList::ErrorType PCH_PList::MapPayload(string filePath, const string &keyPath, const char *&fileBytes, size_t &fileLength, uint64_t &payloadStart, uint64_t &payloadLength)
+{
+    int fd = open(filePath.c_str(), O_RDONLY);
+    
+    if (fd < 0)
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    struct stat fileStat;
+    
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+    {
+        close(fd);
+        return errorNotValidPlistFile;
+    }
+    
+    fileLength = (size_t)fileStat.st_size;
+    
+    fileBytes = (const char *)mmap(NULL, fileLength, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    
+    if (fileBytes == MAP_FAILED)
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    if (PCH_XMLPListParser::IsXMLPList(fileBytes, fileLength))
+    {
+        munmap((void *)fileBytes, fileLength);
+        return errorNotValidPlistFile;
+    }
+    
+    PCH_MemoryStreamBuf memBuf(fileBytes, fileLength);
+    istream memStream(&memBuf);
+    
+    PCH_PList reader;
+    uint64_t streamLength;
+    vector<char> offsetTableBytes;
+    
+    ErrorType err = reader.ReadFileStructure(memStream, streamLength, offsetTableBytes);
+    
+    if (err != noError)
+    {
+        munmap((void *)fileBytes, fileLength);
+        return err;
+    }
+    
+    // Follow the key path the same way as UpdateFile() does: only the containers (and keys) on the way are decoded, and the object at the end isn't decoded at all
+    reader.objectArray.assign(reader.offsetTable.size(), NULL);
+    reader.lazyStream = &memStream;
+    
+    uint64_t objectIndex = reader.topObject;
+    size_t componentStart = 0;
+    
+    while (!keyPath.empty() && componentStart <= keyPath.size())
+    {
+        size_t componentEnd = keyPath.find('.', componentStart);
+        
+        if (componentEnd == string::npos)
+        {
+            componentEnd = keyPath.size();
+        }
+        
+        int64_t childIndex = reader.ChildIndex(objectIndex, keyPath.substr(componentStart, componentEnd - componentStart));
+        
+        if (childIndex < 0 || (uint64_t)childIndex >= reader.offsetTable.size())
+        {
+            err = errorKeyPathNotFound;
+            break;
+        }
+        
+        objectIndex = (uint64_t)childIndex;
+        componentStart = componentEnd + 1;
+    }
+    
+    reader.lazyStream = NULL;
+    
+    if (err == noError)
+    {
+        // the payload has to end before the offset table
+        uint64_t objectOffset = reader.offsetTable[objectIndex];
+        uint8_t objectType = (objectOffset < reader.offsetTableStart ? (uint8_t)fileBytes[objectOffset] >> 4 : 0);
+        
+        if (objectType != 0x04 && objectType != 0x05)
+        {
+            err = errorWrongObjectType;
+        }
+        else if (!PCH_PayloadAt(fileBytes, reader.offsetTableStart, objectOffset, objectType, payloadStart, payloadLength))
+        {
+            err = errorNotValidPlistFile;
+        }
+    }
+    
+    if (err != noError)
+    {
+        munmap((void *)fileBytes, fileLength);
+    }
+    
+    return err;
+}
+
+PCH_PList::ErrorType PCH_PList::ReadPayload(string filePath, const string &keyPath, const function<bool(const char *, size_t)> &sink)
+{
+    const char *fileBytes;
+    size_t fileLength;
+    uint64_t payloadStart;
+    uint64_t payloadLength;
+    
+    ErrorType err = PCH_PList::MapPayload(filePath, keyPath, fileBytes, fileLength, payloadStart, payloadLength);
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    madvise((void *)fileBytes, fileLength, MADV_SEQUENTIAL);
+    
+    for (uint64_t chunkStart=0; chunkStart<payloadLength; chunkStart+=PCH_PLIST_PAYLOAD_CHUNK_SIZE)
+    {
+        size_t chunkLength = (size_t)min((uint64_t)PCH_PLIST_PAYLOAD_CHUNK_SIZE, payloadLength - chunkStart);
+        
+        if (!sink(fileBytes + payloadStart + chunkStart, chunkLength))
+        {
+            break;
+        }
+    }
+    
+    munmap((void *)fileBytes, fileLength);
+    
+    return noError;
+}
+
+PCH_PList::ErrorType PCH_PList::CopyPayload(string filePath, const string &keyPath, int fd)
+{
+    bool writeFailed = false;
+    
+    ErrorType err = PCH_PList::ReadPayload(filePath, keyPath, [fd, &writeFailed](const char *bytes, size_t length)
+    {
+        // write() can stop short (eg: on a pipe or socket), so keep going until the whole chunk is written
+        while (length > 0)
+        {
+            ssize_t numWritten = write(fd, bytes, length);
+            
+            if (numWritten < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                
+                writeFailed = true;
+                return false;
+            }
+            
+            bytes += numWritten;
+            length -= (size_t)numWritten;
+        }
+        
+        return true;
+    });
+    
+    if (err == noError && writeFailed)
+    {
+        return errorCouldNotWriteFile;
+    }
+    
+    return err;
+}
+
+PCH_PList::ErrorType PCH_PList::CopyPayload(string filePath, const string &keyPath, char *buffer, size_t bufferSize, uint64_t &payloadLength)
+{
+    const char *fileBytes;
+    size_t fileLength;
+    uint64_t payloadStart;
+    
+    payloadLength = 0;
+    
+    ErrorType err = PCH_PList::MapPayload(filePath, keyPath, fileBytes, fileLength, payloadStart, payloadLength);
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    if (payloadLength > bufferSize)
+    {
+        err = errorBufferTooSmall;
+    }
+    else
+    {
+        memcpy(buffer, fileBytes + payloadStart, (size_t)payloadLength);
+    }
+    
+    munmap((void *)fileBytes, fileLength);
+    
+    return err;
+}
+
+int64_t PCH_PList::ChildIndex(uint64_t containerIndex, const string &name)
+{
+    PCH_PList_Entry *container = this->EntryAtIndex(containerIndex);
+    
+    if (container == NULL)
+    {
+        return -1;
+    }
+    
+    if (container->entryType == dictType)
+    {
+        const vector<PCH_PList_Dict> &dict = *(vector<PCH_PList_Dict> *)container->data;
+        
+        for (int i=0; i<dict.size(); i++)
+        {
+            PCH_PList_Entry *keyEntry = this->EntryAtIndex(dict[i].keyOffset);
+            
+            if (keyEntry == NULL)
+            {
+                continue;
+            }
+            
+            if ((keyEntry->entryType == asciiStringType && *(string *)keyEntry->data == name) || (keyEntry->entryType == unicodeStringType && PCH_PList::UTF8FromUTF16(*(wstring *)keyEntry->data) == name))
+            {
+                return (int64_t)dict[i].valueOffset;
+            }
+        }
+    }
+    else if (container->entryType == arrayType || container->entryType == setType)
+    {
+        const vector<int64_t> &elements = *(vector<int64_t> *)container->data;
+        
+        char *endPtr = NULL;
+        unsigned long long elementIndex = strtoull(name.c_str(), &endPtr, 10);
+        
+        if (!name.empty() && *endPtr == 0 && elementIndex < elements.size())
+        {
+            return elements[elementIndex];
+        }
+    }
+    
+    return -1;
+}
+
+PCH_PList::ErrorType PCH_PList::ApplyUpdate(const PCH_PList_Update &update, PCH_BinaryPListWriter &writer, vector<uint64_t> &changedContainers)
+{
+    // split the key path into its components
+    vector<string> components;
+    size_t componentStart = 0;
+    
+    while (componentStart <= update.keyPath.size())
+    {
+        size_t componentEnd = update.keyPath.find('.', componentStart);
+        
+        if (componentEnd == string::npos)
+        {
+            componentEnd = update.keyPath.size();
+        }
+        
+        components.push_back(update.keyPath.substr(componentStart, componentEnd - componentStart));
+        componentStart = componentEnd + 1;
+    }
+    
+    // find the container that holds the value
+    uint64_t containerIndex = this->topObject;
+    
+    for (int i=0; i<components.size()-1; i++)
+    {
+        int64_t childIndex = this->ChildIndex(containerIndex, components[i]);
+        
+        if (childIndex < 0)
+        {
+            return errorKeyPathNotFound;
+        }
+        
+        containerIndex = (uint64_t)childIndex;
+    }
+    
+    PCH_PList_Entry *container = this->EntryAtIndex(containerIndex);
+    
+    if (container == NULL || (container->entryType != dictType && container->entryType != arrayType && container->entryType != setType))
+    {
+        return errorKeyPathNotFound;
+    }
+    
+    // write the new value
+    int64_t newValueIndex = -1;
+    
+    if (update.value != NULL)
+    {
+        // there is no XML (or event) equivalent of null
+        if (update.value->valueType == PCH_PList_Value::Null)
+        {
+            return errorUnknownObjectType;
+        }
+        
+        update.value->SendEvents(writer);
+        newValueIndex = (int64_t)writer.lastTopLevelObject;
+    }
+    
+    const string &name = components.back();
+    
+    if (container->entryType == dictType)
+    {
+        vector<PCH_PList_Dict> &dict = *(vector<PCH_PList_Dict> *)container->data;
+        
+        int keyPosition = -1;
+        
+        for (int i=0; i<dict.size() && keyPosition < 0; i++)
+        {
+            PCH_PList_Entry *keyEntry = this->EntryAtIndex(dict[i].keyOffset);
+            
+            if (keyEntry != NULL && ((keyEntry->entryType == asciiStringType && *(string *)keyEntry->data == name) || (keyEntry->entryType == unicodeStringType && PCH_PList::UTF8FromUTF16(*(wstring *)keyEntry->data) == name)))
+            {
+                keyPosition = i;
+            }
+        }
+        
+        if (keyPosition >= 0 && newValueIndex >= 0)
+        {
+            dict[keyPosition].valueOffset = newValueIndex;
+        }
+        else if (keyPosition >= 0)
+        {
+            dict.erase(dict.begin() + keyPosition);
+        }
+        else if (newValueIndex >= 0)
+        {
+            // a new key (which is just a string object)
+            writer.StringValue(name.data(), name.size());
+            dict.push_back(PCH_PList_Dict(writer.lastTopLevelObject, newValueIndex));
+        }
+        else
+        {
+            // removing a key that isn't there
+            return noError;
+        }
+        
+        container->dataSize = dict.size();
+    }
+    else
+    {
+        vector<int64_t> &elements = *(vector<int64_t> *)container->data;
+        
+        char *endPtr = NULL;
+        unsigned long long elementIndex = strtoull(name.c_str(), &endPtr, 10);
+        
+        if (name.empty() || *endPtr != 0 || elementIndex > elements.size() || (elementIndex == elements.size() && newValueIndex < 0))
+        {
+            return errorKeyPathNotFound;
+        }
+        
+        if (elementIndex == elements.size())
+        {
+            elements.push_back(newValueIndex);
+        }
+        else if (newValueIndex >= 0)
+        {
+            elements[elementIndex] = newValueIndex;
+        }
+        else
+        {
+            elements.erase(elements.begin() + elementIndex);
+        }
+        
+        container->dataSize = elements.size();
+    }
+    
+    changedContainers.push_back(containerIndex);
+    
+    return noError;
+}
+
+PCH_PList::ErrorType PCH_PList::UpdateFile(string filePath, const vector<PCH_PList_Update> &updates)
+{
+    ifstream pFile;
+    
+    pFile.open(filePath.c_str(), ios::in | ios::binary);
+    
+    if (!pFile.is_open())
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    PCH_PList reader;
+    uint64_t fileLength;
+    vector<char> offsetTableBytes;
+    
+    ErrorType err = reader.ReadFileStructure(pFile, fileLength, offsetTableBytes);
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    // Only the objects on the key paths are decoded (the same way as for projections). The new objects are collected in memory and written over the old offset table at the end, so nothing in the file changes until everything has worked.
+    uint64_t numObjects = reader.offsetTable.size();
+    reader.objectArray.assign(numObjects, NULL);
+    reader.lazyStream = &pFile;
+    
+    ostringstream newBytes;
+    PCH_BinaryPListWriter writer(newBytes, reader.objectRefSize, numObjects, reader.offsetTableStart);
+    
+    vector<uint64_t> changedContainers;
+    
+    for (int i=0; i<updates.size() && err == noError; i++)
+    {
+        err = reader.ApplyUpdate(updates[i], writer, changedContainers);
+    }
+    
+    reader.lazyStream = NULL;
+    pFile.close();
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    // each changed dict or array is written once, with all of its changes
+    sort(changedContainers.begin(), changedContainers.end());
+    changedContainers.erase(unique(changedContainers.begin(), changedContainers.end()), changedContainers.end());
+    
+    for (int i=0; i<changedContainers.size(); i++)
+    {
+        PCH_PList_Entry *container = reader.objectArray[changedContainers[i]];
+        vector<uint64_t> keyRefs;
+        vector<uint64_t> valueRefs;
+        
+        if (container->entryType == dictType)
+        {
+            const vector<PCH_PList_Dict> &dict = *(vector<PCH_PList_Dict> *)container->data;
+            
+            for (int j=0; j<dict.size(); j++)
+            {
+                keyRefs.push_back(dict[j].keyOffset);
+                valueRefs.push_back(dict[j].valueOffset);
             }
         }
+        else
+        {
+            const vector<int64_t> &elements = *(vector<int64_t> *)container->data;
+            valueRefs.assign(elements.begin(), elements.end());
+        }
+        
+        writer.RewriteContainer(changedContainers[i], container->entryType == dictType, keyRefs, valueRefs);
+    }
+    
+    // if the references are too small for the new objects, the whole file has to be written again
+    if (writer.tooManyObjects)
+    {
+        return PCH_PList::RewriteFile(filePath, updates);
+    }
+    
+    err = writer.Finish(reader.offsetTable, reader.topObject);
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    string updateBytes = newBytes.str();
+    
+    int fd = open(filePath.c_str(), O_WRONLY);
+    
+    if (fd < 0)
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    size_t numWritten = 0;
+    
+    while (numWritten < updateBytes.size())
+    {
+        ssize_t result = pwrite(fd, updateBytes.data() + numWritten, updateBytes.size() - numWritten, (off_t)(reader.offsetTableStart + numWritten));
+        
+        if (result <= 0)
+        {
+            close(fd);
+            return errorCouldNotWriteFile;
+        }
+        
+        numWritten += result;
+    }
+    
+    // the old offset table and trailer may have been longer than what replaced them
+    if (ftruncate(fd, (off_t)(reader.offsetTableStart + updateBytes.size())) != 0 || fsync(fd) != 0)
+    {
+        close(fd);
+        return errorCouldNotWriteFile;
+    }
+    
+    close(fd);
+    
+    return noError;
+}
+
+PCH_PList::ErrorType PCH_PList::CompactFile(string filePath)
+{
+    return PCH_PList::RewriteFile(filePath, vector<PCH_PList_Update>());
+}
+
+PCH_PList::ErrorType PCH_PList::RewriteFile(string filePath, const vector<PCH_PList_Update> &updates)
+{
+    // this is only for binary plists (an XML file would silently become a binary one)
+    ifstream pFile;
+    
+    pFile.open(filePath.c_str(), ios::in | ios::binary);
+    
+    if (!pFile.is_open())
+    {
+        return errorCouldNotOpenFile;
+    }
+    
+    char header[PCH_PLIST_HEADER_LENGTH] = {0};
+    pFile.read(header, PCH_PLIST_HEADER_LENGTH);
+    pFile.close();
+    
+    if (strncmp(header, "bplist", 6) != 0)
+    {
+        cerr << "This is not a valid plist file";
+        return errorNotValidPlistFile;
+    }
+    
+    // the writer needs to know how many objects there will be
+    PCH_PListObjectCounter counter;
+    PCH_PListUpdateFilter countingFilter(updates, counter);
+    
+    ErrorType err = PCH_PList::SendFileEvents(filePath, countingFilter);
+    
+    if (err != noError)
+    {
+        return err;
+    }
+    
+    if (!countingFilter.AllUpdatesApplied())
+    {
+        return errorKeyPathNotFound;
+    }
+    
+    // write the new file next to the old one, so that it can be renamed over it
+    vector<char> tempPath(filePath.begin(), filePath.end());
+    const char *tempSuffix = ".XXXXXX";
+    tempPath.insert(tempPath.end(), tempSuffix, tempSuffix + strlen(tempSuffix) + 1);
+    
+    int fd = mkstemp(tempPath.data());
+    
+    if (fd < 0)
+    {
+        return errorCouldNotWriteFile;
+    }
+    
+    // keep the permissions of the original file
+    struct stat fileStat;
+    
+    if (stat(filePath.c_str(), &fileStat) == 0)
+    {
+        fchmod(fd, fileStat.st_mode & 07777);
+    }
+    
+    close(fd);
+    
+    {
+        vector<char> outBuffer(1024 * 1024);
+        ofstream outFile;
+        
+        outFile.rdbuf()->pubsetbuf(outBuffer.data(), outBuffer.size());
+        outFile.open(tempPath.data(), ios::out | ios::binary | ios::trunc);
+        
+        PCH_BinaryPListWriter writer(outFile, counter.numObjects);
+        PCH_PListUpdateFilter filter(updates, writer);
+        
+        err = PCH_PList::SendFileEvents(filePath, filter);
+        
+        if (err == noError)
+        {
+            err = writer.Finish();
+        }
     }
     
-    cout << "Done reading objects" << endl << endl;
+    if (err == noError && rename(tempPath.data(), filePath.c_str()) != 0)
+    {
+        err = errorCouldNotWriteFile;
+    }
     
-    this->plistRoot = GetValue(this->objectArray[0]);
+    if (err != noError)
+    {
+        unlink(tempPath.data());
+    }
     
-    cout << "Done creating plist tree" << endl;
+    return err;
+}
+
+PCH_PList_Value *PCH_PList_Value::ValueForStringKey(const vector<dictStruct> &dict, const string &key)
+{
+    for (const dictStruct &nextEntry : dict)
+    {
+        if (nextEntry.key->valueType == PCH_PList_Value::AsciiString)
+        {
+            if (nextEntry.key->value.asciiStringValue->compare(key) == 0)
+            {
+                return nextEntry.val;
+            }
+        }
+    }
     
-    return noError;
+    // if we get here, there was no match, return NULL
+    return nullptr;
 }
 
-void PCH_PList::TraversePlist(ostream& outStream)
+const vector<PCH_PList_Value *> &PCH_PList_Value::Elements() const
 {
-    outStream << "<plist>" << endl;
+    static const vector<PCH_PList_Value *> noElements;
     
-    TraverseNode(outStream, this->plistRoot, 1);
+    if (this->valueType == Array)
+    {
+        return *this->value.arrayValue;
+    }
+    else if (this->valueType == Set)
+    {
+        return *this->value.setValue;
+    }
     
-    outStream << "</plist>" << endl;
+    return noElements;
 }
 
-void PCH_PList::TraverseNode(ostream& outStream, PCH_PList_Value *node, int numTabs)
+const vector<PCH_PList_Value::dictStruct> &PCH_PList_Value::Entries() const
 {
-    string tabSpaces = string(this->numSpacesPerTab, ' ');
-    string indentSpaces = string(numTabs * this->numSpacesPerTab, ' ');
+    static const vector<dictStruct> noEntries;
     
-    switch (node->valueType)
+    if (this->valueType == Dict)
     {
-        case PCH_PList_Value::Bool:
+        return *this->value.dictValue;
+    }
+    
+    return noEntries;
+}
+
+void PCH_PList_Value::PrintKeys(const vector<dictStruct> &dict)
+{
+    for (int i=0; i<dict.size(); i++)
+    {
+        const dictStruct &nextEntry = dict.at(i);
+        
+        if (nextEntry.key->valueType == PCH_PList_Value::AsciiString)
         {
-            outStream << indentSpaces << "<bool>" << endl;
-            
-            if (node->value.boolValue)
-            {
-                outStream << indentSpaces << tabSpaces << "TRUE" << endl;
-            }
-            else
-            {
-                outStream << indentSpaces << tabSpaces << "FALSE" << endl;
-            }
-            
-            outStream << indentSpaces << "</bool>" << endl;
-            
-            break;
+            cout << "Key#" << i << ": " << nextEntry.key->value.asciiStringValue->c_str() << endl;
+        }
+    }
+    
+    cout << endl;
+}
+
+// The visitor used by PCH_PList_Value::SendEvents()
+class PCH_PListEventSender : public PCH_PListValueVisitor
+{
+public:
+    
+    PCH_PListEventSender(PCH_PListEventHandler &handler) : handler(handler), skipNextValue(false) {}
+    
+    virtual bool BeginValue(const PCH_PList_Value *value, Role role, size_t depth);
+    virtual void EndValue(const PCH_PList_Value *value, Role role, size_t depth);
+    
+private:
+    
+    PCH_PListEventHandler &handler;
+    
+    // set when a dict key isn't a string, so that its value is skipped too
+    bool skipNextValue;
+};
+
+bool PCH_PListEventSender::BeginValue(const PCH_PList_Value *value, Role role, size_t depth)
+{
+    if (role == dictKey)
+    {
+        // keys are always strings
+        if (value->valueType == PCH_PList_Value::AsciiString)
+        {
+            this->handler.Key(value->value.asciiStringValue->data(), value->value.asciiStringValue->size());
+        }
+        else if (value->valueType == PCH_PList_Value::UnicodeString)
+        {
+            string key = PCH_PList::UTF8FromUTF16(*value->value.uniStringValue);
+            this->handler.Key(key.data(), key.size());
+        }
+        else
+        {
+            this->skipNextValue = true;
         }
         
+        return false;
+    }
+    
+    if (role == dictValue && this->skipNextValue)
+    {
+        this->skipNextValue = false;
+        return false;
+    }
+    
+    switch (value->valueType)
+    {
+        case PCH_PList_Value::Bool:
+            this->handler.BoolValue(value->value.boolValue);
+            break;
+        
         case PCH_PList_Value::Int:
-        {
-            outStream << indentSpaces << "<int>" << endl;
-            
-            outStream << indentSpaces << tabSpaces << node->value.intValue << endl;
-            
-            outStream << indentSpaces << "</int>" << endl;
-            
+            this->handler.IntValue(value->value.intValue);
             break;
-        }
-            
+        
         case PCH_PList_Value::Double:
-        {
-            outStream << indentSpaces << "<double>" << endl;
-            
-            outStream << indentSpaces << tabSpaces << node->value.doubleValue << endl;
-            
-            outStream << indentSpaces << "</double>" << endl;
-            
+            this->handler.RealValue(value->value.doubleValue);
             break;
-        }
-            
+        
         case PCH_PList_Value::Date:
-        {
-            outStream << indentSpaces << "<date>" << endl;
-            
-            outStream << indentSpaces << tabSpaces << node->value.dateValue << endl;
-            
-            outStream << indentSpaces << "</date>" << endl;
-            
+            this->handler.DateValue(value->value.dateValue);
             break;
-        }
-            
+        
+        case PCH_PList_Value::Data:
+            this->handler.DataValue(value->value.dataValue->data(), value->value.dataValue->size());
+            break;
+        
         case PCH_PList_Value::AsciiString:
-        {
-            outStream << indentSpaces << "<ascii-string>" << endl;
-            
-            outStream << indentSpaces << tabSpaces << node->value.asciiStringValue->c_str() << endl;
-            
-            outStream << indentSpaces << "</ascii-string>" << endl;
-            
+            this->handler.StringValue(value->value.asciiStringValue->data(), value->value.asciiStringValue->size());
             break;
-        }
         
         case PCH_PList_Value::UnicodeString:
         {
-            outStream << indentSpaces << "<unicode-string>" << endl;
-            
-            outStream << indentSpaces << tabSpaces << node->value.uniStringValue->c_str() << endl;
-            
-            outStream << indentSpaces << "</unicode-string>" << endl;
-            
-            break;
-        }
-            
-        case PCH_PList_Value::Data:
-        {
-            outStream << indentSpaces << "<data>" << endl;
-            
-            outStream << indentSpaces << tabSpaces;
-            
-            for (int i=0; i<node->value.dataValue->size(); i++)
-            {
-                outStream << hex << setfill('0') << setw(2) << node->value.dataValue->at(i);
-            }
-            
-            outStream << endl;
-            
-            outStream << indentSpaces << "</data>" << endl;
-            
+            string str = PCH_PList::UTF8FromUTF16(*value->value.uniStringValue);
+            this->handler.StringValue(str.data(), str.size());
             break;
         }
-            
+        
         case PCH_PList_Value::Uid:
-        {
-            outStream << indentSpaces << "<UID>" << endl;
-            
-            outStream << indentSpaces << tabSpaces << node->value.uidValue << endl;
-            
-            outStream << indentSpaces << "</UID>" << endl;
-            
+            this->handler.UidValue(value->value.uidValue);
             break;
-        }
-            
+        
         case PCH_PList_Value::Array:
-        {
-            outStream << indentSpaces << "<array>" << endl;
-            
-            int newTabs = numTabs + 1;
-            
-            for (int i=0; i<node->value.arrayValue->size(); i++)
-            {
-                TraverseNode(outStream, node->value.arrayValue->at(i), newTabs);
-            }
-            
-            outStream << indentSpaces << "</array>" << endl;
-            
+            this->handler.BeginArray();
             break;
-        }
-            
+        
         case PCH_PList_Value::Set:
+            this->handler.BeginSet();
+            break;
+        
+        case PCH_PList_Value::Dict:
+            this->handler.BeginDict();
+            break;
+        
+        case PCH_PList_Value::IntArray:
         {
-            outStream << indentSpaces << "<set>" << endl;
+            this->handler.BeginArray();
             
-            int newTabs = numTabs + 1;
-            
-            for (int i=0; i<node->value.setValue->size(); i++)
+            for (int64_t number : value->Ints())
             {
-                TraverseNode(outStream, node->value.setValue->at(i), newTabs);
+                this->handler.IntValue(number);
             }
             
-            outStream << indentSpaces << "</set>" << endl;
-            
+            this->handler.EndArray();
             break;
         }
-            
-        case PCH_PList_Value::Dict:
+        
+        case PCH_PList_Value::DoubleArray:
         {
-            outStream << indentSpaces << "<dict>" << endl;
-            
-            string keyValSpaces = indentSpaces + tabSpaces;
-            int newTabs = numTabs + 2;
+            this->handler.BeginArray();
             
-            for (int i=0; i<node->value.dictValue->size(); i++)
+            for (double number : value->Doubles())
             {
-                PCH_PList_Value::dictStruct nextDictEntry = node->value.dictValue->at(i);
-                
-                // used for analyzing NSKeyedArchive plists
-                if (nextDictEntry.key->valueType != PCH_PList_Value::pch_value_type::AsciiString)
-                {
-                    cerr << "Got a non-string dictionary key" << endl;
-                }
-                
-                outStream << keyValSpaces << "<key>" << endl;
-                
-                TraverseNode(outStream, nextDictEntry.key, newTabs);
-                
-                outStream << keyValSpaces << "</key>" << endl;
-                
-                outStream << keyValSpaces << "<value>" << endl;
-                
-                TraverseNode(outStream, nextDictEntry.val, newTabs);
-                
-                outStream << keyValSpaces << "</value>" << endl;
+                this->handler.RealValue(number);
             }
             
-            outStream << indentSpaces << "</dict>" << endl;
-            
+            this->handler.EndArray();
             break;
         }
-            
+        
         default:
-        {
             break;
-        }
     }
+    
+    return true;
 }
 
-PCH_PList_Value *PCH_PList::GetValue(PCH_PList_Entry *entry)
+void PCH_PListEventSender::EndValue(const PCH_PList_Value *value, Role role, size_t depth)
 {
-    auto entryType = entry->entryType;
+    if (value->valueType == PCH_PList_Value::Array)
+    {
+        this->handler.EndArray();
+    }
+    else if (value->valueType == PCH_PList_Value::Set)
+    {
+        this->handler.EndSet();
+    }
+    else if (value->valueType == PCH_PList_Value::Dict)
+    {
+        this->handler.EndDict();
+    }
+}
+
+void PCH_PList_Value::SendEvents(PCH_PListEventHandler &handler) const
+{
+    PCH_PListEventSender sender(handler);
     
-    auto result = new PCH_PList_Value;
+    PCH_PListTreeWalker walker;
+    walker.Walk(this, sender);
+}
+
+PCH_PList_Value::PCH_PList_Value(PCH_PList_Value &&other)
+{
+    this->valueType = other.valueType;
+    this->value = other.value;
     
-    switch (entryType) {
-            
-        case boolTrueType:
-        {
-            result->valueType = PCH_PList_Value::pch_value_type::Bool;
-            result->value.boolValue = true;
+    other.valueType = Null;
+}
 
-            break;
-        }
-           
-        case boolFalseType:
-        {
-            result->valueType = PCH_PList_Value::pch_value_type::Bool;
-            result->value.boolValue = false;
-            
-            break;
-        }
-            
-        case int64Type:
-        {
-            result->valueType = PCH_PList_Value::pch_value_type::Int;
-            result->value.intValue = *(int64_t*)(entry->data);
-            
-            break;
-        }
-            
-        case dateType:
+PCH_PList_Value &PCH_PList_Value::operator=(PCH_PList_Value &&other)
+{
+    if (this != &other)
+    {
+        this->Clear();
+        
+        this->valueType = other.valueType;
+        this->value = other.value;
+        
+        other.valueType = Null;
+    }
+    
+    return *this;
+}
+
+// The visitor used by PCH_PList_Value::Clone(). Each value is copied when it's reached; containers are copied empty and their children are added as they are reached.
+class PCH_PListCloner : public PCH_PListValueVisitor
+{
+public:
+    
+    PCH_PList_Value *result;
+    
+    PCH_PListCloner() {this->result = NULL;}
+    
+    virtual bool BeginValue(const PCH_PList_Value *value, Role role, size_t depth);
+    virtual void EndValue(const PCH_PList_Value *value, Role role, size_t depth);
+    
+private:
+    
+    // the copies of the containers that are being walked
+    vector<PCH_PList_Value *> openCopies;
+};
+
+bool PCH_PListCloner::BeginValue(const PCH_PList_Value *value, Role role, size_t depth)
+{
+    auto copy = new PCH_PList_Value;
+    copy->valueType = value->valueType;
+    
+    switch (value->valueType)
+    {
+        case PCH_PList_Value::Data:
         {
-            result->valueType = PCH_PList_Value::pch_value_type::Date;
-            result->value.dateValue = *(double*)(entry->data);
-            
+            copy->value.dataValue = new vector<char>(*value->value.dataValue);
             break;
         }
             
-        case doubleType:
+        case PCH_PList_Value::AsciiString:
         {
-            result->valueType = PCH_PList_Value::pch_value_type::Double;
-            result->value.doubleValue = *(double*)(entry->data);
-            
+            copy->value.asciiStringValue = new string(*value->value.asciiStringValue);
             break;
         }
             
-        case dataType:
+        case PCH_PList_Value::UnicodeString:
         {
-            result->valueType = PCH_PList_Value::pch_value_type::Data;
-            char *bytePtr = (char *)entry->data;
-            // this method comes from the "Initializing from an array" part of https://www.geeksforgeeks.org/initialize-a-vector-in-cpp-different-ways/
-            result->value.dataValue = new vector<char>(bytePtr, bytePtr+entry->dataSize);
-            
+            copy->value.uniStringValue = new wstring(*value->value.uniStringValue);
             break;
         }
             
-        case asciiStringType:
+        case PCH_PList_Value::Array:
+        case PCH_PList_Value::Set:
         {
-            result->valueType = PCH_PList_Value::pch_value_type::AsciiString;
-            result->value.asciiStringValue = new string(*(string *)entry->data);
+            vector<PCH_PList_Value *> *newElements = new vector<PCH_PList_Value *>();
+            newElements->reserve(value->Elements().size());
             
-            break;
-        }
-        
-        case unicodeStringType:
-        {
-            result->valueType = PCH_PList_Value::pch_value_type::UnicodeString;
-            result->value.uniStringValue = new wstring(*(wstring *)entry->data);
+            if (value->valueType == PCH_PList_Value::Array)
+            {
+                copy->value.arrayValue = newElements;
+            }
+            else
+            {
+                copy->value.setValue = newElements;
+            }
             
             break;
         }
             
-        case uidType:
+        case PCH_PList_Value::Dict:
         {
-            result->valueType = PCH_PList_Value::pch_value_type::Uid;
-            result->value.uidValue = *(int64_t*)(entry->data);
+            copy->value.dictValue = new vector<PCH_PList_Value::dictStruct>();
+            copy->value.dictValue->reserve(value->Entries().size());
             
             break;
         }
             
-        case arrayType:
+        case PCH_PList_Value::IntArray:
         {
-            result->valueType = PCH_PList_Value::pch_value_type::Array;
-            
-            result->value.arrayValue = new vector<PCH_PList_Value *>();
-            
-            vector<int64_t> indices = *(vector<int64_t> *)entry->data;
-            
-            for (int i=0; i<entry->dataSize; i++)
-            {
-                PCH_PList_Entry *nextEntry = this->objectArray[indices[i]];
-                
-                result->value.arrayValue->push_back(GetValue(nextEntry));
-            }
-            
+            copy->value.intArrayValue = new vector<int64_t>(*value->value.intArrayValue);
             break;
         }
-            
-        case setType:
+        
+        case PCH_PList_Value::DoubleArray:
         {
-            result->valueType = PCH_PList_Value::pch_value_type::Set;
-            
-            result->value.setValue = new vector<PCH_PList_Value *>();
-            
-            vector<int64_t> indices = *(vector<int64_t> *)entry->data;
-            
-            for (int i=0; i<entry->dataSize; i++)
-            {
-                PCH_PList_Entry *nextEntry = this->objectArray[indices[i]];
-                
-                result->value.setValue->push_back(GetValue(nextEntry));
-            }
-            
+            copy->value.doubleArrayValue = new vector<double>(*value->value.doubleArrayValue);
             break;
         }
-            
-        case dictType:
+        
+        default:
         {
-            result->valueType = PCH_PList_Value::pch_value_type::Dict;
-            
-            result->value.dictValue = new vector<PCH_PList_Value::dictStruct>();
-            
-            // unlike the other collection types, the data field does not hold indices into the objectArray, but the key/value pairs (as PCH_PList_Dict's) - those pairs ARE indices into the object array
-            vector<PCH_PList_Dict> dict = *(vector<PCH_PList_Dict> *)entry->data;
-            
-            for (int i=0; i<entry->dataSize; i++)
-            {
-                PCH_PList_Entry *keyEntry = this->objectArray[dict[i].keyOffset];
-                PCH_PList_Entry *valEntry = this->objectArray[dict[i].valueOffset];
-                 
-                PCH_PList_Value::dictStruct tDict;
-                tDict.key = GetValue(keyEntry);
-                tDict.val = GetValue(valEntry);
-                
-                result->value.dictValue->push_back(tDict);
-            }
-            
+            // everything else is stored directly in the union
+            copy->value = value->value;
             break;
         }
-            
-        default:
+    }
+    
+    if (role == rootValue)
+    {
+        this->result = copy;
+    }
+    else if (role == element)
+    {
+        PCH_PList_Value *parent = this->openCopies.back();
+        
+        if (parent->valueType == PCH_PList_Value::Array)
         {
-            cout << "Unimplemented marker!" << endl;
-            
-            break;
+            parent->value.arrayValue->push_back(copy);
+        }
+        else
+        {
+            parent->value.setValue->push_back(copy);
         }
     }
+    else if (role == dictKey)
+    {
+        PCH_PList_Value::dictStruct tDict;
+        tDict.key = copy;
+        tDict.val = NULL;
+        
+        this->openCopies.back()->value.dictValue->push_back(tDict);
+    }
+    else
+    {
+        this->openCopies.back()->value.dictValue->back().val = copy;
+    }
     
-    return result;
+    if (value->valueType == PCH_PList_Value::Array || value->valueType == PCH_PList_Value::Set || value->valueType == PCH_PList_Value::Dict)
+    {
+        this->openCopies.push_back(copy);
+    }
+    
+    return true;
 }
 
-PCH_PList_Value *PCH_PList_Value::ValueForStringKey(const vector<dictStruct> &dict, const string &key)
+void PCH_PListCloner::EndValue(const PCH_PList_Value *value, Role role, size_t depth)
 {
-    for (int i=0; i<dict.size(); i++)
+    if (value->valueType == PCH_PList_Value::Array || value->valueType == PCH_PList_Value::Set || value->valueType == PCH_PList_Value::Dict)
     {
-        dictStruct nextEntry = dict.at(i);
-        
-        if (nextEntry.key->valueType == PCH_PList_Value::AsciiString)
-        {
-            string keyToCheck = *nextEntry.key->value.asciiStringValue;
-            
-            if (keyToCheck.compare(key) == 0)
-            {
-                return nextEntry.val;
-            }
-        }
+        this->openCopies.pop_back();
     }
+}
+
+PCH_PList_Value *PCH_PList_Value::Clone() const
+{
+    PCH_PListCloner cloner;
     
-    // if we get here, there was no match, return NULL
-    return nullptr;
+    PCH_PListTreeWalker walker;
+    walker.Walk(this, cloner);
+    
+    return cloner.result;
 }
 
-void PCH_PList_Value::PrintKeys(const vector<dictStruct> &dict)
+PCH_PList_Value::~PCH_PList_Value()
 {
-    for (int i=0; i<dict.size(); i++)
+    this->Clear();
+}
+
+// PCH_PList_Value may contain pointers in its value field, and containers own their children, so delete them
+void PCH_PList_Value::Clear()
+{
+    // A deep tree would overflow the stack if each container deleted its children (which delete their children, and so on). Instead, the children of every container are moved into one list before the container is deleted, so nothing that is deleted has any children left.
+    bool hasChildren = (this->valueType == Dict ? !this->value.dictValue->empty() : !this->Elements().empty());
+    
+    if (hasChildren)
     {
-        dictStruct nextEntry = dict.at(i);
+        vector<PCH_PList_Value *> pending;
+        this->TakeChildren(pending);
         
-        if (nextEntry.key->valueType == PCH_PList_Value::AsciiString)
+        while (!pending.empty())
         {
-            string nextKey = *nextEntry.key->value.asciiStringValue;
+            PCH_PList_Value *node = pending.back();
+            pending.pop_back();
             
-            cout << "Key#" << i << ": " << nextKey.c_str() << endl;
+            if (node != NULL)
+            {
+                node->TakeChildren(pending);
+                
+                delete node;
+            }
         }
     }
     
-    cout << endl;
-}
-
-
-// PCH_PList_Value may contain pointers in its value field, so delete them
-PCH_PList_Value::~PCH_PList_Value()
-{
     switch (this->valueType)
     {
         case Data:
@@ -971,9 +5182,44 @@ PCH_PList_Value::~PCH_PList_Value()
             break;
         }
             
+        case IntArray:
+        {
+            delete this->value.intArrayValue;
+            break;
+        }
+        
+        case DoubleArray:
+        {
+            delete this->value.doubleArrayValue;
+            break;
+        }
+        
         default:
             break;
     }
+    
+    this->valueType = Null;
+}
+
+void PCH_PList_Value::TakeChildren(vector<PCH_PList_Value *> &children)
+{
+    if (this->valueType == Array || this->valueType == Set)
+    {
+        vector<PCH_PList_Value *> &elements = (this->valueType == Array ? *this->value.arrayValue : *this->value.setValue);
+        
+        children.insert(children.end(), elements.begin(), elements.end());
+        elements.clear();
+    }
+    else if (this->valueType == Dict)
+    {
+        for (const dictStruct &entry : *this->value.dictValue)
+        {
+            children.push_back(entry.key);
+            children.push_back(entry.val);
+        }
+        
+        this->value.dictValue->clear();
+    }
 }
 
 // the PCH_PList_Entry holds a void*, so we need to delete it properly to avoid memory leaks
@@ -982,6 +5228,7 @@ PCH_PList_Entry::~PCH_PList_Entry()
     switch (this->entryType)
     {
         case PCH_PList::ObjectType::int64Type:
+        case PCH_PList::ObjectType::uidType:
         {
             delete (int64_t *)this->data;
             break;
@@ -995,9 +5242,8 @@ PCH_PList_Entry::~PCH_PList_Entry()
         }
             
         case PCH_PList::ObjectType::dataType:
-        case PCH_PList::ObjectType::uidType:
         {
-            delete (char *)this->data;
+            delete (vector<char> *)this->data;
             break;
         }
             
@@ -1030,3 +5276,202 @@ PCH_PList_Entry::~PCH_PList_Entry()
             break;
     }
 }
+
+bool PCH_PListTreeBuilder::AddValue(PCH_PList_Value *value)
+{
+    if (this->containerStack.empty())
+    {
+        // only the first top-level value is kept (a valid plist only has one)
+        if (this->root == NULL)
+        {
+            this->root = value;
+        }
+        else
+        {
+            delete value;
+            return false;
+        }
+        
+        return true;
+    }
+    
+    PCH_PList_Value *container = this->containerStack.back();
+    
+    if (container == NULL)
+    {
+        delete value;
+        return false;
+    }
+    
+    if (container->valueType == PCH_PList_Value::Dict)
+    {
+        // a value without a key can't go into a dictionary
+        if (this->pendingKey == NULL)
+        {
+            delete value;
+            return false;
+        }
+        
+        PCH_PList_Value::dictStruct tDict;
+        tDict.key = this->pendingKey;
+        tDict.val = value;
+        
+        container->value.dictValue->push_back(tDict);
+        
+        this->pendingKey = NULL;
+    }
+    else if (container->valueType == PCH_PList_Value::Set)
+    {
+        container->value.setValue->push_back(value);
+    }
+    else
+    {
+        container->value.arrayValue->push_back(value);
+    }
+    
+    return true;
+}
+
+void PCH_PListTreeBuilder::BeginDict()
+{
+    auto result = new PCH_PList_Value;
+    result->valueType = PCH_PList_Value::pch_value_type::Dict;
+    result->value.dictValue = new vector<PCH_PList_Value::dictStruct>();
+    
+    // a container that was thrown away still needs a place on the stack, so its contents are thrown away too (and its end tag has something to pop)
+    this->containerStack.push_back(this->AddValue(result) ? result : NULL);
+}
+
+void PCH_PListTreeBuilder::EndDict()
+{
+    if (!this->containerStack.empty())
+    {
+        this->containerStack.pop_back();
+    }
+}
+
+void PCH_PListTreeBuilder::BeginArray()
+{
+    auto result = new PCH_PList_Value;
+    result->valueType = PCH_PList_Value::pch_value_type::Array;
+    result->value.arrayValue = new vector<PCH_PList_Value *>();
+    
+    // a container that was thrown away still needs a place on the stack, so its contents are thrown away too (and its end tag has something to pop)
+    this->containerStack.push_back(this->AddValue(result) ? result : NULL);
+}
+
+void PCH_PListTreeBuilder::EndArray()
+{
+    if (!this->containerStack.empty())
+    {
+        this->containerStack.pop_back();
+    }
+}
+
+void PCH_PListTreeBuilder::BeginSet()
+{
+    auto result = new PCH_PList_Value;
+    result->valueType = PCH_PList_Value::pch_value_type::Set;
+    result->value.setValue = new vector<PCH_PList_Value *>();
+    
+    this->containerStack.push_back(this->AddValue(result) ? result : NULL);
+}
+
+void PCH_PListTreeBuilder::EndSet()
+{
+    this->EndArray();
+}
+
+void PCH_PListTreeBuilder::Key(const char *str, size_t length)
+{
+    delete this->pendingKey;
+    
+    this->pendingKey = NewStringValue(str, length);
+}
+
+PCH_PList_Value *PCH_PListTreeBuilder::NewStringValue(const char *str, size_t length)
+{
+    auto result = new PCH_PList_Value;
+    
+    bool isAscii = true;
+    
+    for (size_t i=0; i<length && isAscii; i++)
+    {
+        isAscii = ((unsigned char)str[i] < 0x80);
+    }
+    
+    if (isAscii)
+    {
+        result->valueType = PCH_PList_Value::pch_value_type::AsciiString;
+        result->value.asciiStringValue = new string(str, length);
+        
+        return result;
+    }
+    
+    // binary plists store non-ASCII strings as UTF-16 code units
+    wstring *uniString = new wstring(PCH_PList::UTF16FromUTF8(str, length));
+    
+    result->valueType = PCH_PList_Value::pch_value_type::UnicodeString;
+    result->value.uniStringValue = uniString;
+    
+    return result;
+}
+
+void PCH_PListTreeBuilder::StringValue(const char *str, size_t length)
+{
+    this->AddValue(NewStringValue(str, length));
+}
+
+void PCH_PListTreeBuilder::DataValue(const char *bytes, size_t length)
+{
+    auto result = new PCH_PList_Value;
+    result->valueType = PCH_PList_Value::pch_value_type::Data;
+    result->value.dataValue = new vector<char>(bytes, bytes + length);
+    
+    this->AddValue(result);
+}
+
+void PCH_PListTreeBuilder::IntValue(int64_t value)
+{
+    auto result = new PCH_PList_Value;
+    result->valueType = PCH_PList_Value::pch_value_type::Int;
+    result->value.intValue = value;
+    
+    this->AddValue(result);
+}
+
+void PCH_PListTreeBuilder::RealValue(double value)
+{
+    auto result = new PCH_PList_Value;
+    result->valueType = PCH_PList_Value::pch_value_type::Double;
+    result->value.doubleValue = value;
+    
+    this->AddValue(result);
+}
+
+void PCH_PListTreeBuilder::BoolValue(bool value)
+{
+    auto result = new PCH_PList_Value;
+    result->valueType = PCH_PList_Value::pch_value_type::Bool;
+    result->value.boolValue = value;
+    
+    this->AddValue(result);
+}
+
+void PCH_PListTreeBuilder::DateValue(double value)
+{
+    auto result = new PCH_PList_Value;
+    result->valueType = PCH_PList_Value::pch_value_type::Date;
+    result->value.dateValue = value;
+    
+    this->AddValue(result);
+}
+
+void PCH_PListTreeBuilder::UidValue(int64_t value)
+{
+    auto result = new PCH_PList_Value;
+    result->valueType = PCH_PList_Value::pch_value_type::Uid;
+    result->value.uidValue = value;
+    
+    this->AddValue(result);
+}
@@ -6,17 +6,17 @@
 //  Copyright © 2019 Peter Huber. All rights reserved.
 //
 
-// A C++ class to encapsulate a binary ".plist" file. While a plist file is often represented as a text file in XML format, this class is NOT designed to work with text-based plist (XML) files. The layout of a binary plist file is defined below (from https://opensource.apple.com/source/CF/CF-550/CFBinaryPList.c ). Note that all numerical references contained in the file are in big-endian form, which requires a conversion to small-endian for most modern computer systems (basically, all PCs and all Intel-based Macs). A lot of the other info used here comes from https://medium.com/@karaiskc/understanding-apples-binary-property-list-format-281e6da00dbd
+// A C++ class to encapsulate a binary ".plist" file. While a plist file is often represented as a text file in XML format, this class was originally designed for binary plists only. XML plists are now also accepted by all of the InitializeWithXXX() functions (except the projection version of InitializeWithFile()): they are recognized by their first bytes and handed to PCH_XMLPListParser, which produces the same PCH_PList_Value tree. The layout of a binary plist file is defined below (from https://opensource.apple.com/source/CF/CF-550/CFBinaryPList.c ). Note that all numerical references contained in the file are in big-endian form, which requires a conversion to small-endian for most modern computer systems (basically, all PCs and all Intel-based Macs). A lot of the other info used here comes from https://medium.com/@karaiskc/understanding-apples-binary-property-list-format-281e6da00dbd
 
 /* BINARY PLIST FILE FORMAT
- 
+
 HEADER (8 bytes)
     magic number ("bplist")
     file format version
 
 OBJECT TABLE
     variable-sized objects
-
+    
     Object Formats (marker byte followed by additional info in some cases)
     null    0000 0000
     bool    0000 1000                       // false
@@ -60,8 +60,12 @@ TRAILER (32 bytes)
 #include <iostream>
 #include <string>
 #include <vector>
+#include <map>
+#include <iterator>
+#include <functional>
 
 #include "PCH_NumericManipulations.h"
+#include "PCH_PListMemory.hpp"
 
 using namespace std;
 
@@ -69,10 +73,122 @@ using namespace std;
 #define PCH_PLIST_HEADER_LENGTH     8   // bytes
 #define PCH_PLIST_TRAILER_LENGTH    32  // bytes
 
+// InitializeWithFile() reads binary plists in chunks of this size on a background thread, while the objects in the chunks that have already been read are decoded
+#define PCH_PLIST_PREFETCH_CHUNK_SIZE   (1024 * 1024)   // bytes
+
+// The longest an object header can be: the marker byte, then an int object (a marker byte and up to 8 bytes) for the count
+#define PCH_PLIST_MAX_OBJECT_HEADER_LENGTH  10  // bytes
+
+// With PCH_PList::packNumericArrays set, arrays of at least this many ints (or reals) are loaded as IntArray (or DoubleArray) values
+#define PCH_PLIST_PACKED_ARRAY_MIN_COUNT    16
+
+// ReadPayload() passes big payloads to its sink in pieces of this size, and CopyPayload() writes them to a file descriptor in pieces of this size
+#define PCH_PLIST_PAYLOAD_CHUNK_SIZE    (1024 * 1024)   // bytes
+
+// the default for PCH_PList_Limits::maxExpansion
+#define PCH_PLIST_DEFAULT_MAX_EXPANSION 64  // values per byte of the file
+
+// The optional sidecar index cache (see InitializeWithFile()) is saved next to the plist file, with this extension appended to the plist's file name
+#define PCH_PLIST_INDEX_CACHE_EXTENSION     ".pchidx"
+#define PCH_PLIST_INDEX_CACHE_MAGIC         "PCHIDX\0\0"
+#define PCH_PLIST_INDEX_CACHE_VERSION       1
+#define PCH_PLIST_INDEX_CACHE_BOM           0x01020304
+#define PCH_PLIST_INDEX_CACHE_EMPTY_SLOT    UINT64_MAX
+
 // forward declarations for structs used in the PCH_PList class
 struct PCH_PList_Entry;
 struct PCH_PList_Dict;
 struct PCH_PList_Value;
+class PCH_PListEventHandler;
+class PCH_BinaryPListWriter;
+class PCH_ContiguousStreamBuf;
+
+// A change to make with PCH_PList::UpdateFile(): the value at 'keyPath' (in the same form as the key paths used for projections, see InitializeWithFile()) is set to 'value', or removed if 'value' is NULL. The caller keeps ownership of the value.
+struct PCH_PList_Update
+{
+    string keyPath;
+    const PCH_PList_Value *value;
+};
+
+// A string found by PCH_PList::SearchFile(). A string object that is used in more than one place (writers usually store identical strings only once) gives one hit for each place.
+struct PCH_PList_SearchHit
+{
+    uint64_t objectIndex;
+    
+    // The key path of the string, in the same form as the key paths used for projections. A dictionary key is given the key path of its value.
+    string keyPath;
+    
+    bool isKey;
+};
+
+// Limits on the work that loading a plist may do, for use with files that can't be trusted (eg: in a service that loads plists on behalf of others). A load that would go past a limit stops as soon as that is known, and fails with the error given for the limit. A limit of 0 means that there is no limit (the default for all of them but maxExpansion).
+struct PCH_PList_Limits
+{
+    // the number of objects in a binary plist (or of values and keys in an XML plist): errorTooManyObjects
+    uint64_t maxObjects;
+    
+    // the number of elements in an array or set, or of entries in a dict: errorCollectionTooLarge
+    uint64_t maxCollectionSize;
+    
+    // the nesting depth of containers (a root dict of strings has a depth of 1): errorTooDeep
+    uint64_t maxDepth;
+    
+    // The bytes of data and string payloads (2 per character for unicode strings) that are decoded, both from the file and when they are copied into the tree: errorTooManyBytes. A string object is copied each time it is referenced.
+    uint64_t maxDecodedBytes;
+    
+    // The number of values in the tree: errorTooManyValues. Every reference to an object gives a value of its own (including everything below it), so a small file that references the same container over and over can expand into a huge tree.
+    uint64_t maxValues;
+    
+    // The number of values in the tree for each byte of a binary plist: errorTooManyValues. Each reference takes at least one byte, so a file only goes past this by expanding shared containers many times over. This one is on by default (PCH_PLIST_DEFAULT_MAX_EXPANSION), so such files fail quickly even when no other limits are set; 0 allows any amount of expansion.
+    uint64_t maxExpansion;
+    
+    PCH_PList_Limits() {this->maxObjects = 0; this->maxCollectionSize = 0; this->maxDepth = 0; this->maxDecodedBytes = 0; this->maxValues = 0; this->maxExpansion = PCH_PLIST_DEFAULT_MAX_EXPANSION;}
+};
+
+// A visitor for PCH_PListTreeWalker. Every value in the tree is passed to BeginValue() before its children and to EndValue() after them. The keys of a dict are values too: each key is visited (with role 'dictKey') right before its value (with role 'dictValue').
+class PCH_PListValueVisitor
+{
+public:
+    
+    enum Role
+    {
+        rootValue,
+        element,
+        dictKey,
+        dictValue
+    };
+    
+    virtual ~PCH_PListValueVisitor() {};
+    
+    // 'depth' is 0 for the root, 1 for its children and so on. Return false to skip the children of the value, and its EndValue() call.
+    virtual bool BeginValue(const PCH_PList_Value *value, Role role, size_t depth) = 0;
+    
+    virtual void EndValue(const PCH_PList_Value *value, Role role, size_t depth) {};
+};
+
+// Walks a PCH_PList_Value tree without recursion, so the depth of the tree is only limited by the memory available. The stack of open containers is kept from one walk to the next, so a walker that is used over and over only allocates memory when it meets a tree that is deeper than any before it.
+class PCH_PListTreeWalker
+{
+public:
+    
+    void Walk(const PCH_PList_Value *root, PCH_PListValueVisitor &visitor);
+    
+private:
+    
+    struct OpenContainer
+    {
+        const PCH_PList_Value *container;
+        PCH_PListValueVisitor::Role role;
+        
+        // the next child to visit (for dicts, keys are the even numbers and values the odd ones)
+        size_t nextChild;
+    };
+    
+    vector<OpenContainer> openContainers;
+    
+    // pass 'value' to the visitor, opening it if it's a container whose children are wanted
+    void Visit(const PCH_PList_Value *value, PCH_PListValueVisitor::Role role, PCH_PListValueVisitor &visitor);
+};
 
 
 
@@ -80,7 +196,7 @@ struct PCH_PList_Value;
 
 class PCH_PList
 {
-    
+
 public:
     
     // the different object formats as listed in the file format
@@ -109,7 +225,22 @@ public:
         errorCouldNotOpenFile,
         errorNotValidPlistFile,
         errorUnknownObjectType,
-        errorIllegalRealLength
+        errorIllegalRealLength,
+        errorInvalidXML,
+        errorCouldNotWriteFile,
+        errorKeyPathNotFound,
+        errorWrongObjectType,
+        errorBufferTooSmall,
+        
+        // the limits (see PCH_PList_Limits)
+        errorTooManyObjects,
+        errorCollectionTooLarge,
+        errorTooDeep,
+        errorTooManyBytes,
+        errorTooManyValues,
+        
+        // a container in a binary plist contains itself (directly or further down), whatever the limits are
+        errorCyclicReference
     };
     
     // Instance variables
@@ -120,39 +251,225 @@ public:
     // buffer to hold the 8-byte header
     char headerBuffer[PCH_PLIST_HEADER_LENGTH];
     
-    // the root of the plist (usually a dictionary)
+    // The root of the plist (usually a dictionary). The tree is owned by the instance and deleted with it; use ReleaseRoot() to keep it longer.
     PCH_PList_Value *plistRoot;
     
     // The number of spaces per "indent" (used by the TraversePlist() call)
     int numSpacesPerTab = 4;
     
+    // If this is set before a binary plist is loaded, arrays of PCH_PLIST_PACKED_ARRAY_MIN_COUNT or more elements that are all ints (or all reals) are loaded as a single IntArray (or DoubleArray) value holding the numbers side by side, instead of an Array with a value for each element. Code that reads the tree must handle those types (see PCH_PList_Value::Ints()), so it's off by default.
+    bool packNumericArrays = false;
+    
+    // The limits for the next load (InitializeWithXXX()). Objects that come from the sidecar index (which is only written for files that were loaded before) are only checked as the tree is built, and the static functions that work directly on files don't use limits.
+    PCH_PList_Limits limits;
+    
+    // If this is set, the entries and values of the next load come from it instead of from the current resource (see PCH_PListMemory.hpp). It must outlive the instance (and the tree, if ReleaseRoot() is used).
+    PCH_PList_MemoryResource *memoryResource = NULL;
+    
     // constructors & destructor
     PCH_PList();
-    PCH_PList(string pathName);
+    PCH_PList(string pathName, bool useIndexCache = false);
     virtual ~PCH_PList();
     
+    // The instance owns its objects and tree, so it can't be copied
+    PCH_PList(const PCH_PList &) = delete;
+    PCH_PList &operator=(const PCH_PList &) = delete;
+    
+    // Hand the plist tree over to the caller (who must delete it), without copying it. plistRoot is NULL afterwards.
+    PCH_PList_Value *ReleaseRoot();
+    
     // Function to initialize the class using the file at 'filepath'. The function returns an PCH_PList::ErrorType, which gives a bit of information as to why the function failed (if the call is successful, it returns PCH_PList::ErrorType::noError).
-    ErrorType InitializeWithFile(string filePath);
+    // If useIndexCache is true, the function first looks for a sidecar index (the file path with PCH_PLIST_INDEX_CACHE_EXTENSION appended). If the index exists and matches the file's size, modification time and hash, the objects are built from the index and the (memory-mapped) file without parsing. Otherwise the file is parsed and the index is (re)written for next time. The index is a cache for the machine that wrote it; it is not portable.
+    ErrorType InitializeWithFile(string filePath, bool useIndexCache = false);
+    
+    // Functions to initialize the class from a binary plist that is already in memory (eg: from a network payload or a database BLOB). The first version borrows the caller's buffer (which must remain valid for as long as the instance exists) unless copyBuffer is true, in which case the instance keeps its own copy. The second version takes ownership of the vector without copying it.
+    ErrorType InitializeWithBuffer(const void *buffer, size_t length, bool copyBuffer = false);
+    ErrorType InitializeWithBuffer(vector<char> &&buffer);
+    
+    // Function to initialize the class from a stream that can't seek, like a pipe or stdin. The stream is read to its end into a buffer that the instance owns, which is then parsed like any other buffer (no temporary file is needed).
+    ErrorType InitializeWithStream(istream &inStream);
+    
+    // Function to initialize the class using only part of the file at 'filePath'. Each entry in keyPaths is a list of dictionary keys (and/or array indices) separated by periods (eg: "$objects.12" or "settings.window.frame"), starting at the root object. Only the objects needed to reach the key paths, and the entire subtrees at the ends of the key paths, are decoded; everything else in the file is never read. The resulting plistRoot has the same shape as the full plist, minus every dictionary entry and array element that is not on one of the key paths.
+    ErrorType InitializeWithFile(string filePath, const vector<string> &keyPaths);
+    
+    // Returns the index of the ASCII string object 'str' in the object table, or -1 if there isn't one. If the instance was loaded from a sidecar index, dictionary keys are found through its hash table.
+    int64_t IndexOfStringObject(const string &str);
     
     // Function to traverse the PCH_PList. This function can be used to view a textual representation of the plist file in a "pseudo-XML" style.
     void TraversePlist(ostream& outStream = cout);
     
+    // Send the contents of the (binary or XML) plist file at 'filePath' to 'handler', without building a PCH_PList_Value tree. The file is memory-mapped and each binary object is decoded and released as it is reached, so the memory used depends on the depth of the plist rather than its size. Objects that are referenced more than once are sent each time they are referenced. Null and fill objects have no XML equivalent and are skipped (along with their keys).
+    static ErrorType SendFileEvents(string filePath, PCH_PListEventHandler &handler);
+    
+    // Apply 'updates' (in order) to the binary plist file at 'filePath' without rewriting it. Binary plists find their objects through the offset table, so the new values, new keys and new copies of the dicts and arrays that hold them are written over the old offset table, followed by a new offset table and trailer. The rest of the file is left in place, so the cost of an update depends on the size of the change and of the offset table, but not on the size of the objects. The parent of each key path must already exist (setting a key that doesn't exist adds it, and setting the element just past the end of an array appends to it). Key paths can't go into values that were set earlier in the same call.
+    // Dicts and arrays are assumed not to be shared (no plist writer shares them). The space used by replaced objects is only reclaimed by CompactFile(), which should be called once the file has grown enough to matter (eg: to twice its size after the last compaction). If the new objects don't fit in the file's object reference size, the file is compacted with the updates applied instead.
+    static ErrorType UpdateFile(string filePath, const vector<PCH_PList_Update> &updates);
+    
+    // Rewrite the binary plist file at 'filePath' with only the objects that are still reachable (and only one copy of identical values). The new file replaces the old one when it is complete.
+    static ErrorType CompactFile(string filePath);
+    
+    // Find the strings (values and dictionary keys) that contain 'searchString' (in UTF-8) in the binary plist file at 'filePath', without decoding the file. The memory-mapped object table is scanned for the string's ASCII and UTF-16BE forms in one pass each, and each match is checked against the string object it falls in. Only if something is found are the containers walked to get the key paths of the hits. Strings that can't be reached from the root object (eg: ones replaced by UpdateFile()) are not reported. XML plists aren't supported (errorNotValidPlistFile).
+    static ErrorType SearchFile(string filePath, const string &searchString, vector<PCH_PList_SearchHit> &hits);
+    
+    // Functions to get the payload of one big data or ASCII string object (at 'keyPath', in the same form as the key paths used for projections) out of the binary plist file at 'filePath' without decoding anything else. The file is memory-mapped and only the containers on the key path are read. The payload is never copied into a PCH_PList_Value: ReadPayload() passes it to 'sink' in place, in pieces of up to PCH_PLIST_PAYLOAD_CHUNK_SIZE bytes (the pointers are only valid during the call; the sink returns false to stop early), and the CopyPayload() versions write it to a file descriptor or copy it into a buffer supplied by the caller. 'payloadLength' is set to the length of the payload, even if the buffer is too small to hold it (errorBufferTooSmall).
+    // Other types of object give errorWrongObjectType, and XML plists aren't supported (errorNotValidPlistFile).
+    static ErrorType ReadPayload(string filePath, const string &keyPath, const function<bool(const char *, size_t)> &sink);
+    static ErrorType CopyPayload(string filePath, const string &keyPath, int fd);
+    static ErrorType CopyPayload(string filePath, const string &keyPath, char *buffer, size_t bufferSize, uint64_t &payloadLength);
+    
+    // Conversions between the UTF-16 code units stored in unicode string objects and UTF-8
+    static string UTF8FromUTF16(const wstring &uniString);
+    static wstring UTF16FromUTF8(const char *str, size_t length);
+    
 private:
     
     // ivars
     // the basic object array for the objects represented in the file
     vector<PCH_PList_Entry *> objectArray;
     
+    // the plist bytes, if the instance was initialized with a buffer that it owns
+    vector<char> ownedBuffer;
+    
+    // the position in the file of each object (the offset table from the file)
+    vector<uint64_t> offsetTable;
+    
+    // the size of object references in arrays, sets and dicts (from the trailer)
+    int objectRefSize;
+    
+    // the index of the root object (from the trailer)
+    uint64_t topObject;
+    
+    // the position of the offset table in the file (from the trailer)
+    uint64_t offsetTableStart;
+    
+    // the file offset of the payload of each data/string object, which is only needed while building the sidecar index
+    vector<uint64_t> payloadOffsets;
+    uint64_t currentPayloadOffset;
+    
+    // the sidecar index, if the instance was loaded from one (it is kept mapped for IndexOfStringObject())
+    void *indexCacheMapping;
+    size_t indexCacheMappingSize;
+    
+    // While loading a projection, entries are decoded from this stream the first time they are needed (it is NULL the rest of the time)
+    istream *lazyStream;
+    
+    // The tree of key paths used when loading a projection. A node with no children keeps everything below it.
+    struct KeyPathNode
+    {
+        map<string, KeyPathNode> children;
+    };
+    
     // methods
-    PCH_PList_Value *GetValue(PCH_PList_Entry *entry);
+    // All of the InitializeWithXXX() functions end up here. If indexCachePath is not empty, it is the path of the plist file, whose sidecar index is used (see InitializeWithFile()).
+    ErrorType InitializeWithSeekableStream(istream &pFile, const string &indexCachePath);
+    
+    // Parse an XML plist (the buffer is modified)
+    ErrorType InitializeWithXMLBuffer(char *buffer, size_t length);
+    
+    ErrorType ReadFileStructure(istream &pFile, uint64_t &fileLength, vector<char> &offsetTableBytes);
+    
+    ErrorType ReadObject(istream &pFile, PCH_PList_Entry **entry);
+    
+    // What the marker (and count) of an object say about it: its type, the count (or the number of bytes after the marker, for objects of a fixed size), the number of bytes before the payload or references, and the length of the whole object
+    struct ObjectHeader
+    {
+        ObjectType type;
+        uint64_t count;
+        uint64_t headerLength;
+        uint64_t length;
+    };
+    
+    // The decoder. DecodeObject() decodes the object at 'position' straight from the memory of 'streamBuf', setting objectLength to the number of bytes it takes up. ParseObjectHeader() does all of the checks for an object whose first byte is at 'objectBytes' and which has 'available' bytes before the offset table (of which at least PCH_PLIST_MAX_OBJECT_HEADER_LENGTH, or all of them, can be read), so that MakeEntry() can decode the object's bytes without any further checks.
+    ErrorType DecodeObject(PCH_ContiguousStreamBuf &streamBuf, uint64_t position, PCH_PList_Entry **entry, uint64_t &objectLength);
+    ErrorType ParseObjectHeader(const char *objectBytes, uint64_t available, ObjectHeader &header);
+    void MakeEntry(const char *objectBytes, uint64_t position, const ObjectHeader &header, PCH_PList_Entry **entry);
+    
+    // Used by ReadObject() for streams that aren't in memory: the bytes of the object being decoded
+    vector<char> objectBuffer;
+    
+    // What the current load has used so far, to be checked against 'limits'
+    uint64_t numDecodedBytes;
+    uint64_t numValues;
+    
+    // the number of values that limits.maxExpansion allows for the file being loaded (set by ReadFileStructure(), 0 if there is no limit)
+    uint64_t expansionLimit;
+    
+    // The first limit that was exceeded by GetValue() or EntryAtIndex() (which can't return errors), or errorCyclicReference if GetValue() found a cycle, or noError. Once it is set, GetValue() returns NULL.
+    ErrorType limitError;
+    
+    // Used by ParseObjectHeader(): add the payload of a data or string object to numDecodedBytes, returning false if that goes past the limit
+    bool ChargeDecodedBytes(uint64_t numBytes);
+    
+    // Used by GetValue(): count a new value for 'entry' (and its payload, if it is copied into the tree) against the limits. If a limit is exceeded, limitError is set and false is returned.
+    bool ChargeValue(const PCH_PList_Entry *entry, bool copiesPayload);
+    
+    // Walk the objects starting at topObject (after ReadFileStructure() has been called), sending them to the handler
+    ErrorType SendObjectEvents(istream &pFile, PCH_PListEventHandler &handler);
+    
+    // Used by SearchFile(): walk the containers starting at topObject, adding a hit for every reference to an object whose entry in 'isMatch' is set
+    ErrorType CollectSearchHits(istream &pFile, const vector<bool> &isMatch, vector<PCH_PList_SearchHit> &hits);
+    
+    // Returns the entry for object 'index', decoding it first if necessary (and possible)
+    PCH_PList_Entry *EntryAtIndex(uint64_t index);
+    
+    // Used by ReadPayload() and CopyPayload(): map the binary plist at 'filePath' and find the payload of the data or ASCII string object at 'keyPath'. If the result is noError, the caller must unmap the file (fileBytes and fileLength) when it's done with the payload.
+    static ErrorType MapPayload(string filePath, const string &keyPath, const char *&fileBytes, size_t &fileLength, uint64_t &payloadStart, uint64_t &payloadLength);
+    
+    // Returns the index of the object for 'name' (a key or an array index) in the container 'containerIndex', or -1 if there isn't one
+    int64_t ChildIndex(uint64_t containerIndex, const string &name);
+    
+    // Used by UpdateFile(): make the change in the decoded entries, writing any new objects with 'writer'. The index of the container that was changed is added to changedContainers.
+    ErrorType ApplyUpdate(const PCH_PList_Update &update, PCH_BinaryPListWriter &writer, vector<uint64_t> &changedContainers);
+    
+    // Write a new copy of the binary plist at 'filePath' with the updates applied, then replace the file with it
+    static ErrorType RewriteFile(string filePath, const vector<PCH_PList_Update> &updates);
+    
+    // Build the PCH_PList_Value tree for object 'index' and everything below it. The tree is built without recursion, using valueStack for the containers that are being filled in. If a limit is exceeded, limitError is set and NULL is returned.
+    PCH_PList_Value *GetValue(uint64_t index);
+    
+    struct ValueFrame
+    {
+        uint64_t index;
+        PCH_PList_Entry *entry;
+        PCH_PList_Value *value;
+        size_t nextChild;
+    };
+    
+    vector<ValueFrame> valueStack;
+    
+    // The objects that have a frame on valueStack. A reference to one of them from below its frame is a cycle (errorCyclicReference). All of the flags are clear between calls to GetValue().
+    vector<bool> openObjects;
+    
+    // Build plistRoot from objectArray once every object in the file has been decoded. Nothing needs the payloads of data objects after that, so each one is moved into the tree instead of being copied (see TakeDataValue()).
+    ErrorType BuildTree();
+    
+    // While BuildTree() is running, the value that took the payload of each data object (or NULL if it hasn't been reached yet). It is empty the rest of the time.
+    vector<PCH_PList_Value *> payloadOwners;
+    
+    // Used by GetValue(): returns the IntArray or DoubleArray value for 'entry' if packNumericArrays is set and the entry is an array that can be packed, otherwise NULL
+    PCH_PList_Value *PackedArrayValue(PCH_PList_Entry *entry);
+    
+    // Used by GetValue() while payloadOwners is set up: make the value for the data object 'index', moving the payload out of its entry the first time
+    PCH_PList_Value *TakeDataValue(PCH_PList_Entry *entry, uint64_t index);
     
-    void TraverseNode(ostream& outStream, PCH_PList_Value *node, int numTabs);
+    PCH_PList_Value *GetProjectedValue(uint64_t index, const KeyPathNode &keyPaths);
+    
+    static uint64_t IndexCacheHash(const char *header, const char *offsetTable, size_t offsetTableLength, uint64_t fileLength);
+    bool LoadIndexCache(const string &filePath, uint64_t fileLength, uint64_t sourceHash);
+    bool SaveIndexCache(const string &filePath, uint64_t fileLength, uint64_t sourceHash);
+    
+    // used by TraversePlist()
+    PCH_PListTreeWalker treeWalker;
 };
 
+// ranges over the contents of containers (defined after PCH_PList_Value)
+template <class Iterator> class PCH_PList_Range;
+template <bool yieldsKeys> class PCH_PList_DictIterator;
+
 // The plist file is converted into a list of actual objects, each of which is saved as the following structure. Using this method (a type specifier and a union of possible types, only one of which will actually be used by the object) lets us create concrete-named objects instead of using void pointers and a bunch of ugly casting.
 struct PCH_PList_Value
 {
-    enum pch_value_type {Null, Bool, Int, Double, Date, Data, AsciiString, UnicodeString, Uid, Array, Set, Dict} valueType;
+    enum pch_value_type {Null, Bool, Int, Double, Date, Data, AsciiString, UnicodeString, Uid, Array, Set, Dict, IntArray, DoubleArray} valueType;
     
     // dictionaries are saved as vectors of distStructs (defined here)
     struct dictStruct
@@ -163,8 +480,26 @@ struct PCH_PList_Value
     
     static PCH_PList_Value *ValueForStringKey(const vector<dictStruct> &dict, const string &key);
     
+    // Borrowed access to the contents of a container: the elements of an Array or Set, and the entries of a Dict. An empty vector is returned for any other type of value. The values in the result still belong to this one.
+    const vector<PCH_PList_Value *> &Elements() const;
+    const vector<dictStruct> &Entries() const;
+    
+    // Ranges over just the keys or just the values of a Dict (empty for any other type of value), for use in range-based for loops. Like the vectors above, they iterate over the dict's own storage and yield the values in it, so nothing is allocated or copied.
+    PCH_PList_Range<PCH_PList_DictIterator<true>> Keys() const;
+    PCH_PList_Range<PCH_PList_DictIterator<false>> Values() const;
+    
+    // Borrowed access to the bytes of a Data or AsciiString value (empty for any other type of value), so that a big payload can be read in place instead of being copied out of the vector or string that holds it
+    PCH_PList_Range<const char *> Bytes() const;
+    
+    // Borrowed access to the numbers in an IntArray or DoubleArray (empty for any other type of value). These are arrays of numbers packed side by side (see PCH_PList::packNumericArrays); they are leaves of the tree, and are sent to event handlers as ordinary arrays.
+    PCH_PList_Range<const int64_t *> Ints() const;
+    PCH_PList_Range<const double *> Doubles() const;
+    
     static void PrintKeys(const vector<dictStruct> &dict);
     
+    // Send this value (and everything under it) to 'handler'. Null values are skipped.
+    void SendEvents(PCH_PListEventHandler &handler) const;
+    
     union pch_value
     {
         bool boolValue;
@@ -178,16 +513,165 @@ struct PCH_PList_Value
         vector<PCH_PList_Value *> *arrayValue;
         vector<PCH_PList_Value *> *setValue;
         vector<dictStruct> *dictValue;
-        
+        vector<int64_t> *intArrayValue;
+        vector<double> *doubleArrayValue;
+    
     } value;
     
     // constructor
     PCH_PList_Value() {this->valueType = Null;}
     
-    // destructor
+    // A value owns everything under it (the strings, data and vectors in 'value', and the children of containers), so values can be moved but not copied. Moving only takes over the pointers, so a subtree can be handed from one owner to another (eg: into another container) without allocating anything. The value that was moved from is left as Null.
+    PCH_PList_Value(PCH_PList_Value &&other);
+    PCH_PList_Value &operator=(PCH_PList_Value &&other);
+    PCH_PList_Value(const PCH_PList_Value &) = delete;
+    PCH_PList_Value &operator=(const PCH_PList_Value &) = delete;
+    
+    // Make a deep copy of the value (the caller owns the result)
+    PCH_PList_Value *Clone() const;
+    
+    // destructor (this deletes the whole subtree)
     ~PCH_PList_Value();
+    
+    // values come from the current PCH_PList_MemoryResource
+    static void *operator new(size_t numBytes) {return PCH_PList_MemoryResource::AllocateNode(numBytes);}
+    static void operator delete(void *value, size_t numBytes) {PCH_PList_MemoryResource::FreeNode(value, numBytes);}
+    
+private:
+    
+    // delete whatever 'value' points at and set the value to Null
+    void Clear();
+    
+    // move the children of a container to the end of 'children', leaving the container empty
+    void TakeChildren(vector<PCH_PList_Value *> &children);
+};
+
+// A pair of iterators that can be used in a range-based for loop. If the iterators are random-access (all of the ones used by PCH_PList_Value are), size() and [] are available too. Other representations of a container only need to provide an iterator to be used the same way.
+template <class Iterator>
+class PCH_PList_Range
+{
+public:
+    
+    PCH_PList_Range(Iterator first, Iterator last) : first(first), last(last) {}
+    
+    Iterator begin() const {return this->first;}
+    Iterator end() const {return this->last;}
+    
+    bool empty() const {return this->first == this->last;}
+    size_t size() const {return (size_t)(this->last - this->first);}
+    
+    typename iterator_traits<Iterator>::reference operator[](size_t i) const {return this->first[i];}
+    
+private:
+    
+    Iterator first;
+    Iterator last;
 };
 
+// A random-access iterator over the entries of a dict that yields either the key or the value of each entry
+template <bool yieldsKeys>
+class PCH_PList_DictIterator
+{
+public:
+    
+    typedef random_access_iterator_tag iterator_category;
+    typedef PCH_PList_Value *value_type;
+    typedef ptrdiff_t difference_type;
+    typedef PCH_PList_Value *const *pointer;
+    typedef PCH_PList_Value *const &reference;
+    
+    PCH_PList_DictIterator() : entry(NULL) {}
+    explicit PCH_PList_DictIterator(const PCH_PList_Value::dictStruct *entry) : entry(entry) {}
+    
+    reference operator*() const {return (yieldsKeys ? this->entry->key : this->entry->val);}
+    pointer operator->() const {return &**this;}
+    reference operator[](difference_type n) const {return *(*this + n);}
+    
+    PCH_PList_DictIterator &operator++() {this->entry++; return *this;}
+    PCH_PList_DictIterator operator++(int) {PCH_PList_DictIterator result = *this; this->entry++; return result;}
+    PCH_PList_DictIterator &operator--() {this->entry--; return *this;}
+    PCH_PList_DictIterator operator--(int) {PCH_PList_DictIterator result = *this; this->entry--; return result;}
+    
+    PCH_PList_DictIterator &operator+=(difference_type n) {this->entry += n; return *this;}
+    PCH_PList_DictIterator &operator-=(difference_type n) {this->entry -= n; return *this;}
+    PCH_PList_DictIterator operator+(difference_type n) const {return PCH_PList_DictIterator(this->entry + n);}
+    PCH_PList_DictIterator operator-(difference_type n) const {return PCH_PList_DictIterator(this->entry - n);}
+    difference_type operator-(const PCH_PList_DictIterator &other) const {return this->entry - other.entry;}
+    
+    bool operator==(const PCH_PList_DictIterator &other) const {return this->entry == other.entry;}
+    bool operator!=(const PCH_PList_DictIterator &other) const {return this->entry != other.entry;}
+    bool operator<(const PCH_PList_DictIterator &other) const {return this->entry < other.entry;}
+    bool operator>(const PCH_PList_DictIterator &other) const {return this->entry > other.entry;}
+    bool operator<=(const PCH_PList_DictIterator &other) const {return this->entry <= other.entry;}
+    bool operator>=(const PCH_PList_DictIterator &other) const {return this->entry >= other.entry;}
+    
+private:
+    
+    const PCH_PList_Value::dictStruct *entry;
+};
+
+template <bool yieldsKeys>
+inline PCH_PList_DictIterator<yieldsKeys> operator+(ptrdiff_t n, const PCH_PList_DictIterator<yieldsKeys> &iter)
+{
+    return iter + n;
+}
+
+inline PCH_PList_Range<PCH_PList_DictIterator<true>> PCH_PList_Value::Keys() const
+{
+    const vector<dictStruct> &entries = this->Entries();
+    
+    return PCH_PList_Range<PCH_PList_DictIterator<true>>(PCH_PList_DictIterator<true>(entries.data()), PCH_PList_DictIterator<true>(entries.data() + entries.size()));
+}
+
+inline PCH_PList_Range<PCH_PList_DictIterator<false>> PCH_PList_Value::Values() const
+{
+    const vector<dictStruct> &entries = this->Entries();
+    
+    return PCH_PList_Range<PCH_PList_DictIterator<false>>(PCH_PList_DictIterator<false>(entries.data()), PCH_PList_DictIterator<false>(entries.data() + entries.size()));
+}
+
+inline PCH_PList_Range<const char *> PCH_PList_Value::Bytes() const
+{
+    if (this->valueType == Data)
+    {
+        const char *bytes = this->value.dataValue->data();
+        
+        return PCH_PList_Range<const char *>(bytes, bytes + this->value.dataValue->size());
+    }
+    else if (this->valueType == AsciiString)
+    {
+        const char *bytes = this->value.asciiStringValue->data();
+        
+        return PCH_PList_Range<const char *>(bytes, bytes + this->value.asciiStringValue->size());
+    }
+    
+    return PCH_PList_Range<const char *>(NULL, NULL);
+}
+
+inline PCH_PList_Range<const int64_t *> PCH_PList_Value::Ints() const
+{
+    if (this->valueType == IntArray)
+    {
+        const int64_t *numbers = this->value.intArrayValue->data();
+        
+        return PCH_PList_Range<const int64_t *>(numbers, numbers + this->value.intArrayValue->size());
+    }
+    
+    return PCH_PList_Range<const int64_t *>(NULL, NULL);
+}
+
+inline PCH_PList_Range<const double *> PCH_PList_Value::Doubles() const
+{
+    if (this->valueType == DoubleArray)
+    {
+        const double *numbers = this->value.doubleArrayValue->data();
+        
+        return PCH_PList_Range<const double *>(numbers, numbers + this->value.doubleArrayValue->size());
+    }
+    
+    return PCH_PList_Range<const double *>(NULL, NULL);
+}
+
 // Each object in the file is stored into a PCH_PList_Entry for subsequent processing
 struct PCH_PList_Entry
 {
@@ -200,6 +684,10 @@ struct PCH_PList_Entry
     
     // destructor
     virtual ~PCH_PList_Entry();
+    
+    // entries come from the current PCH_PList_MemoryResource
+    static void *operator new(size_t numBytes) {return PCH_PList_MemoryResource::AllocateNode(numBytes);}
+    static void operator delete(void *entry, size_t numBytes) {PCH_PList_MemoryResource::FreeNode(entry, numBytes);}
 };
 
 // For dictionaries, we need to store both a key and a value offset, so create a struct for it
@@ -212,4 +700,127 @@ struct PCH_PList_Dict
     PCH_PList_Dict(uint64_t keyOffset, uint64_t valueOffset) : keyOffset(keyOffset), valueOffset(valueOffset) {}
 };
 
+// The layout of the sidecar index cache file. Everything is in the host's byte order and every section is 8-byte aligned, so the file can be used directly after it is mapped into memory. The file is: the header, then numObjects PCH_PList_IndexEntry's, then numRefs uint64_t object references, then numKeyHashSlots PCH_PList_KeyHashSlot's.
+struct PCH_PList_IndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrderMark;
+    
+    // the file that the index describes
+    uint64_t sourceSize;
+    int64_t sourceMTime;
+    uint64_t sourceHash;
+    
+    uint64_t numObjects;
+    uint64_t topObject;
+    uint64_t objectRefSize;
+    
+    // the offsets of the sections (from the start of the index file)
+    uint64_t entriesOffset;
+    uint64_t refsOffset;
+    uint64_t numRefs;
+    uint64_t keyHashOffset;
+    uint64_t numKeyHashSlots;
+};
+
+struct PCH_PList_IndexEntry
+{
+    // For ints, uids, reals and dates this is the decoded value. For data and strings it is the file offset of the payload. For arrays, sets and dicts it is the index of the first object reference in the refs section (dicts store their keys followed by their values).
+    uint64_t value;
+    
+    // same as PCH_PList_Entry::dataSize
+    uint64_t dataSize;
+    
+    // a PCH_PList::ObjectType
+    uint8_t type;
+    uint8_t reserved[7];
+};
+
+struct PCH_PList_KeyHashSlot
+{
+    uint64_t hash;
+    uint64_t objectIndex;
+};
+
+// An interface for code that wants to receive the contents of a plist as a sequence of "events" instead of as a tree of PCH_PList_Value's (in the style of a SAX XML parser). Dictionaries are sent as BeginDict(), then alternating Key() and value events, then EndDict(). The string and data pointers are only valid during the call.
+class PCH_PListEventHandler
+{
+public:
+    
+    virtual ~PCH_PListEventHandler() {};
+    
+    virtual void BeginDict() = 0;
+    virtual void EndDict() = 0;
+    
+    virtual void BeginArray() = 0;
+    virtual void EndArray() = 0;
+    
+    // Sets (which only exist in binary plists) are sent like arrays, but with these events. Handlers that don't care about the difference get arrays.
+    virtual void BeginSet() {this->BeginArray();}
+    virtual void EndSet() {this->EndArray();}
+    
+    // the key for the next value in the current dictionary
+    virtual void Key(const char *str, size_t length) = 0;
+    
+    // strings are always UTF-8
+    virtual void StringValue(const char *str, size_t length) = 0;
+    virtual void DataValue(const char *bytes, size_t length) = 0;
+    virtual void IntValue(int64_t value) = 0;
+    virtual void RealValue(double value) = 0;
+    virtual void BoolValue(bool value) = 0;
+    
+    // dates are seconds since 2001-01-01 00:00:00 UTC (the same as in binary plists)
+    virtual void DateValue(double value) = 0;
+    
+    // UIDs (used by NSKeyedArchiver) don't exist in XML, where they are written as a dictionary with the single key "CF$UID". Handlers that don't care about the difference get that dictionary.
+    virtual void UidValue(int64_t value)
+    {
+        this->BeginDict();
+        this->Key("CF$UID", 6);
+        this->IntValue(value);
+        this->EndDict();
+    }
+};
+
+// An event handler that builds a PCH_PList_Value tree (the same tree that PCH_PList creates from a binary plist). Strings that are pure ASCII become AsciiString values; all others become UnicodeString values holding UTF-16 code units.
+class PCH_PListTreeBuilder : public PCH_PListEventHandler
+{
+public:
+    
+    // the tree that was built (the caller takes ownership)
+    PCH_PList_Value *root;
+    
+    PCH_PListTreeBuilder() {this->root = NULL; this->pendingKey = NULL;}
+    virtual ~PCH_PListTreeBuilder() {delete this->pendingKey;}
+    
+    virtual void BeginDict();
+    virtual void EndDict();
+    virtual void BeginArray();
+    virtual void EndArray();
+    virtual void BeginSet();
+    virtual void EndSet();
+    virtual void Key(const char *str, size_t length);
+    virtual void StringValue(const char *str, size_t length);
+    virtual void DataValue(const char *bytes, size_t length);
+    virtual void IntValue(int64_t value);
+    virtual void RealValue(double value);
+    virtual void BoolValue(bool value);
+    virtual void DateValue(double value);
+    virtual void UidValue(int64_t value);
+    
+    static PCH_PList_Value *NewStringValue(const char *str, size_t length);
+    
+private:
+    
+    // the containers that are currently open (NULL for one that was thrown away)
+    vector<PCH_PList_Value *> containerStack;
+    
+    // the key for the next value added to a dictionary
+    PCH_PList_Value *pendingKey;
+    
+    // Add 'value' to the open container (or make it the root), returning false if it had to be deleted instead
+    bool AddValue(PCH_PList_Value *value);
+};
+
 #endif /* PCH_PList_hpp */
@@ -0,0 +1,847 @@
+//
+//  PCH_PListColumnExporter.cpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-18.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+#include "PCH_PListColumnExporter.hpp"
+#include "PCH_PListDocument.hpp"
+#include "PCH_XMLPListParser.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+static void PCH_AppendBigEndian(string &dest, uint64_t value, int numBytes)
+{
+    uint64_t bigValue = (uint64_t)PCH_SwapInt64HostToBig((int64_t)value);
+    
+    dest.append((const char *)&bigValue + (8 - numBytes), numBytes);
+}
+
+static void PCH_AppendInt(string &dest, int64_t value)
+{
+    char numBuff[32];
+    int numLength = snprintf(numBuff, sizeof(numBuff), "%lld", (long long)value);
+    
+    dest.append(numBuff, numLength);
+}
+
+// reals are written the same way as by the XML writer: the shortest form that reads back as the same number
+static void PCH_AppendReal(string &dest, double value)
+{
+    char numBuff[64];
+    int numLength;
+    
+    if (std::isnan(value))
+    {
+        numLength = snprintf(numBuff, sizeof(numBuff), "nan");
+    }
+    else if (std::isinf(value))
+    {
+        numLength = snprintf(numBuff, sizeof(numBuff), value > 0 ? "+infinity" : "-infinity");
+    }
+    else
+    {
+        numLength = snprintf(numBuff, sizeof(numBuff), "%.15g", value);
+        
+        if (strtod(numBuff, NULL) != value)
+        {
+            numLength = snprintf(numBuff, sizeof(numBuff), "%.17g", value);
+        }
+    }
+    
+    dest.append(numBuff, numLength);
+}
+
+static void PCH_AppendBase64(string &dest, const char *bytes, size_t length)
+{
+    static const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    
+    const unsigned char *src = (const unsigned char *)bytes;
+    size_t i = 0;
+    
+    for (; i + 3 <= length; i += 3)
+    {
+        uint32_t triple = (src[i] << 16) | (src[i+1] << 8) | src[i+2];
+        
+        dest += digits[(triple >> 18) & 0x3F];
+        dest += digits[(triple >> 12) & 0x3F];
+        dest += digits[(triple >> 6) & 0x3F];
+        dest += digits[triple & 0x3F];
+    }
+    
+    // the last one or two bytes are padded with '='
+    if (i < length)
+    {
+        uint32_t triple = (src[i] << 16) | (i + 1 < length ? src[i+1] << 8 : 0);
+        
+        dest += digits[(triple >> 18) & 0x3F];
+        dest += digits[(triple >> 12) & 0x3F];
+        dest += (i + 1 < length ? digits[(triple >> 6) & 0x3F] : '=');
+        dest += '=';
+    }
+}
+
+// Append a string as a JSON string literal
+static void PCH_AppendJSONString(string &dest, const char *str, size_t length)
+{
+    dest += '"';
+    
+    for (size_t i=0; i<length; i++)
+    {
+        char nextChar = str[i];
+        
+        if (nextChar == '"' || nextChar == '\\')
+        {
+            dest += '\\';
+            dest += nextChar;
+        }
+        else if ((unsigned char)nextChar < 0x20)
+        {
+            char escBuff[8];
+            snprintf(escBuff, sizeof(escBuff), "\\u%04x", (unsigned int)nextChar);
+            dest += escBuff;
+        }
+        else
+        {
+            dest += nextChar;
+        }
+    }
+    
+    dest += '"';
+}
+
+// The visitor used to write a container as JSON. Data is written as a base64 string, dates as ISO 8601 strings and UIDs as {"CF$UID": n} (the same as in XML plists).
+class PCH_JSONFormatter : public PCH_PListValueVisitor
+{
+public:
+    
+    PCH_JSONFormatter(string &dest) : dest(dest) {}
+    
+    virtual bool BeginValue(const PCH_PList_Value *value, Role role, size_t depth);
+    virtual void EndValue(const PCH_PList_Value *value, Role role, size_t depth);
+    
+private:
+    
+    string &dest;
+    
+    // for each open container, whether anything has been written into it yet
+    vector<bool> hasElements;
+};
+
+bool PCH_JSONFormatter::BeginValue(const PCH_PList_Value *value, Role role, size_t depth)
+{
+    if (role == dictValue)
+    {
+        this->dest += ':';
+    }
+    else if (role != rootValue)
+    {
+        if (this->hasElements.back())
+        {
+            this->dest += ',';
+        }
+        
+        this->hasElements.back() = true;
+    }
+    
+    switch (value->valueType)
+    {
+        case PCH_PList_Value::Bool:
+            this->dest += (value->value.boolValue ? "true" : "false");
+            break;
+        
+        case PCH_PList_Value::Int:
+            PCH_AppendInt(this->dest, value->value.intValue);
+            break;
+        
+        // JSON has no way to write NaN or infinity
+        case PCH_PList_Value::Double:
+            if (std::isfinite(value->value.doubleValue))
+            {
+                PCH_AppendReal(this->dest, value->value.doubleValue);
+            }
+            else
+            {
+                this->dest += "null";
+            }
+            break;
+        
+        case PCH_PList_Value::Date:
+        {
+            string dateString = PCH_XMLPListParser::ISO8601FromDate(value->value.dateValue);
+            PCH_AppendJSONString(this->dest, dateString.data(), dateString.size());
+            break;
+        }
+        
+        case PCH_PList_Value::Data:
+            this->dest += '"';
+            PCH_AppendBase64(this->dest, value->value.dataValue->data(), value->value.dataValue->size());
+            this->dest += '"';
+            break;
+        
+        case PCH_PList_Value::AsciiString:
+            PCH_AppendJSONString(this->dest, value->value.asciiStringValue->data(), value->value.asciiStringValue->size());
+            break;
+        
+        case PCH_PList_Value::UnicodeString:
+        {
+            string str = PCH_PList::UTF8FromUTF16(*value->value.uniStringValue);
+            PCH_AppendJSONString(this->dest, str.data(), str.size());
+            break;
+        }
+        
+        case PCH_PList_Value::Uid:
+            this->dest += "{\"CF$UID\":";
+            PCH_AppendInt(this->dest, value->value.uidValue);
+            this->dest += '}';
+            break;
+        
+        case PCH_PList_Value::Array:
+        case PCH_PList_Value::Set:
+            this->dest += '[';
+            this->hasElements.push_back(false);
+            break;
+        
+        case PCH_PList_Value::Dict:
+            this->dest += '{';
+            this->hasElements.push_back(false);
+            break;
+        
+        case PCH_PList_Value::IntArray:
+        {
+            this->dest += '[';
+            
+            for (size_t i=0; i<value->Ints().size(); i++)
+            {
+                if (i > 0)
+                {
+                    this->dest += ',';
+                }
+                
+                PCH_AppendInt(this->dest, value->Ints()[i]);
+            }
+            
+            this->dest += ']';
+            break;
+        }
+        
+        case PCH_PList_Value::DoubleArray:
+        {
+            this->dest += '[';
+            
+            for (size_t i=0; i<value->Doubles().size(); i++)
+            {
+                if (i > 0)
+                {
+                    this->dest += ',';
+                }
+                
+                double number = value->Doubles()[i];
+                
+                if (std::isfinite(number))
+                {
+                    PCH_AppendReal(this->dest, number);
+                }
+                else
+                {
+                    this->dest += "null";
+                }
+            }
+            
+            this->dest += ']';
+            break;
+        }
+        
+        default:
+            this->dest += "null";
+            break;
+    }
+    
+    return true;
+}
+
+void PCH_JSONFormatter::EndValue(const PCH_PList_Value *value, Role role, size_t depth)
+{
+    if (value->valueType == PCH_PList_Value::Array || value->valueType == PCH_PList_Value::Set)
+    {
+        this->dest += ']';
+        this->hasElements.pop_back();
+    }
+    else if (value->valueType == PCH_PList_Value::Dict)
+    {
+        this->dest += '}';
+        this->hasElements.pop_back();
+    }
+}
+
+PCH_PListColumnExporter::ColumnType PCH_PListColumnExporter::ColumnTypeOfValue(const PCH_PList_Value *value)
+{
+    switch (value->valueType)
+    {
+        case PCH_PList_Value::Bool:
+            return boolColumn;
+        
+        // UIDs are just numbers once they're out of the archive
+        case PCH_PList_Value::Int:
+        case PCH_PList_Value::Uid:
+            return intColumn;
+        
+        case PCH_PList_Value::Double:
+            return realColumn;
+        
+        case PCH_PList_Value::Date:
+            return dateColumn;
+        
+        case PCH_PList_Value::Data:
+            return dataColumn;
+        
+        case PCH_PList_Value::Null:
+            return nullColumn;
+        
+        default:
+            return stringColumn;
+    }
+}
+
+void PCH_PListColumnExporter::AppendCellText(const PCH_PList_Value *value, string &dest)
+{
+    switch (value->valueType)
+    {
+        case PCH_PList_Value::Bool:
+            dest += (value->value.boolValue ? "true" : "false");
+            break;
+        
+        case PCH_PList_Value::Int:
+            PCH_AppendInt(dest, value->value.intValue);
+            break;
+        
+        case PCH_PList_Value::Uid:
+            PCH_AppendInt(dest, value->value.uidValue);
+            break;
+        
+        case PCH_PList_Value::Double:
+            PCH_AppendReal(dest, value->value.doubleValue);
+            break;
+        
+        case PCH_PList_Value::Date:
+            dest += PCH_XMLPListParser::ISO8601FromDate(value->value.dateValue);
+            break;
+        
+        case PCH_PList_Value::Data:
+            PCH_AppendBase64(dest, value->value.dataValue->data(), value->value.dataValue->size());
+            break;
+        
+        case PCH_PList_Value::AsciiString:
+            dest += *value->value.asciiStringValue;
+            break;
+        
+        case PCH_PList_Value::UnicodeString:
+            dest += PCH_PList::UTF8FromUTF16(*value->value.uniStringValue);
+            break;
+        
+        case PCH_PList_Value::Null:
+            break;
+        
+        default:
+        {
+            PCH_JSONFormatter formatter(dest);
+            
+            PCH_PListTreeWalker walker;
+            walker.Walk(value, formatter);
+            break;
+        }
+    }
+}
+
+PCH_PListColumnExporter::PCH_PListColumnExporter(const PCH_PList_Value *records)
+{
+    this->blockRows = 0;
+    
+    if (records == NULL)
+    {
+        return;
+    }
+    
+    for (const PCH_PList_Value *element : records->Elements())
+    {
+        if (element->valueType == PCH_PList_Value::Dict)
+        {
+            this->records.push_back(element);
+        }
+    }
+    
+    // The columns are worked out in one pass over the records. A column's type starts out as the type of its first value and becomes more general as other types are found. The record each column was last seen in is kept so that a key that appears twice in a record is only counted once (the first one is the one that is exported).
+    vector<size_t> lastRecordForColumn;
+    
+    for (size_t i=0; i<this->records.size(); i++)
+    {
+        const vector<PCH_PList_Value::dictStruct> &entries = this->records[i]->Entries();
+        
+        for (size_t j=0; j<entries.size(); j++)
+        {
+            size_t column = this->ColumnForKey(entries[j].key, j);
+            ColumnType valueType = ColumnTypeOfValue(entries[j].val);
+            
+            if (lastRecordForColumn.size() < this->columns.size())
+            {
+                lastRecordForColumn.resize(this->columns.size(), 0);
+            }
+            
+            if (valueType == nullColumn || lastRecordForColumn[column] == i + 1)
+            {
+                continue;
+            }
+            
+            lastRecordForColumn[column] = i + 1;
+            
+            Column &columnInfo = this->columns[column];
+            columnInfo.numValues++;
+            
+            if (columnInfo.type == nullColumn)
+            {
+                columnInfo.type = valueType;
+            }
+            else if (columnInfo.type != valueType)
+            {
+                // ints and reals can share a real column; any other mix can only be written as text
+                bool isNumeric = ((columnInfo.type == intColumn || columnInfo.type == realColumn) && (valueType == intColumn || valueType == realColumn));
+                
+                columnInfo.type = (isNumeric ? realColumn : stringColumn);
+            }
+        }
+    }
+    
+    for (int i=0; i<this->columns.size(); i++)
+    {
+        if (this->columns[i].type == nullColumn)
+        {
+            this->columns[i].type = stringColumn;
+        }
+    }
+}
+
+const string &PCH_PListColumnExporter::KeyString(const PCH_PList_Value *key)
+{
+    if (key->valueType == PCH_PList_Value::AsciiString)
+    {
+        return *key->value.asciiStringValue;
+    }
+    
+    this->keyBuffer.clear();
+    
+    if (key->valueType == PCH_PList_Value::UnicodeString)
+    {
+        this->keyBuffer = PCH_PList::UTF8FromUTF16(*key->value.uniStringValue);
+    }
+    
+    return this->keyBuffer;
+}
+
+size_t PCH_PListColumnExporter::ColumnForKey(const PCH_PList_Value *key, size_t position)
+{
+    const string &name = this->KeyString(key);
+    
+    if (position < this->columnAtPosition.size())
+    {
+        size_t column = this->columnAtPosition[position];
+        
+        if (this->columns[column].name == name)
+        {
+            return column;
+        }
+    }
+    
+    size_t column;
+    auto found = this->columnForName.find(name);
+    
+    if (found != this->columnForName.end())
+    {
+        column = found->second;
+    }
+    else
+    {
+        column = this->columns.size();
+        
+        Column newColumn = {name, nullColumn, 0};
+        this->columns.push_back(newColumn);
+        this->columnForName.emplace(name, column);
+    }
+    
+    // positions are always looked up in order, so a new position is the next one
+    if (position < this->columnAtPosition.size())
+    {
+        this->columnAtPosition[position] = column;
+    }
+    else
+    {
+        this->columnAtPosition.push_back(column);
+    }
+    
+    return column;
+}
+
+void PCH_PListColumnExporter::GatherBlock(size_t firstRow, size_t numRows)
+{
+    this->blockRows = numRows;
+    this->cells.assign(this->columns.size() * numRows, NULL);
+    
+    for (size_t row=0; row<numRows; row++)
+    {
+        const vector<PCH_PList_Value::dictStruct> &entries = this->records[firstRow + row]->Entries();
+        
+        for (size_t j=0; j<entries.size(); j++)
+        {
+            if (entries[j].val->valueType == PCH_PList_Value::Null)
+            {
+                continue;
+            }
+            
+            const PCH_PList_Value *&cell = this->cells[this->ColumnForKey(entries[j].key, j) * numRows + row];
+            
+            if (cell == NULL)
+            {
+                cell = entries[j].val;
+            }
+        }
+    }
+}
+
+void PCH_PListColumnExporter::FlushIfNeeded(ostream &outStream)
+{
+    if (this->buffer.size() >= PCH_COLUMN_EXPORT_BUFFER_SIZE)
+    {
+        outStream.write(this->buffer.data(), this->buffer.size());
+        this->buffer.clear();
+    }
+}
+
+void PCH_PListColumnExporter::AppendField(OutputFormat format, const char *text, size_t length)
+{
+    if (format == tsvFormat)
+    {
+        // TSV has no quoting, so tabs and line breaks are escaped the usual way (and so are backslashes)
+        const char *runStart = text;
+        const char *end = text + length;
+        
+        for (const char *next = text; next < end; next++)
+        {
+            const char *escape = NULL;
+            
+            if (*next == '\t')
+            {
+                escape = "\\t";
+            }
+            else if (*next == '\n')
+            {
+                escape = "\\n";
+            }
+            else if (*next == '\r')
+            {
+                escape = "\\r";
+            }
+            else if (*next == '\\')
+            {
+                escape = "\\\\";
+            }
+            
+            if (escape != NULL)
+            {
+                this->buffer.append(runStart, next - runStart);
+                this->buffer += escape;
+                runStart = next + 1;
+            }
+        }
+        
+        this->buffer.append(runStart, end - runStart);
+        return;
+    }
+    
+    // CSV fields are quoted (with quotes doubled) if they hold a separator, a quote or a line break
+    bool needsQuotes = false;
+    
+    for (size_t i=0; i<length && !needsQuotes; i++)
+    {
+        needsQuotes = (text[i] == ',' || text[i] == '"' || text[i] == '\n' || text[i] == '\r');
+    }
+    
+    if (!needsQuotes)
+    {
+        this->buffer.append(text, length);
+        return;
+    }
+    
+    this->buffer += '"';
+    
+    for (size_t i=0; i<length; i++)
+    {
+        if (text[i] == '"')
+        {
+            this->buffer += '"';
+        }
+        
+        this->buffer += text[i];
+    }
+    
+    this->buffer += '"';
+}
+
+void PCH_PListColumnExporter::AppendTextHeader(OutputFormat format)
+{
+    for (int i=0; i<this->columns.size(); i++)
+    {
+        if (i > 0)
+        {
+            this->buffer += (format == tsvFormat ? '\t' : ',');
+        }
+        
+        this->AppendField(format, this->columns[i].name.data(), this->columns[i].name.size());
+    }
+    
+    this->buffer += (format == tsvFormat ? "\n" : "\r\n");
+}
+
+void PCH_PListColumnExporter::WriteTextBlock(ostream &outStream, OutputFormat format)
+{
+    for (size_t row=0; row<this->blockRows; row++)
+    {
+        for (size_t column=0; column<this->columns.size(); column++)
+        {
+            if (column > 0)
+            {
+                this->buffer += (format == tsvFormat ? '\t' : ',');
+            }
+            
+            const PCH_PList_Value *cell = this->cells[column * this->blockRows + row];
+            
+            if (cell == NULL)
+            {
+                continue;
+            }
+            
+            // ASCII strings (the most common cells) are written straight from the tree
+            if (cell->valueType == PCH_PList_Value::AsciiString)
+            {
+                this->AppendField(format, cell->value.asciiStringValue->data(), cell->value.asciiStringValue->size());
+                continue;
+            }
+            
+            this->cellText.clear();
+            AppendCellText(cell, this->cellText);
+            
+            this->AppendField(format, this->cellText.data(), this->cellText.size());
+        }
+        
+        // RFC 4180 ends CSV lines with CRLF
+        this->buffer += (format == tsvFormat ? "\n" : "\r\n");
+        
+        this->FlushIfNeeded(outStream);
+    }
+}
+
+void PCH_PListColumnExporter::AppendColumnarHeader()
+{
+    this->buffer += "PCHCOL01";
+    PCH_AppendBigEndian(this->buffer, this->columns.size(), 4);
+    
+    for (int i=0; i<this->columns.size(); i++)
+    {
+        this->buffer += (char)this->columns[i].type;
+        PCH_AppendBigEndian(this->buffer, this->columns[i].name.size(), 4);
+        this->buffer += this->columns[i].name;
+    }
+}
+
+void PCH_PListColumnExporter::WriteColumnarBlock(ostream &outStream)
+{
+    PCH_AppendBigEndian(this->buffer, this->blockRows, 4);
+    
+    vector<uint32_t> lengths;
+    
+    for (size_t column=0; column<this->columns.size(); column++)
+    {
+        const PCH_PList_Value **columnCells = this->cells.data() + column * this->blockRows;
+        ColumnType type = this->columns[column].type;
+        
+        size_t bitmapStart = this->buffer.size();
+        this->buffer.append((this->blockRows + 7) / 8, (char)0);
+        
+        for (size_t row=0; row<this->blockRows; row++)
+        {
+            if (columnCells[row] != NULL)
+            {
+                this->buffer[bitmapStart + row / 8] |= (char)(1 << (row % 8));
+            }
+        }
+        
+        if (type == stringColumn || type == dataColumn)
+        {
+            // the lengths come before the bytes, so the text of the cells is collected first
+            lengths.clear();
+            this->cellText.clear();
+            
+            for (size_t row=0; row<this->blockRows; row++)
+            {
+                const PCH_PList_Value *cell = columnCells[row];
+                
+                if (cell == NULL)
+                {
+                    continue;
+                }
+                
+                size_t textStart = this->cellText.size();
+                
+                if (type == dataColumn)
+                {
+                    this->cellText.append(cell->value.dataValue->data(), cell->value.dataValue->size());
+                }
+                else
+                {
+                    AppendCellText(cell, this->cellText);
+                }
+                
+                lengths.push_back((uint32_t)(this->cellText.size() - textStart));
+            }
+            
+            for (uint32_t length : lengths)
+            {
+                PCH_AppendBigEndian(this->buffer, length, 4);
+            }
+            
+            this->buffer += this->cellText;
+        }
+        else
+        {
+            for (size_t row=0; row<this->blockRows; row++)
+            {
+                const PCH_PList_Value *cell = columnCells[row];
+                
+                if (cell == NULL)
+                {
+                    continue;
+                }
+                
+                if (type == boolColumn)
+                {
+                    this->buffer += (char)(cell->value.boolValue ? 1 : 0);
+                }
+                else if (type == intColumn)
+                {
+                    PCH_AppendBigEndian(this->buffer, (uint64_t)(cell->valueType == PCH_PList_Value::Uid ? cell->value.uidValue : cell->value.intValue), 8);
+                }
+                else
+                {
+                    // a real column can hold ints too
+                    double number = (cell->valueType == PCH_PList_Value::Int ? (double)cell->value.intValue : cell->value.doubleValue);
+                    PCH_DoubleBigEndian bigValue = PCH_SwapDoubleHostToBig(number);
+                    
+                    this->buffer.append((const char *)&bigValue, 8);
+                }
+            }
+        }
+        
+        this->FlushIfNeeded(outStream);
+    }
+}
+
+PCH_PList::ErrorType PCH_PListColumnExporter::Export(ostream &outStream, OutputFormat format)
+{
+    this->buffer.clear();
+    this->buffer.reserve(PCH_COLUMN_EXPORT_BUFFER_SIZE + 1024);
+    
+    if (format == columnarFormat)
+    {
+        this->AppendColumnarHeader();
+    }
+    else
+    {
+        this->AppendTextHeader(format);
+    }
+    
+    for (size_t firstRow=0; firstRow<this->records.size(); firstRow+=PCH_COLUMN_EXPORT_BLOCK_ROWS)
+    {
+        this->GatherBlock(firstRow, min(this->records.size() - firstRow, (size_t)PCH_COLUMN_EXPORT_BLOCK_ROWS));
+        
+        if (format == columnarFormat)
+        {
+            this->WriteColumnarBlock(outStream);
+        }
+        else
+        {
+            this->WriteTextBlock(outStream, format);
+        }
+    }
+    
+    // the end of a columnar file is marked by an empty block
+    if (format == columnarFormat)
+    {
+        PCH_AppendBigEndian(this->buffer, 0, 4);
+    }
+    
+    outStream.write(this->buffer.data(), this->buffer.size());
+    this->buffer.clear();
+    
+    // the cells of the last block aren't needed any more
+    this->cells.clear();
+    this->cells.shrink_to_fit();
+    
+    outStream.flush();
+    
+    if (!outStream.good())
+    {
+        cerr << "Could not write the table";
+        return PCH_PList::errorCouldNotWriteFile;
+    }
+    
+    return PCH_PList::noError;
+}
+
+PCH_PList::ErrorType PCH_PListColumnExporter::ExportFile(string inputPath, string keyPath, string outputPath, OutputFormat format)
+{
+    PCH_PList plist;
+    PCH_PList::ErrorType err = plist.InitializeWithFile(inputPath);
+    
+    if (err != PCH_PList::noError)
+    {
+        return err;
+    }
+    
+    // the document is only used to find the key path
+    shared_ptr<const PCH_PListDocument> document = PCH_PListDocument::Freeze(plist);
+    const PCH_PList_Value *records = document->ValueAtKeyPath(keyPath);
+    
+    if (records == NULL)
+    {
+        cerr << "There is nothing at the key path";
+        return PCH_PList::errorKeyPathNotFound;
+    }
+    
+    if (records->valueType != PCH_PList_Value::Array && records->valueType != PCH_PList_Value::Set)
+    {
+        cerr << "The records must be an array or a set";
+        return PCH_PList::errorWrongObjectType;
+    }
+    
+    vector<char> outBuffer(1024 * 1024);
+    ofstream outFile;
+    bool useStdout = (outputPath.compare("-") == 0);
+    
+    if (!useStdout)
+    {
+        outFile.rdbuf()->pubsetbuf(outBuffer.data(), outBuffer.size());
+        outFile.open(outputPath.c_str(), ios::out | ios::binary | ios::trunc);
+        
+        if (!outFile.is_open())
+        {
+            return PCH_PList::errorCouldNotWriteFile;
+        }
+    }
+    
+    PCH_PListColumnExporter exporter(records);
+    
+    return exporter.Export(useStdout ? cout : outFile, format);
+}
@@ -0,0 +1,148 @@
+//
+//  PCH_PListColumnExporter.hpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-18.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+// Export of an array of records (dictionaries that mostly have the same keys) as a table, for use in spreadsheets and analytics tools. The columns are worked out from the keys of the records, in the order the keys are first seen, and each column is given the type of the values in it. The table can be written as CSV, as TSV or in a simple binary columnar format (described below) that keeps the types of the columns.
+// The records are handled a block at a time: the values of a block of records are first gathered into a table of cells (one column after the other), then written out. Gathering walks each record's entries once, and the columns come out of contiguous memory.
+
+#ifndef PCH_PListColumnExporter_hpp
+#define PCH_PListColumnExporter_hpp
+
+#include <stdio.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "PCH_PList.hpp"
+
+using namespace std;
+
+// The number of records that are gathered into cells at a time
+#define PCH_COLUMN_EXPORT_BLOCK_ROWS        4096
+
+// The exporter collects its output in a buffer of about this size before writing it to the stream
+#define PCH_COLUMN_EXPORT_BUFFER_SIZE       (64 * 1024)
+
+/*
+ COLUMNAR FORMAT (all numbers are big-endian, as in binary plists)
+    
+    "PCHCOL01"
+    uint32      number of columns
+    for each column:
+        uint8   type (a PCH_PListColumnExporter::ColumnType)
+        uint32  length of the name, followed by the name (UTF-8)
+    
+    blocks of up to PCH_COLUMN_EXPORT_BLOCK_ROWS rows, each:
+        uint32  number of rows (a block of 0 rows ends the file)
+        for each column:
+            presence bitmap: (rows + 7) / 8 bytes, bit (i % 8) of byte (i / 8) is set if row i has a value
+            the values of the rows that have one:
+                bool            1 byte (0 or 1)
+                int             int64
+                real, date      64-bit IEEE double (dates are seconds since 2001-01-01 00:00:00 UTC)
+                string, data    uint32 length of each value, followed by the bytes of all of the values
+ 
+ A column whose values don't all have the same type is a string column. Values that can't be written as a single cell (arrays, sets and dicts) are written as JSON text.
+ */
+
+class PCH_PListColumnExporter
+{
+public:
+    
+    enum OutputFormat
+    {
+        csvFormat,
+        tsvFormat,
+        columnarFormat
+    };
+    
+    // nullColumn is only used while the columns are being worked out (for a column with no values yet); columns that end up without values are string columns
+    enum ColumnType
+    {
+        nullColumn,
+        boolColumn,
+        intColumn,
+        realColumn,
+        dateColumn,
+        stringColumn,
+        dataColumn
+    };
+    
+    struct Column
+    {
+        string name;
+        ColumnType type;
+        
+        // the number of records that have a value for the column
+        uint64_t numValues;
+    };
+    
+    // 'records' is an Array or Set of Dicts (any elements that aren't dicts are skipped). The columns are worked out right away. The tree must not change (or be deleted) while the exporter is in use.
+    explicit PCH_PListColumnExporter(const PCH_PList_Value *records);
+    
+    const vector<Column> &Columns() const {return this->columns;}
+    
+    // the number of records (rows) that will be written
+    size_t NumRecords() const {return this->records.size();}
+    
+    // Write the table to 'outStream' (the text formats start with a row holding the column names)
+    PCH_PList::ErrorType Export(ostream &outStream, OutputFormat format);
+    
+    // Export the records at 'keyPath' (in the same form as the key paths used for projections; an empty key path is the root) of the (binary or XML) plist file at 'inputPath' to 'outputPath' ("-" writes to stdout).
+    static PCH_PList::ErrorType ExportFile(string inputPath, string keyPath, string outputPath, OutputFormat format);
+    
+private:
+    
+    // the dicts that become rows
+    vector<const PCH_PList_Value *> records;
+    
+    vector<Column> columns;
+    unordered_map<string, size_t> columnForName;
+    
+    // The column of the key at each position in the last record that was looked at. Records usually have their keys in the same order, so this finds the column of most keys without a lookup.
+    vector<size_t> columnAtPosition;
+    
+    // the values of the current block of records, column by column (NULL where a record has no value)
+    vector<const PCH_PList_Value *> cells;
+    size_t blockRows;
+    
+    // the output that hasn't been written to the stream yet
+    string buffer;
+    
+    // scratch space for the text of one cell, and for the UTF-8 form of a unicode key
+    string cellText;
+    string keyBuffer;
+    
+    // the UTF-8 form of a dict key ('keyBuffer' holds it if it had to be converted)
+    const string &KeyString(const PCH_PList_Value *key);
+    
+    // Returns the column of the key at 'position' in a record, adding a new column if there isn't one
+    size_t ColumnForKey(const PCH_PList_Value *key, size_t position);
+    
+    // Fill 'cells' with the values of 'numRows' records, starting at 'firstRow'
+    void GatherBlock(size_t firstRow, size_t numRows);
+    
+    void AppendTextHeader(OutputFormat format);
+    void WriteTextBlock(ostream &outStream, OutputFormat format);
+    
+    void AppendColumnarHeader();
+    void WriteColumnarBlock(ostream &outStream);
+    
+    // append 'text' as a CSV or TSV field
+    void AppendField(OutputFormat format, const char *text, size_t length);
+    
+    void FlushIfNeeded(ostream &outStream);
+    
+    // Append the text form of a value to 'dest': the text itself for strings, the same text as the XML writer uses for other values that fit in a cell, and JSON for containers
+    static void AppendCellText(const PCH_PList_Value *value, string &dest);
+    
+    static ColumnType ColumnTypeOfValue(const PCH_PList_Value *value);
+};
+
+#endif /* PCH_PListColumnExporter_hpp */
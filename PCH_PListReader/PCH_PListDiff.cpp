@@ -0,0 +1,827 @@
+//
+//  PCH_PListDiff.cpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-17.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+#include "PCH_PListDiff.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+// What a value is, as far as its hash is concerned. The different ways of storing the same content (ASCII or unicode strings, packed or unpacked arrays) are the same kind.
+enum PCH_HashKind
+{
+    hashNull = 1,
+    hashBool,
+    hashInt,
+    hashReal,
+    hashDate,
+    hashData,
+    hashString,
+    hashUid,
+    hashArray,
+    hashSet,
+    hashDict
+};
+
+static PCH_HashKind PCH_HashKindOf(const PCH_PList_Value *value)
+{
+    switch (value->valueType)
+    {
+        case PCH_PList_Value::Bool:
+            return hashBool;
+        
+        case PCH_PList_Value::Int:
+            return hashInt;
+        
+        case PCH_PList_Value::Double:
+            return hashReal;
+        
+        case PCH_PList_Value::Date:
+            return hashDate;
+        
+        case PCH_PList_Value::Data:
+            return hashData;
+        
+        case PCH_PList_Value::AsciiString:
+        case PCH_PList_Value::UnicodeString:
+            return hashString;
+        
+        case PCH_PList_Value::Uid:
+            return hashUid;
+        
+        case PCH_PList_Value::Array:
+        case PCH_PList_Value::IntArray:
+        case PCH_PList_Value::DoubleArray:
+            return hashArray;
+        
+        case PCH_PList_Value::Set:
+            return hashSet;
+        
+        case PCH_PList_Value::Dict:
+            return hashDict;
+        
+        default:
+            return hashNull;
+    }
+}
+
+// the values whose hashes are memoized: the ones that are too big to hash every time they're compared
+static bool PCH_IsMemoized(const PCH_PList_Value *value)
+{
+    return (PCH_HashKindOf(value) == hashArray || value->valueType == PCH_PList_Value::Set || value->valueType == PCH_PList_Value::Dict);
+}
+
+// The finalizer of MurmurHash3, which spreads every input bit over the whole result
+static inline uint64_t PCH_MixHash(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    
+    return hash;
+}
+
+static inline uint64_t PCH_HashSeed(PCH_HashKind kind)
+{
+    return (uint64_t)kind * 0x9e3779b97f4a7c15ULL;
+}
+
+// Strings and data can be big, so they are hashed 8 bytes at a time
+static uint64_t PCH_HashBytes(const char *bytes, size_t length, uint64_t hash)
+{
+    hash ^= PCH_MixHash(length);
+    
+    size_t i = 0;
+    
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    
+    uint64_t lastWord = 0;
+    memcpy(&lastWord, bytes + i, length - i);
+    
+    return PCH_MixHash(hash ^ lastWord);
+}
+
+static inline uint64_t PCH_IntHash(int64_t number)
+{
+    return PCH_MixHash(PCH_HashSeed(hashInt) ^ (uint64_t)number);
+}
+
+static inline uint64_t PCH_BitsHash(PCH_HashKind kind, double number)
+{
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    
+    return PCH_MixHash(PCH_HashSeed(kind) ^ bits);
+}
+
+// Arrays are hashed in order; sets and dicts are hashed by adding up the (mixed) hashes of their elements or entries, so the order doesn't matter
+static inline uint64_t PCH_CombineOrdered(uint64_t state, uint64_t elementHash)
+{
+    return PCH_MixHash(state + elementHash);
+}
+
+static inline uint64_t PCH_FinishOrdered(uint64_t state, uint64_t count)
+{
+    return PCH_MixHash(state ^ PCH_MixHash(count));
+}
+
+static inline uint64_t PCH_EntryHash(uint64_t keyHash, uint64_t valueHash)
+{
+    return PCH_MixHash(PCH_MixHash(keyHash) ^ valueHash);
+}
+
+static inline uint64_t PCH_FinishUnordered(PCH_HashKind kind, uint64_t sum, uint64_t count)
+{
+    return PCH_MixHash(PCH_HashSeed(kind) ^ sum ^ PCH_MixHash(count));
+}
+
+uint64_t PCH_PListTreeHashes::LeafHash(const PCH_PList_Value *value)
+{
+    switch (value->valueType)
+    {
+        case PCH_PList_Value::Bool:
+            return PCH_MixHash(PCH_HashSeed(hashBool) ^ (value->value.boolValue ? 1 : 0));
+        
+        case PCH_PList_Value::Int:
+            return PCH_IntHash(value->value.intValue);
+        
+        case PCH_PList_Value::Double:
+            return PCH_BitsHash(hashReal, value->value.doubleValue);
+        
+        case PCH_PList_Value::Date:
+            return PCH_BitsHash(hashDate, value->value.dateValue);
+        
+        case PCH_PList_Value::Data:
+            return PCH_HashBytes(value->value.dataValue->data(), value->value.dataValue->size(), PCH_HashSeed(hashData));
+        
+        case PCH_PList_Value::AsciiString:
+            return PCH_HashBytes(value->value.asciiStringValue->data(), value->value.asciiStringValue->size(), PCH_HashSeed(hashString));
+        
+        case PCH_PList_Value::UnicodeString:
+        {
+            string str = PCH_PList::UTF8FromUTF16(*value->value.uniStringValue);
+            return PCH_HashBytes(str.data(), str.size(), PCH_HashSeed(hashString));
+        }
+        
+        case PCH_PList_Value::Uid:
+            return PCH_MixHash(PCH_HashSeed(hashUid) ^ (uint64_t)value->value.uidValue);
+        
+        // packed arrays are hashed the same way as arrays of separate values
+        case PCH_PList_Value::IntArray:
+        {
+            uint64_t state = PCH_HashSeed(hashArray);
+            
+            for (int64_t number : value->Ints())
+            {
+                state = PCH_CombineOrdered(state, PCH_IntHash(number));
+            }
+            
+            return PCH_FinishOrdered(state, value->Ints().size());
+        }
+        
+        case PCH_PList_Value::DoubleArray:
+        {
+            uint64_t state = PCH_HashSeed(hashArray);
+            
+            for (double number : value->Doubles())
+            {
+                state = PCH_CombineOrdered(state, PCH_BitsHash(hashReal, number));
+            }
+            
+            return PCH_FinishOrdered(state, value->Doubles().size());
+        }
+        
+        default:
+            return PCH_HashSeed(hashNull);
+    }
+}
+
+// The visitor used to hash a tree. A container's hash is worked out as its children finish, so every value is only visited once.
+class PCH_PListHasher : public PCH_PListValueVisitor
+{
+public:
+    
+    uint64_t rootHash;
+    
+    PCH_PListHasher(unordered_map<const PCH_PList_Value *, uint64_t> &hashes) : hashes(hashes) {this->rootHash = 0;}
+    
+    virtual bool BeginValue(const PCH_PList_Value *value, Role role, size_t depth);
+    virtual void EndValue(const PCH_PList_Value *value, Role role, size_t depth);
+    
+private:
+    
+    unordered_map<const PCH_PList_Value *, uint64_t> &hashes;
+    
+    // the hash so far of each container that is being walked
+    struct OpenContainer
+    {
+        PCH_HashKind kind;
+        uint64_t state;
+        uint64_t count;
+        
+        // the hash of the key whose value is next (for dicts)
+        uint64_t keyHash;
+    };
+    
+    vector<OpenContainer> openContainers;
+};
+
+bool PCH_PListHasher::BeginValue(const PCH_PList_Value *value, Role role, size_t depth)
+{
+    if (value->valueType == PCH_PList_Value::Array || value->valueType == PCH_PList_Value::Set || value->valueType == PCH_PList_Value::Dict)
+    {
+        PCH_HashKind kind = PCH_HashKindOf(value);
+        OpenContainer container = {kind, (kind == hashArray ? PCH_HashSeed(hashArray) : 0), 0, 0};
+        
+        this->openContainers.push_back(container);
+    }
+    
+    return true;
+}
+
+void PCH_PListHasher::EndValue(const PCH_PList_Value *value, Role role, size_t depth)
+{
+    uint64_t hash;
+    
+    if (value->valueType == PCH_PList_Value::Array || value->valueType == PCH_PList_Value::Set || value->valueType == PCH_PList_Value::Dict)
+    {
+        const OpenContainer &container = this->openContainers.back();
+        hash = (container.kind == hashArray ? PCH_FinishOrdered(container.state, container.count) : PCH_FinishUnordered(container.kind, container.state, container.count));
+        
+        this->openContainers.pop_back();
+        this->hashes[value] = hash;
+    }
+    else
+    {
+        hash = PCH_PListTreeHashes::LeafHash(value);
+        
+        if (PCH_IsMemoized(value))
+        {
+            this->hashes[value] = hash;
+        }
+    }
+    
+    if (role == rootValue)
+    {
+        this->rootHash = hash;
+        return;
+    }
+    
+    OpenContainer &parent = this->openContainers.back();
+    
+    if (role == dictKey)
+    {
+        parent.keyHash = hash;
+        return;
+    }
+    
+    if (role == dictValue)
+    {
+        parent.state += PCH_EntryHash(parent.keyHash, hash);
+    }
+    else if (parent.kind == hashArray)
+    {
+        parent.state = PCH_CombineOrdered(parent.state, hash);
+    }
+    else
+    {
+        parent.state += PCH_MixHash(hash);
+    }
+    
+    parent.count++;
+}
+
+PCH_PListTreeHashes::PCH_PListTreeHashes(const PCH_PList_Value *root)
+{
+    this->root = root;
+    
+    PCH_PListTreeHashes::HashTree(root, this->memoizedHashes);
+}
+
+uint64_t PCH_PListTreeHashes::HashTree(const PCH_PList_Value *subtreeRoot, unordered_map<const PCH_PList_Value *, uint64_t> &hashes)
+{
+    if (subtreeRoot == NULL)
+    {
+        return PCH_HashSeed(hashNull);
+    }
+    
+    PCH_PListHasher hasher(hashes);
+    
+    PCH_PListTreeWalker walker;
+    walker.Walk(subtreeRoot, hasher);
+    
+    return hasher.rootHash;
+}
+
+uint64_t PCH_PListTreeHashes::HashOf(const PCH_PList_Value *value) const
+{
+    if (value == NULL || !PCH_IsMemoized(value))
+    {
+        return (value == NULL ? PCH_HashSeed(hashNull) : PCH_PListTreeHashes::LeafHash(value));
+    }
+    
+    auto found = this->memoizedHashes.find(value);
+    
+    if (found != this->memoizedHashes.end())
+    {
+        return found->second;
+    }
+    
+    // a container that isn't in this tree is hashed from scratch
+    unordered_map<const PCH_PList_Value *, uint64_t> subtreeHashes;
+    
+    return PCH_PListTreeHashes::HashTree(value, subtreeHashes);
+}
+
+uint64_t PCH_PListTreeHashes::ElementHash(const PCH_PList_Value *array, size_t index) const
+{
+    if (array->valueType == PCH_PList_Value::IntArray)
+    {
+        return PCH_IntHash(array->Ints()[index]);
+    }
+    else if (array->valueType == PCH_PList_Value::DoubleArray)
+    {
+        return PCH_BitsHash(hashReal, array->Doubles()[index]);
+    }
+    
+    return this->HashOf(array->Elements()[index]);
+}
+
+// Compare two values that aren't containers
+static bool PCH_SameLeaf(const PCH_PList_Value *oldValue, const PCH_PList_Value *newValue)
+{
+    switch (oldValue->valueType)
+    {
+        case PCH_PList_Value::Bool:
+            return (oldValue->value.boolValue == newValue->value.boolValue);
+        
+        case PCH_PList_Value::Int:
+            return (oldValue->value.intValue == newValue->value.intValue);
+        
+        // reals are compared bit for bit, the same way they're hashed
+        case PCH_PList_Value::Double:
+        case PCH_PList_Value::Date:
+            return (memcmp(&oldValue->value.doubleValue, &newValue->value.doubleValue, sizeof(double)) == 0);
+        
+        case PCH_PList_Value::Data:
+            return (*oldValue->value.dataValue == *newValue->value.dataValue);
+        
+        case PCH_PList_Value::AsciiString:
+        case PCH_PList_Value::UnicodeString:
+        {
+            if (oldValue->valueType == PCH_PList_Value::AsciiString && newValue->valueType == PCH_PList_Value::AsciiString)
+            {
+                return (*oldValue->value.asciiStringValue == *newValue->value.asciiStringValue);
+            }
+            else if (oldValue->valueType == PCH_PList_Value::UnicodeString && newValue->valueType == PCH_PList_Value::UnicodeString)
+            {
+                return (*oldValue->value.uniStringValue == *newValue->value.uniStringValue);
+            }
+            
+            const PCH_PList_Value *uniValue = (oldValue->valueType == PCH_PList_Value::UnicodeString ? oldValue : newValue);
+            const PCH_PList_Value *asciiValue = (uniValue == oldValue ? newValue : oldValue);
+            
+            return (PCH_PList::UTF8FromUTF16(*uniValue->value.uniStringValue) == *asciiValue->value.asciiStringValue);
+        }
+        
+        case PCH_PList_Value::Uid:
+            return (oldValue->value.uidValue == newValue->value.uidValue);
+        
+        default:
+            return true;
+    }
+}
+
+bool PCH_PListDiff::Equal(const PCH_PListTreeHashes &oldHashes, const PCH_PList_Value *oldValue, const PCH_PListTreeHashes &newHashes, const PCH_PList_Value *newValue)
+{
+    if (oldValue == NULL || newValue == NULL)
+    {
+        return (oldValue == newValue);
+    }
+    
+    if (PCH_HashKindOf(oldValue) != PCH_HashKindOf(newValue))
+    {
+        return false;
+    }
+    
+    if (PCH_IsMemoized(oldValue))
+    {
+        return (oldHashes.HashOf(oldValue) == newHashes.HashOf(newValue));
+    }
+    
+    return PCH_SameLeaf(oldValue, newValue);
+}
+
+bool PCH_PListDiff::Equal(const PCH_PList_Value *oldValue, const PCH_PList_Value *newValue)
+{
+    PCH_PListTreeHashes oldHashes(oldValue);
+    PCH_PListTreeHashes newHashes(newValue);
+    
+    return PCH_PListDiff::Equal(oldHashes, oldValue, newHashes, newValue);
+}
+
+PCH_PListSetIndex::PCH_PListSetIndex(const PCH_PList_Value *set)
+{
+    // hashing the whole set at once means each element that is a container is only walked once
+    PCH_PListTreeHashes hashes(set);
+    
+    const vector<PCH_PList_Value *> &elements = set->Elements();
+    this->elementsByHash.reserve(elements.size());
+    
+    for (const PCH_PList_Value *element : elements)
+    {
+        this->elementsByHash.emplace(hashes.HashOf(element), element);
+    }
+}
+
+const PCH_PList_Value *PCH_PListSetIndex::Find(const PCH_PList_Value *value) const
+{
+    if (value == NULL)
+    {
+        return NULL;
+    }
+    
+    uint64_t valueHash;
+    
+    if (PCH_IsMemoized(value))
+    {
+        PCH_PListTreeHashes valueHashes(value);
+        valueHash = valueHashes.HashOf(value);
+    }
+    else
+    {
+        valueHash = PCH_PListTreeHashes::LeafHash(value);
+    }
+    
+    auto candidates = this->elementsByHash.equal_range(valueHash);
+    
+    for (auto candidate=candidates.first; candidate!=candidates.second; candidate++)
+    {
+        // containers with the same hash are the same, so only leaves need to be compared
+        if (PCH_HashKindOf(candidate->second) != PCH_HashKindOf(value))
+        {
+            continue;
+        }
+        
+        if (PCH_IsMemoized(value) || PCH_SameLeaf(candidate->second, value))
+        {
+            return candidate->second;
+        }
+    }
+    
+    return NULL;
+}
+
+const PCH_PList_Value *PCH_PListSetIndex::FindString(const char *str, size_t length) const
+{
+    auto candidates = this->elementsByHash.equal_range(PCH_HashBytes(str, length, PCH_HashSeed(hashString)));
+    
+    for (auto candidate=candidates.first; candidate!=candidates.second; candidate++)
+    {
+        const PCH_PList_Value *element = candidate->second;
+        
+        if (element->valueType == PCH_PList_Value::AsciiString)
+        {
+            if (element->value.asciiStringValue->size() == length && memcmp(element->value.asciiStringValue->data(), str, length) == 0)
+            {
+                return element;
+            }
+        }
+        else if (element->valueType == PCH_PList_Value::UnicodeString)
+        {
+            string elementString = PCH_PList::UTF8FromUTF16(*element->value.uniStringValue);
+            
+            if (elementString.size() == length && memcmp(elementString.data(), str, length) == 0)
+            {
+                return element;
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+size_t PCH_PListSetIndex::MemoryUsage() const
+{
+    // each entry is a node holding the pair and a link, plus a bucket pointer
+    return sizeof(PCH_PListSetIndex) + this->elementsByHash.size() * (sizeof(pair<const uint64_t, const PCH_PList_Value *>) + 2 * sizeof(void *)) + this->elementsByHash.bucket_count() * sizeof(void *);
+}
+
+// The key path component for a dict key
+static string PCH_KeyName(const PCH_PList_Value *key)
+{
+    if (key == NULL)
+    {
+        return string();
+    }
+    else if (key->valueType == PCH_PList_Value::AsciiString)
+    {
+        return *key->value.asciiStringValue;
+    }
+    else if (key->valueType == PCH_PList_Value::UnicodeString)
+    {
+        return PCH_PList::UTF8FromUTF16(*key->value.uniStringValue);
+    }
+    
+    return string();
+}
+
+static string PCH_ChildKeyPath(const string &keyPath, const string &name)
+{
+    return (keyPath.empty() ? name : keyPath + "." + name);
+}
+
+static size_t PCH_ArrayCount(const PCH_PList_Value *array)
+{
+    if (array->valueType == PCH_PList_Value::IntArray)
+    {
+        return array->Ints().size();
+    }
+    else if (array->valueType == PCH_PList_Value::DoubleArray)
+    {
+        return array->Doubles().size();
+    }
+    
+    return array->Elements().size();
+}
+
+// the value of an array element (NULL for the numbers in packed arrays)
+static const PCH_PList_Value *PCH_ArrayElement(const PCH_PList_Value *array, size_t index)
+{
+    return (array->valueType == PCH_PList_Value::Array ? array->Elements()[index] : NULL);
+}
+
+void PCH_PListDiff::Compare(const PCH_PList_Value *oldRoot, const PCH_PList_Value *newRoot, vector<PCH_PList_Difference> &differences)
+{
+    PCH_PListTreeHashes oldHashes(oldRoot);
+    PCH_PListTreeHashes newHashes(newRoot);
+    
+    PCH_PListDiff::Compare(oldHashes, newHashes, differences);
+}
+
+void PCH_PListDiff::Compare(const PCH_PListTreeHashes &oldHashes, const PCH_PListTreeHashes &newHashes, vector<PCH_PList_Difference> &differences)
+{
+    differences.clear();
+    
+    // The items still to be handled, with the next one at the end. The items for the children of a container are pushed in reverse, so the differences come out in the order they appear in the trees.
+    vector<PendingItem> pendingItems;
+    vector<PendingItem> childItems;
+    
+    pendingItems.push_back({false, PCH_PList_Difference::changed, oldHashes.Root(), newHashes.Root(), string()});
+    
+    while (!pendingItems.empty())
+    {
+        PendingItem item = move(pendingItems.back());
+        pendingItems.pop_back();
+        
+        if (item.isReport)
+        {
+            differences.push_back({item.kind, move(item.keyPath), item.oldValue, item.newValue});
+            continue;
+        }
+        
+        if (PCH_PListDiff::Equal(oldHashes, item.oldValue, newHashes, item.newValue))
+        {
+            continue;
+        }
+        
+        PCH_HashKind oldKind = (item.oldValue == NULL ? hashNull : PCH_HashKindOf(item.oldValue));
+        PCH_HashKind newKind = (item.newValue == NULL ? hashNull : PCH_HashKindOf(item.newValue));
+        
+        childItems.clear();
+        
+        if (oldKind == hashDict && newKind == hashDict)
+        {
+            PCH_PListDiff::CompareDicts(oldHashes, newHashes, item.oldValue, item.newValue, item.keyPath, childItems);
+        }
+        else if (oldKind == hashArray && newKind == hashArray)
+        {
+            PCH_PListDiff::CompareArrays(oldHashes, newHashes, item.oldValue, item.newValue, item.keyPath, childItems);
+        }
+        else if (oldKind == hashSet && newKind == hashSet)
+        {
+            PCH_PListDiff::CompareSets(oldHashes, newHashes, item.oldValue, item.newValue, item.keyPath, childItems);
+        }
+        else
+        {
+            // different types, or different leaves
+            differences.push_back({PCH_PList_Difference::changed, move(item.keyPath), item.oldValue, item.newValue});
+            continue;
+        }
+        
+        for (size_t i=childItems.size(); i>0; i--)
+        {
+            pendingItems.push_back(move(childItems[i - 1]));
+        }
+    }
+}
+
+void PCH_PListDiff::CompareDicts(const PCH_PListTreeHashes &oldHashes, const PCH_PListTreeHashes &newHashes, const PCH_PList_Value *oldDict, const PCH_PList_Value *newDict, const string &keyPath, vector<PendingItem> &items)
+{
+    const vector<PCH_PList_Value::dictStruct> &oldEntries = oldDict->Entries();
+    const vector<PCH_PList_Value::dictStruct> &newEntries = newDict->Entries();
+    
+    // The old entry for each new entry (or -1 if there isn't one). A writer usually keeps the keys of a dict in the same order, so the entries are matched by position first, which doesn't need any lookups; only the ones that don't match that way are looked up by key.
+    vector<int64_t> oldForNew(newEntries.size(), -1);
+    vector<bool> oldIsMatched(oldEntries.size(), false);
+    
+    bool allMatched = true;
+    
+    for (size_t i=0; i<min(oldEntries.size(), newEntries.size()); i++)
+    {
+        const PCH_PList_Value *oldKey = oldEntries[i].key;
+        const PCH_PList_Value *newKey = newEntries[i].key;
+        
+        if (oldKey != NULL && newKey != NULL && PCH_HashKindOf(oldKey) == hashString && PCH_HashKindOf(newKey) == hashString && PCH_SameLeaf(oldKey, newKey))
+        {
+            oldForNew[i] = (int64_t)i;
+            oldIsMatched[i] = true;
+        }
+        else
+        {
+            allMatched = false;
+        }
+    }
+    
+    if (!allMatched || oldEntries.size() != newEntries.size())
+    {
+        // if a key is in a dict more than once, the first one wins
+        unordered_map<string, size_t> unmatchedOldKeys;
+        
+        for (size_t i=0; i<oldEntries.size(); i++)
+        {
+            if (!oldIsMatched[i] && oldEntries[i].key != NULL)
+            {
+                unmatchedOldKeys.emplace(PCH_KeyName(oldEntries[i].key), i);
+            }
+        }
+        
+        for (size_t i=0; i<newEntries.size() && !unmatchedOldKeys.empty(); i++)
+        {
+            if (oldForNew[i] >= 0 || newEntries[i].key == NULL)
+            {
+                continue;
+            }
+            
+            auto found = unmatchedOldKeys.find(PCH_KeyName(newEntries[i].key));
+            
+            if (found != unmatchedOldKeys.end())
+            {
+                oldForNew[i] = (int64_t)found->second;
+                oldIsMatched[found->second] = true;
+                unmatchedOldKeys.erase(found);
+            }
+        }
+    }
+    
+    for (size_t i=0; i<newEntries.size(); i++)
+    {
+        const PCH_PList_Value *newValue = newEntries[i].val;
+        
+        if (oldForNew[i] < 0)
+        {
+            items.push_back({true, PCH_PList_Difference::added, NULL, newValue, PCH_ChildKeyPath(keyPath, PCH_KeyName(newEntries[i].key))});
+            continue;
+        }
+        
+        const PCH_PList_Value *oldValue = oldEntries[oldForNew[i]].val;
+        
+        if (!PCH_PListDiff::Equal(oldHashes, oldValue, newHashes, newValue))
+        {
+            items.push_back({false, PCH_PList_Difference::changed, oldValue, newValue, PCH_ChildKeyPath(keyPath, PCH_KeyName(newEntries[i].key))});
+        }
+    }
+    
+    for (size_t i=0; i<oldEntries.size(); i++)
+    {
+        if (!oldIsMatched[i])
+        {
+            items.push_back({true, PCH_PList_Difference::removed, oldEntries[i].val, NULL, PCH_ChildKeyPath(keyPath, PCH_KeyName(oldEntries[i].key))});
+        }
+    }
+}
+
+void PCH_PListDiff::CompareArrays(const PCH_PListTreeHashes &oldHashes, const PCH_PListTreeHashes &newHashes, const PCH_PList_Value *oldArray, const PCH_PList_Value *newArray, const string &keyPath, vector<PendingItem> &items)
+{
+    size_t oldCount = PCH_ArrayCount(oldArray);
+    size_t newCount = PCH_ArrayCount(newArray);
+    size_t minCount = min(oldCount, newCount);
+    
+    auto sameElement = [&](size_t oldIndex, size_t newIndex)
+    {
+        const PCH_PList_Value *oldElement = PCH_ArrayElement(oldArray, oldIndex);
+        const PCH_PList_Value *newElement = PCH_ArrayElement(newArray, newIndex);
+        
+        if (oldElement != NULL && newElement != NULL)
+        {
+            return PCH_PListDiff::Equal(oldHashes, oldElement, newHashes, newElement);
+        }
+        
+        return (oldHashes.ElementHash(oldArray, oldIndex) == newHashes.ElementHash(newArray, newIndex));
+    };
+    
+    // set aside the elements that are the same at the start and at the end
+    size_t numSameAtStart = 0;
+    
+    while (numSameAtStart < minCount && sameElement(numSameAtStart, numSameAtStart))
+    {
+        numSameAtStart++;
+    }
+    
+    size_t numSameAtEnd = 0;
+    
+    while (numSameAtEnd < minCount - numSameAtStart && sameElement(oldCount - 1 - numSameAtEnd, newCount - 1 - numSameAtEnd))
+    {
+        numSameAtEnd++;
+    }
+    
+    // the elements in between are paired up one for one, and whatever is left over was added or removed
+    size_t oldEnd = oldCount - numSameAtEnd;
+    size_t newEnd = newCount - numSameAtEnd;
+    size_t numPaired = min(oldEnd, newEnd) - numSameAtStart;
+    
+    for (size_t i=numSameAtStart; i<numSameAtStart+numPaired; i++)
+    {
+        const PCH_PList_Value *oldElement = PCH_ArrayElement(oldArray, i);
+        const PCH_PList_Value *newElement = PCH_ArrayElement(newArray, i);
+        
+        if (oldElement != NULL && newElement != NULL)
+        {
+            items.push_back({false, PCH_PList_Difference::changed, oldElement, newElement, PCH_ChildKeyPath(keyPath, to_string(i))});
+        }
+        else if (!sameElement(i, i))
+        {
+            items.push_back({true, PCH_PList_Difference::changed, oldElement, newElement, PCH_ChildKeyPath(keyPath, to_string(i))});
+        }
+    }
+    
+    for (size_t i=numSameAtStart+numPaired; i<newEnd; i++)
+    {
+        items.push_back({true, PCH_PList_Difference::added, NULL, PCH_ArrayElement(newArray, i), PCH_ChildKeyPath(keyPath, to_string(i))});
+    }
+    
+    for (size_t i=numSameAtStart+numPaired; i<oldEnd; i++)
+    {
+        items.push_back({true, PCH_PList_Difference::removed, PCH_ArrayElement(oldArray, i), NULL, PCH_ChildKeyPath(keyPath, to_string(i))});
+    }
+}
+
+void PCH_PListDiff::CompareSets(const PCH_PListTreeHashes &oldHashes, const PCH_PListTreeHashes &newHashes, const PCH_PList_Value *oldSet, const PCH_PList_Value *newSet, const string &keyPath, vector<PendingItem> &items)
+{
+    const vector<PCH_PList_Value *> &oldElements = oldSet->Elements();
+    const vector<PCH_PList_Value *> &newElements = newSet->Elements();
+    
+    // Sets have no order, so each old element is matched with a new element that has the same content. Elements that don't match are reported as removed and added (there's no way to tell which one a changed element used to be).
+    unordered_multimap<uint64_t, size_t> newByHash;
+    newByHash.reserve(newElements.size());
+    
+    for (size_t i=0; i<newElements.size(); i++)
+    {
+        newByHash.emplace(newHashes.HashOf(newElements[i]), i);
+    }
+    
+    vector<bool> newIsMatched(newElements.size(), false);
+    
+    for (size_t i=0; i<oldElements.size(); i++)
+    {
+        auto candidates = newByHash.equal_range(oldHashes.HashOf(oldElements[i]));
+        bool isMatched = false;
+        
+        for (auto candidate=candidates.first; candidate!=candidates.second; candidate++)
+        {
+            if (PCH_PListDiff::Equal(oldHashes, oldElements[i], newHashes, newElements[candidate->second]))
+            {
+                newIsMatched[candidate->second] = true;
+                newByHash.erase(candidate);
+                isMatched = true;
+                break;
+            }
+        }
+        
+        if (!isMatched)
+        {
+            items.push_back({true, PCH_PList_Difference::removed, oldElements[i], NULL, PCH_ChildKeyPath(keyPath, to_string(i))});
+        }
+    }
+    
+    for (size_t i=0; i<newElements.size(); i++)
+    {
+        if (!newIsMatched[i])
+        {
+            items.push_back({true, PCH_PList_Difference::added, NULL, newElements[i], PCH_ChildKeyPath(keyPath, to_string(i))});
+        }
+    }
+}
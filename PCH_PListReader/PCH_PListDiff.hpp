@@ -0,0 +1,126 @@
+//
+//  PCH_PListDiff.hpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-17.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+// Structural hashing and comparison of PCH_PList_Value trees. A PCH_PListTreeHashes computes a Merkle-style hash for every container in a tree (each hash is made from the hashes of the container's children), so two subtrees can be compared by comparing two numbers. PCH_PListDiff uses the hashes to skip every part of two trees that is the same and only walks down the paths that lead to differences, reporting them as key paths.
+// The hashes describe content, not storage: ASCII and unicode strings with the same text hash the same, packed numeric arrays hash the same as the arrays they were packed from, and the order of the entries in a dict (or the elements in a set) doesn't matter. Containers that have the same hash are taken to be the same; with 64-bit hashes, the chance of two different containers being mistaken for each other is negligible.
+
+#ifndef PCH_PListDiff_hpp
+#define PCH_PListDiff_hpp
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "PCH_PList.hpp"
+
+using namespace std;
+
+class PCH_PListTreeHashes
+{
+public:
+    
+    // Compute the hashes for the tree at 'root'. The tree must not change (or be deleted) while the hashes are in use.
+    explicit PCH_PListTreeHashes(const PCH_PList_Value *root);
+    
+    const PCH_PList_Value *Root() const {return this->root;}
+    
+    // Returns the hash of 'value'. The hashes of containers and packed arrays are looked up; everything else is hashed when it's asked for.
+    uint64_t HashOf(const PCH_PList_Value *value) const;
+    
+    // The hash of one element of an Array, IntArray or DoubleArray (packed arrays have no values for their elements)
+    uint64_t ElementHash(const PCH_PList_Value *array, size_t index) const;
+    
+    // The hash of a value that isn't a container (containers have to be hashed from their children)
+    static uint64_t LeafHash(const PCH_PList_Value *value);
+    
+private:
+    
+    const PCH_PList_Value *root;
+    
+    // the hashes of the containers and packed arrays in the tree
+    unordered_map<const PCH_PList_Value *, uint64_t> memoizedHashes;
+    
+    // hash the tree at 'subtreeRoot', adding its containers and packed arrays to 'hashes'
+    static uint64_t HashTree(const PCH_PList_Value *subtreeRoot, unordered_map<const PCH_PList_Value *, uint64_t> &hashes);
+};
+
+// An index of the elements of a Set (or an Array) by content hash, so that a membership test only has to look at the elements that have the same hash instead of all of them. Elements match the same way values compare in PCH_PListDiff::Equal(). The set must not change (or be deleted) while the index is in use.
+class PCH_PListSetIndex
+{
+public:
+    
+    explicit PCH_PListSetIndex(const PCH_PList_Value *set);
+    
+    // Returns the element with the same content as 'value', or NULL if there isn't one. 'value' doesn't have to be part of the same tree. If the set holds the same content more than once, any one of the copies may be returned.
+    const PCH_PList_Value *Find(const PCH_PList_Value *value) const;
+    
+    // The version of Find() for a string (in UTF-8), which matches both ASCII and unicode string elements
+    const PCH_PList_Value *FindString(const char *str, size_t length) const;
+    
+    // The number of bytes of memory used by the index (not counting the set)
+    size_t MemoryUsage() const;
+    
+private:
+    
+    unordered_multimap<uint64_t, const PCH_PList_Value *> elementsByHash;
+};
+
+// A difference found by PCH_PListDiff::Compare(). The key path is in the same form as the key paths used for projections (see PCH_PList::InitializeWithFile()); the root is the empty key path. The values belong to the trees that were compared. A value is NULL on the side that doesn't have it, and for a number inside a packed array (which has no value of its own).
+struct PCH_PList_Difference
+{
+    enum Kind
+    {
+        added,
+        removed,
+        changed
+    };
+    
+    Kind kind;
+    string keyPath;
+    
+    const PCH_PList_Value *oldValue;
+    const PCH_PList_Value *newValue;
+};
+
+class PCH_PListDiff
+{
+public:
+    
+    // Returns true if the two values (from the trees that 'oldHashes' and 'newHashes' were computed for) have the same content
+    static bool Equal(const PCH_PListTreeHashes &oldHashes, const PCH_PList_Value *oldValue, const PCH_PListTreeHashes &newHashes, const PCH_PList_Value *newValue);
+    
+    // The version of Equal() for two values that haven't been hashed (any containers are hashed from scratch)
+    static bool Equal(const PCH_PList_Value *oldValue, const PCH_PList_Value *newValue);
+    
+    // Find the differences between the trees of 'oldHashes' and 'newHashes', in the order they appear in the trees. Subtrees whose hashes match are skipped without being walked, so the time taken depends on the number of differences and the size of the containers that hold them, not on the size of the trees.
+    // Dict entries are matched by key. Arrays are matched element by element after the elements that are the same at the start and at the end are set aside, so inserting or removing elements in one place is reported as just those elements. Sets are matched by content.
+    static void Compare(const PCH_PListTreeHashes &oldHashes, const PCH_PListTreeHashes &newHashes, vector<PCH_PList_Difference> &differences);
+    
+    // The version of Compare() for trees that haven't been hashed yet. Hashing is the expensive part, so use the version above to compare one tree with several others.
+    static void Compare(const PCH_PList_Value *oldRoot, const PCH_PList_Value *newRoot, vector<PCH_PList_Difference> &differences);
+    
+private:
+    
+    // An item on the stack used by Compare(): either a pair of values to compare, or a difference that is ready to be reported
+    struct PendingItem
+    {
+        bool isReport;
+        PCH_PList_Difference::Kind kind;
+        const PCH_PList_Value *oldValue;
+        const PCH_PList_Value *newValue;
+        string keyPath;
+    };
+    
+    static void CompareDicts(const PCH_PListTreeHashes &oldHashes, const PCH_PListTreeHashes &newHashes, const PCH_PList_Value *oldDict, const PCH_PList_Value *newDict, const string &keyPath, vector<PendingItem> &items);
+    static void CompareArrays(const PCH_PListTreeHashes &oldHashes, const PCH_PListTreeHashes &newHashes, const PCH_PList_Value *oldArray, const PCH_PList_Value *newArray, const string &keyPath, vector<PendingItem> &items);
+    static void CompareSets(const PCH_PListTreeHashes &oldHashes, const PCH_PListTreeHashes &newHashes, const PCH_PList_Value *oldSet, const PCH_PList_Value *newSet, const string &keyPath, vector<PendingItem> &items);
+};
+
+#endif /* PCH_PListDiff_hpp */
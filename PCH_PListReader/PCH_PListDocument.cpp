@@ -0,0 +1,652 @@
+//
+//  PCH_PListDocument.cpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-16.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+#include "PCH_PListDocument.hpp"
+
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+
+#include <sys/stat.h>
+
+// The memory used by a single node of the tree (not counting its children), including the string, data or vector it owns. Strings and vectors are counted by their capacity, since that's what was allocated.
+static size_t PCH_NodeMemoryUsage(const PCH_PList_Value *node)
+{
+    size_t result = sizeof(PCH_PList_Value);
+    
+    switch (node->valueType)
+    {
+        case PCH_PList_Value::Data:
+            result += sizeof(vector<char>) + node->value.dataValue->capacity();
+            break;
+        
+        case PCH_PList_Value::AsciiString:
+            result += sizeof(string) + node->value.asciiStringValue->capacity() + 1;
+            break;
+        
+        case PCH_PList_Value::UnicodeString:
+            result += sizeof(wstring) + (node->value.uniStringValue->capacity() + 1) * sizeof(wchar_t);
+            break;
+        
+        case PCH_PList_Value::Array:
+        case PCH_PList_Value::Set:
+            result += sizeof(vector<PCH_PList_Value *>) + node->Elements().capacity() * sizeof(PCH_PList_Value *);
+            break;
+        
+        case PCH_PList_Value::Dict:
+            result += sizeof(vector<PCH_PList_Value::dictStruct>) + node->Entries().capacity() * sizeof(PCH_PList_Value::dictStruct);
+            break;
+        
+        case PCH_PList_Value::IntArray:
+            result += sizeof(vector<int64_t>) + node->value.intArrayValue->capacity() * sizeof(int64_t);
+            break;
+        
+        case PCH_PList_Value::DoubleArray:
+            result += sizeof(vector<double>) + node->value.doubleArrayValue->capacity() * sizeof(double);
+            break;
+        
+        default:
+            break;
+    }
+    
+    return result;
+}
+
+// an estimate of the memory used by each entry in an unordered_map (the node, plus its bucket)
+#define PCH_MAP_ENTRY_OVERHEAD      (3 * sizeof(void *))
+
+shared_ptr<const PCH_PListDocument> PCH_PListDocument::Load(const string &filePath, PCH_PList::ErrorType &error)
+{
+    PCH_PList plist;
+    
+    error = plist.InitializeWithFile(filePath);
+    
+    if (error != PCH_PList::noError)
+    {
+        return shared_ptr<const PCH_PListDocument>();
+    }
+    
+    return Freeze(plist);
+}
+
+shared_ptr<const PCH_PListDocument> PCH_PListDocument::Freeze(PCH_PList &plist)
+{
+    PCH_PList_Value *root = plist.ReleaseRoot();
+    
+    // an empty tree is still a valid (if not very useful) document
+    if (root == NULL)
+    {
+        root = new PCH_PList_Value;
+    }
+    
+    return shared_ptr<const PCH_PListDocument>(new PCH_PListDocument(root));
+}
+
+PCH_PListDocument::PCH_PListDocument(PCH_PList_Value *root)
+{
+    this->root = root;
+    this->fixedBytes = sizeof(PCH_PListDocument);
+    this->cacheBytes = 0;
+    
+    // Give every big dict, every big set and every unicode string a cache entry. This is done up front so that the maps never change once other threads can see the document.
+    vector<const PCH_PList_Value *> nodeStack(1, root);
+    
+    while (!nodeStack.empty())
+    {
+        const PCH_PList_Value *node = nodeStack.back();
+        nodeStack.pop_back();
+        
+        this->fixedBytes += PCH_NodeMemoryUsage(node);
+        
+        if (node->valueType == PCH_PList_Value::UnicodeString)
+        {
+            this->utf8StringSlots.emplace(node, this->utf8StringSlots.size());
+        }
+        else if (node->valueType == PCH_PList_Value::Dict)
+        {
+            if (node->Entries().size() >= PCH_PLIST_DOCUMENT_KEY_INDEX_THRESHOLD)
+            {
+                this->keyIndexSlots.emplace(node, this->keyIndexSlots.size());
+            }
+            
+            for (const PCH_PList_Value::dictStruct &entry : node->Entries())
+            {
+                nodeStack.push_back(entry.key);
+                nodeStack.push_back(entry.val);
+            }
+        }
+        else
+        {
+            if (node->valueType == PCH_PList_Value::Set && node->Elements().size() >= PCH_PLIST_DOCUMENT_SET_INDEX_THRESHOLD)
+            {
+                this->setIndexSlots.emplace(node, this->setIndexSlots.size());
+            }
+            
+            nodeStack.insert(nodeStack.end(), node->Elements().begin(), node->Elements().end());
+        }
+    }
+    
+    size_t slotSize = sizeof(pair<const PCH_PList_Value *, size_t>) + PCH_MAP_ENTRY_OVERHEAD;
+    this->fixedBytes += this->keyIndexSlots.size() * (slotSize + sizeof(atomic<const KeyIndex *>));
+    this->fixedBytes += this->setIndexSlots.size() * (slotSize + sizeof(atomic<const PCH_PListSetIndex *>));
+    this->fixedBytes += this->utf8StringSlots.size() * (slotSize + sizeof(atomic<const string *>));
+    
+    this->keyIndexes = new atomic<const KeyIndex *>[this->keyIndexSlots.size()];
+    
+    for (int i=0; i<this->keyIndexSlots.size(); i++)
+    {
+        this->keyIndexes[i].store(NULL, memory_order_relaxed);
+    }
+    
+    this->setIndexes = new atomic<const PCH_PListSetIndex *>[this->setIndexSlots.size()];
+    
+    for (int i=0; i<this->setIndexSlots.size(); i++)
+    {
+        this->setIndexes[i].store(NULL, memory_order_relaxed);
+    }
+    
+    this->utf8Strings = new atomic<const string *>[this->utf8StringSlots.size()];
+    
+    for (int i=0; i<this->utf8StringSlots.size(); i++)
+    {
+        this->utf8Strings[i].store(NULL, memory_order_relaxed);
+    }
+}
+
+PCH_PListDocument::~PCH_PListDocument()
+{
+    for (int i=0; i<this->keyIndexSlots.size(); i++)
+    {
+        delete this->keyIndexes[i].load(memory_order_relaxed);
+    }
+    
+    delete [] this->keyIndexes;
+    
+    for (int i=0; i<this->setIndexSlots.size(); i++)
+    {
+        delete this->setIndexes[i].load(memory_order_relaxed);
+    }
+    
+    delete [] this->setIndexes;
+    
+    for (int i=0; i<this->utf8StringSlots.size(); i++)
+    {
+        delete this->utf8Strings[i].load(memory_order_relaxed);
+    }
+    
+    delete [] this->utf8Strings;
+    
+    delete this->root;
+}
+
+const string *PCH_PListDocument::StringForValue(const PCH_PList_Value *value) const
+{
+    if (value->valueType == PCH_PList_Value::AsciiString)
+    {
+        return value->value.asciiStringValue;
+    }
+    
+    if (value->valueType != PCH_PList_Value::UnicodeString)
+    {
+        return NULL;
+    }
+    
+    auto slot = this->utf8StringSlots.find(value);
+    
+    // a value that isn't part of this document
+    if (slot == this->utf8StringSlots.end())
+    {
+        return NULL;
+    }
+    
+    atomic<const string *> &cacheEntry = this->utf8Strings[slot->second];
+    
+    const string *result = cacheEntry.load(memory_order_acquire);
+    
+    if (result != NULL)
+    {
+        return result;
+    }
+    
+    const string *newString = new string(PCH_PList::UTF8FromUTF16(*value->value.uniStringValue));
+    
+    // if another thread got there first, use its copy
+    if (!cacheEntry.compare_exchange_strong(result, newString, memory_order_acq_rel))
+    {
+        delete newString;
+        return result;
+    }
+    
+    this->cacheBytes.fetch_add(sizeof(string) + newString->capacity() + 1, memory_order_relaxed);
+    
+    return newString;
+}
+
+const PCH_PListDocument::KeyIndex *PCH_PListDocument::KeyIndexForDict(const PCH_PList_Value *dict, size_t slot) const
+{
+    atomic<const KeyIndex *> &cacheEntry = this->keyIndexes[slot];
+    
+    const KeyIndex *result = cacheEntry.load(memory_order_acquire);
+    
+    if (result != NULL)
+    {
+        return result;
+    }
+    
+    KeyIndex *newIndex = new KeyIndex;
+    newIndex->entries.reserve(dict->Entries().size());
+    
+    for (const PCH_PList_Value::dictStruct &entry : dict->Entries())
+    {
+        const string *key = this->StringForValue(entry.key);
+        
+        if (key != NULL)
+        {
+            newIndex->entries.emplace_back(*key, entry.val);
+        }
+    }
+    
+    // a stable sort keeps duplicate keys in their original order, so the first one is found first
+    stable_sort(newIndex->entries.begin(), newIndex->entries.end(), [](const pair<string, const PCH_PList_Value *> &a, const pair<string, const PCH_PList_Value *> &b) {return a.first < b.first;});
+    
+    if (!cacheEntry.compare_exchange_strong(result, newIndex, memory_order_acq_rel))
+    {
+        delete newIndex;
+        return result;
+    }
+    
+    size_t indexBytes = sizeof(KeyIndex) + newIndex->entries.capacity() * sizeof(pair<string, const PCH_PList_Value *>);
+    
+    for (int i=0; i<newIndex->entries.size(); i++)
+    {
+        indexBytes += newIndex->entries[i].first.capacity() + 1;
+    }
+    
+    this->cacheBytes.fetch_add(indexBytes, memory_order_relaxed);
+    
+    return newIndex;
+}
+
+const PCH_PList_Value *PCH_PListDocument::ValueForKey(const PCH_PList_Value *dict, const string &key) const
+{
+    if (dict->valueType != PCH_PList_Value::Dict)
+    {
+        return NULL;
+    }
+    
+    auto slot = this->keyIndexSlots.find(dict);
+    
+    if (slot != this->keyIndexSlots.end())
+    {
+        const vector<pair<string, const PCH_PList_Value *>> &entries = this->KeyIndexForDict(dict, slot->second)->entries;
+        
+        auto match = lower_bound(entries.begin(), entries.end(), key, [](const pair<string, const PCH_PList_Value *> &entry, const string &key) {return entry.first < key;});
+        
+        if (match != entries.end() && match->first == key)
+        {
+            return match->second;
+        }
+        
+        return NULL;
+    }
+    
+    for (const PCH_PList_Value::dictStruct &entry : dict->Entries())
+    {
+        const string *entryKey = this->StringForValue(entry.key);
+        
+        if (entryKey != NULL && *entryKey == key)
+        {
+            return entry.val;
+        }
+    }
+    
+    return NULL;
+}
+
+const PCH_PListSetIndex *PCH_PListDocument::SetIndexForSet(const PCH_PList_Value *set, size_t slot) const
+{
+    atomic<const PCH_PListSetIndex *> &cacheEntry = this->setIndexes[slot];
+    
+    const PCH_PListSetIndex *result = cacheEntry.load(memory_order_acquire);
+    
+    if (result != NULL)
+    {
+        return result;
+    }
+    
+    const PCH_PListSetIndex *newIndex = new PCH_PListSetIndex(set);
+    
+    if (!cacheEntry.compare_exchange_strong(result, newIndex, memory_order_acq_rel))
+    {
+        delete newIndex;
+        return result;
+    }
+    
+    this->cacheBytes.fetch_add(newIndex->MemoryUsage(), memory_order_relaxed);
+    
+    return newIndex;
+}
+
+const PCH_PList_Value *PCH_PListDocument::SetMember(const PCH_PList_Value *set, const PCH_PList_Value *value) const
+{
+    if (set->valueType != PCH_PList_Value::Set || value == NULL)
+    {
+        return NULL;
+    }
+    
+    auto slot = this->setIndexSlots.find(set);
+    
+    if (slot != this->setIndexSlots.end())
+    {
+        return this->SetIndexForSet(set, slot->second)->Find(value);
+    }
+    
+    for (const PCH_PList_Value *element : set->Elements())
+    {
+        if (PCH_PListDiff::Equal(element, value))
+        {
+            return element;
+        }
+    }
+    
+    return NULL;
+}
+
+const PCH_PList_Value *PCH_PListDocument::SetMemberForString(const PCH_PList_Value *set, const string &str) const
+{
+    if (set->valueType != PCH_PList_Value::Set)
+    {
+        return NULL;
+    }
+    
+    auto slot = this->setIndexSlots.find(set);
+    
+    if (slot != this->setIndexSlots.end())
+    {
+        return this->SetIndexForSet(set, slot->second)->FindString(str.data(), str.size());
+    }
+    
+    for (const PCH_PList_Value *element : set->Elements())
+    {
+        const string *elementString = this->StringForValue(element);
+        
+        if (elementString != NULL && *elementString == str)
+        {
+            return element;
+        }
+    }
+    
+    return NULL;
+}
+
+const PCH_PList_Value *PCH_PListDocument::ValueAtKeyPath(const string &keyPath) const
+{
+    const PCH_PList_Value *result = this->root;
+    
+    // an empty path is the root itself
+    if (keyPath.empty())
+    {
+        return result;
+    }
+    
+    size_t start = 0;
+    
+    while (result != NULL && start <= keyPath.size())
+    {
+        size_t end = keyPath.find('.', start);
+        
+        if (end == string::npos)
+        {
+            end = keyPath.size();
+        }
+        
+        string name = keyPath.substr(start, end - start);
+        
+        if (result->valueType == PCH_PList_Value::Dict)
+        {
+            result = this->ValueForKey(result, name);
+        }
+        else if (result->valueType == PCH_PList_Value::Array || result->valueType == PCH_PList_Value::Set)
+        {
+            // array elements are found by their index
+            char *numberEnd = NULL;
+            unsigned long long index = strtoull(name.c_str(), &numberEnd, 10);
+            
+            if (name.empty() || !isdigit((unsigned char)name[0]) || *numberEnd != 0 || index >= result->Elements().size())
+            {
+                return NULL;
+            }
+            
+            result = result->Elements()[index];
+        }
+        else
+        {
+            return NULL;
+        }
+        
+        start = end + 1;
+    }
+    
+    return result;
+}
+
+PCH_PListDocumentCache::PCH_PListDocumentCache(size_t byteBudget)
+{
+    this->byteBudget = byteBudget;
+    this->bytesUsed = 0;
+    
+    this->numHits = 0;
+    this->numLoads = 0;
+    this->numEvictions = 0;
+}
+
+PCH_PListDocumentCache &PCH_PListDocumentCache::SharedCache()
+{
+    static PCH_PListDocumentCache sharedCache(PCH_PLIST_DOCUMENT_CACHE_DEFAULT_BUDGET);
+    
+    return sharedCache;
+}
+
+bool PCH_PListDocumentCache::FileIdentity::operator==(const FileIdentity &other) const
+{
+    return this->device == other.device && this->inode == other.inode && this->size == other.size && this->modificationSeconds == other.modificationSeconds && this->modificationNanoseconds == other.modificationNanoseconds;
+}
+
+bool PCH_PListDocumentCache::IdentityForFile(const string &filePath, FileIdentity &identity)
+{
+    struct stat fileStat;
+    
+    if (stat(filePath.c_str(), &fileStat) != 0)
+    {
+        return false;
+    }
+    
+    identity.device = fileStat.st_dev;
+    identity.inode = fileStat.st_ino;
+    identity.size = fileStat.st_size;
+    identity.modificationSeconds = (int64_t)fileStat.st_mtime;
+
+#ifdef __APPLE__
+    identity.modificationNanoseconds = (int64_t)fileStat.st_mtimespec.tv_nsec;
+#else
+    identity.modificationNanoseconds = (int64_t)fileStat.st_mtim.tv_nsec;
+#endif
+
+    return true;
+}
+
+shared_ptr<const PCH_PListDocument> PCH_PListDocumentCache::DocumentForFile(const string &filePath, PCH_PList::ErrorType &error)
+{
+    FileIdentity identity;
+    
+    if (!IdentityForFile(filePath, identity))
+    {
+        this->RemoveFile(filePath);
+        
+        error = PCH_PList::errorCouldNotOpenFile;
+        return shared_ptr<const PCH_PListDocument>();
+    }
+    
+    unique_lock<mutex> lock(this->cacheMutex);
+    
+    auto entry = this->entries.find(filePath);
+    
+    // an entry for an older version of the file is thrown away
+    if (entry != this->entries.end() && !(entry->second.identity == identity))
+    {
+        this->RemoveEntry(entry);
+        entry = this->entries.end();
+    }
+    
+    if (entry != this->entries.end())
+    {
+        this->numHits++;
+        
+        CacheEntry &cacheEntry = entry->second;
+        
+        if (!cacheEntry.isLoaded)
+        {
+            // another thread is loading the file, so wait for it (without holding the lock)
+            shared_future<LoadResult> pendingResult = cacheEntry.result;
+            
+            lock.unlock();
+            
+            const LoadResult &result = pendingResult.get();
+            
+            error = result.error;
+            return result.document;
+        }
+        
+        this->lruList.splice(this->lruList.begin(), this->lruList, cacheEntry.lruPosition);
+        
+        shared_ptr<const PCH_PListDocument> document = cacheEntry.result.get().document;
+        
+        // the document's caches may have grown since it was last looked at
+        size_t newBytes = document->MemoryUsage();
+        
+        this->bytesUsed += newBytes - cacheEntry.bytes;
+        cacheEntry.bytes = newBytes;
+        
+        this->EvictToBudget();
+        
+        error = PCH_PList::noError;
+        return document;
+    }
+    
+    // Nobody has loaded the file yet, so this thread does it. The entry is added first so that other threads that want the file wait for this load instead of starting their own.
+    promise<LoadResult> loadPromise;
+    uint64_t loadNumber = ++this->numLoads;
+    
+    CacheEntry &newEntry = this->entries[filePath];
+    newEntry.identity = identity;
+    newEntry.result = loadPromise.get_future().share();
+    newEntry.loadNumber = loadNumber;
+    newEntry.isLoaded = false;
+    newEntry.bytes = 0;
+    
+    lock.unlock();
+    
+    LoadResult result;
+    result.document = PCH_PListDocument::Load(filePath, result.error);
+    
+    loadPromise.set_value(result);
+    
+    lock.lock();
+    
+    // The entry may have been removed (and even replaced by another load) while the file was loading, in which case the document isn't kept. Failed loads aren't kept either, so they're tried again next time.
+    entry = this->entries.find(filePath);
+    
+    if (entry != this->entries.end() && entry->second.loadNumber == loadNumber)
+    {
+        if (result.document)
+        {
+            CacheEntry &cacheEntry = entry->second;
+            cacheEntry.isLoaded = true;
+            cacheEntry.bytes = result.document->MemoryUsage();
+            
+            this->lruList.push_front(filePath);
+            cacheEntry.lruPosition = this->lruList.begin();
+            
+            this->bytesUsed += cacheEntry.bytes;
+            
+            this->EvictToBudget();
+        }
+        else
+        {
+            this->RemoveEntry(entry);
+        }
+    }
+    
+    error = result.error;
+    return result.document;
+}
+
+void PCH_PListDocumentCache::RemoveEntry(unordered_map<string, CacheEntry>::iterator entry)
+{
+    if (entry->second.isLoaded)
+    {
+        this->bytesUsed -= entry->second.bytes;
+        this->lruList.erase(entry->second.lruPosition);
+    }
+    
+    this->entries.erase(entry);
+}
+
+void PCH_PListDocumentCache::EvictToBudget()
+{
+    while (this->bytesUsed > this->byteBudget && !this->lruList.empty())
+    {
+        this->RemoveEntry(this->entries.find(this->lruList.back()));
+        this->numEvictions++;
+    }
+}
+
+void PCH_PListDocumentCache::SetByteBudget(size_t byteBudget)
+{
+    lock_guard<mutex> lock(this->cacheMutex);
+    
+    this->byteBudget = byteBudget;
+    this->EvictToBudget();
+}
+
+void PCH_PListDocumentCache::RemoveFile(const string &filePath)
+{
+    lock_guard<mutex> lock(this->cacheMutex);
+    
+    auto entry = this->entries.find(filePath);
+    
+    if (entry != this->entries.end())
+    {
+        this->RemoveEntry(entry);
+    }
+}
+
+void PCH_PListDocumentCache::RemoveAll()
+{
+    lock_guard<mutex> lock(this->cacheMutex);
+    
+    // files that are being loaded are removed too (the loading threads will see that their entries are gone)
+    this->entries.clear();
+    this->lruList.clear();
+    this->bytesUsed = 0;
+}
+
+PCH_PListDocumentCache::Statistics PCH_PListDocumentCache::CurrentStatistics()
+{
+    lock_guard<mutex> lock(this->cacheMutex);
+    
+    Statistics result;
+    result.numDocuments = this->lruList.size();
+    result.bytesUsed = this->bytesUsed;
+    result.byteBudget = this->byteBudget;
+    result.numHits = this->numHits;
+    result.numLoads = this->numLoads;
+    result.numEvictions = this->numEvictions;
+    
+    return result;
+}
@@ -0,0 +1,202 @@
+//
+//  PCH_PListDocument.hpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-16.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+// A frozen plist that can be shared by any number of threads. A PCH_PList is built to be loaded and then used by one thread (its fields are public and can be changed at any time), so a document takes the PCH_PList_Value tree from it and only hands out const access from then on. Nothing in the tree is changed after the document is created.
+// The only things that are filled in after that are caches: the key index of a big dict (built the first time the dict is searched), the content index of a big set (built the first time the set is searched) and the UTF-8 form of a unicode string (converted the first time it's asked for). Each cache entry has its own atomic pointer, which is published with a single compare-and-swap. Threads never wait for each other; if two threads build the same entry at the same time, one of them throws its copy away.
+
+#ifndef PCH_PListDocument_hpp
+#define PCH_PListDocument_hpp
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <list>
+#include <mutex>
+#include <future>
+
+#include <sys/types.h>
+
+#include "PCH_PList.hpp"
+#include "PCH_PListDiff.hpp"
+
+using namespace std;
+
+// Dicts with at least this many entries get a key index; smaller ones are searched from start to end
+#define PCH_PLIST_DOCUMENT_KEY_INDEX_THRESHOLD      16
+
+// Sets with at least this many elements get a content index (see PCH_PListSetIndex); smaller ones are searched from start to end
+#define PCH_PLIST_DOCUMENT_SET_INDEX_THRESHOLD      16
+
+// the byte budget of PCH_PListDocumentCache::SharedCache() until it is changed
+#define PCH_PLIST_DOCUMENT_CACHE_DEFAULT_BUDGET     (256 * 1024 * 1024)
+
+class PCH_PListDocument
+{
+public:
+    
+    // Load the (binary or XML) plist file at 'filePath' into a new document. Returns an empty pointer (and the reason in 'error') if the file can't be loaded.
+    static shared_ptr<const PCH_PListDocument> Load(const string &filePath, PCH_PList::ErrorType &error);
+    
+    // Make a document from an initialized PCH_PList. The tree is taken from 'plist' without copying it, so plist.plistRoot is NULL afterwards.
+    static shared_ptr<const PCH_PListDocument> Freeze(PCH_PList &plist);
+    
+    ~PCH_PListDocument();
+    
+    PCH_PListDocument(const PCH_PListDocument &) = delete;
+    PCH_PListDocument &operator=(const PCH_PListDocument &) = delete;
+    
+    const PCH_PList_Value *Root() const {return this->root;}
+    
+    // Returns the value for 'key' in 'dict', or NULL if there isn't one (or 'dict' isn't a dict). If the dict has the same key more than once, the first one wins.
+    const PCH_PList_Value *ValueForKey(const PCH_PList_Value *dict, const string &key) const;
+    
+    // Returns the value at 'keyPath' (dictionary keys and/or array indices separated by periods, eg: "$objects.12"), starting at the root, or NULL if there isn't one. The numbers in a packed IntArray or DoubleArray aren't values of their own, so a key path can end at a packed array but not go into it.
+    const PCH_PList_Value *ValueAtKeyPath(const string &keyPath) const;
+    
+    // Returns the element of 'set' with the same content as 'value', or NULL if there isn't one (or 'set' isn't a set). Values are compared the same way as by PCH_PListDiff::Equal(): eg: ASCII and unicode strings with the same text match. 'value' doesn't have to be part of the document.
+    const PCH_PList_Value *SetMember(const PCH_PList_Value *set, const PCH_PList_Value *value) const;
+    bool SetContains(const PCH_PList_Value *set, const PCH_PList_Value *value) const {return (this->SetMember(set, value) != NULL);}
+    
+    // The versions of SetMember() and SetContains() for a string
+    const PCH_PList_Value *SetMemberForString(const PCH_PList_Value *set, const string &str) const;
+    bool SetContainsString(const PCH_PList_Value *set, const string &str) const {return (this->SetMemberForString(set, str) != NULL);}
+    
+    // Returns the UTF-8 form of a string value (NULL if it isn't a string). The result belongs to the document.
+    const string *StringForValue(const PCH_PList_Value *value) const;
+    
+    // The number of bytes of memory used by the document: the tree (every node and the strings, data and vectors it owns), the cache slots and whatever has been added to the caches so far
+    size_t MemoryUsage() const {return this->fixedBytes + this->cacheBytes.load(memory_order_relaxed);}
+    
+private:
+    
+    PCH_PList_Value *root;
+    
+    // the memory used by the tree and cache slots (which never changes), and by the cache entries that have been built
+    size_t fixedBytes;
+    mutable atomic<size_t> cacheBytes;
+    
+    // the sorted keys of a big dict, each with its value
+    struct KeyIndex
+    {
+        vector<pair<string, const PCH_PList_Value *>> entries;
+    };
+    
+    // The position of each cache entry in the arrays below. These maps are filled in by the constructor and never change afterwards, so they can be read without locking.
+    unordered_map<const PCH_PList_Value *, size_t> keyIndexSlots;
+    unordered_map<const PCH_PList_Value *, size_t> setIndexSlots;
+    unordered_map<const PCH_PList_Value *, size_t> utf8StringSlots;
+    
+    // the caches (NULL until an entry is built)
+    atomic<const KeyIndex *> *keyIndexes;
+    atomic<const PCH_PListSetIndex *> *setIndexes;
+    atomic<const string *> *utf8Strings;
+    
+    PCH_PListDocument(PCH_PList_Value *root);
+    
+    const KeyIndex *KeyIndexForDict(const PCH_PList_Value *dict, size_t slot) const;
+    const PCH_PListSetIndex *SetIndexForSet(const PCH_PList_Value *set, size_t slot) const;
+};
+
+// A cache of documents, keyed by file path, so that a file that is opened over and over is only parsed once. A cached document is only used if the file still has the same device, inode, size and modification time; otherwise it is loaded again. Documents are shared, so a document that is evicted from the cache stays valid for as long as someone holds on to it.
+// The cache keeps the total MemoryUsage() of its documents within a byte budget by evicting the least-recently-used ones. If several threads ask for a file that isn't in the cache, it is loaded by the first one and the others wait for it. All member functions can be called from any thread.
+class PCH_PListDocumentCache
+{
+public:
+    
+    PCH_PListDocumentCache(size_t byteBudget);
+    
+    // The cache for the whole process (its budget starts at PCH_PLIST_DOCUMENT_CACHE_DEFAULT_BUDGET)
+    static PCH_PListDocumentCache &SharedCache();
+    
+    // Returns the document for the plist file at 'filePath', loading it if necessary. Returns an empty pointer (and the reason in 'error') if the file can't be loaded. A document that is bigger than the whole budget is still returned, but it isn't kept.
+    shared_ptr<const PCH_PListDocument> DocumentForFile(const string &filePath, PCH_PList::ErrorType &error);
+    
+    // Change the byte budget, evicting documents if necessary
+    void SetByteBudget(size_t byteBudget);
+    
+    // Remove one file (or every file) from the cache
+    void RemoveFile(const string &filePath);
+    void RemoveAll();
+    
+    struct Statistics
+    {
+        size_t numDocuments;
+        size_t bytesUsed;
+        size_t byteBudget;
+        
+        // requests that found a document in the cache (or one that was being loaded by another thread), files that were loaded, and documents that were evicted to stay within the budget
+        uint64_t numHits;
+        uint64_t numLoads;
+        uint64_t numEvictions;
+    };
+    
+    Statistics CurrentStatistics();
+    
+private:
+    
+    // what identifies the version of a file that a document was loaded from
+    struct FileIdentity
+    {
+        dev_t device;
+        ino_t inode;
+        off_t size;
+        int64_t modificationSeconds;
+        int64_t modificationNanoseconds;
+        
+        bool operator==(const FileIdentity &other) const;
+    };
+    
+    struct LoadResult
+    {
+        shared_ptr<const PCH_PListDocument> document;
+        PCH_PList::ErrorType error;
+    };
+    
+    struct CacheEntry
+    {
+        FileIdentity identity;
+        
+        // the load is complete once the future is ready (until then, 'bytes' is 0 and the entry isn't in lruList)
+        shared_future<LoadResult> result;
+        bool isLoaded;
+        
+        // which load created the entry (so that a load can tell whether its entry is still there when it finishes)
+        uint64_t loadNumber;
+        
+        size_t bytes;
+        
+        // the entry's position in lruList
+        list<string>::iterator lruPosition;
+    };
+    
+    mutex cacheMutex;
+    
+    unordered_map<string, CacheEntry> entries;
+    
+    // the paths of the loaded entries, most recently used first
+    list<string> lruList;
+    
+    size_t byteBudget;
+    size_t bytesUsed;
+    
+    uint64_t numHits;
+    uint64_t numLoads;
+    uint64_t numEvictions;
+    
+    static bool IdentityForFile(const string &filePath, FileIdentity &identity);
+    
+    // These must be called with cacheMutex locked
+    void RemoveEntry(unordered_map<string, CacheEntry>::iterator entry);
+    void EvictToBudget();
+};
+
+#endif /* PCH_PListDocument_hpp */
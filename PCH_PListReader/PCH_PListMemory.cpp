@@ -0,0 +1,141 @@
+//
+//  PCH_PListMemory.cpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-20.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+#include "PCH_PListMemory.hpp"
+
+#include <new>
+#include <algorithm>
+#include <cstdint>
+
+// Every node starts this many bytes into its allocation, after the pointer to its resource. None of the node types need more than 8-byte alignment (they hold pointers, int64_t's and doubles), so the nodes stay aligned.
+#define PCH_PLIST_NODE_HEADER_LENGTH    8   // bytes
+
+static_assert(sizeof(PCH_PList_MemoryResource *) <= PCH_PLIST_NODE_HEADER_LENGTH, "The resource pointer doesn't fit in front of the node");
+
+static thread_local PCH_PList_MemoryResource *currentResource = NULL;
+
+PCH_PList_MemoryResource *PCH_PList_MemoryResource::Current()
+{
+    return currentResource;
+}
+
+void *PCH_PList_MemoryResource::AllocateNode(size_t numBytes)
+{
+    PCH_PList_MemoryResource *resource = currentResource;
+    size_t blockSize = numBytes + PCH_PLIST_NODE_HEADER_LENGTH;
+    
+    char *block = (char *)(resource == NULL ? ::operator new(blockSize) : resource->Allocate(blockSize, PCH_PLIST_NODE_HEADER_LENGTH));
+    *(PCH_PList_MemoryResource **)block = resource;
+    
+    return block + PCH_PLIST_NODE_HEADER_LENGTH;
+}
+
+void PCH_PList_MemoryResource::FreeNode(void *node, size_t numBytes)
+{
+    if (node == NULL)
+    {
+        return;
+    }
+    
+    char *block = (char *)node - PCH_PLIST_NODE_HEADER_LENGTH;
+    PCH_PList_MemoryResource *resource = *(PCH_PList_MemoryResource **)block;
+    
+    if (resource == NULL)
+    {
+        ::operator delete(block);
+    }
+    else
+    {
+        resource->Deallocate(block, numBytes + PCH_PLIST_NODE_HEADER_LENGTH, PCH_PLIST_NODE_HEADER_LENGTH);
+    }
+}
+
+PCH_PList_MemoryScope::PCH_PList_MemoryScope(PCH_PList_MemoryResource *resource)
+{
+    this->previousResource = currentResource;
+    
+    if (resource != NULL)
+    {
+        currentResource = resource;
+    }
+}
+
+PCH_PList_MemoryScope::~PCH_PList_MemoryScope()
+{
+    currentResource = this->previousResource;
+}
+
+PCH_PList_MonotonicResource::PCH_PList_MonotonicResource(size_t initialBlockSize)
+{
+    this->nextByte = NULL;
+    this->bytesLeft = 0;
+    this->initialBlockSize = max(initialBlockSize, (size_t)1);
+    this->nextBlockSize = this->initialBlockSize;
+    this->bytesReserved = 0;
+}
+
+PCH_PList_MonotonicResource::~PCH_PList_MonotonicResource()
+{
+    this->Release();
+}
+
+void *PCH_PList_MonotonicResource::Allocate(size_t numBytes, size_t alignment)
+{
+    lock_guard<mutex> lock(this->blockMutex);
+    
+    // the alignment is a power of 2
+    size_t padding = (alignment - ((uintptr_t)this->nextByte & (alignment - 1))) & (alignment - 1);
+    
+    if (this->bytesLeft < padding || this->bytesLeft - padding < numBytes)
+    {
+        // The rest of the current block is abandoned. The new block is big enough for the allocation however it has to be aligned.
+        size_t blockSize = max(this->nextBlockSize, numBytes + alignment);
+        char *block = (char *)::operator new(blockSize);
+        
+        this->blocks.push_back(block);
+        this->bytesReserved += blockSize;
+        this->nextByte = block;
+        this->bytesLeft = blockSize;
+        
+        if (this->nextBlockSize < PCH_PLIST_MONOTONIC_MAX_BLOCK_SIZE)
+        {
+            this->nextBlockSize = min(2 * this->nextBlockSize, (size_t)PCH_PLIST_MONOTONIC_MAX_BLOCK_SIZE);
+        }
+        
+        padding = (alignment - ((uintptr_t)this->nextByte & (alignment - 1))) & (alignment - 1);
+    }
+    
+    char *result = this->nextByte + padding;
+    this->nextByte += padding + numBytes;
+    this->bytesLeft -= padding + numBytes;
+    
+    return result;
+}
+
+void PCH_PList_MonotonicResource::Release()
+{
+    lock_guard<mutex> lock(this->blockMutex);
+    
+    for (int i=0; i<this->blocks.size(); i++)
+    {
+        ::operator delete(this->blocks[i]);
+    }
+    
+    this->blocks.clear();
+    this->nextByte = NULL;
+    this->bytesLeft = 0;
+    this->nextBlockSize = this->initialBlockSize;
+    this->bytesReserved = 0;
+}
+
+size_t PCH_PList_MonotonicResource::BytesReserved()
+{
+    lock_guard<mutex> lock(this->blockMutex);
+    
+    return this->bytesReserved;
+}
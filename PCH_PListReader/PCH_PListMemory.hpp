@@ -0,0 +1,96 @@
+//
+//  PCH_PListMemory.hpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-20.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+// Where the nodes of the library come from. The nodes are the PCH_PList_Entry's that the loader decodes, the PCH_PList_Value's of plist trees and the PCH_UnarchivedBase's of unarchived models. These are by far the most numerous allocations, and they all go through the memory resource that is current on the thread that creates them (the global heap, unless a PCH_PList_MemoryScope says otherwise). PCH_PList::memoryResource and the memoryResource parameter of PCH_UnarchivedModel install one for the duration of a load or an unarchive.
+// This is modelled on std::pmr::memory_resource, which isn't available with the C++14 library that the project is built with. That is also why the strings, vectors and payloads that nodes point at still come from the global heap: they're part of the public types of the tree. So a tree (or model) in a PCH_PList_MonotonicResource is still deleted the usual way, which frees the strings and vectors but doesn't free any of the nodes (that happens all at once, when the resource is released).
+
+#ifndef PCH_PListMemory_hpp
+#define PCH_PListMemory_hpp
+
+#include <stdio.h>
+
+#include <cstddef>
+#include <vector>
+#include <mutex>
+
+using namespace std;
+
+// PCH_PList_MonotonicResource gets its memory in blocks that start at this size and double up to the maximum size (bigger allocations get a block of their own)
+#define PCH_PLIST_MONOTONIC_INITIAL_BLOCK_SIZE  (64 * 1024)         // bytes
+#define PCH_PLIST_MONOTONIC_MAX_BLOCK_SIZE      (4 * 1024 * 1024)   // bytes
+
+class PCH_PList_MemoryResource
+{
+public:
+    
+    virtual ~PCH_PList_MemoryResource() {}
+    
+    virtual void *Allocate(size_t numBytes, size_t alignment) = 0;
+    
+    // 'numBytes' and 'alignment' are the ones that the memory was allocated with
+    virtual void Deallocate(void *memory, size_t numBytes, size_t alignment) = 0;
+    
+    // The resource that new nodes come from on the calling thread (NULL is the global heap)
+    static PCH_PList_MemoryResource *Current();
+    
+    // Used by the operator new and delete of the node types. Each node is preceded by a pointer to the resource that it came from, so it can be deleted anywhere (on another thread, or outside of the scope that it was created in).
+    static void *AllocateNode(size_t numBytes);
+    static void FreeNode(void *node, size_t numBytes);
+};
+
+// While an instance exists, new nodes on the calling thread come from 'resource'. Scopes can be nested, and a scope for NULL leaves the current resource as it is.
+class PCH_PList_MemoryScope
+{
+public:
+    
+    explicit PCH_PList_MemoryScope(PCH_PList_MemoryResource *resource);
+    ~PCH_PList_MemoryScope();
+    
+    PCH_PList_MemoryScope(const PCH_PList_MemoryScope &) = delete;
+    PCH_PList_MemoryScope &operator=(const PCH_PList_MemoryScope &) = delete;
+    
+private:
+    
+    PCH_PList_MemoryResource *previousResource;
+};
+
+// A resource that hands out its blocks one piece after another and never reuses anything: Deallocate() does nothing, and all of the memory is given back at once by Release() (or the destructor), no matter how many nodes were allocated. Unlike std::pmr::monotonic_buffer_resource, it can be shared between threads, since the threads of a parallel unarchive allocate from the same resource.
+class PCH_PList_MonotonicResource : public PCH_PList_MemoryResource
+{
+public:
+    
+    explicit PCH_PList_MonotonicResource(size_t initialBlockSize = PCH_PLIST_MONOTONIC_INITIAL_BLOCK_SIZE);
+    ~PCH_PList_MonotonicResource();
+    
+    PCH_PList_MonotonicResource(const PCH_PList_MonotonicResource &) = delete;
+    PCH_PList_MonotonicResource &operator=(const PCH_PList_MonotonicResource &) = delete;
+    
+    void *Allocate(size_t numBytes, size_t alignment);
+    void Deallocate(void *memory, size_t numBytes, size_t alignment) {}
+    
+    // Give back all of the memory. Everything that was allocated from the resource must have been deleted (or must never be used again) by then.
+    void Release();
+    
+    // the total size of the blocks that the resource holds
+    size_t BytesReserved();
+    
+private:
+    
+    mutex blockMutex;
+    vector<char *> blocks;
+    
+    // the unused part of the newest block
+    char *nextByte;
+    size_t bytesLeft;
+    
+    size_t initialBlockSize;
+    size_t nextBlockSize;
+    size_t bytesReserved;
+};
+
+#endif /* PCH_PListMemory_hpp */
@@ -0,0 +1,934 @@
+//
+//  PCH_PListWriter.cpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-14.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+#include "PCH_PListWriter.hpp"
+#include "PCH_XMLPListParser.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+
+// Returns the number of bytes (1, 2, 4 or 8) needed to hold 'value'
+static int ByteCountForValue(uint64_t value)
+{
+    if (value <= 0xFF)
+    {
+        return 1;
+    }
+    else if (value <= 0xFFFF)
+    {
+        return 2;
+    }
+    else if (value <= 0xFFFFFFFFULL)
+    {
+        return 4;
+    }
+    
+    return 8;
+}
+
+// The finalizer of MurmurHash3, used to combine the content hashes of the children of a container
+static inline uint64_t MixHash(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    
+    return hash;
+}
+
+PCH_BinaryPListWriter::PCH_BinaryPListWriter(ostream &outStream, uint64_t maxObjects) : outStream(outStream)
+{
+    this->InitializeWriter(ByteCountForValue(maxObjects > 0 ? maxObjects - 1 : 0), 0, PCH_PLIST_HEADER_LENGTH);
+    
+    this->outStream.write("bplist00", PCH_PLIST_HEADER_LENGTH);
+}
+
+PCH_BinaryPListWriter::PCH_BinaryPListWriter(ostream &outStream, int objectRefSize, uint64_t firstObjectIndex, uint64_t firstFilePos) : outStream(outStream)
+{
+    this->InitializeWriter(objectRefSize, firstObjectIndex, firstFilePos);
+}
+
+void PCH_BinaryPListWriter::InitializeWriter(int objectRefSize, uint64_t firstObjectIndex, uint64_t firstFilePos)
+{
+    this->numObjects = firstObjectIndex;
+    this->numDuplicates = 0;
+    this->numDuplicateSetElements = 0;
+    this->lastTopLevelObject = 0;
+    
+    this->objectRefSize = objectRefSize;
+    this->tooManyObjects = false;
+    
+    this->offsetSpillFile = NULL;
+    this->numSpilledOffsets = 0;
+    this->offsets.reserve(PCH_BINARY_WRITER_OFFSET_CHUNK);
+    
+    this->openDepth = 0;
+    this->hasPendingKey = false;
+    this->pendingKey = 0;
+    this->pendingKeyHash = 0;
+    this->numOpenSets = 0;
+    this->objectHash = 0;
+    this->hasRoot = false;
+    this->rootObject = 0;
+    this->uniqueObjectsSize = 0;
+    
+    this->filePos = firstFilePos;
+}
+
+PCH_BinaryPListWriter::~PCH_BinaryPListWriter()
+{
+    if (this->offsetSpillFile != NULL)
+    {
+        fclose(this->offsetSpillFile);
+    }
+}
+
+void PCH_BinaryPListWriter::AppendBigEndian(string &dest, uint64_t value, int numBytes)
+{
+    uint64_t bigValue = (uint64_t)PCH_SwapInt64HostToBig((int64_t)value);
+    
+    dest.append((const char *)&bigValue + (8 - numBytes), numBytes);
+}
+
+void PCH_BinaryPListWriter::AppendMarker(uint8_t typeNibble, uint64_t count)
+{
+    // counts of 15 and over don't fit in the marker, so they follow it as an int object
+    if (count < 0x0F)
+    {
+        this->objectBuffer += (char)((typeNibble << 4) | count);
+        return;
+    }
+    
+    this->objectBuffer += (char)((typeNibble << 4) | 0x0F);
+    
+    int countSize = ByteCountForValue(count);
+    int sizeExponent = (countSize == 1 ? 0 : (countSize == 2 ? 1 : (countSize == 4 ? 2 : 3)));
+    
+    this->objectBuffer += (char)(0x10 | sizeExponent);
+    AppendBigEndian(this->objectBuffer, count, countSize);
+}
+
+void PCH_BinaryPListWriter::AppendString(const char *str, size_t length)
+{
+    bool isAscii = true;
+    
+    for (size_t i=0; i<length && isAscii; i++)
+    {
+        isAscii = ((unsigned char)str[i] < 0x80);
+    }
+    
+    if (isAscii)
+    {
+        this->AppendMarker(0x05, length);
+        this->objectBuffer.append(str, length);
+        
+        return;
+    }
+    
+    // everything else is stored as big-endian UTF-16
+    wstring uniString = PCH_PList::UTF16FromUTF8(str, length);
+    
+    this->AppendMarker(0x06, uniString.size());
+    
+    for (size_t i=0; i<uniString.size(); i++)
+    {
+        AppendBigEndian(this->objectBuffer, (uint64_t)uniString[i] & 0xFFFF, 2);
+    }
+}
+
+uint64_t PCH_BinaryPListWriter::NewObjectIndex()
+{
+    if (this->offsets.size() == PCH_BINARY_WRITER_OFFSET_CHUNK)
+    {
+        if (this->offsetSpillFile == NULL)
+        {
+            this->offsetSpillFile = tmpfile();
+        }
+        
+        if (this->offsetSpillFile == NULL || fwrite(this->offsets.data(), sizeof(uint64_t), this->offsets.size(), this->offsetSpillFile) != this->offsets.size())
+        {
+            this->outStream.setstate(ios_base::badbit);
+        }
+        
+        this->numSpilledOffsets += this->offsets.size();
+        this->offsets.clear();
+    }
+    
+    this->offsets.push_back(this->filePos);
+    
+    uint64_t objectIndex = this->numObjects;
+    this->numObjects++;
+    
+    if (this->objectRefSize < 8 && objectIndex >> (8 * this->objectRefSize) != 0)
+    {
+        this->tooManyObjects = true;
+    }
+    
+    return objectIndex;
+}
+
+uint64_t PCH_BinaryPListWriter::WriteObject()
+{
+    // the encoded bytes say everything about an object that isn't a container (the writer always encodes the same content the same way)
+    if (this->numOpenSets > 0)
+    {
+        this->objectHash = MixHash(hash<string>()(this->objectBuffer));
+    }
+    
+    bool checkDuplicates = (this->objectBuffer.size() <= PCH_BINARY_WRITER_MAX_UNIQUE_LENGTH);
+    
+    if (checkDuplicates)
+    {
+        auto existing = this->uniqueObjects.find(this->objectBuffer);
+        
+        if (existing != this->uniqueObjects.end())
+        {
+            this->numDuplicates++;
+            return existing->second;
+        }
+    }
+    
+    uint64_t objectIndex = this->NewObjectIndex();
+    
+    this->outStream.write(this->objectBuffer.data(), this->objectBuffer.size());
+    this->filePos += this->objectBuffer.size();
+    
+    if (checkDuplicates && this->uniqueObjectsSize < PCH_BINARY_WRITER_UNIQUE_TABLE_SIZE)
+    {
+        this->uniqueObjects[this->objectBuffer] = objectIndex;
+        
+        // a rough estimate of what the table entry costs
+        this->uniqueObjectsSize += this->objectBuffer.size() + 64;
+    }
+    
+    return objectIndex;
+}
+
+void PCH_BinaryPListWriter::AddReference(uint64_t objectIndex)
+{
+    if (this->openDepth == 0)
+    {
+        this->lastTopLevelObject = objectIndex;
+        
+        // only the first top-level value is the root (a valid plist only has one)
+        if (!this->hasRoot)
+        {
+            this->rootObject = objectIndex;
+            this->hasRoot = true;
+        }
+        
+        return;
+    }
+    
+    OpenContainer &container = this->openContainers[this->openDepth - 1];
+    
+    if (container.isDict)
+    {
+        // a value without a key can't go into a dictionary
+        if (!this->hasPendingKey)
+        {
+            return;
+        }
+        
+        AppendBigEndian(container.keyRefs, this->pendingKey, this->objectRefSize);
+        this->hasPendingKey = false;
+        
+        // dict entries are added up, so their order doesn't matter
+        if (this->numOpenSets > 0)
+        {
+            container.contentHash += MixHash(MixHash(this->pendingKeyHash) ^ this->objectHash);
+        }
+    }
+    else if (container.isSet)
+    {
+        if (!container.elementHashes.insert(this->objectHash).second)
+        {
+            this->numDuplicateSetElements++;
+            return;
+        }
+        
+        container.contentHash += MixHash(this->objectHash);
+    }
+    else if (this->numOpenSets > 0)
+    {
+        container.contentHash = MixHash(container.contentHash + this->objectHash);
+    }
+    
+    AppendBigEndian(container.valueRefs, objectIndex, this->objectRefSize);
+    container.count++;
+}
+
+void PCH_BinaryPListWriter::BeginContainer(bool isDict, bool isSet)
+{
+    if (this->openDepth == this->openContainers.size())
+    {
+        this->openContainers.push_back(OpenContainer());
+    }
+    
+    OpenContainer &container = this->openContainers[this->openDepth];
+    container.isDict = isDict;
+    container.isSet = isSet;
+    container.count = 0;
+    container.keyRefs.clear();
+    container.valueRefs.clear();
+    
+    // the key that was sent before this container belongs to the parent, so it is kept until the container is finished
+    container.hasParentKey = this->hasPendingKey;
+    container.parentKey = this->pendingKey;
+    container.parentKeyHash = this->pendingKeyHash;
+    this->hasPendingKey = false;
+    
+    // the three kinds of container start from different hashes, so an empty dict, array and set are all different
+    container.contentHash = (isDict ? 1 : (isSet ? 2 : 3));
+    
+    if (isSet)
+    {
+        container.elementHashes.clear();
+        this->numOpenSets++;
+    }
+    
+    this->openDepth++;
+}
+
+void PCH_BinaryPListWriter::BeginDict()
+{
+    this->BeginContainer(true, false);
+}
+
+void PCH_BinaryPListWriter::BeginArray()
+{
+    this->BeginContainer(false, false);
+}
+
+void PCH_BinaryPListWriter::BeginSet()
+{
+    this->BeginContainer(false, true);
+}
+
+void PCH_BinaryPListWriter::EndContainer()
+{
+    if (this->openDepth == 0)
+    {
+        return;
+    }
+    
+    OpenContainer &container = this->openContainers[this->openDepth - 1];
+    
+    this->objectBuffer.clear();
+    this->AppendMarker(container.isDict ? 0x0D : (container.isSet ? 0x0C : 0x0A), container.count);
+    
+    // containers are never shared, so they are written directly instead of going through WriteObject()
+    uint64_t objectIndex = this->NewObjectIndex();
+    
+    this->outStream.write(this->objectBuffer.data(), this->objectBuffer.size());
+    this->outStream.write(container.keyRefs.data(), container.keyRefs.size());
+    this->outStream.write(container.valueRefs.data(), container.valueRefs.size());
+    this->filePos += this->objectBuffer.size() + container.keyRefs.size() + container.valueRefs.size();
+    
+    this->openDepth--;
+    
+    if (container.isSet)
+    {
+        this->numOpenSets--;
+    }
+    
+    this->hasPendingKey = container.hasParentKey;
+    this->pendingKey = container.parentKey;
+    this->pendingKeyHash = container.parentKeyHash;
+    this->objectHash = MixHash(container.contentHash ^ MixHash(container.count));
+    
+    this->AddReference(objectIndex);
+}
+
+void PCH_BinaryPListWriter::EndDict()
+{
+    this->EndContainer();
+}
+
+void PCH_BinaryPListWriter::EndArray()
+{
+    this->EndContainer();
+}
+
+void PCH_BinaryPListWriter::EndSet()
+{
+    this->EndContainer();
+}
+
+void PCH_BinaryPListWriter::Key(const char *str, size_t length)
+{
+    this->objectBuffer.clear();
+    this->AppendString(str, length);
+    
+    this->pendingKey = this->WriteObject();
+    this->pendingKeyHash = this->objectHash;
+    this->hasPendingKey = true;
+}
+
+void PCH_BinaryPListWriter::StringValue(const char *str, size_t length)
+{
+    this->objectBuffer.clear();
+    this->AppendString(str, length);
+    
+    this->AddReference(this->WriteObject());
+}
+
+void PCH_BinaryPListWriter::DataValue(const char *bytes, size_t length)
+{
+    this->objectBuffer.clear();
+    this->AppendMarker(0x04, length);
+    this->objectBuffer.append(bytes, length);
+    
+    this->AddReference(this->WriteObject());
+}
+
+void PCH_BinaryPListWriter::IntValue(int64_t value)
+{
+    // Negative numbers always take 8 bytes; other values use the smallest size that holds them (1, 2 and 4 byte integers are unsigned)
+    int numBytes = (value < 0 ? 8 : ByteCountForValue((uint64_t)value));
+    int sizeExponent = (numBytes == 1 ? 0 : (numBytes == 2 ? 1 : (numBytes == 4 ? 2 : 3)));
+    
+    this->objectBuffer.clear();
+    this->objectBuffer += (char)(0x10 | sizeExponent);
+    AppendBigEndian(this->objectBuffer, (uint64_t)value, numBytes);
+    
+    this->AddReference(this->WriteObject());
+}
+
+void PCH_BinaryPListWriter::RealValue(double value)
+{
+    PCH_DoubleBigEndian bigValue = PCH_SwapDoubleHostToBig(value);
+    
+    this->objectBuffer.clear();
+    this->objectBuffer += (char)0x23;
+    this->objectBuffer.append((const char *)&bigValue, 8);
+    
+    this->AddReference(this->WriteObject());
+}
+
+void PCH_BinaryPListWriter::BoolValue(bool value)
+{
+    this->objectBuffer.clear();
+    this->objectBuffer += (char)(value ? 0x09 : 0x08);
+    
+    this->AddReference(this->WriteObject());
+}
+
+void PCH_BinaryPListWriter::DateValue(double value)
+{
+    PCH_DoubleBigEndian bigValue = PCH_SwapDoubleHostToBig(value);
+    
+    this->objectBuffer.clear();
+    this->objectBuffer += (char)0x33;
+    this->objectBuffer.append((const char *)&bigValue, 8);
+    
+    this->AddReference(this->WriteObject());
+}
+
+void PCH_BinaryPListWriter::UidValue(int64_t value)
+{
+    // UIDs are unsigned, and the marker holds the number of bytes minus one
+    int numBytes = ByteCountForValue((uint64_t)value);
+    
+    this->objectBuffer.clear();
+    this->objectBuffer += (char)(0x80 | (numBytes - 1));
+    AppendBigEndian(this->objectBuffer, (uint64_t)value, numBytes);
+    
+    this->AddReference(this->WriteObject());
+}
+
+void PCH_BinaryPListWriter::RewriteContainer(uint64_t objectIndex, bool isDict, const vector<uint64_t> &keyRefs, const vector<uint64_t> &valueRefs)
+{
+    this->objectBuffer.clear();
+    this->AppendMarker(isDict ? 0x0D : 0x0A, valueRefs.size());
+    
+    if (isDict)
+    {
+        for (size_t i=0; i<keyRefs.size(); i++)
+        {
+            AppendBigEndian(this->objectBuffer, keyRefs[i], this->objectRefSize);
+        }
+    }
+    
+    for (size_t i=0; i<valueRefs.size(); i++)
+    {
+        AppendBigEndian(this->objectBuffer, valueRefs[i], this->objectRefSize);
+    }
+    
+    this->rewrittenContainers.push_back(make_pair(objectIndex, this->filePos));
+    
+    this->outStream.write(this->objectBuffer.data(), this->objectBuffer.size());
+    this->filePos += this->objectBuffer.size();
+}
+
+PCH_PList::ErrorType PCH_BinaryPListWriter::Finish()
+{
+    if (!this->hasRoot || this->openDepth != 0)
+    {
+        cerr << "The plist is incomplete";
+        return PCH_PList::errorNotValidPlistFile;
+    }
+    
+    return this->Finish(vector<uint64_t>(), this->rootObject);
+}
+
+PCH_PList::ErrorType PCH_BinaryPListWriter::Finish(const vector<uint64_t> &previousOffsets, uint64_t topObject)
+{
+    if (this->tooManyObjects)
+    {
+        cerr << "There were more objects than the object reference size allows";
+        return PCH_PList::errorCouldNotWriteFile;
+    }
+    
+    // every object starts before the offset table, so its position sets the size of the offsets
+    uint64_t offsetTableStart = this->filePos;
+    int offsetSize = ByteCountForValue(offsetTableStart);
+    
+    string offsetBytes;
+    offsetBytes.reserve(PCH_BINARY_WRITER_OFFSET_CHUNK * offsetSize);
+    
+    // The offsets of the existing file come first (with the rewritten containers pointing at their new copies). They are converted a chunk at a time to keep the buffer small.
+    size_t nextRewritten = 0;
+    vector<pair<uint64_t, uint64_t>> rewritten = this->rewrittenContainers;
+    sort(rewritten.begin(), rewritten.end());
+    
+    for (size_t chunkStart=0; chunkStart<previousOffsets.size(); chunkStart+=PCH_BINARY_WRITER_OFFSET_CHUNK)
+    {
+        size_t chunkEnd = min(previousOffsets.size(), chunkStart + PCH_BINARY_WRITER_OFFSET_CHUNK);
+        
+        offsetBytes.clear();
+        
+        for (size_t i=chunkStart; i<chunkEnd; i++)
+        {
+            uint64_t offset = previousOffsets[i];
+            
+            // if a container was rewritten more than once, the last copy wins
+            while (nextRewritten < rewritten.size() && rewritten[nextRewritten].first == i)
+            {
+                offset = rewritten[nextRewritten].second;
+                nextRewritten++;
+            }
+            
+            AppendBigEndian(offsetBytes, offset, offsetSize);
+        }
+        
+        this->outStream.write(offsetBytes.data(), offsetBytes.size());
+    }
+    
+    // then the offsets that were moved to the temporary file
+    if (this->offsetSpillFile != NULL)
+    {
+        rewind(this->offsetSpillFile);
+        
+        vector<uint64_t> spilledOffsets(PCH_BINARY_WRITER_OFFSET_CHUNK);
+        uint64_t numLeft = this->numSpilledOffsets;
+        
+        while (numLeft > 0)
+        {
+            size_t numToRead = (size_t)min(numLeft, (uint64_t)PCH_BINARY_WRITER_OFFSET_CHUNK);
+            
+            if (fread(spilledOffsets.data(), sizeof(uint64_t), numToRead, this->offsetSpillFile) != numToRead)
+            {
+                return PCH_PList::errorCouldNotWriteFile;
+            }
+            
+            offsetBytes.clear();
+            
+            for (size_t i=0; i<numToRead; i++)
+            {
+                AppendBigEndian(offsetBytes, spilledOffsets[i], offsetSize);
+            }
+            
+            this->outStream.write(offsetBytes.data(), offsetBytes.size());
+            numLeft -= numToRead;
+        }
+    }
+    
+    offsetBytes.clear();
+    
+    for (size_t i=0; i<this->offsets.size(); i++)
+    {
+        AppendBigEndian(offsetBytes, this->offsets[i], offsetSize);
+    }
+    
+    // The trailer starts with 5 unused bytes and the "sort version", followed by the sizes, the number of objects, the root object and the position of the offset table
+    offsetBytes.append(6, (char)0);
+    offsetBytes += (char)offsetSize;
+    offsetBytes += (char)this->objectRefSize;
+    AppendBigEndian(offsetBytes, this->numObjects, 8);
+    AppendBigEndian(offsetBytes, topObject, 8);
+    AppendBigEndian(offsetBytes, offsetTableStart, 8);
+    
+    this->outStream.write(offsetBytes.data(), offsetBytes.size());
+    this->outStream.flush();
+    
+    if (!this->outStream.good())
+    {
+        cerr << "Could not write the plist";
+        return PCH_PList::errorCouldNotWriteFile;
+    }
+    
+    return PCH_PList::noError;
+}
+
+PCH_XMLPListWriter::PCH_XMLPListWriter(ostream &outStream) : outStream(outStream)
+{
+    this->depth = 0;
+    this->pendingOpenTag = NULL;
+    
+    this->buffer.reserve(PCH_XML_WRITER_BUFFER_SIZE + 1024);
+    this->buffer += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    this->buffer += "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n";
+    this->buffer += "<plist version=\"1.0\">\n";
+}
+
+void PCH_XMLPListWriter::FlushIfNeeded()
+{
+    if (this->buffer.size() >= PCH_XML_WRITER_BUFFER_SIZE)
+    {
+        this->outStream.write(this->buffer.data(), this->buffer.size());
+        this->buffer.clear();
+    }
+}
+
+void PCH_XMLPListWriter::BeginLine()
+{
+    if (this->pendingOpenTag != NULL)
+    {
+        this->buffer += '<';
+        this->buffer += this->pendingOpenTag;
+        this->buffer += ">\n";
+        
+        this->pendingOpenTag = NULL;
+    }
+    
+    // the root object isn't indented
+    this->buffer.append(this->depth, '\t');
+}
+
+void PCH_XMLPListWriter::AppendEscaped(const char *str, size_t length)
+{
+    const char *runStart = str;
+    const char *end = str + length;
+    
+    for (const char *next = str; next < end; next++)
+    {
+        const char *entity = NULL;
+        
+        if (*next == '<')
+        {
+            entity = "&lt;";
+        }
+        else if (*next == '>')
+        {
+            entity = "&gt;";
+        }
+        else if (*next == '&')
+        {
+            entity = "&amp;";
+        }
+        
+        if (entity != NULL)
+        {
+            this->buffer.append(runStart, next - runStart);
+            this->buffer += entity;
+            runStart = next + 1;
+        }
+    }
+    
+    this->buffer.append(runStart, end - runStart);
+}
+
+void PCH_XMLPListWriter::AppendElement(const char *tag, const char *text, size_t length)
+{
+    this->BeginLine();
+    
+    this->buffer += '<';
+    this->buffer += tag;
+    this->buffer += '>';
+    this->buffer.append(text, length);
+    this->buffer += "</";
+    this->buffer += tag;
+    this->buffer += ">\n";
+    
+    this->FlushIfNeeded();
+}
+
+void PCH_XMLPListWriter::BeginDict()
+{
+    this->BeginLine();
+    
+    this->pendingOpenTag = "dict";
+    this->depth++;
+    
+    // a long run of nested containers adds nothing but opening tags and indentation, which have to be flushed too
+    this->FlushIfNeeded();
+}
+
+void PCH_XMLPListWriter::BeginArray()
+{
+    this->BeginLine();
+    
+    this->pendingOpenTag = "array";
+    this->depth++;
+    
+    this->FlushIfNeeded();
+}
+
+void PCH_XMLPListWriter::EndDict()
+{
+    this->depth--;
+    
+    if (this->pendingOpenTag != NULL)
+    {
+        this->buffer += "<dict/>\n";
+        this->pendingOpenTag = NULL;
+    }
+    else
+    {
+        this->buffer.append(this->depth, '\t');
+        this->buffer += "</dict>\n";
+    }
+    
+    this->FlushIfNeeded();
+}
+
+void PCH_XMLPListWriter::EndArray()
+{
+    this->depth--;
+    
+    if (this->pendingOpenTag != NULL)
+    {
+        this->buffer += "<array/>\n";
+        this->pendingOpenTag = NULL;
+    }
+    else
+    {
+        this->buffer.append(this->depth, '\t');
+        this->buffer += "</array>\n";
+    }
+    
+    this->FlushIfNeeded();
+}
+
+void PCH_XMLPListWriter::Key(const char *str, size_t length)
+{
+    this->BeginLine();
+    
+    this->buffer += "<key>";
+    this->AppendEscaped(str, length);
+    this->buffer += "</key>\n";
+    
+    this->FlushIfNeeded();
+}
+
+void PCH_XMLPListWriter::StringValue(const char *str, size_t length)
+{
+    this->BeginLine();
+    
+    this->buffer += "<string>";
+    this->AppendEscaped(str, length);
+    this->buffer += "</string>\n";
+    
+    this->FlushIfNeeded();
+}
+
+void PCH_XMLPListWriter::DataValue(const char *bytes, size_t length)
+{
+    static const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    
+    this->BeginLine();
+    
+    this->buffer += "<data>";
+    
+    const unsigned char *src = (const unsigned char *)bytes;
+    size_t i = 0;
+    
+    for (; i + 3 <= length; i += 3)
+    {
+        uint32_t triple = (src[i] << 16) | (src[i+1] << 8) | src[i+2];
+        
+        this->buffer += digits[(triple >> 18) & 0x3F];
+        this->buffer += digits[(triple >> 12) & 0x3F];
+        this->buffer += digits[(triple >> 6) & 0x3F];
+        this->buffer += digits[triple & 0x3F];
+    }
+    
+    // the last one or two bytes are padded with '='
+    if (i < length)
+    {
+        uint32_t triple = (src[i] << 16) | (i + 1 < length ? src[i+1] << 8 : 0);
+        
+        this->buffer += digits[(triple >> 18) & 0x3F];
+        this->buffer += digits[(triple >> 12) & 0x3F];
+        this->buffer += (i + 1 < length ? digits[(triple >> 6) & 0x3F] : '=');
+        this->buffer += '=';
+    }
+    
+    this->buffer += "</data>\n";
+    
+    this->FlushIfNeeded();
+}
+
+void PCH_XMLPListWriter::IntValue(int64_t value)
+{
+    char numBuff[32];
+    int numLength = snprintf(numBuff, sizeof(numBuff), "%lld", (long long)value);
+    
+    this->AppendElement("integer", numBuff, numLength);
+}
+
+void PCH_XMLPListWriter::RealValue(double value)
+{
+    char numBuff[64];
+    int numLength;
+    
+    if (std::isnan(value))
+    {
+        numLength = snprintf(numBuff, sizeof(numBuff), "nan");
+    }
+    else if (std::isinf(value))
+    {
+        numLength = snprintf(numBuff, sizeof(numBuff), value > 0 ? "+infinity" : "-infinity");
+    }
+    else
+    {
+        // use the shortest form that reads back as the same number
+        numLength = snprintf(numBuff, sizeof(numBuff), "%.15g", value);
+        
+        if (strtod(numBuff, NULL) != value)
+        {
+            numLength = snprintf(numBuff, sizeof(numBuff), "%.17g", value);
+        }
+    }
+    
+    this->AppendElement("real", numBuff, numLength);
+}
+
+void PCH_XMLPListWriter::BoolValue(bool value)
+{
+    this->BeginLine();
+    
+    this->buffer += (value ? "<true/>\n" : "<false/>\n");
+    
+    this->FlushIfNeeded();
+}
+
+void PCH_XMLPListWriter::DateValue(double value)
+{
+    string dateString = PCH_XMLPListParser::ISO8601FromDate(value);
+    
+    this->AppendElement("date", dateString.data(), dateString.size());
+}
+
+PCH_PList::ErrorType PCH_XMLPListWriter::Finish()
+{
+    this->buffer += "</plist>\n";
+    
+    this->outStream.write(this->buffer.data(), this->buffer.size());
+    this->buffer.clear();
+    
+    this->outStream.flush();
+    
+    if (!this->outStream.good())
+    {
+        cerr << "Could not write the plist";
+        return PCH_PList::errorCouldNotWriteFile;
+    }
+    
+    return PCH_PList::noError;
+}
+
+PCH_PList::ErrorType PCH_PListConverter::ConvertFile(string inputPath, string outputPath, OutputFormat outputFormat)
+{
+    ifstream inFile;
+    
+    inFile.open(inputPath.c_str(), ios::in | ios::binary);
+    
+    if (!inFile.is_open())
+    {
+        return PCH_PList::errorCouldNotOpenFile;
+    }
+    
+    char firstBytes[64];
+    inFile.read(firstBytes, sizeof(firstBytes));
+    bool inputIsXML = PCH_XMLPListParser::IsXMLPList(firstBytes, (size_t)inFile.gcount());
+    
+    inFile.clear();
+    inFile.seekg(0, ios_base::end);
+    uint64_t inputLength = (uint64_t)inFile.tellg();
+    inFile.close();
+    
+    // a bigger buffer than the default means fewer (and larger) writes
+    vector<char> outBuffer(1024 * 1024);
+    ofstream outFile;
+    bool useStdout = (outputPath.compare("-") == 0);
+    
+    if (!useStdout)
+    {
+        outFile.rdbuf()->pubsetbuf(outBuffer.data(), outBuffer.size());
+        outFile.open(outputPath.c_str(), ios::out | ios::binary | ios::trunc);
+        
+        if (!outFile.is_open())
+        {
+            return PCH_PList::errorCouldNotWriteFile;
+        }
+    }
+    
+    ostream &outStream = (useStdout ? cout : outFile);
+    
+    PCH_PList::ErrorType err;
+    
+    if (outputFormat == xmlFormat)
+    {
+        PCH_XMLPListWriter writer(outStream);
+        
+        err = PCH_PList::SendFileEvents(inputPath, writer);
+        
+        if (err == PCH_PList::noError)
+        {
+            err = writer.Finish();
+        }
+        
+        return err;
+    }
+    
+    // The binary writer needs to know how many objects there could be. Every object in an XML plist takes at least 6 bytes ("<key/>"), which is close enough. A binary plist can refer to the same object from many places, and each of those becomes its own object in the output (before duplicates are removed), so the only way to know is to count them.
+    uint64_t maxObjects = inputLength / 6 + 1;
+    
+    if (!inputIsXML)
+    {
+        PCH_PListObjectCounter counter;
+        
+        err = PCH_PList::SendFileEvents(inputPath, counter);
+        
+        if (err != PCH_PList::noError)
+        {
+            return err;
+        }
+        
+        maxObjects = counter.numObjects;
+    }
+    
+    PCH_BinaryPListWriter writer(outStream, maxObjects);
+    
+    err = PCH_PList::SendFileEvents(inputPath, writer);
+    
+    if (err == PCH_PList::noError)
+    {
+        err = writer.Finish();
+    }
+    
+    return err;
+}
@@ -0,0 +1,243 @@
+//
+//  PCH_PListWriter.hpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-14.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+// Writers for binary and XML plists. Both writers are PCH_PListEventHandler's, so they can be fed directly by PCH_XMLPListParser or PCH_PList::SendFileEvents() without a PCH_PList_Value tree in between, and they write to their output stream as the events arrive. PCH_PListConverter (at the end of this file) connects a reader to a writer to convert a file from one format to the other.
+
+#ifndef PCH_PListWriter_hpp
+#define PCH_PListWriter_hpp
+
+#include <stdio.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "PCH_PList.hpp"
+
+using namespace std;
+
+// The number of offset table entries that PCH_BinaryPListWriter keeps in memory. Older entries are moved to a temporary file until the table is written at the end.
+#define PCH_BINARY_WRITER_OFFSET_CHUNK          (1024 * 1024)
+
+// Objects (other than containers) up to this many bytes long are written only once, with every later copy replaced by a reference to the first one. The table used to find the copies is limited to the given number of bytes; once it is full, new objects are no longer added to it.
+#define PCH_BINARY_WRITER_MAX_UNIQUE_LENGTH     256
+#define PCH_BINARY_WRITER_UNIQUE_TABLE_SIZE     (64 * 1024 * 1024)
+
+// The XML writer collects its output in a buffer of about this size before writing it to the stream
+#define PCH_XML_WRITER_BUFFER_SIZE              (64 * 1024)
+
+class PCH_BinaryPListWriter : public PCH_PListEventHandler
+{
+public:
+    
+    // 'maxObjects' is an upper limit on the number of objects that will be written. It is needed to choose the size of the object references up front, since the contents of a container are written before the container itself.
+    PCH_BinaryPListWriter(ostream &outStream, uint64_t maxObjects);
+    
+    // A writer for objects that are appended to an existing binary plist (see PCH_PList::UpdateFile()). No header is written; the first new object gets index 'firstObjectIndex' and is placed at 'firstFilePos' in the file.
+    PCH_BinaryPListWriter(ostream &outStream, int objectRefSize, uint64_t firstObjectIndex, uint64_t firstFilePos);
+    
+    virtual ~PCH_BinaryPListWriter();
+    
+    virtual void BeginDict();
+    virtual void EndDict();
+    virtual void BeginArray();
+    virtual void EndArray();
+    virtual void Key(const char *str, size_t length);
+    virtual void StringValue(const char *str, size_t length);
+    virtual void DataValue(const char *bytes, size_t length);
+    virtual void IntValue(int64_t value);
+    virtual void RealValue(double value);
+    virtual void BoolValue(bool value);
+    virtual void DateValue(double value);
+    virtual void UidValue(int64_t value);
+    
+    // Sets are written without duplicates: an element with the same content as an earlier element of the same set is left out. Content is compared by hash (containers are hashed from their children as they are written, with the entries of dicts and the elements of sets in any order), so it costs nothing outside of sets. The objects of an element that is left out have already been written by then; they stay in the file, but nothing refers to them.
+    virtual void BeginSet();
+    virtual void EndSet();
+    
+    // Write a new copy of the existing container 'objectIndex' with the given references (keyRefs is ignored for arrays). Finish() points the offset table entry for objectIndex at the new copy.
+    void RewriteContainer(uint64_t objectIndex, bool isDict, const vector<uint64_t> &keyRefs, const vector<uint64_t> &valueRefs);
+    
+    // Write the offset table and the trailer. This must be called after the root object is complete.
+    PCH_PList::ErrorType Finish();
+    
+    // The version of Finish() for appending: 'previousOffsets' is the offset table of the existing file (which has firstObjectIndex entries) and 'topObject' is its root
+    PCH_PList::ErrorType Finish(const vector<uint64_t> &previousOffsets, uint64_t topObject);
+    
+    // the number of objects in the file, and the number of values that were written as references to an identical object
+    uint64_t numObjects;
+    uint64_t numDuplicates;
+    
+    // the number of set elements that were left out because they were the same as another element of their set
+    uint64_t numDuplicateSetElements;
+    
+    // the index of the most recent value sent outside of any dict or array
+    uint64_t lastTopLevelObject;
+    
+    // set if there are more objects than the object reference size allows (Finish() will fail)
+    bool tooManyObjects;
+    
+private:
+    
+    ostream &outStream;
+    uint64_t filePos;
+    int objectRefSize;
+    
+    // the existing containers that were written again by RewriteContainer(), and their new positions
+    vector<pair<uint64_t, uint64_t>> rewrittenContainers;
+    
+    // the offset table: the most recent entries are in memory, the rest are in a temporary file (in the host's byte order)
+    vector<uint64_t> offsets;
+    FILE *offsetSpillFile;
+    uint64_t numSpilledOffsets;
+    
+    // The containers that are currently open. Their references are kept in the form they will be written (big-endian, objectRefSize bytes each). Entries past openDepth are finished containers that are kept so their buffers can be reused.
+    struct OpenContainer
+    {
+        bool isDict;
+        bool isSet;
+        uint64_t count;
+        string keyRefs;
+        string valueRefs;
+        
+        // the key for this container in its parent dict
+        bool hasParentKey;
+        uint64_t parentKey;
+        uint64_t parentKeyHash;
+        
+        // the content hash so far (only kept while a set is open), and the hashes of the elements of a set
+        uint64_t contentHash;
+        unordered_set<uint64_t> elementHashes;
+    };
+    
+    vector<OpenContainer> openContainers;
+    size_t openDepth;
+    
+    bool hasPendingKey;
+    uint64_t pendingKey;
+    uint64_t pendingKeyHash;
+    
+    // The number of open sets. Content hashes are only needed inside a set, so they are only worked out while this isn't 0.
+    int numOpenSets;
+    
+    // the content hash of the most recent object
+    uint64_t objectHash;
+    
+    bool hasRoot;
+    uint64_t rootObject;
+    
+    // the encoded bytes of the objects that have been written, and their indices
+    unordered_map<string, uint64_t> uniqueObjects;
+    size_t uniqueObjectsSize;
+    
+    // the object that is being encoded
+    string objectBuffer;
+    
+    void InitializeWriter(int objectRefSize, uint64_t firstObjectIndex, uint64_t firstFilePos);
+    
+    static void AppendBigEndian(string &dest, uint64_t value, int numBytes);
+    
+    // append the marker byte (and count, if necessary) for an object of type 'typeNibble' with 'count' bytes or elements
+    void AppendMarker(uint8_t typeNibble, uint64_t count);
+    
+    void AppendString(const char *str, size_t length);
+    
+    // Write the object in objectBuffer (unless it's a copy of an object that was already written), returning its index
+    uint64_t WriteObject();
+    
+    uint64_t NewObjectIndex();
+    
+    void AddReference(uint64_t objectIndex);
+    
+    void BeginContainer(bool isDict, bool isSet);
+    void EndContainer();
+};
+
+class PCH_XMLPListWriter : public PCH_PListEventHandler
+{
+public:
+    
+    // The XML declaration, DOCTYPE and <plist> tag are written right away
+    PCH_XMLPListWriter(ostream &outStream);
+    
+    virtual void BeginDict();
+    virtual void EndDict();
+    virtual void BeginArray();
+    virtual void EndArray();
+    virtual void Key(const char *str, size_t length);
+    virtual void StringValue(const char *str, size_t length);
+    virtual void DataValue(const char *bytes, size_t length);
+    virtual void IntValue(int64_t value);
+    virtual void RealValue(double value);
+    virtual void BoolValue(bool value);
+    virtual void DateValue(double value);
+    
+    // Write the closing </plist> tag and flush the output. This must be called after the root object is complete.
+    PCH_PList::ErrorType Finish();
+    
+private:
+    
+    ostream &outStream;
+    string buffer;
+    
+    // the number of open containers
+    int depth;
+    
+    // The opening tag of the most recently opened container ("dict" or "array"), if it hasn't been written yet. It is held back so that empty containers can be written as "<dict/>".
+    const char *pendingOpenTag;
+    
+    // write any pending opening tag and the indentation for a new line
+    void BeginLine();
+    
+    void AppendEscaped(const char *str, size_t length);
+    
+    void AppendElement(const char *tag, const char *text, size_t length);
+    
+    void FlushIfNeeded();
+};
+
+// An event handler that only counts the objects that a PCH_BinaryPListWriter would write (before duplicates are removed)
+class PCH_PListObjectCounter : public PCH_PListEventHandler
+{
+public:
+    
+    uint64_t numObjects;
+    
+    PCH_PListObjectCounter() {this->numObjects = 0;}
+    
+    virtual void BeginDict() {this->numObjects++;}
+    virtual void EndDict() {}
+    virtual void BeginArray() {this->numObjects++;}
+    virtual void EndArray() {}
+    virtual void Key(const char *str, size_t length) {this->numObjects++;}
+    virtual void StringValue(const char *str, size_t length) {this->numObjects++;}
+    virtual void DataValue(const char *bytes, size_t length) {this->numObjects++;}
+    virtual void IntValue(int64_t value) {this->numObjects++;}
+    virtual void RealValue(double value) {this->numObjects++;}
+    virtual void BoolValue(bool value) {this->numObjects++;}
+    virtual void DateValue(double value) {this->numObjects++;}
+    virtual void UidValue(int64_t value) {this->numObjects++;}
+};
+
+class PCH_PListConverter
+{
+public:
+    
+    enum OutputFormat
+    {
+        binaryFormat,
+        xmlFormat
+    };
+    
+    // Convert the plist file at 'inputPath' (binary or XML) into 'outputFormat', writing it to 'outputPath' ("-" writes to stdout). The input is streamed from a memory mapping straight into the writer, so no PCH_PList_Value tree is built.
+    static PCH_PList::ErrorType ConvertFile(string inputPath, string outputPath, OutputFormat outputFormat);
+};
+
+#endif /* PCH_PListWriter_hpp */
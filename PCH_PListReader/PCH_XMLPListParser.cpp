@@ -0,0 +1,730 @@
+//
+//  PCH_XMLPListParser.cpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-12.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+#include "PCH_XMLPListParser.hpp"
+
+#include <cstring>
+#include <cstdlib>
+
+// The number of seconds between 1970-01-01 (the Unix epoch) and 2001-01-01 (Apple's reference date)
+#define PCH_SECONDS_FROM_1970_TO_2001   978307200.0
+
+// Character classes used by the scanner. Using a table means that every test is a single load, no matter how many characters are in the class.
+enum
+{
+    xmlWhitespace = 0x01,
+    xmlNameEnd = 0x02 // characters that end an element name
+};
+
+static const unsigned char xmlCharClass[256] = {
+
+    // 0x00 - 0x0F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, xmlWhitespace | xmlNameEnd, xmlWhitespace | xmlNameEnd, 0, 0, xmlWhitespace | xmlNameEnd, 0, 0,
+    // 0x10 - 0x1F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    // 0x20 - 0x2F (space and '/')
+    xmlWhitespace | xmlNameEnd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, xmlNameEnd,
+    // 0x30 - 0x3F ('>')
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, xmlNameEnd, 0
+    
+    // everything else is 0
+};
+
+// Base64 decoding table: 0-63 are digit values, 64 is whitespace (skipped), 65 is padding ('='), 255 is invalid
+static unsigned char base64DecodeTable[256];
+static bool base64TableInitialized = false;
+
+static void InitializeBase64Table()
+{
+    const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    
+    memset(base64DecodeTable, 255, sizeof(base64DecodeTable));
+    
+    for (int i=0; i<64; i++)
+    {
+        base64DecodeTable[(unsigned char)digits[i]] = (unsigned char)i;
+    }
+    
+    base64DecodeTable[(unsigned char)' '] = 64;
+    base64DecodeTable[(unsigned char)'\t'] = 64;
+    base64DecodeTable[(unsigned char)'\n'] = 64;
+    base64DecodeTable[(unsigned char)'\r'] = 64;
+    base64DecodeTable[(unsigned char)'='] = 65;
+    
+    base64TableInitialized = true;
+}
+
+// Find the first occurrence of 'c' in [start, end). memchr() is vectorized by the system library on every platform we care about (SSE2/AVX2 on Intel, NEON on Apple Silicon), so this is where the "SIMD" scanning happens.
+static inline char *FindChar(char *start, char *end, char c)
+{
+    if (start >= end)
+    {
+        return NULL;
+    }
+    
+    return (char *)memchr(start, c, end - start);
+}
+
+// Find the first occurrence of the string 'str' in [start, end)
+static char *FindString(char *start, char *end, const char *str)
+{
+    size_t strLength = strlen(str);
+    
+    while (start != NULL && start + strLength <= end)
+    {
+        start = FindChar(start, end, str[0]);
+        
+        if (start == NULL || start + strLength > end)
+        {
+            return NULL;
+        }
+        
+        if (memcmp(start, str, strLength) == 0)
+        {
+            return start;
+        }
+        
+        start++;
+    }
+    
+    return NULL;
+}
+
+static inline char *SkipWhitespace(char *start, char *end)
+{
+    while (start < end && (xmlCharClass[(unsigned char)*start] & xmlWhitespace))
+    {
+        start++;
+    }
+    
+    return start;
+}
+
+// Append the code point to 'dest' as UTF-8, returning the new end of 'dest'
+static char *AppendUTF8(char *dest, uint32_t codePoint)
+{
+    if (codePoint < 0x80)
+    {
+        *dest++ = (char)codePoint;
+    }
+    else if (codePoint < 0x800)
+    {
+        *dest++ = (char)(0xC0 | (codePoint >> 6));
+        *dest++ = (char)(0x80 | (codePoint & 0x3F));
+    }
+    else if (codePoint < 0x10000)
+    {
+        *dest++ = (char)(0xE0 | (codePoint >> 12));
+        *dest++ = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+        *dest++ = (char)(0x80 | (codePoint & 0x3F));
+    }
+    else
+    {
+        *dest++ = (char)(0xF0 | (codePoint >> 18));
+        *dest++ = (char)(0x80 | ((codePoint >> 12) & 0x3F));
+        *dest++ = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+        *dest++ = (char)(0x80 | (codePoint & 0x3F));
+    }
+    
+    return dest;
+}
+
+// NSKeyedArchiver UIDs are written in XML as "<dict><key>CF$UID</key><integer>n</integer></dict>". Check whether the contents of the dict that starts at 'start' (just after the <dict> tag) are exactly that. If they are, the UID is returned in 'uid' and 'afterDict' points just past the </dict>.
+static bool MatchUIDDict(char *start, char *end, int64_t &uid, char *&afterDict)
+{
+    char *cursor = SkipWhitespace(start, end);
+    
+    if (end - cursor < 17 || memcmp(cursor, "<key>CF$UID</key>", 17) != 0)
+    {
+        return false;
+    }
+    
+    cursor = SkipWhitespace(cursor + 17, end);
+    
+    if (end - cursor < 9 || memcmp(cursor, "<integer>", 9) != 0)
+    {
+        return false;
+    }
+    
+    cursor += 9;
+    
+    char *digits = cursor;
+    uint64_t value = 0;
+    
+    while (cursor < end && *cursor >= '0' && *cursor <= '9')
+    {
+        value = value * 10 + (*cursor - '0');
+        cursor++;
+    }
+    
+    if (cursor == digits || end - cursor < 10 || memcmp(cursor, "</integer>", 10) != 0)
+    {
+        return false;
+    }
+    
+    cursor = SkipWhitespace(cursor + 10, end);
+    
+    if (end - cursor < 7 || memcmp(cursor, "</dict>", 7) != 0)
+    {
+        return false;
+    }
+    
+    uid = (int64_t)value;
+    afterDict = cursor + 7;
+    
+    return true;
+}
+
+bool PCH_XMLPListParser::IsXMLPList(const char *buffer, size_t length)
+{
+    char *start = (char *)buffer;
+    char *end = start + length;
+    
+    // skip the UTF-8 byte-order mark, if there is one
+    if (length >= 3 && memcmp(start, "\xEF\xBB\xBF", 3) == 0)
+    {
+        start += 3;
+    }
+    
+    start = SkipWhitespace(start, end);
+    
+    return (end - start >= 6 && (memcmp(start, "<?xml", 5) == 0 || memcmp(start, "<plist", 6) == 0 || memcmp(start, "<!DOC", 5) == 0));
+}
+
+char *PCH_XMLPListParser::DecodeText(char *textStart, char *end, size_t &textLength)
+{
+    // 'dest' trails 'src' (decoded text is never longer than the original), so everything can be done in place
+    char *src = textStart;
+    char *dest = textStart;
+    
+    while (true)
+    {
+        char *nextTag = FindChar(src, end, '<');
+        
+        if (nextTag == NULL)
+        {
+            return NULL;
+        }
+        
+        // handle the entities between here and the next tag. In the common case there aren't any and this is a single memchr().
+        char *nextEntity = FindChar(src, nextTag, '&');
+        
+        while (nextEntity != NULL)
+        {
+            // copy the plain text before the entity
+            if (dest != src)
+            {
+                memmove(dest, src, nextEntity - src);
+            }
+            
+            dest += nextEntity - src;
+            
+            char *entityEnd = FindChar(nextEntity, nextTag, ';');
+            
+            if (entityEnd == NULL)
+            {
+                return NULL;
+            }
+            
+            char *entity = nextEntity + 1;
+            size_t entityLength = entityEnd - entity;
+            
+            if (entityLength == 2 && memcmp(entity, "lt", 2) == 0)
+            {
+                *dest++ = '<';
+            }
+            else if (entityLength == 2 && memcmp(entity, "gt", 2) == 0)
+            {
+                *dest++ = '>';
+            }
+            else if (entityLength == 3 && memcmp(entity, "amp", 3) == 0)
+            {
+                *dest++ = '&';
+            }
+            else if (entityLength == 4 && memcmp(entity, "quot", 4) == 0)
+            {
+                *dest++ = '"';
+            }
+            else if (entityLength == 4 && memcmp(entity, "apos", 4) == 0)
+            {
+                *dest++ = '\'';
+            }
+            else if (entityLength >= 2 && entity[0] == '#')
+            {
+                // a numeric character reference; the UTF-8 encoding is never longer than the reference itself
+                uint32_t codePoint = (uint32_t)strtoul(entity + (entity[1] == 'x' ? 2 : 1), NULL, (entity[1] == 'x' ? 16 : 10));
+                dest = AppendUTF8(dest, codePoint);
+            }
+            else
+            {
+                return NULL;
+            }
+            
+            src = entityEnd + 1;
+            nextEntity = FindChar(src, nextTag, '&');
+        }
+        
+        // copy the rest of the text up to the tag
+        if (dest != src)
+        {
+            memmove(dest, src, nextTag - src);
+        }
+        
+        dest += nextTag - src;
+        src = nextTag;
+        
+        // a CDATA section is copied verbatim, after which there may be more text
+        if (end - src >= 9 && memcmp(src, "<![CDATA[", 9) == 0)
+        {
+            char *cdataStart = src + 9;
+            char *cdataEnd = FindString(cdataStart, end, "]]>");
+            
+            if (cdataEnd == NULL)
+            {
+                return NULL;
+            }
+            
+            memmove(dest, cdataStart, cdataEnd - cdataStart);
+            dest += cdataEnd - cdataStart;
+            src = cdataEnd + 3;
+            
+            continue;
+        }
+        
+        textLength = dest - textStart;
+        
+        return src;
+    }
+}
+
+bool PCH_XMLPListParser::DecodeBase64(char *text, size_t length, size_t &decodedLength)
+{
+    if (!base64TableInitialized)
+    {
+        InitializeBase64Table();
+    }
+    
+    const unsigned char *src = (const unsigned char *)text;
+    const unsigned char *end = src + length;
+    unsigned char *dest = (unsigned char *)text;
+    
+    uint32_t accumulator = 0;
+    int numBits = 0;
+    
+    for (; src < end; src++)
+    {
+        unsigned char digit = base64DecodeTable[*src];
+        
+        if (digit < 64)
+        {
+            accumulator = (accumulator << 6) | digit;
+            numBits += 6;
+            
+            if (numBits >= 8)
+            {
+                numBits -= 8;
+                *dest++ = (unsigned char)(accumulator >> numBits);
+            }
+        }
+        else if (digit == 65)
+        {
+            // padding ends the data
+            break;
+        }
+        else if (digit != 64)
+        {
+            return false;
+        }
+    }
+    
+    decodedLength = dest - (unsigned char *)text;
+    
+    return true;
+}
+
+// Howard Hinnant's "days_from_civil" algorithm (http://howardhinnant.github.io/date_algorithms.html), which gives the number of days since 1970-01-01 for a date in the proleptic Gregorian calendar
+static int64_t DaysFromCivil(int64_t year, unsigned int month, unsigned int day)
+{
+    year -= (month <= 2);
+    
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    unsigned int yearOfEra = (unsigned int)(year - era * 400);
+    unsigned int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    
+    return era * 146097 + (int64_t)dayOfEra - 719468;
+}
+
+bool PCH_XMLPListParser::DateFromISO8601(const char *str, size_t length, double &result)
+{
+    int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0;
+    
+    // the string isn't NUL-terminated, so copy it (dates are short)
+    char dateBuff[64];
+    
+    if (length >= sizeof(dateBuff))
+    {
+        return false;
+    }
+    
+    memcpy(dateBuff, str, length);
+    dateBuff[length] = 0;
+    
+    if (sscanf(dateBuff, "%d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &minute, &second) < 3)
+    {
+        return false;
+    }
+    
+    int64_t days = DaysFromCivil(year, month, day);
+    
+    result = (double)(days * 86400 + hour * 3600 + minute * 60 + second) - PCH_SECONDS_FROM_1970_TO_2001;
+    
+    return true;
+}
+
+string PCH_XMLPListParser::ISO8601FromDate(double date)
+{
+    // Howard Hinnant's "civil_from_days", the inverse of DaysFromCivil() above
+    int64_t totalSeconds = (int64_t)(date + PCH_SECONDS_FROM_1970_TO_2001);
+    int64_t days = totalSeconds / 86400;
+    int64_t secondsOfDay = totalSeconds % 86400;
+    
+    if (secondsOfDay < 0)
+    {
+        secondsOfDay += 86400;
+        days--;
+    }
+    
+    days += 719468;
+    
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned int dayOfEra = (unsigned int)(days - era * 146097);
+    unsigned int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int64_t year = (int64_t)yearOfEra + era * 400;
+    unsigned int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    unsigned int mp = (5 * dayOfYear + 2) / 153;
+    unsigned int day = dayOfYear - (153 * mp + 2) / 5 + 1;
+    unsigned int month = (mp < 10 ? mp + 3 : mp - 9);
+    
+    year += (month <= 2);
+    
+    char dateBuff[64];
+    snprintf(dateBuff, sizeof(dateBuff), "%04lld-%02u-%02uT%02d:%02d:%02dZ", (long long)year, month, day, (int)(secondsOfDay / 3600), (int)((secondsOfDay / 60) % 60), (int)(secondsOfDay % 60));
+    
+    return string(dateBuff);
+}
+
+PCH_PList::ErrorType PCH_XMLPListParser::Parse(char *buffer, size_t length, PCH_PListEventHandler &handler)
+{
+    char *cursor = buffer;
+    char *end = buffer + length;
+    
+    // the dicts and arrays that are currently open ('d' or 'a'), used to make sure that the closing tags match
+    vector<char> openContainers;
+    
+    bool foundValue = false;
+    
+    while (true)
+    {
+        cursor = FindChar(cursor, end, '<');
+        
+        if (cursor == NULL)
+        {
+            break;
+        }
+        
+        char *tagStart = cursor + 1;
+        
+        if (tagStart >= end)
+        {
+            return PCH_PList::errorInvalidXML;
+        }
+        
+        // processing instructions (the XML declaration), comments and the DOCTYPE are skipped
+        if (*tagStart == '?')
+        {
+            cursor = FindString(tagStart, end, "?>");
+            
+            if (cursor == NULL)
+            {
+                return PCH_PList::errorInvalidXML;
+            }
+            
+            continue;
+        }
+        
+        if (*tagStart == '!')
+        {
+            if (end - tagStart >= 3 && memcmp(tagStart, "!--", 3) == 0)
+            {
+                cursor = FindString(tagStart + 3, end, "-->");
+            }
+            else
+            {
+                cursor = FindChar(tagStart, end, '>');
+            }
+            
+            if (cursor == NULL)
+            {
+                return PCH_PList::errorInvalidXML;
+            }
+            
+            continue;
+        }
+        
+        bool isClosingTag = (*tagStart == '/');
+        
+        if (isClosingTag)
+        {
+            tagStart++;
+        }
+        
+        char *nameEnd = tagStart;
+        
+        while (nameEnd < end && !(xmlCharClass[(unsigned char)*nameEnd] & xmlNameEnd))
+        {
+            nameEnd++;
+        }
+        
+        char *tagEnd = FindChar(nameEnd, end, '>');
+        
+        if (tagEnd == NULL)
+        {
+            return PCH_PList::errorInvalidXML;
+        }
+        
+        bool isEmptyElement = (tagEnd[-1] == '/');
+        
+        size_t nameLength = nameEnd - tagStart;
+        
+        // the first character is enough to tell the elements apart, except for the 'd's (dict, data, date)
+        char nameChar = (nameLength > 0 ? tagStart[0] : 0);
+        
+        cursor = tagEnd + 1;
+        
+        if (isClosingTag)
+        {
+            if (nameLength == 4 && memcmp(tagStart, "dict", 4) == 0)
+            {
+                if (openContainers.empty() || openContainers.back() != 'd')
+                {
+                    return PCH_PList::errorInvalidXML;
+                }
+                
+                openContainers.pop_back();
+                handler.EndDict();
+            }
+            else if (nameLength == 5 && memcmp(tagStart, "array", 5) == 0)
+            {
+                if (openContainers.empty() || openContainers.back() != 'a')
+                {
+                    return PCH_PList::errorInvalidXML;
+                }
+                
+                openContainers.pop_back();
+                handler.EndArray();
+            }
+            
+            // the closing tags of the other elements are consumed when the element is read
+            continue;
+        }
+        
+        if (nameLength == 5 && memcmp(tagStart, "plist", 5) == 0)
+        {
+            continue;
+        }
+        
+        if (nameLength == 4 && memcmp(tagStart, "dict", 4) == 0)
+        {
+            foundValue = true;
+            
+            int64_t uid;
+            char *afterDict;
+            
+            if (!isEmptyElement && MatchUIDDict(cursor, end, uid, afterDict))
+            {
+                handler.UidValue(uid);
+                cursor = afterDict;
+                
+                continue;
+            }
+            
+            handler.BeginDict();
+            
+            if (isEmptyElement)
+            {
+                handler.EndDict();
+            }
+            else
+            {
+                openContainers.push_back('d');
+            }
+            
+            continue;
+        }
+        
+        if (nameLength == 5 && memcmp(tagStart, "array", 5) == 0)
+        {
+            foundValue = true;
+            handler.BeginArray();
+            
+            if (isEmptyElement)
+            {
+                handler.EndArray();
+            }
+            else
+            {
+                openContainers.push_back('a');
+            }
+            
+            continue;
+        }
+        
+        if (nameLength == 4 && memcmp(tagStart, "true", 4) == 0)
+        {
+            foundValue = true;
+            handler.BoolValue(true);
+            continue;
+        }
+        
+        if (nameLength == 5 && memcmp(tagStart, "false", 5) == 0)
+        {
+            foundValue = true;
+            handler.BoolValue(false);
+            continue;
+        }
+        
+        // everything else has text content
+        char *text = cursor;
+        size_t textLength = 0;
+        
+        if (!isEmptyElement)
+        {
+            char *closingTag = DecodeText(text, end, textLength);
+            
+            if (closingTag == NULL || end - closingTag < nameLength + 3 || closingTag[1] != '/' || memcmp(closingTag + 2, tagStart, nameLength) != 0)
+            {
+                return PCH_PList::errorInvalidXML;
+            }
+            
+            cursor = FindChar(closingTag, end, '>');
+            
+            if (cursor == NULL)
+            {
+                return PCH_PList::errorInvalidXML;
+            }
+            
+            cursor++;
+        }
+        
+        foundValue = true;
+        
+        switch (nameChar)
+        {
+            case 'k':
+            {
+                handler.Key(text, textLength);
+                break;
+            }
+            
+            case 's':
+            {
+                handler.StringValue(text, textLength);
+                break;
+            }
+            
+            case 'i':
+            {
+                // integers may be negative, and unsigned values above INT64_MAX are stored as their two's complement
+                char *digits = SkipWhitespace(text, text + textLength);
+                bool isNegative = (digits < text + textLength && *digits == '-');
+                
+                if (isNegative || (digits < text + textLength && *digits == '+'))
+                {
+                    digits++;
+                }
+                
+                uint64_t value = 0;
+                
+                if (text + textLength - digits > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X'))
+                {
+                    value = strtoull(string(digits, text + textLength - digits).c_str(), NULL, 16);
+                }
+                else
+                {
+                    while (digits < text + textLength && *digits >= '0' && *digits <= '9')
+                    {
+                        value = value * 10 + (*digits - '0');
+                        digits++;
+                    }
+                }
+                
+                handler.IntValue(isNegative ? -(int64_t)value : (int64_t)value);
+                
+                break;
+            }
+            
+            case 'r':
+            {
+                // strtod() needs a terminated string, so temporarily terminate the text (the character we overwrite is part of the closing tag, or already-consumed text)
+                char savedChar = text[textLength];
+                text[textLength] = 0;
+                
+                handler.RealValue(strtod(text, NULL));
+                
+                text[textLength] = savedChar;
+                
+                break;
+            }
+            
+            case 'd':
+            {
+                if (nameLength == 4 && memcmp(tagStart, "data", 4) == 0)
+                {
+                    size_t dataLength = 0;
+                    
+                    if (!DecodeBase64(text, textLength, dataLength))
+                    {
+                        return PCH_PList::errorInvalidXML;
+                    }
+                    
+                    handler.DataValue(text, dataLength);
+                }
+                else if (nameLength == 4 && memcmp(tagStart, "date", 4) == 0)
+                {
+                    double date;
+                    
+                    if (!DateFromISO8601(text, textLength, date))
+                    {
+                        return PCH_PList::errorInvalidXML;
+                    }
+                    
+                    handler.DateValue(date);
+                }
+                else
+                {
+                    return PCH_PList::errorInvalidXML;
+                }
+                
+                break;
+            }
+            
+            default:
+            {
+                return PCH_PList::errorInvalidXML;
+            }
+        }
+    }
+    
+    if (!openContainers.empty() || !foundValue)
+    {
+        return PCH_PList::errorInvalidXML;
+    }
+    
+    return PCH_PList::noError;
+}
@@ -0,0 +1,47 @@
+//
+//  PCH_XMLPListParser.hpp
+//  PCH_PListReader
+//
+//  Created by Peter Huber on 2020-01-12.
+//  Copyright © 2020 Peter Huber. All rights reserved.
+//
+
+// A fast reader for text-based (XML) plist files. The parser does not build a DOM. Instead, it walks the buffer once and sends the contents to a PCH_PListEventHandler (use a PCH_PListTreeBuilder to get the same PCH_PList_Value tree that PCH_PList creates from binary plists). To keep things fast, the parser works directly in the caller's buffer: entities in strings and base64 in <data> elements are decoded in place, so the buffer is modified.
+// Only the elements used by Apple's plist DTD are understood: plist, dict, array, key, string, data, date, integer, real, true and false. The XML declaration, DOCTYPE and comments are skipped. A dict that holds nothing but a "CF$UID" integer is sent as a UID (see PCH_PListEventHandler::UidValue()).
+
+#ifndef PCH_XMLPListParser_hpp
+#define PCH_XMLPListParser_hpp
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "PCH_PList.hpp"
+
+using namespace std;
+
+class PCH_XMLPListParser
+{
+public:
+    
+    // Returns true if the first bytes of the buffer look like an XML plist (after an optional UTF-8 byte-order mark and whitespace)
+    static bool IsXMLPList(const char *buffer, size_t length);
+    
+    // Parse the XML plist in 'buffer' (which is modified) and send its contents to 'handler'. Returns PCH_PList::noError or PCH_PList::errorInvalidXML.
+    static PCH_PList::ErrorType Parse(char *buffer, size_t length, PCH_PListEventHandler &handler);
+    
+    // Convert an ISO 8601 date in the form used by plists ("2001-01-01T00:00:00Z") into seconds since 2001-01-01 00:00:00 UTC, and vice-versa
+    static bool DateFromISO8601(const char *str, size_t length, double &result);
+    static string ISO8601FromDate(double date);
+    
+private:
+    
+    // Decode entities (&lt; &#x20AC; etc.) and CDATA sections in the text that starts at 'textStart', in place. On return, 'textLength' is the length of the decoded text and the function result points at the '<' of the closing tag (or NULL on error).
+    static char *DecodeText(char *textStart, char *end, size_t &textLength);
+    
+    // Decode base64 in place, skipping whitespace. Returns false if the text isn't valid base64.
+    static bool DecodeBase64(char *text, size_t length, size_t &decodedLength);
+};
+
+#endif /* PCH_XMLPListParser_hpp */
@@ -13,19 +13,219 @@
 #include <set>
 #include <map>
 
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "PCH_PList.hpp"
 #include "PCH_NSKeyedArchiver_Analyzer.hpp"
+#include "PCH_PListWriter.hpp"
+#include "PCH_PListDiff.hpp"
+#include "PCH_PListColumnExporter.hpp"
+#include "PCH_NSKeyedArchiver_Encoder.hpp"
 
 using namespace std;
 
 int main(int argc, const char * argv[]) {
     
-    // no error checking, just assume that a valid plist file has been passed as the first argument followed by an optional output file name
+    // no error checking, just assume that a valid plist file has been passed as the first argument followed by an optional output file name. Alternatively, "--stats <file>" prints a JSON report about an NSKeyedArchiver archive, "--convert xml|binary <input file> <output file | ->" converts a plist from one format to the other,, "--search <string> <file>..." lists the strings in binary plists that contain <string>, "--extract <key path> <file> <output file | ->" writes the bytes of one data or ASCII string object in a binary plist, "--diff <old file> <new file>" lists the key paths that were added (+), removed (-) or changed (~), and "--export csv|tsv|columnar <key path> <file> <output file | ->" writes the array of dicts at <key path> ("" for the root) as a table, and "--rearchive <file> <output file | ->" reads an NSKeyedArchiver archive into its object model and archives the model again (as a binary plist).
     
-    string filePath(argv[1]);
+    if (argc < 2)
+    {
+        cerr << "Usage: PCH_PListReader [--stats] <plist file | -> [output file]" << endl;
+        cerr << "       PCH_PListReader --convert xml|binary <plist file> <output file | ->" << endl;
+        cerr << "       PCH_PListReader --search <string> <plist file>..." << endl;
+        cerr << "       PCH_PListReader --extract <key path> <plist file> <output file | ->" << endl;
+        cerr << "       PCH_PListReader --diff <old plist file> <new plist file>" << endl;
+        cerr << "       PCH_PListReader --export csv|tsv|columnar <key path> <plist file> <output file | ->" << endl;
+        cerr << "       PCH_PListReader --rearchive <plist file> <output file | ->" << endl;
+        return 1;
+    }
+    
+    if (string(argv[1]).compare("--rearchive") == 0)
+    {
+        if (argc < 4)
+        {
+            cerr << "Usage: PCH_PListReader --rearchive <plist file> <output file | ->" << endl;
+            return 1;
+        }
+        
+        PCH_PList archive;
+        
+        if (archive.InitializeWithFile(argv[2]) != PCH_PList::noError)
+        {
+            cerr << "Could not load the archive!!!" << endl;
+            return 1;
+        }
+        
+        PCH_UnarchivedModel model(archive.plistRoot);
+        
+        if (!model.isValid || PCH_NSKeyedArchiver_Encoder::EncodeFile(model.rootItem, argv[3]) != PCH_PList::noError)
+        {
+            cerr << "Could not archive the model!!!" << endl;
+            return 1;
+        }
+        
+        return 0;
+    }
+    
+    if (string(argv[1]).compare("--diff") == 0)
+    {
+        if (argc < 4)
+        {
+            cerr << "Usage: PCH_PListReader --diff <old plist file> <new plist file>" << endl;
+            return 2;
+        }
+        
+        // Like diff, the exit status is 0 if the files are the same, 1 if they're different and 2 if they couldn't be compared
+        PCH_PList oldPlist;
+        PCH_PList newPlist;
+        
+        if (oldPlist.InitializeWithFile(argv[2]) != PCH_PList::noError || newPlist.InitializeWithFile(argv[3]) != PCH_PList::noError)
+        {
+            cerr << "Could not load the plists!!!" << endl;
+            return 2;
+        }
+        
+        vector<PCH_PList_Difference> differences;
+        PCH_PListDiff::Compare(oldPlist.plistRoot, newPlist.plistRoot, differences);
+        
+        const char *kindSymbols[] = {"+", "-", "~"};
+        
+        for (int i=0; i<differences.size(); i++)
+        {
+            cout << kindSymbols[differences[i].kind] << " " << (differences[i].keyPath.empty() ? "(root)" : differences[i].keyPath) << endl;
+        }
+        
+        return (differences.empty() ? 0 : 1);
+    }
+    
+    if (string(argv[1]).compare("--extract") == 0)
+    {
+        if (argc < 5)
+        {
+            cerr << "Usage: PCH_PListReader --extract <key path> <plist file> <output file | ->" << endl;
+            return 1;
+        }
+        
+        // the payload goes straight from the file to the output, so it can be much bigger than memory
+        bool toStdout = (string(argv[4]).compare("-") == 0);
+        int outFd = (toStdout ? STDOUT_FILENO : open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        
+        if (outFd < 0)
+        {
+            cerr << "Could not open " << argv[4] << endl;
+            return 1;
+        }
+        
+        PCH_PList::ErrorType err = PCH_PList::CopyPayload(argv[3], argv[2], outFd);
+        
+        if (!toStdout && close(outFd) != 0 && err == PCH_PList::noError)
+        {
+            err = PCH_PList::errorCouldNotWriteFile;
+        }
+        
+        if (err != PCH_PList::noError)
+        {
+            cerr << "Could not extract " << argv[2] << " from " << argv[3] << endl;
+            return 1;
+        }
+        
+        return 0;
+    }
+    
+    if (string(argv[1]).compare("--search") == 0)
+    {
+        if (argc < 4)
+        {
+            cerr << "Usage: PCH_PListReader --search <string> <plist file>..." << endl;
+            return 1;
+        }
+        
+        // Like grep, the exit status is 0 if anything was found. Each hit is printed as "<file>: #<object index> <key path>", with "(key)" added for dictionary keys.
+        bool foundAny = false;
+        
+        for (int i=3; i<argc; i++)
+        {
+            vector<PCH_PList_SearchHit> hits;
+            
+            if (PCH_PList::SearchFile(argv[i], argv[2], hits) != PCH_PList::noError)
+            {
+                cerr << "Could not search " << argv[i] << endl;
+                continue;
+            }
+            
+            for (int j=0; j<hits.size(); j++)
+            {
+                cout << argv[i] << ": #" << hits[j].objectIndex << " " << hits[j].keyPath << (hits[j].isKey ? " (key)" : "") << endl;
+            }
+            
+            foundAny = foundAny || !hits.empty();
+        }
+        
+        return (foundAny ? 0 : 1);
+    }
+    
+    if (string(argv[1]).compare("--export") == 0)
+    {
+        string formatName(argc < 3 ? "" : argv[2]);
+        
+        if (argc < 6 || (formatName.compare("csv") != 0 && formatName.compare("tsv") != 0 && formatName.compare("columnar") != 0))
+        {
+            cerr << "Usage: PCH_PListReader --export csv|tsv|columnar <key path> <plist file> <output file | ->" << endl;
+            return 1;
+        }
+        
+        PCH_PListColumnExporter::OutputFormat outputFormat = (formatName.compare("csv") == 0 ? PCH_PListColumnExporter::csvFormat : (formatName.compare("tsv") == 0 ? PCH_PListColumnExporter::tsvFormat : PCH_PListColumnExporter::columnarFormat));
+        
+        if (PCH_PListColumnExporter::ExportFile(argv[4], argv[3], argv[5], outputFormat) != PCH_PList::noError)
+        {
+            cerr << "Could not export the records!!!" << endl;
+            return 1;
+        }
+        
+        return 0;
+    }
     
-    PCH_PList inplist(filePath);
+    if (string(argv[1]).compare("--convert") == 0)
+    {
+        if (argc < 5 || (string(argv[2]).compare("xml") != 0 && string(argv[2]).compare("binary") != 0))
+        {
+            cerr << "Usage: PCH_PListReader --convert xml|binary <plist file> <output file | ->" << endl;
+            return 1;
+        }
+        
+        PCH_PListConverter::OutputFormat outputFormat = (string(argv[2]).compare("xml") == 0 ? PCH_PListConverter::xmlFormat : PCH_PListConverter::binaryFormat);
+        
+        if (PCH_PListConverter::ConvertFile(argv[3], argv[4], outputFormat) != PCH_PList::noError)
+        {
+            cerr << "Could not convert the plist!!!";
+            return 1;
+        }
+        
+        return 0;
+    }
+    
+    bool printStats = (string(argv[1]).compare("--stats") == 0);
+    
+    if (printStats && argc < 3)
+    {
+        cerr << "Usage: PCH_PListReader --stats <plist file>" << endl;
+        return 1;
+    }
+    
+    string filePath(printStats ? argv[2] : argv[1]);
+    
+    // a file path of "-" means that the plist is piped into stdin
+    PCH_PList inplist;
+    
+    if (filePath.compare("-") == 0)
+    {
+        inplist.isValid = (inplist.InitializeWithStream(cin) == PCH_PList::noError);
+    }
+    else
+    {
+        inplist.isValid = (inplist.InitializeWithFile(filePath) == PCH_PList::noError);
+    }
 
     if (!inplist.isValid)
     {
@@ -35,7 +235,11 @@ int main(int argc, const char * argv[]) {
     
     PCH_UnarchivedModel testModel(inplist.plistRoot);
     
-    if (argc > 2)
+    if (printStats)
+    {
+        testModel.WriteStatistics(cout);
+    }
+    else if (argc > 2)
     {
         ofstream outFile;
         